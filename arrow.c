@@ -0,0 +1,608 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <pcap/dlt.h>
+
+#include "arrow.h"
+#include "dns.h"
+#include "format.h"
+#include "output.h"
+#include "util.h"
+#include "vlan.h"
+
+// Metadata of the IPC messages is a flatbuffer (see Schema.fbs and
+// Message.fbs in the Arrow sources). It is built here with a minimal
+// flatbuffers builder, back to front like the real one: objects are pushed at
+// the start of the buffer, and referenced by their distance to its end.
+struct fb {
+  uint8_t *buf;
+  size_t cap;
+  size_t size;     // used, at the end of `buf'
+  size_t minalign;
+  uint32_t fields[8]; // position of each field of the current table
+  unsigned nfields;
+  size_t table;    // size when the current table was started
+};
+
+static void fb_reset(struct fb *b) {
+  b->size = 0;
+  b->minalign = 1;
+}
+
+static void fb_grow(struct fb *b, size_t needed) {
+  if (b->cap - b->size >= needed) return;
+  size_t cap = b->cap ? b->cap * 2 : 1024;
+  while (cap - b->size < needed) cap *= 2;
+  uint8_t *buf = malloc(cap);
+  if (buf == NULL) {
+    FATAL("Out of memory");
+    abort();
+  }
+  if (b->size > 0) memcpy(buf + cap - b->size, b->buf + b->cap - b->size, b->size);
+  free(b->buf);
+  b->buf = buf;
+  b->cap = cap;
+}
+
+// Pads so that `size' is aligned on `align' once `extra' bytes are pushed
+static void fb_prep(struct fb *b, size_t align, size_t extra) {
+  if (align > b->minalign) b->minalign = align;
+  size_t pad = (~(b->size + extra) + 1) & (align - 1);
+  fb_grow(b, pad + extra + align);
+  memset(b->buf + b->cap - b->size - pad, 0, pad);
+  b->size += pad;
+}
+
+static uint8_t *fb_head(struct fb *b) {
+  return b->buf + b->cap - b->size;
+}
+
+static void fb_push(struct fb *b, const void *data, size_t length) {
+  fb_grow(b, length);
+  b->size += length;
+  memcpy(fb_head(b), data, length);
+}
+
+// Scalars are little-endian, which is all this code runs on
+static void fb_scalar(struct fb *b, const void *value, size_t width) {
+  fb_prep(b, width, 0);
+  fb_push(b, value, width);
+}
+
+static void fb_offset(struct fb *b, uint32_t target) {
+  fb_prep(b, 4, 0);
+  uint32_t off = b->size + 4 - target;
+  fb_push(b, &off, 4);
+}
+
+static uint32_t fb_string(struct fb *b, const char *s) {
+  uint32_t length = strlen(s);
+  fb_prep(b, 4, length + 1);
+  fb_push(b, "", 1);
+  fb_push(b, s, length);
+  fb_push(b, &length, 4);
+  return b->size;
+}
+
+// Vector of `count' structs of `width' bytes, already in order
+static uint32_t fb_structs(struct fb *b, const void *data, uint32_t count, size_t width, size_t align) {
+  fb_prep(b, 4, count * width);
+  fb_prep(b, align, count * width);
+  fb_push(b, data, count * width);
+  fb_prep(b, 4, 0);
+  fb_push(b, &count, 4);
+  return b->size;
+}
+
+static uint32_t fb_offsets(struct fb *b, const uint32_t *offsets, uint32_t count) {
+  fb_prep(b, 4, count * 4);
+  for (uint32_t i = count; i > 0; i--)
+    fb_offset(b, offsets[i - 1]);
+  fb_push(b, &count, 4);
+  return b->size;
+}
+
+static void fb_start(struct fb *b) {
+  memset(b->fields, 0, sizeof(b->fields));
+  b->nfields = 0;
+  b->table = b->size;
+}
+
+static void fb_field(struct fb *b, unsigned slot, const void *value, size_t width) {
+  fb_scalar(b, value, width);
+  b->fields[slot] = b->size;
+  if (slot >= b->nfields) b->nfields = slot + 1;
+}
+
+static void fb_field_offset(struct fb *b, unsigned slot, uint32_t target) {
+  fb_offset(b, target);
+  b->fields[slot] = b->size;
+  if (slot >= b->nfields) b->nfields = slot + 1;
+}
+
+static uint32_t fb_end(struct fb *b) {
+  int32_t placeholder = 0;
+  fb_scalar(b, &placeholder, 4);
+  uint32_t object = b->size;
+
+  // The vtable goes right before the table, with the offset of each field
+  // from the start of the table
+  for (unsigned i = b->nfields; i > 0; i--) {
+    uint16_t off = b->fields[i - 1] ? object - b->fields[i - 1] : 0;
+    fb_scalar(b, &off, 2);
+  }
+  uint16_t table_size = object - b->table;
+  uint16_t vtable_size = 4 + 2 * b->nfields;
+  fb_scalar(b, &table_size, 2);
+  fb_scalar(b, &vtable_size, 2);
+
+  int32_t soffset = b->size - object;
+  memcpy(b->buf + b->cap - object, &soffset, 4);
+  return object;
+}
+
+static size_t fb_finish(struct fb *b, uint32_t root) {
+  fb_prep(b, b->minalign, 4);
+  fb_offset(b, root);
+  return b->size;
+}
+
+// Arrow enums, from Schema.fbs and Message.fbs
+#define METADATA_V5 4
+#define HEADER_SCHEMA 1
+#define HEADER_RECORD_BATCH 3
+#define TYPE_INT 2
+#define TYPE_UTF8 5
+#define TYPE_TIMESTAMP 10
+#define UNIT_MICROSECOND 2
+
+enum column_type {
+  COL_TIMESTAMP,
+  COL_UINT8,
+  COL_UINT16,
+  COL_UINT32,
+  COL_UTF8,
+};
+
+enum column_id {
+  C_TS,
+  C_CAPLEN,
+  C_LEN,
+  C_LINK_TYPE,
+  C_SRC_MAC,
+  C_DST_MAC,
+  C_VLAN_ID,
+  C_SRC_ADDR,
+  C_DST_ADDR,
+  C_IP_PROTO,
+  C_SPORT,
+  C_DPORT,
+  C_DNS_ID,
+  C_DNS_RCODE,
+  C_DNS_QDCOUNT,
+  C_DNS_ANCOUNT,
+  C_DNS_NSCOUNT,
+  C_DNS_ARCOUNT,
+  C_DHCP_MSGTYPE,
+  C_DHCP_XID,
+  C_VXLAN_VNI,
+  C_COUNT,
+};
+
+static const struct {
+  const char *name;
+  enum column_type type;
+} columns[C_COUNT] = {
+  [C_TS] = { "ts", COL_TIMESTAMP },
+  [C_CAPLEN] = { "caplen", COL_UINT32 },
+  [C_LEN] = { "len", COL_UINT32 },
+  [C_LINK_TYPE] = { "link_type", COL_UINT16 },
+  [C_SRC_MAC] = { "src_mac", COL_UTF8 },
+  [C_DST_MAC] = { "dst_mac", COL_UTF8 },
+  [C_VLAN_ID] = { "vlan_id", COL_UINT16 },
+  [C_SRC_ADDR] = { "src_addr", COL_UTF8 },
+  [C_DST_ADDR] = { "dst_addr", COL_UTF8 },
+  [C_IP_PROTO] = { "ip_proto", COL_UINT8 },
+  [C_SPORT] = { "sport", COL_UINT16 },
+  [C_DPORT] = { "dport", COL_UINT16 },
+  [C_DNS_ID] = { "dns_id", COL_UINT16 },
+  [C_DNS_RCODE] = { "dns_rcode", COL_UINT8 },
+  [C_DNS_QDCOUNT] = { "dns_qdcount", COL_UINT16 },
+  [C_DNS_ANCOUNT] = { "dns_ancount", COL_UINT16 },
+  [C_DNS_NSCOUNT] = { "dns_nscount", COL_UINT16 },
+  [C_DNS_ARCOUNT] = { "dns_arcount", COL_UINT16 },
+  [C_DHCP_MSGTYPE] = { "dhcp_msgtype", COL_UINT8 },
+  [C_DHCP_XID] = { "dhcp_xid", COL_UINT32 },
+  [C_VXLAN_VNI] = { "vxlan_vni", COL_UINT32 },
+};
+
+static const uint8_t type_width[] = {
+  [COL_TIMESTAMP] = 8,
+  [COL_UINT8] = 1,
+  [COL_UINT16] = 2,
+  [COL_UINT32] = 4,
+  [COL_UTF8] = 4, // offsets
+};
+
+struct column {
+  uint8_t *validity;
+  uint8_t *values;  // or the offsets of utf8 columns
+  char *data;       // utf8 only
+  size_t data_len;
+  size_t data_cap;
+  uint32_t nulls;
+};
+
+struct batch {
+  unsigned rows;
+  struct column columns[C_COUNT];
+  struct fb fb;
+  // Buffers of the record batch message, two or three per column
+  uint64_t buffers[C_COUNT * 3][2];
+  uint64_t nodes[C_COUNT][2];
+};
+
+static unsigned batch_rows = ARROW_DEFAULT_BATCH_ROWS;
+
+static pthread_key_t batch_key;
+static pthread_once_t batch_once = PTHREAD_ONCE_INIT;
+static __thread struct batch *thread_batch = NULL;
+
+static void free_batch(void *arg) {
+  struct batch *b = arg;
+  for (int i = 0; i < C_COUNT; i++) {
+    free(b->columns[i].validity);
+    free(b->columns[i].values);
+    free(b->columns[i].data);
+  }
+  free(b->fb.buf);
+  free(b);
+}
+
+static void create_key(void) {
+  pthread_key_create(&batch_key, free_batch);
+}
+
+static void *alloc_or_die(size_t size) {
+  void *p = calloc(1, size);
+  if (p == NULL) {
+    FATAL("Out of memory");
+    abort();
+  }
+  return p;
+}
+
+// Batch of the calling thread, allocated on first use for `batch_rows' rows
+static struct batch *get_batch(void) {
+  if (thread_batch != NULL) return thread_batch;
+
+  pthread_once(&batch_once, create_key);
+  struct batch *b = alloc_or_die(sizeof(struct batch));
+  for (int i = 0; i < C_COUNT; i++) {
+    struct column *c = &b->columns[i];
+    c->validity = alloc_or_die((batch_rows + 7) / 8);
+    c->values = alloc_or_die(((size_t)batch_rows + 1) * type_width[columns[i].type]);
+  }
+  pthread_setspecific(batch_key, b);
+  thread_batch = b;
+  return b;
+}
+
+static void set_valid(struct column *c, unsigned row) {
+  c->validity[row / 8] |= 1 << (row % 8);
+}
+
+static void set_uint(struct batch *b, enum column_id id, uint32_t value) {
+  struct column *c = &b->columns[id];
+  unsigned row = b->rows;
+  switch (columns[id].type) {
+    case COL_UINT8:
+      c->values[row] = value;
+      break;
+    case COL_UINT16:
+      ((uint16_t *)c->values)[row] = value;
+      break;
+    case COL_UINT32:
+      ((uint32_t *)c->values)[row] = value;
+      break;
+    default:
+      return;
+  }
+  set_valid(c, row);
+}
+
+// Strings are appended, their end offset is set for every row in end_row
+static void set_string(struct batch *b, enum column_id id, const char *s) {
+  struct column *c = &b->columns[id];
+  size_t length = strlen(s);
+  if (c->data_cap - c->data_len < length) {
+    size_t cap = c->data_cap ? c->data_cap * 2 : 4096;
+    while (cap - c->data_len < length) cap *= 2;
+    char *data = realloc(c->data, cap);
+    if (data == NULL) return;
+    c->data = data;
+    c->data_cap = cap;
+  }
+  memcpy(c->data + c->data_len, s, length);
+  c->data_len += length;
+  set_valid(c, b->rows);
+}
+
+static void end_row(struct batch *b) {
+  unsigned row = b->rows;
+  for (int i = 0; i < C_COUNT; i++) {
+    struct column *c = &b->columns[i];
+    if (columns[i].type == COL_UTF8)
+      ((int32_t *)c->values)[row + 1] = c->data_len;
+    if (!(c->validity[row / 8] & (1 << (row % 8)))) {
+      c->nulls++;
+      // Null slots of fixed width columns are zeroed, so that batches do not
+      // leak the values of the previous one
+      if (columns[i].type != COL_UTF8 && columns[i].type != COL_TIMESTAMP)
+        memset(c->values + (size_t)row * type_width[columns[i].type], 0, type_width[columns[i].type]);
+    }
+  }
+  b->rows++;
+}
+
+static uint16_t link_type_of(const struct layer *l) {
+  switch (l->type) {
+    case LAYER_NULL: return DLT_NULL;
+    case LAYER_LINUX_SLL: return DLT_LINUX_SLL;
+    case LAYER_ETHERNET: return DLT_EN10MB;
+    default: return DLT_RAW;
+  }
+}
+
+static uint32_t type_table(struct fb *fb, enum column_type type, uint8_t *union_type) {
+  uint8_t yes = 1;
+  int32_t bits;
+  fb_start(fb);
+  switch (type) {
+    case COL_TIMESTAMP:
+    {
+      uint32_t tz = fb_string(fb, "UTC");
+      fb_start(fb);
+      int16_t unit = UNIT_MICROSECOND;
+      fb_field(fb, 0, &unit, 2);
+      fb_field_offset(fb, 1, tz);
+      *union_type = TYPE_TIMESTAMP;
+      return fb_end(fb);
+    }
+    case COL_UTF8:
+      *union_type = TYPE_UTF8;
+      return fb_end(fb);
+    default:
+      bits = type_width[type] * 8;
+      fb_field(fb, 0, &bits, 4);
+      yes = 0;
+      fb_field(fb, 1, &yes, 1);
+      *union_type = TYPE_INT;
+      return fb_end(fb);
+  }
+}
+
+// Message table around a header, returns the size of the flatbuffer
+static size_t message(struct fb *fb, uint8_t header_type, uint32_t header, int64_t body_length) {
+  int16_t version = METADATA_V5;
+  fb_start(fb);
+  fb_field(fb, 3, &body_length, 8);
+  fb_field_offset(fb, 2, header);
+  fb_field(fb, 0, &version, 2);
+  fb_field(fb, 1, &header_type, 1);
+  return fb_finish(fb, fb_end(fb));
+}
+
+// Writes a continuation marker, the metadata padded to 8 bytes, and returns
+// where the body goes, `body_length' bytes being reserved for it.
+static uint8_t *write_message(struct fb *fb, size_t fb_size, size_t body_length, size_t *total) {
+  size_t meta = (fb_size + 7) & ~(size_t)7;
+  *total = 8 + meta + body_length;
+  uint8_t *p = (uint8_t *)out_reserve(*total);
+  if (p == NULL) return NULL;
+  uint32_t marker = 0xffffffff, length = meta;
+  memcpy(p, &marker, 4);
+  memcpy(p + 4, &length, 4);
+  memcpy(p + 8, fb->buf + fb->cap - fb_size, fb_size);
+  memset(p + 8 + fb_size, 0, meta - fb_size);
+  return p + 8 + meta;
+}
+
+void arrow_init(unsigned rows) {
+  if (rows > 0) batch_rows = rows;
+
+  struct fb fb = { 0 };
+  fb_reset(&fb);
+  uint32_t fields[C_COUNT];
+  for (int i = C_COUNT - 1; i >= 0; i--) {
+    uint32_t children = fb_offsets(&fb, NULL, 0);
+    uint8_t union_type;
+    uint32_t type = type_table(&fb, columns[i].type, &union_type);
+    uint32_t name = fb_string(&fb, columns[i].name);
+    uint8_t nullable = i > C_LINK_TYPE;
+    fb_start(&fb);
+    fb_field_offset(&fb, 0, name);
+    fb_field_offset(&fb, 3, type);
+    fb_field_offset(&fb, 5, children);
+    fb_field(&fb, 1, &nullable, 1);
+    fb_field(&fb, 2, &union_type, 1);
+    fields[i] = fb_end(&fb);
+  }
+  uint32_t vector = fb_offsets(&fb, fields, C_COUNT);
+  fb_start(&fb);
+  fb_field_offset(&fb, 1, vector);
+  uint32_t schema = fb_end(&fb);
+
+  size_t total;
+  if (write_message(&fb, message(&fb, HEADER_SCHEMA, schema, 0), 0, &total) != NULL)
+    out_commit(total);
+  free(fb.buf);
+  // Written now, before any thread has output to write
+  output_flush();
+}
+
+static size_t pad8(size_t n) {
+  return (n + 7) & ~(size_t)7;
+}
+
+void arrow_flush(void) {
+  struct batch *b = thread_batch;
+  if (b == NULL || b->rows == 0) return;
+
+  // Layout of the body: for each column its validity bitmap, its values (or
+  // offsets), and the characters of the utf8 columns
+  unsigned nbuffers = 0;
+  uint64_t body = 0;
+  for (int i = 0; i < C_COUNT; i++) {
+    struct column *c = &b->columns[i];
+    enum column_type type = columns[i].type;
+    size_t values = (size_t)b->rows * type_width[type];
+    if (type == COL_UTF8) values += 4;
+
+    b->nodes[i][0] = b->rows;
+    b->nodes[i][1] = c->nulls;
+    b->buffers[nbuffers][0] = body;
+    b->buffers[nbuffers++][1] = (b->rows + 7) / 8;
+    body += pad8((b->rows + 7) / 8);
+    b->buffers[nbuffers][0] = body;
+    b->buffers[nbuffers++][1] = values;
+    body += pad8(values);
+    if (type == COL_UTF8) {
+      b->buffers[nbuffers][0] = body;
+      b->buffers[nbuffers++][1] = c->data_len;
+      body += pad8(c->data_len);
+    }
+  }
+
+  struct fb *fb = &b->fb;
+  fb_reset(fb);
+  uint32_t buffers = fb_structs(fb, b->buffers, nbuffers, 16, 8);
+  uint32_t nodes = fb_structs(fb, b->nodes, C_COUNT, 16, 8);
+  int64_t length = b->rows;
+  fb_start(fb);
+  fb_field(fb, 0, &length, 8);
+  fb_field_offset(fb, 1, nodes);
+  fb_field_offset(fb, 2, buffers);
+  uint32_t batch = fb_end(fb);
+
+  size_t total;
+  uint8_t *p = write_message(fb, message(fb, HEADER_RECORD_BATCH, batch, body), body, &total);
+  if (p != NULL) {
+    memset(p, 0, body);
+    nbuffers = 0;
+    for (int i = 0; i < C_COUNT; i++) {
+      struct column *c = &b->columns[i];
+      memcpy(p + b->buffers[nbuffers][0], c->validity, b->buffers[nbuffers][1]);
+      nbuffers++;
+      memcpy(p + b->buffers[nbuffers][0], c->values, b->buffers[nbuffers][1]);
+      nbuffers++;
+      if (columns[i].type == COL_UTF8) {
+        memcpy(p + b->buffers[nbuffers][0], c->data, b->buffers[nbuffers][1]);
+        nbuffers++;
+      }
+    }
+    out_commit(total);
+  }
+
+  // Ready for the next batch, the buffers are kept
+  for (int i = 0; i < C_COUNT; i++) {
+    struct column *c = &b->columns[i];
+    memset(c->validity, 0, (b->rows + 7) / 8);
+    c->data_len = 0;
+    c->nulls = 0;
+  }
+  b->rows = 0;
+}
+
+void arrow_append(const struct pcap_pkthdr *header, const struct dissection *d) {
+  struct batch *b = get_batch();
+  char buf[INET6_ADDRSTRLEN];
+  uint32_t seen = 0; // layer types already used, only the outermost counts
+
+  ((int64_t *)b->columns[C_TS].values)[b->rows] =
+    (int64_t)header->ts.tv_sec * 1000000 + header->ts.tv_usec;
+  set_valid(&b->columns[C_TS], b->rows);
+  set_uint(b, C_CAPLEN, header->caplen);
+  set_uint(b, C_LEN, header->len);
+  set_uint(b, C_LINK_TYPE, d->count > 0 ? link_type_of(&d->layers[0]) : DLT_RAW);
+
+  for (unsigned i = 0; i < d->count; i++) {
+    const struct layer *l = &d->layers[i];
+    // IPv4 and IPv6 fill the same columns, like UDP and TCP
+    uint32_t kind = 1 << l->type;
+    if (l->type == LAYER_IPV6) kind = 1 << LAYER_IPV4;
+    if (l->type == LAYER_TCP) kind = 1 << LAYER_UDP;
+    if (seen & kind) continue;
+    seen |= kind;
+
+    switch (l->type) {
+      case LAYER_ETHERNET:
+        set_string(b, C_SRC_MAC, format_ether(l->ether.src, buf));
+        set_string(b, C_DST_MAC, format_ether(l->ether.dst, buf));
+        break;
+      case LAYER_VLAN:
+        set_uint(b, C_VLAN_ID, l->vlan.tci & VLAN_VID_MASK);
+        break;
+      case LAYER_IPV4:
+        set_string(b, C_SRC_ADDR, format_ipv4(l->ipv4.src, buf));
+        set_string(b, C_DST_ADDR, format_ipv4(l->ipv4.dst, buf));
+        set_uint(b, C_IP_PROTO, l->ipv4.proto);
+        break;
+      case LAYER_IPV6:
+        set_string(b, C_SRC_ADDR, format_ipv6(l->ipv6.src, buf));
+        set_string(b, C_DST_ADDR, format_ipv6(l->ipv6.dst, buf));
+        set_uint(b, C_IP_PROTO, l->ipv6.proto);
+        break;
+      case LAYER_UDP:
+        set_uint(b, C_SPORT, l->udp.sport);
+        set_uint(b, C_DPORT, l->udp.dport);
+        break;
+      case LAYER_TCP:
+        set_uint(b, C_SPORT, l->tcp.sport);
+        set_uint(b, C_DPORT, l->tcp.dport);
+        break;
+      case LAYER_DNS:
+      {
+        // The dissection keeps the flags in network order
+        struct dns_hdr h = { .flags = ntohs(l->dns.flags) };
+        set_uint(b, C_DNS_ID, l->dns.id);
+        set_uint(b, C_DNS_RCODE, h.rcode);
+        set_uint(b, C_DNS_QDCOUNT, l->dns.qdcount);
+        set_uint(b, C_DNS_ANCOUNT, l->dns.ancount);
+        set_uint(b, C_DNS_NSCOUNT, l->dns.nscount);
+        set_uint(b, C_DNS_ARCOUNT, l->dns.arcount);
+        break;
+      }
+      case LAYER_BOOTP:
+        set_uint(b, C_DHCP_XID, ntohl(l->bootp.xid));
+        for (uint16_t j = 0; j < l->bootp.option_count; j++) {
+          const struct dhcp_option *option = &l->bootp.options[j];
+          if (option->code == 53 && option->length >= 1) {
+            set_uint(b, C_DHCP_MSGTYPE, d->packet[option->offset]);
+            break;
+          }
+        }
+        break;
+      case LAYER_VXLAN:
+        set_uint(b, C_VXLAN_VNI, l->vxlan.id);
+        break;
+      default:
+        break;
+    }
+  }
+
+  end_row(b);
+  if (b->rows == batch_rows) arrow_flush();
+}
+
+void arrow_finish(void) {
+  arrow_flush();
+  uint8_t *p = (uint8_t *)out_reserve(8);
+  if (p != NULL) {
+    uint32_t eos[2] = { 0xffffffff, 0 };
+    memcpy(p, eos, 8);
+    out_commit(8);
+  }
+  output_flush();
+}
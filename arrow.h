@@ -0,0 +1,45 @@
+#ifndef __ARROW_H
+#define __ARROW_H
+
+#include <pcap/pcap.h>
+
+#include "dissect.h"
+
+// Columnar export (--format arrow) in the Arrow IPC stream format, readable
+// with pyarrow.ipc.open_stream, DuckDB's arrow extension, or anything built
+// on the Arrow libraries. One row per packet, with the following columns
+// (all nullable but the first four, null when the packet has no such layer;
+// the outermost layer is used when there are several):
+//
+//   ts                timestamp[us, UTC]
+//   caplen, len       uint32
+//   link_type         uint16, DLT_* of the first layer
+//   src_mac, dst_mac  utf8
+//   vlan_id           uint16
+//   src_addr,dst_addr utf8, IPv4 or IPv6
+//   ip_proto          uint8, protocol or next header
+//   sport, dport      uint16, UDP or TCP
+//   dns_id            uint16
+//   dns_rcode         uint8
+//   dns_qdcount, dns_ancount, dns_nscount, dns_arcount  uint16
+//   dhcp_msgtype      uint8
+//   dhcp_xid          uint32, BOOTP transaction id
+//   vxlan_vni         uint32
+//
+// Each thread fills its own batch, written as one record batch message when
+// it reaches `batch_rows' rows, or on render_flush. Column buffers are kept
+// from one batch to the next.
+#define ARROW_DEFAULT_BATCH_ROWS 65536
+
+// Writes the schema message, once before the first batch
+void arrow_init(unsigned batch_rows);
+
+void arrow_append(const struct pcap_pkthdr *header, const struct dissection *d);
+
+// Writes the batch of the calling thread, if it has rows
+void arrow_flush(void);
+
+// Writes the end of stream marker, after the last batch
+void arrow_finish(void);
+
+#endif
@@ -0,0 +1,182 @@
+#include <stddef.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <pcap/dlt.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "batch.h"
+#include "cursor.h"
+#include "link.h"
+#include "tcp.h"
+#include "udp.h"
+
+// Classes are compared 16 at a time, into a 32 bits bitmap
+#if CAPTURE_BATCH_MAX % 16 != 0 || CAPTURE_BATCH_MAX > 32
+#error "CAPTURE_BATCH_MAX must be 16 or 32"
+#endif
+
+// Fills the fields of packet `i'. Out of bounds, the cursor reads 0, which
+// is never a valid ethertype or protocol: a truncated packet just ends in a
+// class with less bits.
+static void classify_one(struct batch *b, unsigned i, int link_type,
+                         uint32_t length, const uint8_t *packet) {
+  struct cursor c = cursor_make(packet, length);
+  uint16_t type = 0;
+  switch (link_type) {
+#ifdef DLT_EN10MB
+    case DLT_EN10MB:
+      type = cursor_u16(&c, 12);
+      cursor_skip(&c, 14);
+      break;
+#endif
+#ifdef DLT_LINUX_SLL
+    case DLT_LINUX_SLL:
+      type = cursor_u16(&c, 14);
+      cursor_skip(&c, 16);
+      break;
+#endif
+#ifdef DLT_NULL
+    case DLT_NULL:
+    {
+      // In the byte order of the capturing host
+      uint32_t af = 0;
+      cursor_copy(&c, 0, &af, sizeof(af));
+      type = af_to_ethertype(af);
+      cursor_skip(&c, 4);
+      break;
+    }
+#endif
+  }
+  if (c.error) type = 0;
+
+  unsigned tags = 0;
+  for (; type == ETHERTYPE_VLAN && tags < 2 && cursor_has(&c, 0, 4); tags++) {
+    type = cursor_u16(&c, 2);
+    cursor_skip(&c, 4);
+  }
+
+  uint8_t proto = 0;
+  uint16_t sport = 0, dport = 0;
+  int ports = 0;
+  if (type == ETHERTYPE_IP && cursor_has(&c, 0, sizeof(struct ip))) {
+    proto = cursor_u8(&c, offsetof(struct ip, ip_p));
+    // Only whole datagrams: the fragments of one have to stay together
+    ports = (cursor_u16(&c, offsetof(struct ip, ip_off)) & (IP_MF | IP_OFFMASK)) == 0;
+    cursor_skip(&c, (cursor_u8(&c, 0) & 0x0f) * 4);
+  } else if (type == ETHERTYPE_IPV6 && cursor_has(&c, 0, 40)) {
+    proto = cursor_u8(&c, 6);
+    ports = 1;
+    cursor_skip(&c, 40);
+  }
+  if (ports && (proto == IPPROTO_UDP || proto == IPPROTO_TCP) && !c.error) {
+    sport = cursor_u16(&c, 0);
+    dport = cursor_u16(&c, 2);
+  }
+
+  b->ether_type[i] = type;
+  b->vlan_tags[i] = tags;
+  b->proto[i] = proto;
+  b->sport[i] = sport;
+  b->dport[i] = dport;
+  if (proto == IPPROTO_UDP)
+    b->app[i] = resolve_udp_handler(dport) != NULL || resolve_udp_handler(sport) != NULL;
+  else if (proto == IPPROTO_TCP)
+    b->app[i] = resolve_tcp_app(dport) != NULL || resolve_tcp_app(sport) != NULL;
+  else
+    b->app[i] = 0;
+}
+
+static void classify_all(struct batch *b) {
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  for (unsigned i = 0; i < CAPTURE_BATCH_MAX; i += 16) {
+    __m128i t0 = _mm_loadu_si128((const __m128i *)(b->ether_type + i));
+    __m128i t1 = _mm_loadu_si128((const __m128i *)(b->ether_type + i + 8));
+    // 16 bits all ones or zeros, narrowed to 8 by the signed saturation
+    __m128i ip4 = _mm_packs_epi16(_mm_cmpeq_epi16(t0, _mm_set1_epi16(ETHERTYPE_IP)),
+                                  _mm_cmpeq_epi16(t1, _mm_set1_epi16(ETHERTYPE_IP)));
+    __m128i ip6 = _mm_packs_epi16(_mm_cmpeq_epi16(t0, _mm_set1_epi16((short)ETHERTYPE_IPV6)),
+                                  _mm_cmpeq_epi16(t1, _mm_set1_epi16((short)ETHERTYPE_IPV6)));
+    __m128i proto = _mm_loadu_si128((const __m128i *)(b->proto + i));
+    __m128i udp = _mm_cmpeq_epi8(proto, _mm_set1_epi8(IPPROTO_UDP));
+    __m128i tcp = _mm_cmpeq_epi8(proto, _mm_set1_epi8(IPPROTO_TCP));
+    __m128i untagged = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(b->vlan_tags + i)), zero);
+    __m128i no_app = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(b->app + i)), zero);
+
+    __m128i class = _mm_or_si128(_mm_and_si128(ip4, _mm_set1_epi8(BATCH_IPV4)),
+                                 _mm_and_si128(ip6, _mm_set1_epi8(BATCH_IPV6)));
+    class = _mm_or_si128(class, _mm_and_si128(udp, _mm_set1_epi8(BATCH_UDP)));
+    class = _mm_or_si128(class, _mm_and_si128(tcp, _mm_set1_epi8(BATCH_TCP)));
+    class = _mm_or_si128(class, _mm_andnot_si128(untagged, _mm_set1_epi8(BATCH_VLAN)));
+    class = _mm_or_si128(class, _mm_andnot_si128(no_app, _mm_set1_epi8(BATCH_APP)));
+    _mm_storeu_si128((__m128i *)(b->classes + i), class);
+  }
+#else
+  for (unsigned i = 0; i < CAPTURE_BATCH_MAX; i++)
+    b->classes[i] = (b->ether_type[i] == ETHERTYPE_IP ? BATCH_IPV4 : 0)
+                  | (b->ether_type[i] == ETHERTYPE_IPV6 ? BATCH_IPV6 : 0)
+                  | (b->proto[i] == IPPROTO_UDP ? BATCH_UDP : 0)
+                  | (b->proto[i] == IPPROTO_TCP ? BATCH_TCP : 0)
+                  | (b->vlan_tags[i] != 0 ? BATCH_VLAN : 0)
+                  | (b->app[i] != 0 ? BATCH_APP : 0);
+#endif
+}
+
+// Bitmap of the packets of a class
+static uint32_t members(const struct batch *b, uint8_t class) {
+  uint32_t mask = 0;
+#ifdef __SSE2__
+  for (unsigned i = 0; i < CAPTURE_BATCH_MAX; i += 16) {
+    __m128i classes = _mm_loadu_si128((const __m128i *)(b->classes + i));
+    mask |= (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(classes, _mm_set1_epi8(class))) << i;
+  }
+#else
+  for (unsigned i = 0; i < CAPTURE_BATCH_MAX; i++)
+    mask |= (uint32_t)(b->classes[i] == class) << i;
+#endif
+  return mask;
+}
+
+void batch_classify(struct batch *b, int link_type, unsigned count,
+                    const struct pcap_pkthdr *headers, const uint8_t *const *packets) {
+  b->count = count;
+  b->headers = headers;
+  b->packets = packets;
+
+  for (unsigned i = 0; i < count && i < BATCH_PREFETCH; i++)
+    __builtin_prefetch(packets[i]);
+  for (unsigned i = 0; i < count; i++) {
+    if (i + BATCH_PREFETCH < count) {
+      // Ethernet, IP and transport headers span two lines at most
+      __builtin_prefetch(packets[i + BATCH_PREFETCH]);
+      __builtin_prefetch(packets[i + BATCH_PREFETCH] + 64);
+    }
+    classify_one(b, i, link_type, headers[i].caplen, packets[i]);
+  }
+  // The SIMD passes read whole vectors: what is past the batch gets a class
+  // too, left out of the bitmaps by batch_dispatch
+  for (unsigned i = count; i < CAPTURE_BATCH_MAX; i++) {
+    b->ether_type[i] = 0;
+    b->vlan_tags[i] = 0;
+    b->proto[i] = 0;
+    b->app[i] = 0;
+  }
+  classify_all(b);
+}
+
+void batch_dispatch(const struct batch *b, pcap_handler handler, uint8_t *user) {
+  uint32_t pending = b->count < 32 ? (1u << b->count) - 1 : UINT32_MAX;
+  while (pending != 0) {
+    uint32_t class = members(b, b->classes[__builtin_ctz(pending)]) & pending;
+    pending &= ~class;
+    for (; class != 0; class &= class - 1) {
+      unsigned i = __builtin_ctz(class);
+      handler(user, &b->headers[i], b->packets[i]);
+    }
+  }
+}
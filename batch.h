@@ -0,0 +1,52 @@
+#ifndef __BATCH_H
+#define __BATCH_H
+
+#include <stdint.h>
+#include <pcap/pcap.h>
+
+#include "capture.h"
+
+// Decoding by batches, for when the packets are not printed (sketch, IPFIX).
+//
+// A first pass over the batch reads the headers every decoder needs (link
+// type, ethertype, VLAN tags, IP protocol, ports) into one array per field,
+// prefetching the packets a few ahead, and gives each packet a class from
+// these fields, 16 at a time with SSE2. Then the packets are decoded class
+// by class, so the same handlers run back to back, on headers already in the
+// cache.
+//
+// All the packets of a flow fall in the same class (its addresses, protocol
+// and ports decide it), so they are still decoded in capture order: only
+// packets of different flows are reordered within a batch.
+#define BATCH_PREFETCH 4 // packets ahead
+
+// Bits of the class of a packet
+enum {
+  BATCH_IPV4 = 1,
+  BATCH_IPV6 = 2,
+  BATCH_UDP = 4,
+  BATCH_TCP = 8,
+  BATCH_VLAN = 16,
+  BATCH_APP = 32, // UDP or TCP port with an application decoder
+};
+
+struct batch {
+  unsigned count;
+  const struct pcap_pkthdr *headers;
+  const uint8_t *const *packets;
+  uint16_t ether_type[CAPTURE_BATCH_MAX]; // after the VLAN tags, 0 if unknown
+  uint8_t vlan_tags[CAPTURE_BATCH_MAX];
+  uint8_t proto[CAPTURE_BATCH_MAX];       // IP protocol, 0 if not IP
+  uint16_t sport[CAPTURE_BATCH_MAX];      // 0 if not UDP/TCP, or a fragment
+  uint16_t dport[CAPTURE_BATCH_MAX];
+  uint8_t app[CAPTURE_BATCH_MAX];
+  uint8_t classes[CAPTURE_BATCH_MAX];
+};
+
+void batch_classify(struct batch *batch, int link_type, unsigned count,
+                    const struct pcap_pkthdr *headers, const uint8_t *const *packets);
+
+// Calls `handler' on each packet of the batch, class by class
+void batch_dispatch(const struct batch *batch, pcap_handler handler, uint8_t *user);
+
+#endif
@@ -0,0 +1,95 @@
+// Microbenchmark of the one's complement sums of checksum.h, on the TCP
+// segments of 1500 bytes frames at odd addresses; checks first that all of
+// them agree, on every length and alignment. 10 Gb/s is about 812k of these
+// frames per second.
+//
+//   make bench
+//   ./bench_checksum [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "checksum.h"
+
+#define SAMPLES 256
+#define SEGMENT_LENGTH 1480 // 1500 bytes of IPv4, less its header
+
+typedef uint64_t sum_function(const uint8_t *data, size_t length, uint64_t sum);
+
+static const struct {
+  const char *name;
+  sum_function *sum;
+  const char *cpu; // for __builtin_cpu_supports, NULL for any
+} sums[] = {
+  { "scalar", checksum_scalar, NULL },
+#ifdef CHECKSUM_X86
+  { "sse2", checksum_sse2, "sse2" },
+  { "avx2", checksum_avx2, "avx2" },
+#endif
+};
+#define SUMS (sizeof(sums) / sizeof(sums[0]))
+
+// One byte more, so the segments are not aligned
+static uint8_t segments[SAMPLES][SEGMENT_LENGTH + 1];
+// Sink so the compiler keeps the calls
+static volatile uint16_t sink;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int supported(unsigned i) {
+#ifdef CHECKSUM_X86
+  if (sums[i].cpu != NULL) {
+    __builtin_cpu_init();
+    // __builtin_cpu_supports only takes literals
+    if (sums[i].cpu[0] == 's') return __builtin_cpu_supports("sse2");
+    return __builtin_cpu_supports("avx2");
+  }
+#endif
+  return 1;
+}
+
+static int check(void) {
+  int errors = 0;
+  for (unsigned i = 1; i < SUMS; i++) {
+    if (!supported(i)) continue;
+    for (unsigned offset = 0; offset < 8; offset++)
+      for (unsigned length = 0; length + offset <= SEGMENT_LENGTH + 1; length++) {
+        const uint8_t *data = segments[length % SAMPLES] + offset;
+        uint16_t expected = checksum_fold(checksum_scalar(data, length, 0));
+        uint16_t got = checksum_fold(sums[i].sum(data, length, 0));
+        if (got != expected) {
+          fprintf(stderr, "%s: %u bytes at +%u: %#06x, %#06x expected\n",
+                  sums[i].name, length, offset, got, expected);
+          errors++;
+        }
+      }
+  }
+  return errors;
+}
+
+int main(int argc, char **argv) {
+  unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+
+  srand(42);
+  for (int i = 0; i < SAMPLES; i++)
+    for (int j = 0; j < SEGMENT_LENGTH + 1; j++)
+      segments[i][j] = rand();
+
+  if (check() != 0) return EXIT_FAILURE;
+
+  for (unsigned i = 0; i < SUMS; i++) {
+    if (!supported(i)) continue;
+    double t0 = now();
+    for (unsigned long n = 0; n < iterations; n++)
+      sink += checksum_fold(sums[i].sum(segments[n % SAMPLES] + 1, SEGMENT_LENGTH, 0));
+    double t = now() - t0;
+    printf("%-6s %7.1f ns/segment  %6.2f GB/s  %6.2f Mpps\n", sums[i].name,
+           t * 1e9 / iterations, iterations * (double)SEGMENT_LENGTH / t / 1e9, iterations / t / 1e6);
+  }
+  return EXIT_SUCCESS;
+}
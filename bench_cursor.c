@@ -0,0 +1,163 @@
+// Microbenchmark of the packet cursor (cursor.h) against the casts and
+// APPLY_OVERHEAD checks the handlers used before. Both read the fields of
+// ethernet, IPv4, UDP and DNS headers from frames at odd addresses, some of
+// them truncated; checks first that both read the same.
+//
+//   make bench
+//   ./bench_cursor [iterations]
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+#include "cursor.h"
+#include "dns.h"
+
+#define SAMPLES 1024
+#define FRAME_LENGTH 128
+
+// One byte more, so the frames are not aligned
+static uint8_t frames[SAMPLES][FRAME_LENGTH + 1];
+static uint32_t lengths[SAMPLES];
+// Sink so the compiler keeps the calls
+static volatile uint32_t sink;
+
+struct fields {
+  uint16_t ether_type;
+  uint8_t src[4], dst[4];
+  uint8_t proto;
+  uint16_t sport, dport, ulen;
+  uint16_t id, qdcount;
+  int depth; // headers read before the packet was too small
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, unsigned long iterations, double casts, double cursor) {
+  printf("%-10s casts %6.1f ns   cursor %6.1f ns   x%.2f\n", name,
+         casts * 1e9 / iterations, cursor * 1e9 / iterations, casts / cursor);
+}
+
+// The check of util.h before the cursor, without the warning
+#define APPLY_OVERHEAD(structure, length, packet)                              \
+  {                                                                            \
+    if ((int)(length) < (int)sizeof(structure)) return;                        \
+    length -= sizeof(structure);                                               \
+    packet += sizeof(structure);                                               \
+  }
+
+#define NEED(c, size) { if (!cursor_has(&(c), 0, (size))) return; }
+
+static __attribute__((noinline)) void read_casts(struct fields *f, uint32_t length,
+                                                 const uint8_t *packet) {
+  struct ether_header *ether = (struct ether_header *)packet;
+  APPLY_OVERHEAD(struct ether_header, length, packet);
+  f->depth = 1;
+  f->ether_type = ntohs(ether->ether_type);
+
+  struct ip *ip = (struct ip *)packet;
+  APPLY_OVERHEAD(struct ip, length, packet);
+  f->depth = 2;
+  memcpy(f->src, &ip->ip_src, 4);
+  memcpy(f->dst, &ip->ip_dst, 4);
+  f->proto = ip->ip_p;
+
+  struct udphdr *udp = (struct udphdr *)packet;
+  APPLY_OVERHEAD(struct udphdr, length, packet);
+  f->depth = 3;
+  f->sport = ntohs(udp->uh_sport);
+  f->dport = ntohs(udp->uh_dport);
+  f->ulen = ntohs(udp->uh_ulen);
+
+  struct dns_hdr *dns = (struct dns_hdr *)packet;
+  APPLY_OVERHEAD(struct dns_hdr, length, packet);
+  f->depth = 4;
+  f->id = ntohs(dns->id);
+  f->qdcount = ntohs(dns->qdcount);
+}
+
+static __attribute__((noinline)) void read_cursor(struct fields *f, uint32_t length,
+                                                  const uint8_t *packet) {
+  struct cursor c = cursor_make(packet, length);
+  NEED(c, sizeof(struct ether_header));
+  struct cursor h = cursor_pull(&c, sizeof(struct ether_header));
+  f->depth = 1;
+  f->ether_type = cursor_u16(&h, offsetof(struct ether_header, ether_type));
+
+  NEED(c, sizeof(struct ip));
+  h = cursor_pull(&c, sizeof(struct ip));
+  f->depth = 2;
+  cursor_copy(&h, offsetof(struct ip, ip_src), f->src, 4);
+  cursor_copy(&h, offsetof(struct ip, ip_dst), f->dst, 4);
+  f->proto = cursor_u8(&h, offsetof(struct ip, ip_p));
+
+  NEED(c, sizeof(struct udphdr));
+  h = cursor_pull(&c, sizeof(struct udphdr));
+  f->depth = 3;
+  f->sport = cursor_u16(&h, offsetof(struct udphdr, uh_sport));
+  f->dport = cursor_u16(&h, offsetof(struct udphdr, uh_dport));
+  f->ulen = cursor_u16(&h, offsetof(struct udphdr, uh_ulen));
+
+  NEED(c, sizeof(struct dns_hdr));
+  h = cursor_pull(&c, sizeof(struct dns_hdr));
+  f->depth = 4;
+  f->id = cursor_u16(&h, offsetof(struct dns_hdr, id));
+  f->qdcount = cursor_u16(&h, offsetof(struct dns_hdr, qdcount));
+}
+
+static int check(void) {
+  int errors = 0;
+  for (int i = 0; i < SAMPLES; i++) {
+    struct fields a, b;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    read_casts(&a, lengths[i], frames[i] + 1);
+    read_cursor(&b, lengths[i], frames[i] + 1);
+    if (memcmp(&a, &b, sizeof(a)) != 0) {
+      fprintf(stderr, "sample %d (%u bytes): mismatch\n", i, lengths[i]);
+      errors++;
+    }
+  }
+  return errors;
+}
+
+int main(int argc, char **argv) {
+  unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+  struct fields f;
+  double t0, t1, t2;
+
+  srand(42);
+  for (int i = 0; i < SAMPLES; i++) {
+    for (int j = 0; j < FRAME_LENGTH + 1; j++)
+      frames[i][j] = rand();
+    // One frame out of eight stops in a header
+    lengths[i] = i % 8 == 0 ? rand() % 54 : 54 + rand() % (FRAME_LENGTH - 54);
+  }
+
+  if (check() != 0) return EXIT_FAILURE;
+
+  t0 = now();
+  for (unsigned long i = 0; i < iterations; i++) {
+    read_casts(&f, lengths[i % SAMPLES], frames[i % SAMPLES] + 1);
+    sink += f.depth;
+  }
+  t1 = now();
+  for (unsigned long i = 0; i < iterations; i++) {
+    read_cursor(&f, lengths[i % SAMPLES], frames[i % SAMPLES] + 1);
+    sink += f.depth;
+  }
+  t2 = now();
+  report("headers", iterations, t1 - t0, t2 - t1);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,158 @@
+// Microbenchmark of the formatters in format.c against the libc functions
+// they replace. Checks first that both give the same output on random input.
+//
+//   make bench
+//   ./bench_format [iterations]
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/ether.h>
+
+#include "format.h"
+
+#define SAMPLES 1024
+#define DUMP_LENGTH 1500
+
+static uint8_t samples[SAMPLES][16];
+static uint8_t dump[DUMP_LENGTH];
+// Sink so the compiler keeps the calls
+static volatile size_t sink;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, unsigned long iterations, double libc, double fast) {
+  printf("%-10s libc %8.1f ns   format %8.1f ns   x%.1f\n", name,
+         libc * 1e9 / iterations, fast * 1e9 / iterations, libc / fast);
+}
+
+// The hex dump as render.c used to print it, with snprintf instead of printf
+static size_t hexdump_libc(const uint8_t *packet, uint32_t length, char *buf) {
+  size_t off = 0;
+  for (uint32_t i = 0; i * 16 < length; i++) {
+    for (uint32_t j = 0; j < 16; j++) {
+      if (j + i * 16 < length)
+        off += sprintf(buf + off, "%02x ", packet[i * 16 + j]);
+      else
+        off += sprintf(buf + off, "   ");
+      if (j == 7) off += sprintf(buf + off, " ");
+    }
+    off += sprintf(buf + off, "  ");
+    for (uint32_t j = 0; j < 16; j++) {
+      if (j + i * 16 < length)
+        off += sprintf(buf + off, "%c", isprint(packet[i * 16 + j]) ? packet[i * 16 + j] : '.');
+      else
+        off += sprintf(buf + off, " ");
+      if (j == 7) off += sprintf(buf + off, " ");
+    }
+    off += sprintf(buf + off, "\n");
+  }
+  return off;
+}
+
+static int check(void) {
+  char a[FORMAT_HEXDUMP_SIZE(DUMP_LENGTH)], b[FORMAT_HEXDUMP_SIZE(DUMP_LENGTH)];
+  int errors = 0;
+
+  for (int i = 0; i < SAMPLES; i++) {
+    // Mostly zero groups, to go through the "::" and IPv4 cases
+    if (i % 4 == 0) memset(samples[i], 0, 10 + i % 5);
+    if (i % 8 == 0) samples[i][10] = samples[i][11] = 0xff;
+
+    struct ether_addr ea;
+    memcpy(&ea, samples[i], 6);
+    ether_ntoa_r(&ea, a);
+    if (strcmp(a, format_ether(samples[i], b)) != 0) {
+      fprintf(stderr, "ether: %s != %s\n", a, b);
+      errors++;
+    }
+
+    inet_ntop(AF_INET, samples[i], a, INET_ADDRSTRLEN);
+    if (strcmp(a, format_ipv4(samples[i], b)) != 0) {
+      fprintf(stderr, "ipv4: %s != %s\n", a, b);
+      errors++;
+    }
+
+    inet_ntop(AF_INET6, samples[i], a, INET6_ADDRSTRLEN);
+    if (strcmp(a, format_ipv6(samples[i], b)) != 0) {
+      fprintf(stderr, "ipv6: %s != %s\n", a, b);
+      errors++;
+    }
+  }
+
+  for (uint32_t length = 0; length <= 64; length++) {
+    size_t la = hexdump_libc(dump, length, a);
+    size_t lb = format_hexdump(dump, length, b);
+    if (la != lb || memcmp(a, b, la) != 0) {
+      fprintf(stderr, "hexdump: mismatch for %u bytes\n", length);
+      errors++;
+    }
+  }
+  return errors;
+}
+
+int main(int argc, char **argv) {
+  unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  char buf[FORMAT_HEXDUMP_SIZE(DUMP_LENGTH)];
+  double t0, t1, t2;
+
+  srand(42);
+  for (int i = 0; i < SAMPLES; i++)
+    for (int j = 0; j < 16; j++)
+      samples[i][j] = rand();
+  for (int i = 0; i < DUMP_LENGTH; i++)
+    dump[i] = rand();
+
+  if (check() != 0) return EXIT_FAILURE;
+
+  t0 = now();
+  for (unsigned long i = 0; i < iterations; i++) {
+    struct ether_addr ea;
+    memcpy(&ea, samples[i % SAMPLES], 6);
+    sink += (size_t)ether_ntoa_r(&ea, buf);
+  }
+  t1 = now();
+  for (unsigned long i = 0; i < iterations; i++)
+    sink += (size_t)format_ether(samples[i % SAMPLES], buf);
+  t2 = now();
+  report("ether", iterations, t1 - t0, t2 - t1);
+
+  t0 = now();
+  for (unsigned long i = 0; i < iterations; i++)
+    sink += (size_t)inet_ntop(AF_INET, samples[i % SAMPLES], buf, INET_ADDRSTRLEN);
+  t1 = now();
+  for (unsigned long i = 0; i < iterations; i++)
+    sink += (size_t)format_ipv4(samples[i % SAMPLES], buf);
+  t2 = now();
+  report("ipv4", iterations, t1 - t0, t2 - t1);
+
+  t0 = now();
+  for (unsigned long i = 0; i < iterations; i++)
+    sink += (size_t)inet_ntop(AF_INET6, samples[i % SAMPLES], buf, INET6_ADDRSTRLEN);
+  t1 = now();
+  for (unsigned long i = 0; i < iterations; i++)
+    sink += (size_t)format_ipv6(samples[i % SAMPLES], buf);
+  t2 = now();
+  report("ipv6", iterations, t1 - t0, t2 - t1);
+
+  // A full size frame per iteration
+  unsigned long dumps = iterations / 100 + 1;
+  t0 = now();
+  for (unsigned long i = 0; i < dumps; i++)
+    sink += hexdump_libc(dump, DUMP_LENGTH, buf);
+  t1 = now();
+  for (unsigned long i = 0; i < dumps; i++)
+    sink += format_hexdump(dump, DUMP_LENGTH, buf);
+  t2 = now();
+  report("hexdump", dumps, t1 - t0, t2 - t1);
+
+  return EXIT_SUCCESS;
+}
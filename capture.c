@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "output.h"
+#include "sketch.h"
+#include "util.h"
+
+// Snaplen used for live captures and to compile filters
+#define SNAPLEN 9000
+// Where the libpcap backend copies the packets of a batch
+#define BATCH_COPY_SIZE (CAPTURE_BATCH_MAX * SNAPLEN)
+
+static int pcap_backend_datalink(struct capture *c) {
+  return pcap_datalink(c->handle);
+}
+
+static int pcap_backend_setfilter(struct capture *c, struct bpf_program *fp) {
+  return pcap_setfilter(c->handle, fp);
+}
+
+// pcap_loop, but for the wake-ups on the timeout of a live capture
+static int pcap_backend_loop(struct capture *c, pcap_handler callback, uint8_t *user) {
+  int ret;
+  while ((ret = pcap_dispatch(c->handle, -1, callback, user)) >= 0) {
+    // Nothing more in a file, a timeout on an interface
+    if (ret == 0 && pcap_file(c->handle) != NULL) break;
+    output_idle();
+    sketch_idle();
+  }
+  return ret;
+}
+
+// libpcap reuses its buffer once the callback returns: the packets of each
+// pcap_dispatch are copied
+static int pcap_backend_loop_batch(struct capture *c, capture_batch_handler handler,
+                                   uint8_t *user) {
+  struct capture_batcher *b = malloc(sizeof(struct capture_batcher));
+  uint8_t *copy = malloc(BATCH_COPY_SIZE);
+  if (b == NULL || copy == NULL) {
+    free(b);
+    free(copy);
+    return PCAP_ERROR;
+  }
+  capture_batcher_init(b, handler, user);
+  b->copy = copy;
+  b->copy_size = BATCH_COPY_SIZE;
+
+  int ret;
+  while ((ret = pcap_dispatch(c->handle, CAPTURE_BATCH_MAX, capture_batch_add, (uint8_t *)b)) >= 0) {
+    capture_batch_flush(b);
+    // Nothing more in a file, a timeout on an interface
+    if (ret == 0 && pcap_file(c->handle) != NULL) break;
+    sketch_idle();
+  }
+  capture_batch_flush(b);
+  free(copy);
+  free(b);
+  return ret;
+}
+
+static void pcap_backend_breakloop(struct capture *c) {
+  pcap_breakloop(c->handle);
+}
+
+static int pcap_backend_stats(struct capture *c, struct pcap_stat *stats) {
+  return pcap_stats(c->handle, stats);
+}
+
+static void pcap_backend_close(struct capture *c) {
+  pcap_close(c->handle);
+  free(c);
+}
+
+static struct capture *wrap_pcap(pcap_t *pcap) {
+  if (pcap == NULL) return NULL;
+
+  struct capture *c = calloc(1, sizeof(struct capture));
+  if (c == NULL) {
+    pcap_close(pcap);
+    return NULL;
+  }
+
+  c->handle = pcap;
+  c->datalink = pcap_backend_datalink;
+  c->setfilter = pcap_backend_setfilter;
+  c->loop = pcap_backend_loop;
+  c->loop_batch = pcap_backend_loop_batch;
+  c->breakloop = pcap_backend_breakloop;
+  c->stats = pcap_backend_stats;
+  c->close = pcap_backend_close;
+  return c;
+}
+
+struct capture *capture_open_live(const char *device, char *errbuf) {
+  return wrap_pcap(pcap_open_live(device, SNAPLEN, 1, CAPTURE_TIMEOUT, errbuf));
+}
+
+struct capture *capture_open_offline(const char *file, char *errbuf) {
+  return wrap_pcap(pcap_open_offline(file, errbuf));
+}
+
+int capture_set_filter(struct capture *c, const char *filter, char *errbuf) {
+  struct bpf_program fp;
+  // libpcap needs a handle to compile a filter, use a dead one when the
+  // backend is not libpcap.
+  int own = c->close != pcap_backend_close;
+  pcap_t *pcap = own ? pcap_open_dead(c->datalink(c), SNAPLEN) : c->handle;
+  if (pcap == NULL) {
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "could not compile filter");
+    return -1;
+  }
+
+  DEBUGF("Compiling filter `%s'", filter);
+  // TODO: check for netmask
+  if (pcap_compile(pcap, &fp, filter, 1, PCAP_NETMASK_UNKNOWN) == PCAP_ERROR) {
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s", pcap_geterr(pcap));
+    if (own) pcap_close(pcap);
+    return -1;
+  }
+
+  DEBUG("Applying filter");
+  int ret = c->setfilter(c, &fp);
+  if (ret == PCAP_ERROR)
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s",
+             own ? "could not apply filter" : pcap_geterr(pcap));
+
+  pcap_freecode(&fp);
+  if (own) pcap_close(pcap);
+  return ret == PCAP_ERROR ? -1 : 0;
+}
+
+void capture_batcher_init(struct capture_batcher *b, capture_batch_handler handler,
+                          uint8_t *user) {
+  b->handler = handler;
+  b->user = user;
+  b->count = 0;
+  b->copy = NULL;
+  b->copy_size = 0;
+  b->copy_used = 0;
+}
+
+void capture_batch_flush(struct capture_batcher *b) {
+  if (b->count > 0)
+    b->handler(b->user, b->count, b->headers, b->packets);
+  b->count = 0;
+  b->copy_used = 0;
+}
+
+void capture_batch_add(uint8_t *batcher, const struct pcap_pkthdr *header, const uint8_t *packet) {
+  struct capture_batcher *b = (struct capture_batcher *)batcher;
+  if (b->copy != NULL) {
+    if (b->copy_used + header->caplen > b->copy_size)
+      capture_batch_flush(b);
+    if (header->caplen > b->copy_size) {
+      // Bigger than the whole copy: alone, while it is still valid
+      b->handler(b->user, 1, header, &packet);
+      return;
+    }
+    memcpy(b->copy + b->copy_used, packet, header->caplen);
+    packet = b->copy + b->copy_used;
+    b->copy_used += header->caplen;
+  }
+  b->headers[b->count] = *header;
+  b->packets[b->count] = packet;
+  if (++b->count == CAPTURE_BATCH_MAX)
+    capture_batch_flush(b);
+}
+
+struct single {
+  capture_batch_handler handler;
+  uint8_t *user;
+};
+
+static void deliver_single(uint8_t *arg, const struct pcap_pkthdr *header, const uint8_t *packet) {
+  struct single *s = (struct single *)arg;
+  s->handler(s->user, 1, header, &packet);
+}
+
+int capture_loop_batch(struct capture *c, capture_batch_handler handler, uint8_t *user) {
+  if (c->loop_batch != NULL)
+    return c->loop_batch(c, handler, user);
+  struct single s = { handler, user };
+  return c->loop(c, deliver_single, (uint8_t *)&s);
+}
@@ -0,0 +1,68 @@
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#include <stdint.h>
+#include <pcap/pcap.h>
+
+// A source of packets. libpcap is the default backend, the others (see
+// tpacket.h) implement the same operations so that main.c does not care where
+// the packets come from. Packets are handed to a pcap_handler, with the same
+// semantics as pcap_loop.
+//
+// Backends can also hand the packets by batches of up to CAPTURE_BATCH_MAX
+// (loop_batch, NULL if they can not): the headers and packets of a batch are
+// valid until the handler returns.
+#define CAPTURE_BATCH_MAX 32
+
+// Longest a live capture loop waits on a quiet interface, in ms, before it
+// wakes up to write the output waiting for its flush interval (output_idle)
+#define CAPTURE_TIMEOUT 100
+
+typedef void (*capture_batch_handler)(uint8_t *user, unsigned count,
+                                      const struct pcap_pkthdr *headers,
+                                      const uint8_t *const *packets);
+
+struct capture {
+  void *handle;
+  int (*datalink)(struct capture *);
+  int (*setfilter)(struct capture *, struct bpf_program *);
+  int (*loop)(struct capture *, pcap_handler, uint8_t *);
+  int (*loop_batch)(struct capture *, capture_batch_handler, uint8_t *);
+  void (*breakloop)(struct capture *);
+  int (*stats)(struct capture *, struct pcap_stat *);
+  void (*close)(struct capture *);
+};
+
+struct capture *capture_open_live(const char *device, char *errbuf);
+struct capture *capture_open_offline(const char *file, char *errbuf);
+
+// Compiles and applies a BPF filter. Backends without libpcap get it compiled
+// for their link type. Returns -1 and fills `errbuf' on error.
+int capture_set_filter(struct capture *capture, const char *filter, char *errbuf);
+
+// Like the loop of the capture, by batches. Backends without loop_batch hand
+// batches of one packet.
+int capture_loop_batch(struct capture *capture, capture_batch_handler handler, uint8_t *user);
+
+// For the backends: collects the packets given to capture_batch_add (a
+// pcap_handler, with the batcher as `user') and hands them to the handler
+// when CAPTURE_BATCH_MAX are there, or on capture_batch_flush. Packets are
+// kept in place, the backend must flush before they go away; with `copy',
+// they are copied instead, for the backends that reuse their buffer.
+struct capture_batcher {
+  capture_batch_handler handler;
+  uint8_t *user;
+  unsigned count;
+  struct pcap_pkthdr headers[CAPTURE_BATCH_MAX];
+  const uint8_t *packets[CAPTURE_BATCH_MAX];
+  uint8_t *copy;
+  size_t copy_size;
+  size_t copy_used;
+};
+
+void capture_batcher_init(struct capture_batcher *batcher, capture_batch_handler handler,
+                          uint8_t *user);
+void capture_batch_add(uint8_t *batcher, const struct pcap_pkthdr *header, const uint8_t *packet);
+void capture_batch_flush(struct capture_batcher *batcher);
+
+#endif
@@ -0,0 +1,205 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+#include "checksum.h"
+#include "stats.h"
+#include "util.h"
+
+#ifdef CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+const char *checksum_names[CHECKSUM_PROTOCOLS] = {
+  [CHECKSUM_IPV4] = "IPv4",
+  [CHECKSUM_UDP] = "UDP",
+  [CHECKSUM_TCP] = "TCP",
+};
+
+static const enum stats_warning warnings[CHECKSUM_PROTOCOLS] = {
+  [CHECKSUM_IPV4] = STATS_BAD_IPV4_CHECKSUM,
+  [CHECKSUM_UDP] = STATS_BAD_UDP_CHECKSUM,
+  [CHECKSUM_TCP] = STATS_BAD_TCP_CHECKSUM,
+};
+
+uint64_t (*checksum_sum)(const uint8_t *data, size_t length, uint64_t sum) = checksum_scalar;
+const char *checksum_implementation = "scalar";
+
+uint64_t checksum_scalar(const uint8_t *data, size_t length, uint64_t sum) {
+  uint32_t word;
+  uint16_t half;
+  for (; length >= 4; data += 4, length -= 4) {
+    memcpy(&word, data, 4);
+    sum += word;
+  }
+  if (length >= 2) {
+    memcpy(&half, data, 2);
+    sum += half;
+    data += 2;
+    length -= 2;
+  }
+  if (length == 1) {
+    uint8_t last[2] = { data[0], 0 };
+    memcpy(&half, last, 2);
+    sum += half;
+  }
+  return sum;
+}
+
+#ifdef CHECKSUM_X86
+// The 32 bits words are widened to 64 bits lanes, two accumulators per
+// vector: no carry is lost before 2^32 vectors
+__attribute__((target("sse2")))
+uint64_t checksum_sse2(const uint8_t *data, size_t length, uint64_t sum) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i low = zero, high = zero;
+  for (; length >= 16; data += 16, length -= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)data);
+    low = _mm_add_epi64(low, _mm_unpacklo_epi32(v, zero));
+    high = _mm_add_epi64(high, _mm_unpackhi_epi32(v, zero));
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(low, high));
+  return checksum_scalar(data, length, sum + lanes[0] + lanes[1]);
+}
+
+__attribute__((target("avx2")))
+uint64_t checksum_avx2(const uint8_t *data, size_t length, uint64_t sum) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i low = zero, high = zero;
+  for (; length >= 32; data += 32, length -= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)data);
+    low = _mm256_add_epi64(low, _mm256_unpacklo_epi32(v, zero));
+    high = _mm256_add_epi64(high, _mm256_unpackhi_epi32(v, zero));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(low, high));
+  return checksum_sse2(data, length, sum + lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+#endif
+
+uint16_t checksum_fold(uint64_t sum) {
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return sum;
+}
+
+void checksum_init(void) {
+#ifdef CHECKSUM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    checksum_sum = checksum_avx2;
+    checksum_implementation = "avx2";
+  } else if (__builtin_cpu_supports("sse2")) {
+    checksum_sum = checksum_sse2;
+    checksum_implementation = "sse2";
+  }
+#endif
+}
+
+static int enabled = 0;
+static int offload = 0;
+
+void checksum_enable(int with_offload) {
+  enabled = 1;
+  offload = with_offload;
+}
+
+// Counters of a thread, only written by it, as in stats.c
+struct counters {
+  struct checksum_stats stats;
+  struct counters *next;
+};
+
+#define BUMP(field) \
+  __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED)
+
+static struct counters *all_counters = NULL;
+static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct counters *thread_counters = NULL;
+
+static struct checksum_stats *get_counters(void) {
+  if (thread_counters != NULL) return &thread_counters->stats;
+
+  struct counters *c = calloc(1, sizeof(struct counters));
+  if (c == NULL) return NULL;
+  pthread_mutex_lock(&counters_lock);
+  c->next = all_counters;
+  __atomic_store_n(&all_counters, c, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&counters_lock);
+  thread_counters = c;
+  return &c->stats;
+}
+
+// Counts a verified checksum, from the sum of everything it covers, itself
+// included. `field' is the checksum and `pseudo' the sum of the pseudo-header,
+// both in the byte order of the host.
+static void verify(enum checksum_protocol p, uint64_t sum, uint16_t field, uint64_t pseudo) {
+  struct checksum_stats *s = get_counters();
+  if (s != NULL) BUMP(s->verified[p]);
+  if (checksum_fold(sum) == 0xffff) return;
+
+  if (offload && (field == 0 || (p != CHECKSUM_IPV4 && field == checksum_fold(pseudo)))) {
+    if (s != NULL) BUMP(s->offloaded[p]);
+    return;
+  }
+  if (s != NULL) BUMP(s->bad[p]);
+  // Without the field: one's complement subtraction
+  uint16_t expected = ~checksum_fold(sum + (uint16_t)~field);
+  WARNF("Bad %s checksum 0x%04x (0x%04x expected)", checksum_names[p], ntohs(field), ntohs(expected));
+  stats_warn(warnings[p]);
+}
+
+void checksum_ipv4(const uint8_t *header, uint32_t length) {
+  if (!enabled || length < sizeof(struct ip)) return;
+  uint16_t field;
+  memcpy(&field, header + offsetof(struct ip, ip_sum), 2);
+  verify(CHECKSUM_IPV4, checksum_sum(header, length, 0), field, 0);
+}
+
+void checksum_transport(uint8_t proto, const uint8_t *src, const uint8_t *dst,
+                        unsigned address_size, const uint8_t *segment, uint32_t length) {
+  if (!enabled) return;
+  enum checksum_protocol p;
+  uint16_t field;
+  if (proto == IPPROTO_UDP) {
+    if (length < sizeof(struct udphdr)) return;
+    p = CHECKSUM_UDP;
+    memcpy(&field, segment + offsetof(struct udphdr, uh_sum), 2);
+    // Optional over IPv4 (RFC 768)
+    if (field == 0 && address_size == 4) return;
+    // Covers what its header says, if it fits
+    uint16_t ulen;
+    memcpy(&ulen, segment + offsetof(struct udphdr, uh_ulen), 2);
+    ulen = ntohs(ulen);
+    if (ulen >= sizeof(struct udphdr) && ulen <= length) length = ulen;
+  } else if (proto == IPPROTO_TCP) {
+    if (length < sizeof(struct tcphdr)) return;
+    p = CHECKSUM_TCP;
+    memcpy(&field, segment + offsetof(struct tcphdr, th_sum), 2);
+  } else {
+    return;
+  }
+
+  // Addresses, then the protocol and the length as 32 bits in network order:
+  // the same words as the 8 bits zero, protocol, 16 bits length of IPv4
+  uint64_t pseudo = checksum_scalar(src, address_size, 0);
+  pseudo = checksum_scalar(dst, address_size, pseudo);
+  pseudo += htons(proto) + htons(length >> 16) + htons(length & 0xffff);
+  verify(p, checksum_sum(segment, length, pseudo), field, pseudo);
+}
+
+void checksum_stats(struct checksum_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  for (struct counters *c = __atomic_load_n(&all_counters, __ATOMIC_ACQUIRE); c != NULL; c = c->next)
+    for (unsigned p = 0; p < CHECKSUM_PROTOCOLS; p++) {
+      stats->verified[p] += __atomic_load_n(&c->stats.verified[p], __ATOMIC_RELAXED);
+      stats->bad[p] += __atomic_load_n(&c->stats.bad[p], __ATOMIC_RELAXED);
+      stats->offloaded[p] += __atomic_load_n(&c->stats.offloaded[p], __ATOMIC_RELAXED);
+    }
+}
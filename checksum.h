@@ -0,0 +1,67 @@
+#ifndef __CHECKSUM_H
+#define __CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Verification of the IPv4 header, UDP and TCP checksums (RFC 1071), off
+// unless enabled with mydump_verify_checksums. Bad ones are logged, counted
+// by stats.h as warnings, and by protocol here.
+//
+// The one's complement sum is computed on words loaded in the byte order of
+// the host, which gives the same sum byte-swapped, and accumulated in 64 bits
+// so that carries are only folded at the end: 4 bytes at a time, or 16 and 32
+// with SSE2 and AVX2, picked at startup from what the CPU supports.
+//
+// With `offload', the checksums the capturing host left to its NIC are not
+// counted bad: 0 (IPv4, TCP, UDP over IPv6), or the sum of the pseudo-header
+// alone (UDP, TCP), which is the partial checksum Linux hands to the card.
+enum checksum_protocol {
+  CHECKSUM_IPV4,
+  CHECKSUM_UDP,
+  CHECKSUM_TCP,
+  CHECKSUM_PROTOCOLS,
+};
+
+extern const char *checksum_names[CHECKSUM_PROTOCOLS];
+
+struct checksum_stats {
+  uint64_t verified[CHECKSUM_PROTOCOLS];
+  uint64_t bad[CHECKSUM_PROTOCOLS];
+  uint64_t offloaded[CHECKSUM_PROTOCOLS]; // bad, but left to the NIC
+};
+
+// Adds the 16 bits words of `data' to `sum', not folded. An odd last byte is
+// padded with a zero.
+uint64_t checksum_scalar(const uint8_t *data, size_t length, uint64_t sum);
+#if defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_X86
+uint64_t checksum_sse2(const uint8_t *data, size_t length, uint64_t sum);
+uint64_t checksum_avx2(const uint8_t *data, size_t length, uint64_t sum);
+#endif
+
+// The fastest of them on this CPU once checksum_init is done, and its name
+extern uint64_t (*checksum_sum)(const uint8_t *data, size_t length, uint64_t sum);
+extern const char *checksum_implementation;
+
+// The sum on 16 bits, in the byte order of the host
+uint16_t checksum_fold(uint64_t sum);
+
+// Picks the sum for the CPU (mydump_init)
+void checksum_init(void);
+
+// Before any packet is decoded
+void checksum_enable(int offload);
+
+// Verifies an IPv4 header of `length' bytes, options included
+void checksum_ipv4(const uint8_t *header, uint32_t length);
+
+// Verifies a whole UDP or TCP segment, with the pseudo-header of its IP
+// addresses (`address_size' bytes each: 4 or 16). Does nothing for other
+// protocols.
+void checksum_transport(uint8_t proto, const uint8_t *src, const uint8_t *dst,
+                        unsigned address_size, const uint8_t *segment, uint32_t length);
+
+void checksum_stats(struct checksum_stats *stats);
+
+#endif
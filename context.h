@@ -0,0 +1,57 @@
+#ifndef __CONTEXT_H
+#define __CONTEXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "link.h"
+#include "mydump.h"
+#include "util.h"
+
+#define ARENA_MAX_BLOCKS 16
+
+struct arena_block {
+  uint8_t *data;
+  size_t size;
+};
+
+// Memory of the dissection of one packet, reset by each one
+struct arena {
+  unsigned current;
+  size_t used;
+  struct arena_block blocks[ARENA_MAX_BLOCKS];
+};
+
+// Everything the decoding of a packet changes, besides the shared budgets and
+// counters. The decoders find it with context_current(): the context bound by
+// mydump_decode, or else the one of the calling thread, created on first use
+// and freed when it exits.
+struct mydump_context {
+  char indent[256];
+  uint8_t indent_level;
+  struct arena arena;
+  void *frag; // see frag.c
+  void *stream; // see stream.c
+  struct out_buffer out; // what mydump_render returns
+  enum output_format format;
+  int log_level; // -1 for the level of the process
+  mydump_log_sink log;
+  void *log_user;
+  // Last link type decoded
+  int link_type;
+  link_handler handler;
+  // Being decoded, for the warnings it keeps (dissect_defer_warnings)
+  struct dissection *decoding;
+};
+
+extern __thread struct mydump_context *bound_context;
+
+// The context of the calling thread, created on first use
+struct mydump_context *context_thread(void);
+
+static inline struct mydump_context *context_current(void) {
+  struct mydump_context *c = bound_context;
+  return c != NULL ? c : context_thread();
+}
+
+#endif
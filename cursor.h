@@ -0,0 +1,99 @@
+#ifndef __CURSOR_H
+#define __CURSOR_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// Bounds-checked view of the bytes of a packet, for the handlers, instead of
+// casting the packet to header structures: those loads may be unaligned, which
+// is undefined, and nothing checks them against the length.
+//
+// Reads are big-endian, at an offset from the start of the view, and go
+// through memcpy: with a constant offset in a view of known size (a header
+// from cursor_pull), the check folds away and each read is a single load and
+// byte swap. Out of bounds, a read returns 0 and a skip does nothing; both
+// set `error', so a handler can read all its fields and check once.
+struct cursor {
+  const uint8_t *data;
+  uint32_t length;
+  int error;
+};
+
+static inline struct cursor cursor_make(const uint8_t *data, uint32_t length) {
+  struct cursor c = { data, length, 0 };
+  return c;
+}
+
+// Whether `size' bytes can be read at `offset'
+static inline int cursor_has(const struct cursor *c, uint32_t offset, uint32_t size) {
+  return offset <= c->length && size <= c->length - offset;
+}
+
+static inline uint8_t cursor_u8(struct cursor *c, uint32_t offset) {
+  if (!cursor_has(c, offset, 1)) {
+    c->error = 1;
+    return 0;
+  }
+  return c->data[offset];
+}
+
+static inline uint16_t cursor_u16(struct cursor *c, uint32_t offset) {
+  uint16_t v;
+  if (!cursor_has(c, offset, 2)) {
+    c->error = 1;
+    return 0;
+  }
+  memcpy(&v, c->data + offset, 2);
+  return ntohs(v);
+}
+
+static inline uint32_t cursor_u32(struct cursor *c, uint32_t offset) {
+  uint32_t v;
+  if (!cursor_has(c, offset, 4)) {
+    c->error = 1;
+    return 0;
+  }
+  memcpy(&v, c->data + offset, 4);
+  return ntohl(v);
+}
+
+// Copies bytes as they are: addresses, fields kept in network order. Zeroes
+// `dst' out of bounds.
+static inline void cursor_copy(struct cursor *c, uint32_t offset, void *dst, uint32_t size) {
+  if (!cursor_has(c, offset, size)) {
+    c->error = 1;
+    memset(dst, 0, size);
+    return;
+  }
+  memcpy(dst, c->data + offset, size);
+}
+
+static inline void cursor_skip(struct cursor *c, uint32_t size) {
+  if (size > c->length) {
+    c->error = 1;
+    return;
+  }
+  c->data += size;
+  c->length -= size;
+}
+
+// The `size' bytes at `offset', as a view of their own. Out of bounds, an
+// empty view in error.
+static inline struct cursor cursor_sub(struct cursor *c, uint32_t offset, uint32_t size) {
+  if (!cursor_has(c, offset, size)) {
+    c->error = 1;
+    struct cursor empty = { c->data, 0, 1 };
+    return empty;
+  }
+  return cursor_make(c->data + offset, size);
+}
+
+// The next `size' bytes (a header), skipped in `c'
+static inline struct cursor cursor_pull(struct cursor *c, uint32_t size) {
+  struct cursor header = cursor_sub(c, 0, size);
+  cursor_skip(c, size);
+  return header;
+}
+
+#endif
@@ -0,0 +1,21 @@
+#include "dispatch.h"
+
+int dispatch_set(struct dispatch *t, uint16_t key, void *value) {
+  if (key == 0) return -1;
+
+  unsigned used = 0;
+  for (unsigned i = 0; i < DISPATCH_SLOTS; i++)
+    used += t->keys[i] != 0;
+
+  unsigned i = dispatch_slot(key);
+  for (; t->keys[i] != 0; i = (i + 1) & (DISPATCH_SLOTS - 1))
+    if (t->keys[i] == key) {
+      t->values[i] = value;
+      return 0;
+    }
+  // Some slots stay empty to end the probes
+  if (used >= DISPATCH_MAX_KEYS) return -1;
+  t->keys[i] = key;
+  t->values[i] = value;
+  return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef __DISPATCH_H
+#define __DISPATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compact table from a 16 bits wire value (ethertype, port) to a decoder,
+// instead of an array indexed by the value: the keys fit in one cache line
+// and a lookup reads one more for the value, whatever the keys. Open
+// addressing with linear probing; 0 is the empty key, so it can not be
+// dispatched. Filled at startup (mydump_init, --decode-as), read-only after.
+#define DISPATCH_SLOTS 32 // power of two, 2 bytes each: a cache line of keys
+#define DISPATCH_MAX_KEYS 24
+
+struct dispatch {
+  uint16_t keys[DISPATCH_SLOTS];
+  void *values[DISPATCH_SLOTS];
+} __attribute__((aligned(64)));
+
+static inline unsigned dispatch_slot(uint16_t key) {
+  return (key * 0x9e3779b1u) >> (32 - 5);
+}
+
+static inline void *dispatch_get(const struct dispatch *t, uint16_t key) {
+  for (unsigned i = dispatch_slot(key); t->keys[i] != 0; i = (i + 1) & (DISPATCH_SLOTS - 1))
+    if (t->keys[i] == key)
+      return t->values[i];
+  return NULL;
+}
+
+// Adds or replaces the value of a key; a NULL value leaves the key without
+// decoder. Returns -1 for key 0 or when the table is full.
+int dispatch_set(struct dispatch *t, uint16_t key, void *value);
+
+#endif
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "context.h"
+#include "dissect.h"
+#include "profile.h"
+#include "util.h"
+
+#define ARENA_BLOCK_SIZE 65536
+
+static int defer_warnings = 0;
+
+void *dissect_alloc(size_t size) {
+  struct arena *arena = &context_current()->arena;
+  // Keep everything aligned for any field type
+  size = (size + 15) & ~(size_t)15;
+
+  while (arena->current < ARENA_MAX_BLOCKS) {
+    struct arena_block *block = &arena->blocks[arena->current];
+    if (block->data == NULL) {
+      block->size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+      block->data = malloc(block->size);
+      if (block->data == NULL) return NULL;
+    }
+    if (block->size - arena->used >= size) {
+      void *p = block->data + arena->used;
+      arena->used += size;
+      return p;
+    }
+    arena->current++;
+    arena->used = 0;
+  }
+  return NULL;
+}
+
+struct dissection *dissect(void (*handler)(struct dissection *, const uint32_t, const uint8_t *),
+                           const struct pcap_pkthdr *header, const uint8_t *packet) {
+  struct arena *arena = &context_current()->arena;
+  arena->current = 0;
+  arena->used = 0;
+
+  struct dissection *d = dissect_alloc(sizeof(struct dissection));
+  if (d == NULL) {
+    ERROR("Could not allocate the dissection record");
+    abort();
+  }
+  d->packet = packet;
+  d->length = header->caplen;
+  d->ts = header->ts;
+  d->count = 0;
+  d->warnings = NULL;
+
+  struct mydump_context *c = context_current();
+  c->decoding = d;
+  PROFILE_CALL(PROFILE_LINK, d->count > 0 ? d->layers[0].type : LAYER_PAYLOAD,
+               handler(d, header->caplen, packet));
+  c->decoding = NULL;
+  indent_reset();
+  return d;
+}
+
+void dissect_defer_warnings(int defer) {
+  defer_warnings = defer;
+}
+
+int dissect_keep_warning(struct dissection *d, struct log_site *site,
+                         const char *fmt, va_list ap) {
+  if (!defer_warnings) return 0;
+  va_list size_ap;
+  va_copy(size_ap, ap);
+  int n = vsnprintf(NULL, 0, fmt, size_ap);
+  va_end(size_ap);
+  if (n < 0) return 0;
+  struct dissect_warning *w = dissect_alloc(sizeof(struct dissect_warning) + n + 1);
+  if (w == NULL) return 0;
+  vsnprintf(w->text, n + 1, fmt, ap);
+  w->site = site;
+  w->after = d->count;
+  w->next = NULL;
+
+  struct dissect_warning **last = &d->warnings;
+  while (*last != NULL)
+    last = &(*last)->next;
+  *last = w;
+  return 1;
+}
+
+const struct dissect_warning *dissect_log_warnings(const struct dissect_warning *w,
+                                                   unsigned layer) {
+  for (; w != NULL && w->after <= layer; w = w->next)
+    log_emit(w->site, "%s", w->text);
+  return w;
+}
+
+struct layer *dissect_push(struct dissection *d, uint8_t type,
+                           const uint8_t *packet, uint32_t length) {
+  if (d->count == DISSECT_MAX_LAYERS) {
+    WARNF("Too many layers (%d)", DISSECT_MAX_LAYERS);
+    stats_warn(STATS_TOO_MANY_LAYERS);
+    return NULL;
+  }
+
+  struct layer *l = &d->layers[d->count++];
+  l->type = type;
+  l->depth = indent_depth();
+  l->offset = packet - d->packet;
+  l->length = length;
+  return l;
+}
+
+void handle_raw(struct dissection *d, const uint32_t length, const uint8_t *packet) {
+  dissect_push(d, LAYER_PAYLOAD, packet, length);
+}
@@ -0,0 +1,179 @@
+#ifndef __DISSECT_H
+#define __DISSECT_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <pcap/pcap.h>
+
+// Result of the decoding of a packet. Handlers only parse the packet and push
+// one layer per header in this record, with its offset and the fields worth
+// showing; nothing is formatted until the record is rendered (see render.h),
+// and only for the verbosity that was asked for.
+enum layer_type {
+  LAYER_PAYLOAD, // not decoded, shown as a hex dump
+  LAYER_NULL,
+  LAYER_LINUX_SLL,
+  LAYER_ETHERNET,
+  LAYER_VLAN,
+  LAYER_ARP,
+  LAYER_IPV4,
+  LAYER_IPV6,
+  LAYER_ICMP,
+  LAYER_ICMPV6,
+  LAYER_UDP,
+  LAYER_TCP,
+  LAYER_DNS,
+  LAYER_BOOTP,
+  LAYER_VXLAN,
+  LAYER_IPV6_EXT,
+};
+
+struct dhcp_option {
+  uint8_t code;
+  uint8_t length;
+  uint32_t offset; // of the value, in the packet
+};
+
+struct layer {
+  uint8_t type;
+  uint8_t depth;   // nesting level, for the logs
+  uint32_t offset; // of the header, in the packet
+  uint32_t length; // of what follows the header
+  union {
+    struct {
+      uint32_t af;
+      uint16_t ether_type;
+    } null;
+    struct {
+      uint8_t addr[8];
+      uint16_t ether_type;
+    } sll;
+    struct {
+      uint8_t src[6];
+      uint8_t dst[6];
+      uint16_t ether_type;
+    } ether;
+    struct {
+      uint16_t tci;
+      uint16_t ether_type;
+    } vlan;
+    struct {
+      uint16_t op;
+      uint8_t sha[6];
+      uint8_t tha[6];
+      uint8_t spa[4];
+      uint8_t tpa[4];
+    } arp;
+    struct {
+      uint8_t src[4];
+      uint8_t dst[4];
+      uint8_t proto;
+    } ipv4;
+    struct {
+      uint8_t src[16];
+      uint8_t dst[16];
+      uint8_t next;  // first header after the fixed one
+      uint8_t proto; // after the extension headers
+    } ipv6;
+    struct {
+      uint8_t type; // of this header (IPPROTO_HOPOPTS...)
+      uint8_t next;
+    } ipv6_ext;
+    struct {
+      uint8_t type;
+      uint8_t code;
+    } icmp;
+    struct {
+      uint16_t sport;
+      uint16_t dport;
+      uint16_t length;
+      uint16_t checksum;
+    } udp;
+    struct {
+      uint16_t sport;
+      uint16_t dport;
+      uint16_t checksum;
+      uint8_t flags;
+      uint8_t held; // payload waiting for reordering (stream.h)
+    } tcp;
+    struct {
+      uint16_t id;
+      uint16_t flags;
+      uint16_t qdcount;
+      uint16_t ancount;
+      uint16_t nscount;
+      uint16_t arcount;
+    } dns;
+    struct {
+      uint8_t op;
+      uint8_t htype;
+      uint8_t hlen;
+      uint8_t hops;
+      uint32_t xid;
+      uint16_t option_count;
+      struct dhcp_option *options; // in the arena, NULL if not DHCP
+    } bootp;
+    struct {
+      uint32_t id; // VNI, as read by vxlan.h
+    } vxlan;
+  };
+};
+
+#define DISSECT_MAX_LAYERS 16
+
+struct log_site;
+
+// A warning logged while decoding, once its layers are traced (see
+// dissect_defer_warnings)
+struct dissect_warning {
+  struct log_site *site;
+  unsigned after; // layers pushed before it
+  struct dissect_warning *next;
+  char text[]; // formatted, indented
+};
+
+struct dissection {
+  const uint8_t *packet;
+  uint32_t length;
+  struct timeval ts; // capture time, for the decoders that keep state
+  unsigned count;
+  struct layer layers[DISSECT_MAX_LAYERS];
+  struct dissect_warning *warnings; // in order, in the arena
+};
+
+// Per-thread allocator for everything a dissection points to, emptied at the
+// start of each packet. Blocks are kept from one packet to the next.
+void *dissect_alloc(size_t size);
+
+// Decodes a packet with the link handler of its capture. The record, and
+// everything it points to, is valid until the next packet decoded by the same
+// thread.
+struct dissection *dissect(void (*handler)(struct dissection *, const uint32_t, const uint8_t *),
+                           const struct pcap_pkthdr *header, const uint8_t *packet);
+
+// When the layers are traced as debug logs once decoded (render.h), the
+// warnings of the decoders are kept in the dissection instead of being logged
+// right away, so that they come after the layer they are about.
+void dissect_defer_warnings(int defer);
+
+// For log_emit: keeps a warning in `d' if they are deferred. Returns 0 if it
+// was not kept and should be logged now.
+int dissect_keep_warning(struct dissection *d, struct log_site *site,
+                         const char *fmt, va_list ap);
+
+// Logs the warnings from `w' which were kept before layer `layer' was pushed,
+// returns the first one left
+const struct dissect_warning *dissect_log_warnings(const struct dissect_warning *w,
+                                                   unsigned layer);
+
+// Handler for what is not decoded, pushes a LAYER_PAYLOAD
+void handle_raw(struct dissection *d, const uint32_t length, const uint8_t *packet);
+
+// Adds a layer for the header at `packet', returns NULL when the record is
+// full. Handlers stop decoding in this case.
+struct layer *dissect_push(struct dissection *d, uint8_t type,
+                           const uint8_t *packet, uint32_t length);
+
+#endif
@@ -7,114 +7,305 @@
 #include <net/if_arp.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
+#include <stddef.h>
+#include <string.h>
 
+#include "checksum.h"
+#include "cursor.h"
+#include "dispatch.h"
 #include "ether.h"
+#include "frag.h"
+#include "profile.h"
 #include "vlan.h"
 #include "protocol.h"
 #include "util.h"
 
-static void handle_ip(uint32_t length, const uint8_t *packet) {
-  struct ip *ip = (struct ip *)packet;
-  APPLY_OVERHEAD(struct ip, length, packet);
-  DEBUGF("IPv4 packet src: %s, dst: %s, protocol: %#08x",
-         inet_ntoa(ip->ip_src),
-         inet_ntoa(ip->ip_dst),
-         ip->ip_p);
-  PRINTF("IPv4 %s -> %s, ", inet_ntoa(ip->ip_src), inet_ntoa(ip->ip_dst));
-  handle_protocol_payload(ip->ip_p, length, packet);
+static void handle_ip(struct dissection *d, uint32_t length, const uint8_t *packet) {
+  struct cursor c = cursor_make(packet, length);
+  CURSOR_NEED(c, sizeof(struct ip));
+  // The payload starts after the options
+  uint32_t hlen = (cursor_u8(&c, 0) & 0x0f) * 4;
+  if (hlen < sizeof(struct ip)) {
+    WARNF("Invalid IPv4 header length %d", hlen);
+    stats_warn(STATS_INVALID_IPV4_HEADER);
+    return;
+  }
+  CURSOR_NEED(c, hlen);
+  struct cursor h = cursor_pull(&c, hlen);
+  struct layer *l = dissect_push(d, LAYER_IPV4, h.data, c.length);
+  if (l == NULL) return;
+  cursor_copy(&h, offsetof(struct ip, ip_src), l->ipv4.src, sizeof(l->ipv4.src));
+  cursor_copy(&h, offsetof(struct ip, ip_dst), l->ipv4.dst, sizeof(l->ipv4.dst));
+  uint8_t protocol = cursor_u8(&h, offsetof(struct ip, ip_p));
+  l->ipv4.proto = protocol;
+  checksum_ipv4(h.data, hlen);
+
+  // What the header says, without the link layer padding. The transport
+  // checksum can not be verified when the capture truncated it (0).
+  uint32_t total = cursor_u16(&h, offsetof(struct ip, ip_len));
+  uint32_t segment = total >= hlen && total - hlen <= c.length ? total - hlen : 0;
+  uint16_t off = cursor_u16(&h, offsetof(struct ip, ip_off));
+  if (off & (IP_MF | IP_OFFMASK)) {
+    if (total < hlen) {
+      WARNF("Invalid IPv4 fragment (header: %d, total: %d)", hlen, total);
+      stats_warn(STATS_INVALID_FRAGMENT);
+      return;
+    }
+    // Truncated by the capture, can not be reassembled
+    if (total - hlen > c.length) {
+      indent_log();
+      handle_raw(d, c.length, c.data);
+      dedent_log();
+      return;
+    }
+    struct cursor fragment = cursor_sub(&c, 0, total - hlen);
+
+    struct frag_key key;
+    memset(&key, 0, sizeof(key));
+    memcpy(key.src, l->ipv4.src, 4);
+    memcpy(key.dst, l->ipv4.dst, 4);
+    key.id = cursor_u16(&h, offsetof(struct ip, ip_id));
+    key.family = 4;
+    key.proto = protocol;
+    uint8_t proto;
+    const uint8_t *datagram = frag_add(d, &key, (off & IP_OFFMASK) * 8, off & IP_MF, protocol,
+                                       fragment.data, fragment.length, &length, &proto);
+    if (datagram == NULL) {
+      // Not complete yet, or not reassembled
+      indent_log();
+      handle_raw(d, fragment.length, fragment.data);
+      dedent_log();
+      return;
+    }
+    c = cursor_make(datagram, length);
+    segment = length;
+  }
+  checksum_transport(protocol, l->ipv4.src, l->ipv4.dst, 4, c.data, segment);
+  handle_protocol_payload(d, protocol, c.length, c.data);
 }
 
-static void handle_ip6(uint32_t length, const uint8_t *packet) {
-  struct ip6_hdr *ip6 = (struct ip6_hdr *)packet;
-  APPLY_OVERHEAD(struct ip6_hdr, length, packet);
-  char src[INET6_ADDRSTRLEN];
-  char dst[INET6_ADDRSTRLEN];
-  DEBUGF("IPv6 packet src:[%s], dst:[%s], protocol: %#08x",
-         inet_ntop(AF_INET6, &(ip6->ip6_src), src, INET6_ADDRSTRLEN),
-         inet_ntop(AF_INET6, &(ip6->ip6_dst), dst, INET6_ADDRSTRLEN),
-         ip6->ip6_nxt);
-  PRINTF("IPv6 %s -> %s, ",
-         inet_ntop(AF_INET6, &(ip6->ip6_src), src, INET6_ADDRSTRLEN),
-         inet_ntop(AF_INET6, &(ip6->ip6_dst), dst, INET6_ADDRSTRLEN));
-  handle_protocol_payload(ip6->ip6_nxt, length, packet);
+// Kind of each next header value, and the size of the extension headers
+// from their length field: (length + add) << shift, in bytes
+static const uint8_t ipv6_ext_kinds[256] = {
+  [IPPROTO_HOPOPTS] = IPV6_EXT_HOP_BY_HOP,
+  [IPPROTO_ROUTING] = IPV6_EXT_ROUTING,
+  [IPPROTO_FRAGMENT] = IPV6_EXT_FRAGMENT,
+  [IPPROTO_DSTOPTS] = IPV6_EXT_DESTINATION,
+  [IPPROTO_AH] = IPV6_EXT_AUTH,
+  [IPPROTO_ESP] = IPV6_EXT_ESP,
+  [IPPROTO_MH] = IPV6_EXT_MOBILITY,
+};
+static const uint8_t ipv6_ext_add[IPV6_EXT_KINDS] = {
+  [IPV6_EXT_HOP_BY_HOP] = 1, [IPV6_EXT_ROUTING] = 1, [IPV6_EXT_DESTINATION] = 1,
+  [IPV6_EXT_AUTH] = 2, [IPV6_EXT_MOBILITY] = 1,
+};
+static const uint8_t ipv6_ext_shift[IPV6_EXT_KINDS] = {
+  [IPV6_EXT_HOP_BY_HOP] = 3, [IPV6_EXT_ROUTING] = 3, [IPV6_EXT_DESTINATION] = 3,
+  [IPV6_EXT_AUTH] = 2, [IPV6_EXT_MOBILITY] = 3,
+};
+
+const char *ipv6_ext_names[IPV6_EXT_KINDS] = {
+  [IPV6_EXT_HOP_BY_HOP] = "hop-by-hop",
+  [IPV6_EXT_ROUTING] = "routing",
+  [IPV6_EXT_FRAGMENT] = "fragment",
+  [IPV6_EXT_DESTINATION] = "destination options",
+  [IPV6_EXT_AUTH] = "authentication",
+  [IPV6_EXT_ESP] = "ESP",
+  [IPV6_EXT_MOBILITY] = "mobility",
+};
+
+static struct ipv6_ext_stats ext_totals;
+#define COUNT(counter) __atomic_add_fetch(&ext_totals.counter, 1, __ATOMIC_RELAXED)
+
+void ipv6_ext_stats(struct ipv6_ext_stats *stats) {
+  stats->packets = __atomic_load_n(&ext_totals.packets, __ATOMIC_RELAXED);
+  stats->too_deep = __atomic_load_n(&ext_totals.too_deep, __ATOMIC_RELAXED);
+  for (unsigned i = 0; i < IPV6_EXT_KINDS; i++)
+    stats->headers[i] = __atomic_load_n(&ext_totals.headers[i], __ATOMIC_RELAXED);
 }
 
-static void handle_vlan(uint32_t length, const uint8_t *packet) {
-  struct vlan_hdr *vlan = (struct vlan_hdr *)packet;
-  APPLY_OVERHEAD(struct vlan_hdr, length, packet);
-  DEBUGF("VLAN vid: %d, type: %04x",
-         htons(vlan->vlan_vid) & VLAN_VID_MASK, htons(vlan->ether_type));
-  PRINTF("VLAN %d, ", htons(vlan->vlan_vid));
-  handle_ether_payload(htons(vlan->ether_type), length, packet);
+// Reassembles the datagram of a fragment, from the fixed header, the fragment
+// header and what follows it. Returns NULL while it is not complete, the
+// datagram otherwise, with its length and first next header.
+static const uint8_t *handle_ip6_fragment(struct dissection *d, struct cursor *ip6,
+                                          struct cursor *frag, const struct cursor *payload,
+                                          uint32_t *length, uint8_t *next) {
+  struct frag_key key;
+  memset(&key, 0, sizeof(key));
+  cursor_copy(ip6, offsetof(struct ip6_hdr, ip6_src), key.src, 16);
+  cursor_copy(ip6, offsetof(struct ip6_hdr, ip6_dst), key.dst, 16);
+  key.id = cursor_u32(frag, offsetof(struct ip6_frag, ip6f_ident));
+  key.family = 6;
+  uint16_t offlg = cursor_u16(frag, offsetof(struct ip6_frag, ip6f_offlg));
+  return frag_add(d, &key, offlg & ntohs(IP6F_OFF_MASK), offlg & ntohs(IP6F_MORE_FRAG),
+                  cursor_u8(frag, offsetof(struct ip6_frag, ip6f_nxt)),
+                  payload->data, payload->length, length, next);
 }
 
-static void handle_arp(uint32_t length, const uint8_t *packet) {
-  struct arphdr *arp = (struct arphdr *)packet;
-  APPLY_OVERHEAD(struct arphdr, length, packet);
-  uint16_t op = htons(arp->ar_op);
+static void handle_ip6(struct dissection *d, uint32_t length, const uint8_t *packet) {
+  struct cursor c = cursor_make(packet, length);
+  CURSOR_NEED(c, sizeof(struct ip6_hdr));
+  struct cursor ip6 = cursor_pull(&c, sizeof(struct ip6_hdr));
+  struct layer *l = dissect_push(d, LAYER_IPV6, ip6.data, c.length);
+  if (l == NULL) return;
+  cursor_copy(&ip6, offsetof(struct ip6_hdr, ip6_src), l->ipv6.src, sizeof(l->ipv6.src));
+  cursor_copy(&ip6, offsetof(struct ip6_hdr, ip6_dst), l->ipv6.dst, sizeof(l->ipv6.dst));
+  uint8_t next = cursor_u8(&ip6, offsetof(struct ip6_hdr, ip6_nxt));
+  l->ipv6.next = next;
+  l->ipv6.proto = next;
+
+  // Without the link layer padding (a length of 0 is a jumbogram, which has
+  // its length in a hop-by-hop option)
+  uint32_t plen = cursor_u16(&ip6, offsetof(struct ip6_hdr, ip6_plen));
+  if (plen > 0 && plen < c.length) c = cursor_sub(&c, 0, plen);
+  // Whether the transport checksum can be verified: not when the capture
+  // truncated the packet
+  int whole = plen > 0 && plen <= c.length;
+
+  uint8_t kind = ipv6_ext_kinds[next];
+  if (kind != IPV6_EXT_NONE) {
+    COUNT(packets);
+    indent_log();
+    for (unsigned depth = 0; kind != IPV6_EXT_NONE; kind = ipv6_ext_kinds[next], depth++) {
+      if (depth == IPV6_MAX_EXTENSIONS) {
+        COUNT(too_deep);
+        WARNF("More than %d IPv6 extension headers", IPV6_MAX_EXTENSIONS);
+        stats_warn(STATS_IPV6_EXT_TOO_DEEP);
+        handle_raw(d, c.length, c.data);
+        dedent_log();
+        return;
+      }
+      COUNT(headers[kind]);
+
+      // All of them take at least 8 bytes. Only the SPI and the sequence
+      // number of ESP are in clear.
+      uint32_t size = 8;
+      if (c.length >= size && kind != IPV6_EXT_ESP && kind != IPV6_EXT_FRAGMENT)
+        size = (uint32_t)(cursor_u8(&c, 1) + ipv6_ext_add[kind]) << ipv6_ext_shift[kind];
+      if (size > c.length) {
+        WARNF("IPv6 extension header too small (%d < %d)", c.length, size);
+        stats_warn(STATS_IPV6_EXT_TOO_SMALL);
+        dedent_log();
+        return;
+      }
+
+      struct cursor h = cursor_pull(&c, size);
+      struct layer *ext = dissect_push(d, LAYER_IPV6_EXT, h.data, c.length);
+      if (ext == NULL) {
+        dedent_log();
+        return;
+      }
+      ext->ipv6_ext.type = next;
+      ext->ipv6_ext.next = kind == IPV6_EXT_ESP ? IPPROTO_NONE : cursor_u8(&h, 0);
 
-  if ((arp->ar_hln + arp->ar_pln) * 2 > (int16_t)length) {
+      if (kind == IPV6_EXT_ESP) {
+        next = IPPROTO_NONE;
+        break;
+      }
+      next = cursor_u8(&h, 0);
+      if (kind == IPV6_EXT_FRAGMENT) {
+        uint32_t datagram_length;
+        const uint8_t *datagram = handle_ip6_fragment(d, &ip6, &h, &c, &datagram_length, &next);
+        if (datagram == NULL) {
+          // Not complete yet, or not reassembled
+          handle_raw(d, c.length, c.data);
+          dedent_log();
+          return;
+        }
+        // The fragment header may be followed by other extension headers
+        c = cursor_make(datagram, datagram_length);
+        whole = 1;
+      }
+    }
+    dedent_log();
+    l->ipv6.proto = next;
+  }
+
+  if (next == IPPROTO_NONE) {
+    indent_log();
+    handle_raw(d, c.length, c.data);
+    dedent_log();
+    return;
+  }
+  if (whole)
+    checksum_transport(next, l->ipv6.src, l->ipv6.dst, 16, c.data, c.length);
+  handle_protocol_payload(d, next, c.length, c.data);
+}
+
+static void handle_vlan(struct dissection *d, uint32_t length, const uint8_t *packet) {
+  struct cursor c = cursor_make(packet, length);
+  CURSOR_NEED(c, sizeof(struct vlan_hdr));
+  struct cursor h = cursor_pull(&c, sizeof(struct vlan_hdr));
+  struct layer *l = dissect_push(d, LAYER_VLAN, h.data, c.length);
+  if (l == NULL) return;
+  l->vlan.tci = cursor_u16(&h, offsetof(struct vlan_hdr, vlan_vid));
+  l->vlan.ether_type = cursor_u16(&h, offsetof(struct vlan_hdr, ether_type));
+  handle_ether_payload(d, l->vlan.ether_type, c.length, c.data);
+}
+
+static void handle_arp(struct dissection *d, uint32_t length, const uint8_t *packet) {
+  struct cursor c = cursor_make(packet, length);
+  CURSOR_NEED(c, sizeof(struct arphdr));
+  struct cursor h = cursor_pull(&c, sizeof(struct arphdr));
+  uint16_t op = cursor_u16(&h, offsetof(struct arphdr, ar_op));
+  uint8_t hln = cursor_u8(&h, offsetof(struct arphdr, ar_hln));
+  uint8_t pln = cursor_u8(&h, offsetof(struct arphdr, ar_pln));
+
+  if ((uint32_t)(hln + pln) * 2 > c.length) {
     WARNF("ARP packet too small (op: %04x, hrd: %04x, pro: %04x, hln: %d, pln: %d)",
-          op, htons(arp->ar_hrd), htons(arp->ar_pro), arp->ar_hln, arp->ar_pln);
+          op, cursor_u16(&h, offsetof(struct arphdr, ar_hrd)),
+          cursor_u16(&h, offsetof(struct arphdr, ar_pro)), hln, pln);
+    stats_warn(STATS_ARP_TOO_SMALL);
     return;
   }
 
+  struct layer *l = dissect_push(d, LAYER_ARP, h.data, c.length);
+  if (l == NULL) return;
+  // Shorter addresses are zero-padded, longer ones truncated
+  memset(&l->arp, 0, sizeof(l->arp));
+  l->arp.op = op;
+
   // Let's assume it's IPv4 over ethernet for now.
-  struct ether_addr *sha = (struct ether_addr *)packet;
-  packet += arp->ar_hln;
-  length -= arp->ar_hln;
-  struct in_addr *spa = (struct in_addr *)packet;
-  packet += arp->ar_pln;
-  length -= arp->ar_pln;
-  struct ether_addr *tha = (struct ether_addr *)packet;
-  packet += arp->ar_hln;
-  length -= arp->ar_hln;
-  struct in_addr *tpa = (struct in_addr *)packet;
-  packet += arp->ar_pln;
-  length -= arp->ar_pln;
-
-  switch (op) {
-    case ARPOP_REQUEST:
-      DEBUGF("ARP request, who has %s (%s)? Tell %s (%s)", inet_ntoa(*tpa), ether_ntoa(tha), inet_ntoa(*spa), ether_ntoa(sha));
-      PRINTF("ARP request");
-      break;
-    case ARPOP_REPLY:
-      DEBUGF("ARP reply, %s is at %s", inet_ntoa(*spa), ether_ntoa(sha));
-      PRINTF("ARP reply");
-      break;
-    default:
-      DEBUGF("Unhandled ARP op: %04x, tpa: %s, tha: %s, spa: %s, sha: %s",
-             op, inet_ntoa(*tpa), ether_ntoa(tha), inet_ntoa(*spa), ether_ntoa(sha));
-      break;
-  }
+  struct cursor sha = cursor_pull(&c, hln);
+  struct cursor spa = cursor_pull(&c, pln);
+  struct cursor tha = cursor_pull(&c, hln);
+  struct cursor tpa = cursor_pull(&c, pln);
+
+  cursor_copy(&sha, 0, l->arp.sha, hln < 6 ? hln : 6);
+  cursor_copy(&tha, 0, l->arp.tha, hln < 6 ? hln : 6);
+  cursor_copy(&spa, 0, l->arp.spa, pln < 4 ? pln : 4);
+  cursor_copy(&tpa, 0, l->arp.tpa, pln < 4 ? pln : 4);
 
-  if (length > 0) {
+  if (c.length > 0) {
     WARN("Garbage after ARP packet");
-    handle_raw(length, packet);
+    stats_warn(STATS_ARP_GARBAGE);
+    handle_raw(d, c.length, c.data);
   }
 }
 
-static network_handler handlers[] = {
-  [ETHERTYPE_IP] = handle_ip,
-  [ETHERTYPE_IPV6] = handle_ip6,
-  [ETHERTYPE_ARP] = handle_arp,
-  [ETHERTYPE_VLAN] = handle_vlan,
-};
+static struct dispatch handlers;
+
+void ether_init(void) {
+  dispatch_set(&handlers, ETHERTYPE_IP, handle_ip);
+  dispatch_set(&handlers, ETHERTYPE_IPV6, handle_ip6);
+  dispatch_set(&handlers, ETHERTYPE_ARP, handle_arp);
+  dispatch_set(&handlers, ETHERTYPE_VLAN, handle_vlan);
+}
 
 network_handler resolve_network_handler(const uint16_t ether_type) {
-  if (ether_type >= (sizeof(handlers) / sizeof(network_handler)))
-    return NULL;
-  return handlers[ether_type];
+  return (network_handler)dispatch_get(&handlers, ether_type);
 }
 
-void handle_ether_payload(const uint16_t ether_type, const uint32_t length, const uint8_t *packet) {
+void handle_ether_payload(struct dissection *d, const uint16_t ether_type,
+                          const uint32_t length, const uint8_t *packet) {
   network_handler handler = resolve_network_handler(ether_type);
   if (handler == NULL) {
     WARNF("Unknown ethertype %#04x", ether_type);
+    stats_warn(STATS_UNKNOWN_ETHERTYPE);
     return;
   }
 
   indent_log();
-  handler(length, packet);
+  PROFILE_CALL(PROFILE_ETHER, ether_type, handler(d, length, packet));
   dedent_log();
 }
@@ -3,8 +3,39 @@
 
 #include <stdint.h>
 
-typedef void(*network_handler)(uint32_t, const uint8_t*);
+#include "dissect.h"
+
+typedef void(*network_handler)(struct dissection *, uint32_t, const uint8_t*);
+// Fills the table of the ethertypes, once before decoding
+void ether_init(void);
 network_handler resolve_network_handler(const uint16_t ether_type);
-void handle_ether_payload(const uint16_t ether_type, const uint32_t, const uint8_t *packet);
+void handle_ether_payload(struct dissection *d, const uint16_t ether_type,
+                          const uint32_t, const uint8_t *packet);
+
+// IPv6 extension headers followed before the rest is shown as raw payload
+#define IPV6_MAX_EXTENSIONS 8
+
+enum ipv6_ext_kind {
+  IPV6_EXT_NONE, // not an extension header
+  IPV6_EXT_HOP_BY_HOP,
+  IPV6_EXT_ROUTING,
+  IPV6_EXT_FRAGMENT,
+  IPV6_EXT_DESTINATION,
+  IPV6_EXT_AUTH,
+  IPV6_EXT_ESP, // the rest is encrypted, nothing is decoded after it
+  IPV6_EXT_MOBILITY,
+  IPV6_EXT_KINDS,
+};
+
+// IPv6 packets that had extension headers to walk, and how many of each kind
+// were seen, for all the threads
+struct ipv6_ext_stats {
+  uint64_t packets;
+  uint64_t too_deep; // more than IPV6_MAX_EXTENSIONS
+  uint64_t headers[IPV6_EXT_KINDS];
+};
+
+extern const char *ipv6_ext_names[IPV6_EXT_KINDS];
+void ipv6_ext_stats(struct ipv6_ext_stats *stats);
 
 #endif
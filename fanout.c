@@ -0,0 +1,174 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fanout.h"
+#include "util.h"
+
+struct fanout_thread {
+  struct capture *socket;
+  unsigned cpu;
+  pcap_handler callback;
+  uint8_t *user;
+  uint64_t packets;
+  pthread_t thread;
+};
+
+struct fanout {
+  unsigned count;
+  struct fanout_thread *threads;
+};
+
+static int fanout_datalink(struct capture *c) {
+  struct fanout *f = c->handle;
+  return f->threads[0].socket->datalink(f->threads[0].socket);
+}
+
+static int fanout_setfilter(struct capture *c, struct bpf_program *fp) {
+  struct fanout *f = c->handle;
+  for (unsigned i = 0; i < f->count; i++) {
+    struct capture *socket = f->threads[i].socket;
+    if (socket->setfilter(socket, fp) == PCAP_ERROR)
+      return PCAP_ERROR;
+  }
+  return 0;
+}
+
+static void count_packet(uint8_t *user, const struct pcap_pkthdr *header,
+                         const uint8_t *packet) {
+  struct fanout_thread *t = (struct fanout_thread *)user;
+  t->packets++;
+  t->callback(t->user, header, packet);
+}
+
+static void *fanout_thread_main(void *arg) {
+  struct fanout_thread *t = arg;
+
+#ifdef __linux__
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(t->cpu, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+    WARNF("Could not pin capture thread to CPU %u", t->cpu);
+#endif
+
+  t->socket->loop(t->socket, count_packet, (uint8_t *)t);
+  return NULL;
+}
+
+// Stops the `started' first sockets and waits for their threads
+static void stop_started(struct fanout *f, unsigned started) {
+  for (unsigned i = 0; i < started; i++)
+    f->threads[i].socket->breakloop(f->threads[i].socket);
+  for (unsigned i = 0; i < started; i++)
+    pthread_join(f->threads[i].thread, NULL);
+}
+
+static int fanout_loop(struct capture *c, pcap_handler callback, uint8_t *user) {
+  struct fanout *f = c->handle;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1) cpus = 1;
+
+  for (unsigned i = 0; i < f->count; i++) {
+    struct fanout_thread *t = &f->threads[i];
+    t->cpu = i % cpus;
+    t->callback = callback;
+    t->user = user;
+    int err = pthread_create(&t->thread, NULL, fanout_thread_main, t);
+    if (err != 0) {
+      ERRORF("Could not start the thread of fanout socket %u: %s", i, strerror(err));
+      stop_started(f, i);
+      return PCAP_ERROR;
+    }
+  }
+
+  for (unsigned i = 0; i < f->count; i++) {
+    pthread_join(f->threads[i].thread, NULL);
+    INFOF("Fanout socket %u (CPU %u): %" PRIu64 " packets",
+          i, f->threads[i].cpu, f->threads[i].packets);
+  }
+  return 0;
+}
+
+static void fanout_breakloop(struct capture *c) {
+  struct fanout *f = c->handle;
+  for (unsigned i = 0; i < f->count; i++)
+    f->threads[i].socket->breakloop(f->threads[i].socket);
+}
+
+static int fanout_stats(struct capture *c, struct pcap_stat *stats) {
+  struct fanout *f = c->handle;
+  stats->ps_recv = stats->ps_drop = stats->ps_ifdrop = 0;
+  for (unsigned i = 0; i < f->count; i++) {
+    struct pcap_stat st;
+    struct capture *socket = f->threads[i].socket;
+    if (socket->stats(socket, &st) == PCAP_ERROR)
+      return PCAP_ERROR;
+    stats->ps_recv += st.ps_recv;
+    stats->ps_drop += st.ps_drop;
+    stats->ps_ifdrop += st.ps_ifdrop;
+  }
+  return 0;
+}
+
+static void fanout_close(struct capture *c) {
+  struct fanout *f = c->handle;
+  for (unsigned i = 0; i < f->count; i++)
+    if (f->threads[i].socket != NULL)
+      f->threads[i].socket->close(f->threads[i].socket);
+  free(f->threads);
+  free(f);
+  free(c);
+}
+
+struct capture *fanout_open(const char *device,
+                            const struct tpacket_config *config,
+                            unsigned sockets, enum fanout_mode mode,
+                            char *errbuf) {
+  struct capture *c = calloc(1, sizeof(struct capture));
+  struct fanout *f = calloc(1, sizeof(struct fanout));
+  struct fanout_thread *threads = calloc(sockets, sizeof(struct fanout_thread));
+  if (c == NULL || f == NULL || threads == NULL) {
+    free(c);
+    free(f);
+    free(threads);
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "out of memory");
+    return NULL;
+  }
+
+  f->threads = threads;
+  c->handle = f;
+  c->datalink = fanout_datalink;
+  c->setfilter = fanout_setfilter;
+  c->loop = fanout_loop;
+  c->breakloop = fanout_breakloop;
+  c->stats = fanout_stats;
+  c->close = fanout_close;
+
+  // Group ids are global to the system, avoid clashing with other instances
+  uint16_t group = getpid() & 0xffff;
+  for (f->count = 0; f->count < sockets; f->count++) {
+    struct capture *socket = tpacket_open(device, config, errbuf);
+    if (socket == NULL) {
+      fanout_close(c);
+      return NULL;
+    }
+    threads[f->count].socket = socket;
+    if (tpacket_join_fanout(socket, group, mode, errbuf) < 0) {
+      f->count++;
+      fanout_close(c);
+      return NULL;
+    }
+  }
+
+  DEBUGF("Fanout group %u on `%s' with %u sockets", group, device, sockets);
+  return c;
+}
@@ -0,0 +1,16 @@
+#ifndef __FANOUT_H
+#define __FANOUT_H
+
+#include "capture.h"
+#include "tpacket.h"
+
+// Opens `sockets' TPACKET_V3 rings on the same device, joined in a single
+// PACKET_FANOUT group. The loop of the returned capture runs one thread per
+// socket, each pinned to its own CPU, so the handler is called concurrently
+// from all of them. Statistics are the sum of all the sockets.
+struct capture *fanout_open(const char *device,
+                            const struct tpacket_config *config,
+                            unsigned sockets, enum fanout_mode mode,
+                            char *errbuf);
+
+#endif
@@ -0,0 +1,257 @@
+#include <stddef.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <pcap/dlt.h>
+
+#include "cursor.h"
+#include "ether.h"
+#include "flow.h"
+#include "link.h"
+#include "vlan.h"
+#include "vxlan.h"
+
+#define VXLAN_PORT 4789
+// Maximum number of nested VXLAN frames followed
+#define MAX_DEPTH 4
+
+static int extract_ether_payload(uint16_t ether_type, struct cursor c,
+                                 struct flow_key *key, int depth);
+
+static int extract_ethernet(struct cursor c, struct flow_key *key, int depth) {
+  if (!cursor_has(&c, 0, sizeof(struct ether_header))) return 0;
+  struct cursor h = cursor_pull(&c, sizeof(struct ether_header));
+  cursor_copy(&h, offsetof(struct ether_header, ether_shost), key->src, ETHER_ADDR_LEN);
+  cursor_copy(&h, offsetof(struct ether_header, ether_dhost), key->dst, ETHER_ADDR_LEN);
+  return extract_ether_payload(cursor_u16(&h, offsetof(struct ether_header, ether_type)),
+                               c, key, depth);
+}
+
+static int extract_transport(uint8_t protocol, struct cursor c, struct flow_key *key,
+                             int depth) {
+  key->proto = protocol;
+  switch (protocol) {
+    case IPPROTO_TCP:
+    {
+      if (!cursor_has(&c, 0, sizeof(struct tcphdr))) return 1;
+      key->sport = cursor_u16(&c, offsetof(struct tcphdr, th_sport));
+      key->dport = cursor_u16(&c, offsetof(struct tcphdr, th_dport));
+      return 1;
+    }
+
+    case IPPROTO_UDP:
+    {
+      if (!cursor_has(&c, 0, sizeof(struct udphdr))) return 1;
+      struct cursor h = cursor_pull(&c, sizeof(struct udphdr));
+      uint16_t sport = cursor_u16(&h, offsetof(struct udphdr, uh_sport));
+      uint16_t dport = cursor_u16(&h, offsetof(struct udphdr, uh_dport));
+
+      // The flow of a VXLAN packet is the one of the encapsulated frame
+      if ((sport == VXLAN_PORT || dport == VXLAN_PORT)
+          && depth < MAX_DEPTH && cursor_has(&c, 0, sizeof(struct vxlan_hdr))) {
+        struct cursor vxlan = cursor_pull(&c, sizeof(struct vxlan_hdr));
+        struct flow_key inner;
+        memset(&inner, 0, sizeof(inner));
+        inner.vlan = key->vlan;
+        inner.tunnel_id = cursor_u32(&vxlan, offsetof(struct vxlan_hdr, vni_reserved)) >> 8;
+        if (extract_ethernet(c, &inner, depth + 1))
+          *key = inner;
+      }
+      // Otherwise no ports: any datagram may be fragmented, and its
+      // fragments have none
+      return 1;
+    }
+
+    default:
+      return 1;
+  }
+}
+
+static int extract_ether_payload(uint16_t ether_type, struct cursor c,
+                                 struct flow_key *key, int depth) {
+  switch (ether_type) {
+    case ETHERTYPE_VLAN:
+    {
+      if (!cursor_has(&c, 0, sizeof(struct vlan_hdr))) return 1;
+      struct cursor h = cursor_pull(&c, sizeof(struct vlan_hdr));
+      if (key->vlan == 0)
+        key->vlan = cursor_u16(&h, offsetof(struct vlan_hdr, vlan_vid)) & VLAN_VID_MASK;
+      return extract_ether_payload(cursor_u16(&h, offsetof(struct vlan_hdr, ether_type)),
+                                   c, key, depth);
+    }
+
+    case ETHERTYPE_IP:
+    {
+      if (!cursor_has(&c, 0, sizeof(struct ip))) return 1;
+      uint32_t hlen = (cursor_u8(&c, 0) & 0x0f) * 4;
+      if (hlen < sizeof(struct ip) || !cursor_has(&c, 0, hlen)) return 1;
+      struct cursor h = cursor_pull(&c, hlen);
+      memset(key->src, 0, sizeof(key->src));
+      memset(key->dst, 0, sizeof(key->dst));
+      cursor_copy(&h, offsetof(struct ip, ip_src), key->src, 4);
+      cursor_copy(&h, offsetof(struct ip, ip_dst), key->dst, 4);
+      key->family = 4;
+      key->proto = cursor_u8(&h, offsetof(struct ip, ip_p));
+      // Only the first fragment has the ports, keep all of them together
+      if (cursor_u16(&h, offsetof(struct ip, ip_off)) & (IP_MF | IP_OFFMASK)) return 1;
+      return extract_transport(key->proto, c, key, depth);
+    }
+
+    case ETHERTYPE_IPV6:
+    {
+      if (!cursor_has(&c, 0, sizeof(struct ip6_hdr))) return 1;
+      struct cursor h = cursor_pull(&c, sizeof(struct ip6_hdr));
+      cursor_copy(&h, offsetof(struct ip6_hdr, ip6_src), key->src, 16);
+      cursor_copy(&h, offsetof(struct ip6_hdr, ip6_dst), key->dst, 16);
+      key->family = 6;
+
+      // The ports are after the extension headers. Fragments stop there, all
+      // of them stay together like with IPv4, with the protocol of the
+      // datagram.
+      uint8_t next = cursor_u8(&h, offsetof(struct ip6_hdr, ip6_nxt));
+      for (unsigned i = 0; i < IPV6_MAX_EXTENSIONS; i++) {
+        if (next == IPPROTO_FRAGMENT) {
+          if (cursor_has(&c, 0, sizeof(struct ip6_frag)))
+            key->proto = cursor_u8(&c, offsetof(struct ip6_frag, ip6f_nxt));
+          return 1;
+        }
+        if (next != IPPROTO_HOPOPTS && next != IPPROTO_ROUTING
+            && next != IPPROTO_DSTOPTS && next != IPPROTO_AH)
+          break;
+        if (!cursor_has(&c, 0, 8)) break;
+        uint32_t size = next == IPPROTO_AH ? (cursor_u8(&c, 1) + 2) * 4 : (cursor_u8(&c, 1) + 1) * 8;
+        if (!cursor_has(&c, 0, size)) break;
+        next = cursor_u8(&c, 0);
+        cursor_skip(&c, size);
+      }
+      key->proto = next;
+      return extract_transport(next, c, key, depth);
+    }
+
+    default:
+      return 1;
+  }
+}
+
+int flow_key_extract(const uint16_t link_type, uint32_t length,
+                     const uint8_t *packet, struct flow_key *key) {
+  memset(key, 0, sizeof(struct flow_key));
+  struct cursor c = cursor_make(packet, length);
+  switch (link_type) {
+#ifdef DLT_EN10MB
+    case DLT_EN10MB:
+      return extract_ethernet(c, key, 0);
+#endif
+#ifdef DLT_NULL
+    case DLT_NULL:
+    {
+      // In the byte order of the capturing host
+      uint32_t af;
+      if (!cursor_has(&c, 0, 4)) return 0;
+      cursor_copy(&c, 0, &af, sizeof(af));
+      cursor_skip(&c, 4);
+      return extract_ether_payload(af_to_ethertype(af), c, key, 0);
+    }
+#endif
+#ifdef DLT_LINUX_SLL
+    case DLT_LINUX_SLL:
+    {
+      if (!cursor_has(&c, 0, 16)) return 0;
+      uint16_t ether_type = cursor_u16(&c, 14);
+      cursor_skip(&c, 16);
+      return extract_ether_payload(ether_type, c, key, 0);
+    }
+#endif
+    default:
+      return 0;
+  }
+}
+
+void flow_key_from_layers(const struct dissection *d, struct flow_key *key) {
+  memset(key, 0, sizeof(struct flow_key));
+  for (unsigned i = 0; i < d->count; i++) {
+    const struct layer *l = &d->layers[i];
+    switch (l->type) {
+      case LAYER_ETHERNET:
+        memcpy(key->src, l->ether.src, ETHER_ADDR_LEN);
+        memcpy(key->dst, l->ether.dst, ETHER_ADDR_LEN);
+        break;
+      case LAYER_VLAN:
+        if (key->vlan == 0)
+          key->vlan = l->vlan.tci & VLAN_VID_MASK;
+        break;
+      case LAYER_VXLAN:
+      {
+        // What follows is the encapsulated frame
+        uint16_t vlan = key->vlan;
+        memset(key, 0, sizeof(struct flow_key));
+        key->vlan = vlan;
+        key->tunnel_id = l->vxlan.id;
+        break;
+      }
+      case LAYER_IPV4:
+        memset(key->src, 0, sizeof(key->src));
+        memset(key->dst, 0, sizeof(key->dst));
+        memcpy(key->src, l->ipv4.src, 4);
+        memcpy(key->dst, l->ipv4.dst, 4);
+        key->family = 4;
+        key->proto = l->ipv4.proto;
+        break;
+      case LAYER_IPV6:
+        memcpy(key->src, l->ipv6.src, 16);
+        memcpy(key->dst, l->ipv6.dst, 16);
+        key->family = 6;
+        key->proto = l->ipv6.proto;
+        break;
+      case LAYER_TCP:
+        key->proto = IPPROTO_TCP;
+        key->sport = l->tcp.sport;
+        key->dport = l->tcp.dport;
+        break;
+      case LAYER_UDP:
+        key->proto = IPPROTO_UDP;
+        key->sport = l->udp.sport;
+        key->dport = l->udp.dport;
+        break;
+    }
+  }
+}
+
+static inline uint64_t mix(uint64_t h, uint64_t v) {
+  h ^= v;
+  h *= 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 29);
+}
+
+static inline uint64_t load64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+uint32_t flow_hash(const struct flow_key *key) {
+  // Order the two endpoints so that both directions give the same input
+  const uint8_t *a = key->src, *b = key->dst;
+  uint16_t pa = key->sport, pb = key->dport;
+  int cmp = memcmp(a, b, 16);
+  if (cmp > 0 || (cmp == 0 && pa > pb)) {
+    a = key->dst;
+    b = key->src;
+    pa = key->dport;
+    pb = key->sport;
+  }
+
+  uint64_t h = key->family | (uint64_t)key->proto << 8
+             | (uint64_t)key->vlan << 16 | (uint64_t)key->tunnel_id << 32;
+  h = mix(h, load64(a));
+  h = mix(h, load64(a + 8));
+  h = mix(h, load64(b));
+  h = mix(h, load64(b + 8));
+  h = mix(h, (uint64_t)pa << 16 | pb);
+  return (uint32_t)(h ^ (h >> 32));
+}
@@ -0,0 +1,42 @@
+#ifndef __FLOW_H
+#define __FLOW_H
+
+#include <stdint.h>
+
+#include "dissect.h"
+
+// Identifies a flow: the 5-tuple of the innermost IP packet (the frame carried
+// by VXLAN if any), with its VLAN id and VXLAN VNI (`tunnel_id'). IPv4
+// addresses only use the first 4 bytes of `src' and `dst'. Packets without an
+// IP layer use their MAC addresses, with `family' set to 0.
+struct flow_key {
+  uint8_t src[16];
+  uint8_t dst[16];
+  uint16_t sport;
+  uint16_t dport;
+  uint16_t vlan;
+  uint8_t family; // 0, 4 or 6
+  uint8_t proto;
+  uint32_t tunnel_id; // VXLAN VNI
+};
+
+// Fills `key' from the headers of the packet, to pick its pipeline worker.
+// Returns 0 if the packet is too short or of an unknown link type, 1
+// otherwise.
+//
+// The fragments of a datagram have no ports, so they are keyed without, and
+// so is UDP, whose datagrams may be fragmented or not within a flow: a UDP
+// flow is the one of its two addresses. TCP keeps its ports, so the rare
+// fragmented TCP segments (it sizes them to the path MTU) and the fragments
+// of VXLAN packets may not be handled by the worker of their flow.
+int flow_key_extract(const uint16_t link_type, uint32_t length,
+                     const uint8_t *packet, struct flow_key *key);
+
+// Same as flow_key_extract, from the layers of a dissection
+void flow_key_from_layers(const struct dissection *d, struct flow_key *key);
+
+// Symmetric hash of a flow key: A→B and B→A hash to the same value. Keys of
+// flow_key_extract have no UDP ports, see above.
+uint32_t flow_hash(const struct flow_key *key);
+
+#endif
@@ -0,0 +1,494 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "flowtable.h"
+#include "format.h"
+#include "util.h"
+#include "wheel.h"
+
+// Control bytes of the slots: 7 bits of the hash, or EMPTY. A probe looks at
+// GROUP of them at once, the first GROUP - 1 are repeated after the last so
+// that it never has to wrap around.
+#define GROUP 16
+#define EMPTY 0x80
+
+// At most 7/8 of the slots are used, so that probes stay short
+#define MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+// Records waiting to be written, per thread
+#define RECORDS_BUFFER (64 << 10)
+#define RECORD_MAX 512
+
+static const char *end_names[] = {
+  [FLOW_END_IDLE] = "idle",
+  [FLOW_END_EVICTED] = "evicted",
+  [FLOW_END_CAPTURE] = "end",
+};
+
+struct entry {
+  struct flow_key key;
+  uint32_t hash;
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t first; // µs of capture time
+  uint64_t last;
+  struct wheel_entry timer;
+  uint8_t tcp_flags;
+};
+
+// Flows of a thread
+struct table {
+  uint8_t *ctrl; // capacity + GROUP - 1
+  struct entry *entries;
+  size_t mask;
+  size_t count;
+  struct wheel wheel;
+  int wheel_started;
+  // Flows expired by the wheel, removed once it is done with its lists
+  struct wheel_entry expired;
+  // Only taken when there are reports, which read all the tables
+  pthread_mutex_t lock;
+  char *records;
+  size_t records_used;
+  struct table *next;
+};
+
+static struct flowtable_config config;
+static int enabled = 0;
+static size_t capacity = 0;
+
+// All the tables, kept after their thread is gone for flowtable_finish
+static struct table *tables = NULL;
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct table *thread_table = NULL;
+
+static pthread_mutex_t records_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t next_report = 0; // seconds of capture time
+
+static struct flowtable_stats totals;
+#define COUNT(counter) __atomic_add_fetch(&totals.counter, 1, __ATOMIC_RELAXED)
+
+void flowtable_init(const struct flowtable_config *c) {
+  config = *c;
+  if (config.threads == 0) config.threads = 1;
+  if (config.top_interval == 0) config.top_interval = FLOWTABLE_DEFAULT_TOP_INTERVAL;
+  enabled = config.records_fd >= 0 || config.exporter != NULL || config.top > 0;
+
+  // A power of two of slots per thread, each an entry and a control byte
+  size_t slots = config.memory / config.threads / (sizeof(struct entry) + 1);
+  capacity = GROUP;
+  while (capacity * 2 <= slots) capacity *= 2;
+  if (enabled)
+    DEBUGF("Flow table: %zu slots per thread", capacity);
+}
+
+static struct table *get_table(void) {
+  if (thread_table != NULL) return thread_table;
+
+  struct table *t = calloc(1, sizeof(struct table));
+  if (t == NULL) return NULL;
+  t->ctrl = malloc(capacity + GROUP - 1);
+  t->entries = malloc(capacity * sizeof(struct entry));
+  t->records = config.records_fd >= 0 ? malloc(RECORDS_BUFFER) : NULL;
+  if (t->ctrl == NULL || t->entries == NULL
+      || (config.records_fd >= 0 && t->records == NULL)) {
+    free(t->ctrl);
+    free(t->entries);
+    free(t->records);
+    free(t);
+    return NULL;
+  }
+  memset(t->ctrl, EMPTY, capacity + GROUP - 1);
+  t->mask = capacity - 1;
+  t->expired.prev = t->expired.next = &t->expired;
+  pthread_mutex_init(&t->lock, NULL);
+
+  pthread_mutex_lock(&tables_lock);
+  t->next = tables;
+  tables = t;
+  pthread_mutex_unlock(&tables_lock);
+  thread_table = t;
+  return t;
+}
+
+// Bit i set when the control byte at `ctrl + i' is `tag'
+static inline unsigned match(const uint8_t *ctrl, uint8_t tag) {
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+  unsigned bits = 0;
+  for (unsigned i = 0; i < GROUP; i++)
+    bits |= (unsigned)(ctrl[i] == tag) << i;
+  return bits;
+#endif
+}
+
+static inline void set_ctrl(struct table *t, size_t slot, uint8_t tag) {
+  t->ctrl[slot] = tag;
+  if (slot < GROUP - 1)
+    t->ctrl[slot + t->mask + 1] = tag;
+}
+
+static void write_records(struct table *t) {
+  if (t->records_used == 0) return;
+  pthread_mutex_lock(&records_lock);
+  size_t done = 0;
+  while (done < t->records_used) {
+    ssize_t n = write(config.records_fd, t->records + done, t->records_used - done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      ERRORF("Could not write the flow records: %s", strerror(errno));
+      break;
+    }
+    done += n;
+  }
+  pthread_mutex_unlock(&records_lock);
+  t->records_used = 0;
+}
+
+static void format_address(const struct flow_key *key, const uint8_t *addr, char *buf) {
+  switch (key->family) {
+    case 4:
+      format_ipv4(addr, buf);
+      break;
+    case 6:
+      format_ipv6(addr, buf);
+      break;
+    default:
+      format_ether(addr, buf);
+      break;
+  }
+}
+
+static void emit(struct table *t, const struct entry *e, enum flow_end end) {
+  if (config.exporter != NULL) {
+    struct flow_record record = {
+      .key = e->key,
+      .packets = e->packets,
+      .bytes = e->bytes,
+      .first = e->first,
+      .last = e->last,
+      .tcp_flags = e->tcp_flags,
+      .end = end,
+    };
+    config.exporter(&record);
+  }
+  if (t->records == NULL) return;
+  if (RECORDS_BUFFER - t->records_used < RECORD_MAX) write_records(t);
+
+  char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+  format_address(&e->key, e->key.src, src);
+  format_address(&e->key, e->key.dst, dst);
+  int n = snprintf(t->records + t->records_used, RECORD_MAX,
+                   "{\"src\":\"%s\",\"dst\":\"%s\",\"sport\":%u,\"dport\":%u,"
+                   "\"proto\":%u,\"vlan\":%u,\"vni\":%" PRIu32 ","
+                   "\"packets\":%" PRIu64 ",\"bytes\":%" PRIu64 ","
+                   "\"first\":%" PRIu64 ".%06" PRIu64 ",\"last\":%" PRIu64 ".%06" PRIu64 ","
+                   "\"tcp_flags\":%u,\"end\":\"%s\"}\n",
+                   src, dst, e->key.sport, e->key.dport,
+                   e->key.proto, e->key.vlan, e->key.tunnel_id,
+                   e->packets, e->bytes,
+                   e->first / 1000000, e->first % 1000000,
+                   e->last / 1000000, e->last % 1000000,
+                   e->tcp_flags, end_names[end]);
+  if (n > 0 && n < RECORD_MAX) t->records_used += n;
+}
+
+// Moves the entry in `from' to the free slot `to', and its timer with it
+static void move_entry(struct table *t, size_t from, size_t to) {
+  struct entry *e = &t->entries[to];
+  *e = t->entries[from];
+  if (e->timer.next != NULL) {
+    e->timer.prev->next = &e->timer;
+    e->timer.next->prev = &e->timer;
+  }
+  set_ctrl(t, to, t->ctrl[from]);
+  set_ctrl(t, from, EMPTY);
+}
+
+// Linear probing without tombstones: the entries after the removed one are
+// shifted back into the hole, unless that would put them before their home.
+static void remove_entry(struct table *t, size_t slot) {
+  wheel_cancel(&t->entries[slot].timer);
+  set_ctrl(t, slot, EMPTY);
+  t->count--;
+
+  size_t hole = slot;
+  for (size_t i = (slot + 1) & t->mask; t->ctrl[i] != EMPTY; i = (i + 1) & t->mask) {
+    size_t home = t->entries[i].hash & t->mask;
+    if (((i - home) & t->mask) >= ((i - hole) & t->mask)) {
+      move_entry(t, i, hole);
+      hole = i;
+    }
+  }
+}
+
+static void expired(struct wheel_entry *timer, void *arg) {
+  struct table *t = arg;
+  timer->prev = t->expired.prev;
+  timer->next = &t->expired;
+  t->expired.prev->next = timer;
+  t->expired.prev = timer;
+}
+
+static void expire(struct table *t, uint64_t now) {
+  wheel_advance(&t->wheel, now, expired, t);
+  while (t->expired.next != &t->expired) {
+    struct entry *e = (struct entry *)((char *)t->expired.next - offsetof(struct entry, timer));
+    COUNT(expired);
+    emit(t, e, FLOW_END_IDLE);
+    remove_entry(t, e - t->entries);
+  }
+}
+
+// Drops the least recently seen flow of the group where `hash' would go
+static void evict(struct table *t, uint32_t hash) {
+  size_t home = hash & t->mask;
+  size_t victim = home;
+  for (unsigned i = 0; i < GROUP; i++) {
+    size_t slot = (home + i) & t->mask;
+    if (t->ctrl[slot] == EMPTY) continue;
+    if (t->ctrl[victim] == EMPTY || t->entries[slot].last < t->entries[victim].last)
+      victim = slot;
+  }
+  if (t->ctrl[victim] == EMPTY) {
+    // Nothing there: the oldest of the whole table would be too slow to find,
+    // any full slot will do
+    while (t->ctrl[victim] == EMPTY) victim = (victim + 1) & t->mask;
+  }
+  COUNT(evictions);
+  emit(t, &t->entries[victim], FLOW_END_EVICTED);
+  remove_entry(t, victim);
+}
+
+static struct entry *lookup(struct table *t, const struct flow_key *key, uint32_t hash) {
+  uint8_t tag = hash >> 25;
+  for (;;) {
+    size_t pos = hash & t->mask;
+    for (;;) {
+      unsigned empty = match(t->ctrl + pos, EMPTY);
+      unsigned hits = match(t->ctrl + pos, tag);
+      // Linear probing: nothing after the first empty slot
+      if (empty != 0) hits &= (empty & -empty) - 1;
+      while (hits != 0) {
+        struct entry *e = &t->entries[(pos + __builtin_ctz(hits)) & t->mask];
+        if (e->hash == hash && memcmp(&e->key, key, sizeof(struct flow_key)) == 0)
+          return e;
+        hits &= hits - 1;
+      }
+      if (empty != 0) {
+        pos = (pos + __builtin_ctz(empty)) & t->mask;
+        break;
+      }
+      pos = (pos + GROUP) & t->mask;
+    }
+
+    if (t->count < MAX_LOAD(t->mask + 1)) {
+      struct entry *e = &t->entries[pos];
+      set_ctrl(t, pos, tag);
+      t->count++;
+      e->key = *key;
+      e->hash = hash;
+      e->packets = 0;
+      e->bytes = 0;
+      e->first = 0;
+      e->last = 0;
+      e->tcp_flags = 0;
+      e->timer.prev = e->timer.next = NULL;
+      COUNT(flows);
+      return e;
+    }
+    // Evicting shifts the entries, the free slot has to be found again
+    evict(t, hash);
+  }
+}
+
+static void report(uint64_t at);
+
+void flowtable_packet(const struct pcap_pkthdr *header, const struct dissection *d) {
+  if (!enabled || d == NULL || d->count == 0) return;
+  struct table *t = get_table();
+  if (t == NULL) return;
+
+  struct flow_key key;
+  flow_key_from_layers(d, &key);
+  uint8_t tcp_flags = 0;
+  for (unsigned i = 0; i < d->count; i++)
+    if (d->layers[i].type == LAYER_TCP)
+      tcp_flags = d->layers[i].tcp.flags;
+
+  uint64_t now = header->ts.tv_sec;
+  uint64_t us = now * 1000000 + header->ts.tv_usec;
+  uint32_t hash = flow_hash(&key);
+
+  if (config.top > 0) pthread_mutex_lock(&t->lock);
+  if (!t->wheel_started) {
+    wheel_init(&t->wheel, now);
+    t->wheel_started = 1;
+  }
+  expire(t, now);
+
+  struct entry *e = lookup(t, &key, hash);
+  // In a batch (batch.h), a datagram reassembled from fragments may come
+  // after later packets of its flow
+  if (e->packets == 0 || us < e->first) e->first = us;
+  e->packets++;
+  e->bytes += header->len;
+  if (us > e->last) e->last = us;
+  e->tcp_flags |= tcp_flags;
+  // Rescheduled at most once a second
+  if (e->timer.next == NULL || e->timer.expires != now + FLOWTABLE_IDLE_TIMEOUT)
+    wheel_schedule(&t->wheel, &e->timer, now + FLOWTABLE_IDLE_TIMEOUT);
+  if (config.top > 0) pthread_mutex_unlock(&t->lock);
+
+  if (config.top == 0) return;
+  uint64_t next = __atomic_load_n(&next_report, __ATOMIC_RELAXED);
+  if (next == 0) {
+    __atomic_compare_exchange_n(&next_report, &next, now + config.top_interval, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  } else if (now >= next) {
+    // Reported by the first thread past the end of the interval
+    uint64_t at = now - (now - next) % config.top_interval;
+    if (__atomic_compare_exchange_n(&next_report, &next, at + config.top_interval, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      report(at);
+  }
+}
+
+static int heavier(const struct entry *a, const struct entry *b) {
+  return a->bytes > b->bytes || (a->bytes == b->bytes && a->packets > b->packets);
+}
+
+static int compare_heaviest(const void *a, const void *b) {
+  return heavier(b, a) - heavier(a, b);
+}
+
+// Keeps the `top' heaviest of `t' in `best', sorted, and returns how many
+static unsigned heaviest(const struct table *t, struct entry *best, unsigned top) {
+  unsigned count = 0;
+  for (size_t i = 0; i <= t->mask; i++) {
+    if (t->ctrl[i] == EMPTY) continue;
+    const struct entry *e = &t->entries[i];
+    if (count == top && !heavier(e, &best[count - 1])) continue;
+    unsigned j = count < top ? count++ : count - 1;
+    while (j > 0 && heavier(e, &best[j - 1])) {
+      best[j] = best[j - 1];
+      j--;
+    }
+    best[j] = *e;
+  }
+  return count;
+}
+
+static const char *proto_name(uint8_t proto) {
+  switch (proto) {
+    case IPPROTO_TCP: return "tcp";
+    case IPPROTO_UDP: return "udp";
+    case IPPROTO_ICMP: return "icmp";
+    case IPPROTO_ICMPV6: return "icmpv6";
+    default: return NULL;
+  }
+}
+
+// Prints the heaviest flows of all the tables, on stderr like the statistics.
+// A flow is only in several tables when it was split between offline jobs.
+static void report(uint64_t at) {
+  pthread_mutex_lock(&tables_lock);
+  unsigned count = 0;
+  for (struct table *t = tables; t != NULL; t = t->next) count++;
+  struct entry *best = malloc((size_t)(count + 1) * config.top * sizeof(struct entry));
+  if (best == NULL) {
+    pthread_mutex_unlock(&tables_lock);
+    return;
+  }
+
+  unsigned n = 0;
+  for (struct table *t = tables; t != NULL; t = t->next) {
+    struct entry *found = best + n;
+    pthread_mutex_lock(&t->lock);
+    unsigned m = heaviest(t, found, config.top);
+    pthread_mutex_unlock(&t->lock);
+    for (unsigned i = 0; i < m; i++) {
+      unsigned j = 0;
+      while (j < n && memcmp(&best[j].key, &found[i].key, sizeof(struct flow_key)) != 0) j++;
+      if (j == n) {
+        best[n++] = found[i];
+        continue;
+      }
+      best[j].packets += found[i].packets;
+      best[j].bytes += found[i].bytes;
+    }
+  }
+  pthread_mutex_unlock(&tables_lock);
+  qsort(best, n, sizeof(struct entry), compare_heaviest);
+  if (n > config.top) n = config.top;
+
+  pthread_mutex_lock(&records_lock);
+  if (at > 0)
+    fprintf(stderr, "Top %u flows at %" PRIu64 ":\n", n, at);
+  else
+    fprintf(stderr, "Top %u flows at the end of the capture:\n", n);
+  for (unsigned i = 0; i < n; i++) {
+    const struct entry *e = &best[i];
+    char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+    format_address(&e->key, e->key.src, src);
+    format_address(&e->key, e->key.dst, dst);
+    const char *proto = proto_name(e->key.proto);
+    char number[4];
+    if (proto == NULL) {
+      snprintf(number, sizeof(number), "%u", e->key.proto);
+      proto = number;
+    }
+    if (e->key.sport != 0 || e->key.dport != 0)
+      fprintf(stderr, "%4u  %s:%u > %s:%u %s, %" PRIu64 " packets, %" PRIu64 " bytes\n",
+              i + 1, src, e->key.sport, dst, e->key.dport, proto, e->packets, e->bytes);
+    else
+      fprintf(stderr, "%4u  %s > %s %s, %" PRIu64 " packets, %" PRIu64 " bytes\n",
+              i + 1, src, dst, proto, e->packets, e->bytes);
+  }
+  pthread_mutex_unlock(&records_lock);
+  free(best);
+}
+
+void flowtable_finish(void) {
+  if (!enabled) return;
+  if (config.top > 0) report(0);
+
+  pthread_mutex_lock(&tables_lock);
+  struct table *t = tables;
+  tables = NULL;
+  pthread_mutex_unlock(&tables_lock);
+  while (t != NULL) {
+    for (size_t i = 0; i <= t->mask; i++)
+      if (t->ctrl[i] != EMPTY)
+        emit(t, &t->entries[i], FLOW_END_CAPTURE);
+    if (t->records != NULL) write_records(t);
+
+    struct table *next = t->next;
+    pthread_mutex_destroy(&t->lock);
+    free(t->ctrl);
+    free(t->entries);
+    free(t->records);
+    free(t);
+    t = next;
+  }
+  thread_table = NULL;
+}
+
+void flowtable_stats(struct flowtable_stats *stats) {
+  stats->flows = __atomic_load_n(&totals.flows, __ATOMIC_RELAXED);
+  stats->expired = __atomic_load_n(&totals.expired, __ATOMIC_RELAXED);
+  stats->evictions = __atomic_load_n(&totals.evictions, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,79 @@
+#ifndef __FLOWTABLE_H
+#define __FLOWTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pcap/pcap.h>
+
+#include "dissect.h"
+#include "flow.h"
+
+// Per-flow accounting. Every decoded packet is counted in the flow of its
+// layers (see flow.h), one direction at a time: packets, bytes on the wire,
+// first and last capture time, and the TCP flags seen.
+//
+// Flows are kept per decoding thread in an open-addressing table with the
+// keys stored inline. Each slot has a control byte holding 7 bits of the hash
+// (or a mark for the empty ones), and a probe compares 16 of them at once
+// (with SSE2 when available). The table is sized once from the memory budget and never
+// grows: when it is full, the least recently seen flow near the new one is
+// evicted. Flows idle for FLOWTABLE_IDLE_TIMEOUT seconds of capture time are
+// expired by a timer wheel (wheel.h).
+//
+// Flows leaving the table (idle, evicted, or still there at the end) are
+// written as NDJSON records, and given to an exporter. The heaviest flows of all the threads can be
+// reported every few seconds of capture time.
+#define FLOWTABLE_DEFAULT_MEMORY (64 << 20)
+#define FLOWTABLE_IDLE_TIMEOUT 60
+#define FLOWTABLE_DEFAULT_TOP_INTERVAL 10
+
+enum flow_end {
+  FLOW_END_IDLE,
+  FLOW_END_EVICTED, // the table was full
+  FLOW_END_CAPTURE, // still there at the end
+};
+
+struct flow_record {
+  struct flow_key key;
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t first; // µs of capture time
+  uint64_t last;
+  uint8_t tcp_flags;
+  enum flow_end end;
+};
+
+// Called from the decoding thread of the flow, or from flowtable_finish
+typedef void (*flow_exporter)(const struct flow_record *record);
+
+struct flowtable_config {
+  size_t memory;         // for all the threads
+  unsigned threads;      // decoding threads sharing the memory
+  int records_fd;        // where the records are written, -1 for none
+  flow_exporter exporter; // NULL for none
+  unsigned top;          // flows in each report, 0 for none
+  unsigned top_interval; // seconds of capture time between the reports
+};
+
+struct flowtable_stats {
+  uint64_t flows;     // created
+  uint64_t expired;   // idle
+  uint64_t evictions; // the table was full
+};
+
+// Set before any packet is decoded. The table is disabled when there are
+// no records, exporter nor reports.
+void flowtable_init(const struct flowtable_config *config);
+
+// Counts a decoded packet in its flow
+void flowtable_packet(const struct pcap_pkthdr *header, const struct dissection *d);
+
+// Once all the decoding threads are done: makes a last report, writes the
+// records of the flows still in the tables and frees them.
+void flowtable_finish(void);
+
+// Sum of the counters of all the threads so far
+void flowtable_stats(struct flowtable_stats *stats);
+
+#endif
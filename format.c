@@ -0,0 +1,334 @@
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define HAVE_SSSE3_KERNEL
+#endif
+
+#include "format.h"
+
+static const char hex[16] = "0123456789abcdef";
+
+// Decimal representation of each byte
+static const struct {
+  uint8_t length;
+  char digits[3];
+} dec[256] = {
+  { 1, "0" }, { 1, "1" }, { 1, "2" }, { 1, "3" }, { 1, "4" }, { 1, "5" }, { 1, "6" }, { 1, "7" },
+  { 1, "8" }, { 1, "9" }, { 2, "10" }, { 2, "11" }, { 2, "12" }, { 2, "13" }, { 2, "14" }, { 2, "15" },
+  { 2, "16" }, { 2, "17" }, { 2, "18" }, { 2, "19" }, { 2, "20" }, { 2, "21" }, { 2, "22" }, { 2, "23" },
+  { 2, "24" }, { 2, "25" }, { 2, "26" }, { 2, "27" }, { 2, "28" }, { 2, "29" }, { 2, "30" }, { 2, "31" },
+  { 2, "32" }, { 2, "33" }, { 2, "34" }, { 2, "35" }, { 2, "36" }, { 2, "37" }, { 2, "38" }, { 2, "39" },
+  { 2, "40" }, { 2, "41" }, { 2, "42" }, { 2, "43" }, { 2, "44" }, { 2, "45" }, { 2, "46" }, { 2, "47" },
+  { 2, "48" }, { 2, "49" }, { 2, "50" }, { 2, "51" }, { 2, "52" }, { 2, "53" }, { 2, "54" }, { 2, "55" },
+  { 2, "56" }, { 2, "57" }, { 2, "58" }, { 2, "59" }, { 2, "60" }, { 2, "61" }, { 2, "62" }, { 2, "63" },
+  { 2, "64" }, { 2, "65" }, { 2, "66" }, { 2, "67" }, { 2, "68" }, { 2, "69" }, { 2, "70" }, { 2, "71" },
+  { 2, "72" }, { 2, "73" }, { 2, "74" }, { 2, "75" }, { 2, "76" }, { 2, "77" }, { 2, "78" }, { 2, "79" },
+  { 2, "80" }, { 2, "81" }, { 2, "82" }, { 2, "83" }, { 2, "84" }, { 2, "85" }, { 2, "86" }, { 2, "87" },
+  { 2, "88" }, { 2, "89" }, { 2, "90" }, { 2, "91" }, { 2, "92" }, { 2, "93" }, { 2, "94" }, { 2, "95" },
+  { 2, "96" }, { 2, "97" }, { 2, "98" }, { 2, "99" }, { 3, "100" }, { 3, "101" }, { 3, "102" }, { 3, "103" },
+  { 3, "104" }, { 3, "105" }, { 3, "106" }, { 3, "107" }, { 3, "108" }, { 3, "109" }, { 3, "110" }, { 3, "111" },
+  { 3, "112" }, { 3, "113" }, { 3, "114" }, { 3, "115" }, { 3, "116" }, { 3, "117" }, { 3, "118" }, { 3, "119" },
+  { 3, "120" }, { 3, "121" }, { 3, "122" }, { 3, "123" }, { 3, "124" }, { 3, "125" }, { 3, "126" }, { 3, "127" },
+  { 3, "128" }, { 3, "129" }, { 3, "130" }, { 3, "131" }, { 3, "132" }, { 3, "133" }, { 3, "134" }, { 3, "135" },
+  { 3, "136" }, { 3, "137" }, { 3, "138" }, { 3, "139" }, { 3, "140" }, { 3, "141" }, { 3, "142" }, { 3, "143" },
+  { 3, "144" }, { 3, "145" }, { 3, "146" }, { 3, "147" }, { 3, "148" }, { 3, "149" }, { 3, "150" }, { 3, "151" },
+  { 3, "152" }, { 3, "153" }, { 3, "154" }, { 3, "155" }, { 3, "156" }, { 3, "157" }, { 3, "158" }, { 3, "159" },
+  { 3, "160" }, { 3, "161" }, { 3, "162" }, { 3, "163" }, { 3, "164" }, { 3, "165" }, { 3, "166" }, { 3, "167" },
+  { 3, "168" }, { 3, "169" }, { 3, "170" }, { 3, "171" }, { 3, "172" }, { 3, "173" }, { 3, "174" }, { 3, "175" },
+  { 3, "176" }, { 3, "177" }, { 3, "178" }, { 3, "179" }, { 3, "180" }, { 3, "181" }, { 3, "182" }, { 3, "183" },
+  { 3, "184" }, { 3, "185" }, { 3, "186" }, { 3, "187" }, { 3, "188" }, { 3, "189" }, { 3, "190" }, { 3, "191" },
+  { 3, "192" }, { 3, "193" }, { 3, "194" }, { 3, "195" }, { 3, "196" }, { 3, "197" }, { 3, "198" }, { 3, "199" },
+  { 3, "200" }, { 3, "201" }, { 3, "202" }, { 3, "203" }, { 3, "204" }, { 3, "205" }, { 3, "206" }, { 3, "207" },
+  { 3, "208" }, { 3, "209" }, { 3, "210" }, { 3, "211" }, { 3, "212" }, { 3, "213" }, { 3, "214" }, { 3, "215" },
+  { 3, "216" }, { 3, "217" }, { 3, "218" }, { 3, "219" }, { 3, "220" }, { 3, "221" }, { 3, "222" }, { 3, "223" },
+  { 3, "224" }, { 3, "225" }, { 3, "226" }, { 3, "227" }, { 3, "228" }, { 3, "229" }, { 3, "230" }, { 3, "231" },
+  { 3, "232" }, { 3, "233" }, { 3, "234" }, { 3, "235" }, { 3, "236" }, { 3, "237" }, { 3, "238" }, { 3, "239" },
+  { 3, "240" }, { 3, "241" }, { 3, "242" }, { 3, "243" }, { 3, "244" }, { 3, "245" }, { 3, "246" }, { 3, "247" },
+  { 3, "248" }, { 3, "249" }, { 3, "250" }, { 3, "251" }, { 3, "252" }, { 3, "253" }, { 3, "254" }, { 3, "255" },
+};
+
+static inline char *put_hex8(char *p, uint8_t v) {
+  // No leading zero, like "%x"
+  if (v >= 16) *p++ = hex[v >> 4];
+  *p++ = hex[v & 0xf];
+  return p;
+}
+
+static inline char *put_dec8(char *p, uint8_t v) {
+  // Always copy 3 bytes, the extra ones are overwritten by what follows
+  memcpy(p, dec[v].digits, 3);
+  return p + dec[v].length;
+}
+
+char *format_ether(const uint8_t *addr, char *buf) {
+  char *p = buf;
+  for (int i = 0; i < 6; i++) {
+    if (i > 0) *p++ = ':';
+    p = put_hex8(p, addr[i]);
+  }
+  *p = '\0';
+  return buf;
+}
+
+static char *put_ipv4(char *p, const uint8_t *addr) {
+  for (int i = 0; i < 4; i++) {
+    if (i > 0) *p++ = '.';
+    p = put_dec8(p, addr[i]);
+  }
+  return p;
+}
+
+char *format_ipv4(const uint8_t *addr, char *buf) {
+  *put_ipv4(buf, addr) = '\0';
+  return buf;
+}
+
+char *format_ipv6(const uint8_t *addr, char *buf) {
+  uint16_t words[8];
+  for (int i = 0; i < 8; i++)
+    words[i] = addr[2 * i] << 8 | addr[2 * i + 1];
+
+  // Longest run of at least two zero groups, the first one on ties
+  int best = -1, best_len = 0;
+  for (int i = 0; i < 8;) {
+    if (words[i] != 0) {
+      i++;
+      continue;
+    }
+    int start = i;
+    while (i < 8 && words[i] == 0) i++;
+    if (i - start > best_len) {
+      best = start;
+      best_len = i - start;
+    }
+  }
+  if (best_len < 2) best = -1;
+
+  char *p = buf;
+  for (int i = 0; i < 8; i++) {
+    if (i == best) {
+      *p++ = ':';
+      i += best_len - 1;
+      if (i == 7) *p++ = ':';
+      continue;
+    }
+    if (i > 0) *p++ = ':';
+
+    // ::a.b.c.d and ::ffff:a.b.c.d
+    if (i == 6 && best == 0 && (best_len == 6 || (best_len == 5 && words[5] == 0xffff))) {
+      p = put_ipv4(p, addr + 12);
+      break;
+    }
+
+    uint16_t w = words[i];
+    if (w >= 0x1000) *p++ = hex[w >> 12];
+    if (w >= 0x100) *p++ = hex[(w >> 8) & 0xf];
+    if (w >= 0x10) *p++ = hex[(w >> 4) & 0xf];
+    *p++ = hex[w & 0xf];
+  }
+  *p = '\0';
+  return buf;
+}
+
+size_t format_uint(uint64_t value, char *buf) {
+  char tmp[20];
+  char *p = tmp + sizeof(tmp);
+  // Three digits per division, zero padded except for the leading group
+  while (value >= 1000) {
+    unsigned part = value % 1000;
+    value /= 1000;
+    p -= 3;
+    p[0] = '0' + part / 100;
+    p[1] = '0' + part / 10 % 10;
+    p[2] = '0' + part % 10;
+  }
+  do {
+    *--p = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+
+  size_t length = tmp + sizeof(tmp) - p;
+  memcpy(buf, p, length);
+  buf[length] = '\0';
+  return length;
+}
+
+static inline char *put_sep(char *p, const char *sep, size_t sep_len) {
+  memcpy(p, sep, sep_len);
+  return p + sep_len;
+}
+
+size_t format_ipv4_list(const uint8_t *addrs, size_t count, const char *sep, char *buf) {
+  size_t sep_len = strlen(sep);
+  char *p = buf;
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0) p = put_sep(p, sep, sep_len);
+    p = put_ipv4(p, addrs + 4 * i);
+  }
+  *p = '\0';
+  return p - buf;
+}
+
+size_t format_u8_list(const uint8_t *values, size_t count, const char *sep, char *buf) {
+  size_t sep_len = strlen(sep);
+  char *p = buf;
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0) p = put_sep(p, sep, sep_len);
+    p = put_dec8(p, values[i]);
+  }
+  *p = '\0';
+  return p - buf;
+}
+
+size_t format_hex_list(const uint8_t *values, size_t count, const char *sep, char *buf) {
+  size_t sep_len = strlen(sep);
+  char *p = buf;
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0) p = put_sep(p, sep, sep_len);
+    *p++ = hex[values[i] >> 4];
+    *p++ = hex[values[i] & 0xf];
+  }
+  *p = '\0';
+  return p - buf;
+}
+
+// Layout of a hex dump line:
+//   0..23   "xx " for bytes 0 to 7
+//   24      ' '
+//   25..48  "xx " for bytes 8 to 15
+//   49..50  "  "
+//   51..58  ASCII of bytes 0 to 7
+//   59      ' '
+//   60..67  ASCII of bytes 8 to 15
+//   68      '\n'
+static char *hexdump_line(const uint8_t *data, uint32_t length, char *p) {
+  for (uint32_t j = 0; j < 16; j++) {
+    if (j < length) {
+      *p++ = hex[data[j] >> 4];
+      *p++ = hex[data[j] & 0xf];
+    } else {
+      *p++ = ' ';
+      *p++ = ' ';
+    }
+    *p++ = ' ';
+    if (j == 7) *p++ = ' ';
+  }
+
+  *p++ = ' ';
+  *p++ = ' ';
+
+  for (uint32_t j = 0; j < 16; j++) {
+    // isprint in the C locale
+    if (j < length)
+      *p++ = data[j] >= 0x20 && data[j] < 0x7f ? data[j] : '.';
+    else
+      *p++ = ' ';
+    if (j == 7) *p++ = ' ';
+  }
+  *p++ = '\n';
+  return p;
+}
+
+#ifdef HAVE_SSSE3_KERNEL
+// Full lines are built in 5 stores of 16 bytes: each is a constant (the
+// spaces and the new line) or'ed with a shuffle of the hex digits of bytes 0
+// to 7, of bytes 8 to 15, and of the ASCII bytes. The shuffle masks are
+// derived from the layout above.
+enum { SRC_LOW, SRC_HIGH, SRC_ASCII, SRC_COUNT };
+static uint8_t shuffles[5][SRC_COUNT][16] __attribute__((aligned(16)));
+static char constants[5][16] __attribute__((aligned(16)));
+
+static void hexdump_init(void) {
+  memset(shuffles, 0x80, sizeof(shuffles));
+  memset(constants, 0, sizeof(constants));
+  for (int pos = 0; pos < 5 * 16; pos++) {
+    uint8_t *mask = NULL;
+    int index = 0;
+    char c = 0;
+    if (pos < 24) {
+      if (pos % 3 == 2) c = ' ';
+      else { mask = shuffles[pos / 16][SRC_LOW]; index = pos / 3 * 2 + pos % 3; }
+    } else if (pos == 24) {
+      c = ' ';
+    } else if (pos < 49) {
+      int q = pos - 25;
+      if (q % 3 == 2) c = ' ';
+      else { mask = shuffles[pos / 16][SRC_HIGH]; index = q / 3 * 2 + q % 3; }
+    } else if (pos < 51) {
+      c = ' ';
+    } else if (pos < 59) {
+      mask = shuffles[pos / 16][SRC_ASCII]; index = pos - 51;
+    } else if (pos == 59) {
+      c = ' ';
+    } else if (pos < 68) {
+      mask = shuffles[pos / 16][SRC_ASCII]; index = pos - 60 + 8;
+    } else if (pos == 68) {
+      c = '\n';
+    }
+    if (mask != NULL) mask[pos % 16] = index;
+    constants[pos / 16][pos % 16] = c;
+  }
+}
+
+__attribute__((target("ssse3")))
+static size_t hexdump_ssse3(const uint8_t *data, uint32_t lines, char *p) {
+  const __m128i digits = _mm_loadu_si128((const __m128i *)hex);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  const __m128i low = _mm_set1_epi8(0x1f);
+  const __m128i high = _mm_set1_epi8(0x7f);
+  const __m128i dot = _mm_set1_epi8('.');
+
+  for (uint32_t i = 0; i < lines; i++, data += 16, p += FORMAT_HEXDUMP_LINE) {
+    __m128i v = _mm_loadu_si128((const __m128i *)data);
+    __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+    __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, nibble));
+
+    __m128i src[SRC_COUNT];
+    src[SRC_LOW] = _mm_unpacklo_epi8(hi, lo);
+    src[SRC_HIGH] = _mm_unpackhi_epi8(hi, lo);
+    // Bytes from 0x80 are negative, so out of (0x1f, 0x7f) as well
+    __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(v, low), _mm_cmplt_epi8(v, high));
+    src[SRC_ASCII] = _mm_or_si128(_mm_and_si128(printable, v), _mm_andnot_si128(printable, dot));
+
+    for (int c = 0; c < 5; c++) {
+      __m128i out = _mm_load_si128((const __m128i *)constants[c]);
+      for (int s = 0; s < SRC_COUNT; s++)
+        out = _mm_or_si128(out, _mm_shuffle_epi8(src[s], _mm_load_si128((const __m128i *)shuffles[c][s])));
+      _mm_storeu_si128((__m128i *)(p + 16 * c), out);
+    }
+  }
+  return (size_t)lines * FORMAT_HEXDUMP_LINE;
+}
+
+static int use_ssse3;
+static pthread_once_t hexdump_once = PTHREAD_ONCE_INIT;
+
+static void hexdump_select(void) {
+  hexdump_init();
+  __builtin_cpu_init();
+  use_ssse3 = __builtin_cpu_supports("ssse3") != 0;
+}
+#endif
+
+size_t format_hexdump(const uint8_t *data, uint32_t length, char *buf) {
+  char *p = buf;
+  uint32_t lines = length / 16;
+
+#ifdef HAVE_SSSE3_KERNEL
+  pthread_once(&hexdump_once, hexdump_select);
+  if (use_ssse3) {
+    p += hexdump_ssse3(data, lines, p);
+    data += lines * 16;
+    length -= lines * 16;
+    lines = 0;
+  }
+#endif
+
+  for (uint32_t i = 0; i < lines; i++, data += 16, length -= 16)
+    p = hexdump_line(data, 16, p);
+  if (length > 0)
+    p = hexdump_line(data, length, p);
+  return p - buf;
+}
@@ -0,0 +1,42 @@
+#ifndef __FORMAT_H
+#define __FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Address and hex formatters for the output. They write into a buffer given by
+// the caller, so they can be used from any thread, and are driven by lookup
+// tables instead of going through printf. The output is the same as the libc
+// functions they replace (ether_ntoa, inet_ntop).
+
+// "%x:%x:%x:%x:%x:%x", like ether_ntoa
+#define ETHER_ADDRSTRLEN 18
+char *format_ether(const uint8_t *addr, char *buf);
+
+// Dotted decimal, `buf' holds at least INET_ADDRSTRLEN (16) bytes
+char *format_ipv4(const uint8_t *addr, char *buf);
+
+// Same as inet_ntop(AF_INET6): longest run of zero groups compressed, and
+// IPv4 compatible or mapped addresses in dotted decimal. `buf' holds at least
+// INET6_ADDRSTRLEN (46) bytes.
+char *format_ipv6(const uint8_t *addr, char *buf);
+
+// Unsigned decimal, `buf' holds at least 21 bytes. Returns the length written.
+size_t format_uint(uint64_t value, char *buf);
+
+// Lists of `count' items separated by `sep', for DHCP options. Return the
+// length written, the buffer must hold count * 16 bytes for addresses, or
+// count * 5 for bytes.
+size_t format_ipv4_list(const uint8_t *addrs, size_t count, const char *sep, char *buf);
+size_t format_u8_list(const uint8_t *values, size_t count, const char *sep, char *buf);
+size_t format_hex_list(const uint8_t *values, size_t count, const char *sep, char *buf);
+
+// Hex dump, 16 bytes per line: two groups of 8 hex bytes and the same bytes
+// in ASCII, non printable characters as '.'. Returns the length written, the
+// buffer must hold FORMAT_HEXDUMP_SIZE(length) bytes (a bit more than what is
+// written, full lines are stored 16 bytes at a time).
+#define FORMAT_HEXDUMP_LINE 69
+#define FORMAT_HEXDUMP_SIZE(length) ((((length) + 15) / 16) * FORMAT_HEXDUMP_LINE + 16)
+size_t format_hexdump(const uint8_t *data, uint32_t length, char *buf);
+
+#endif
@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "context.h"
+#include "frag.h"
+#include "slab.h"
+
+// Fragment offsets are multiples of 8 bytes, the map of what was received
+// has one bit for each 8 bytes of the datagram
+#define UNIT 8
+#define UNITS ((FRAG_MAX_DATAGRAM + UNIT - 1) / UNIT)
+
+struct buffer {
+  uint8_t data[FRAG_MAX_DATAGRAM];
+  uint8_t map[(UNITS + 7) / 8];
+};
+
+struct datagram {
+  struct frag_key key;
+  struct buffer *buffer; // NULL when the slot is free
+  uint64_t expires;
+  uint32_t received; // bytes
+  uint32_t end;      // of the furthest fragment
+  uint32_t total;    // known with the last fragment
+  uint8_t proto;
+  uint8_t has_proto;
+  uint8_t has_last;
+};
+
+struct table {
+  struct datagram slots[FRAG_SLOTS];
+  struct slab buffers;
+};
+
+static size_t frag_memory = FRAG_DEFAULT_MEMORY;
+static struct slab_budget budget = { .limit = FRAG_DEFAULT_MEMORY };
+
+static struct frag_stats totals;
+#define COUNT(counter) __atomic_add_fetch(&totals.counter, 1, __ATOMIC_RELAXED)
+
+static void release(struct table *t, struct datagram *g) {
+  slab_free(&t->buffers, g->buffer);
+  g->buffer = NULL;
+}
+
+void frag_release(void *table) {
+  struct table *t = table;
+  slab_destroy(&t->buffers);
+  free(t);
+}
+
+static struct table *get_table(void) {
+  struct mydump_context *c = context_current();
+  if (c->frag != NULL) return c->frag;
+
+  struct table *t = calloc(1, sizeof(struct table));
+  if (t == NULL) return NULL;
+  slab_init(&t->buffers, sizeof(struct buffer), 1, &budget);
+  c->frag = t;
+  return t;
+}
+
+void frag_init(size_t memory) {
+  frag_memory = memory;
+  budget.limit = memory;
+}
+
+static inline uint64_t mix(uint64_t h, uint64_t v) {
+  h ^= v;
+  h *= 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 29);
+}
+
+static inline uint64_t load64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t hash_key(const struct frag_key *key) {
+  uint64_t h = key->id | (uint64_t)key->proto << 32 | (uint64_t)key->family << 40;
+  h = mix(h, load64(key->src));
+  h = mix(h, load64(key->src + 8));
+  h = mix(h, load64(key->dst));
+  h = mix(h, load64(key->dst + 8));
+  return (uint32_t)(h ^ (h >> 32));
+}
+
+static int same_key(const struct frag_key *a, const struct frag_key *b) {
+  return a->id == b->id && a->family == b->family && a->proto == b->proto
+      && memcmp(a->src, b->src, 16) == 0 && memcmp(a->dst, b->dst, 16) == 0;
+}
+
+// Makes room in the budget by dropping the datagram that expires first
+static struct buffer *alloc_buffer(struct table *t, uint64_t now) {
+  struct buffer *b;
+  while ((b = slab_alloc(&t->buffers)) == NULL) {
+    struct datagram *victim = NULL;
+    for (unsigned i = 0; i < FRAG_SLOTS; i++) {
+      struct datagram *g = &t->slots[i];
+      if (g->buffer != NULL && (victim == NULL || g->expires < victim->expires))
+        victim = g;
+    }
+    if (victim == NULL) return NULL;
+    if (victim->expires <= now)
+      COUNT(timeouts);
+    else
+      COUNT(evictions);
+    release(t, victim);
+  }
+  return b;
+}
+
+static struct datagram *lookup(struct table *t, const struct frag_key *key, uint64_t now) {
+  uint32_t h = hash_key(key);
+  struct datagram *empty = NULL;
+  struct datagram *oldest = NULL;
+  for (unsigned i = 0; i < FRAG_PROBE; i++) {
+    struct datagram *g = &t->slots[(h + i) % FRAG_SLOTS];
+    if (g->buffer != NULL && g->expires <= now) {
+      COUNT(timeouts);
+      release(t, g);
+    }
+    if (g->buffer == NULL) {
+      if (empty == NULL) empty = g;
+      continue;
+    }
+    if (same_key(&g->key, key)) return g;
+    if (oldest == NULL || g->expires < oldest->expires) oldest = g;
+  }
+
+  // Slots are only looked for near the hash, so a full neighbourhood loses
+  // its oldest datagram
+  if (empty == NULL) {
+    COUNT(evictions);
+    release(t, oldest);
+    empty = oldest;
+  }
+  empty->buffer = alloc_buffer(t, now);
+  if (empty->buffer == NULL) return NULL;
+  memset(empty->buffer->map, 0, sizeof(empty->buffer->map));
+  empty->key = *key;
+  empty->expires = now + FRAG_TIMEOUT;
+  empty->received = 0;
+  empty->end = 0;
+  empty->total = 0;
+  empty->has_proto = 0;
+  empty->has_last = 0;
+  return empty;
+}
+
+#define RECEIVED(map, unit) ((map)[(unit) >> 3] & (1 << ((unit) & 7)))
+
+const uint8_t *frag_add(struct dissection *d, const struct frag_key *key,
+                        uint32_t offset, int more, uint8_t proto,
+                        const uint8_t *data, uint32_t length,
+                        uint32_t *datagram_length, uint8_t *datagram_proto) {
+  if (frag_memory == 0) return NULL;
+  struct table *t = get_table();
+  if (t == NULL) return NULL;
+  COUNT(fragments);
+
+  uint32_t end = offset + length;
+  if (end > FRAG_MAX_DATAGRAM || (more && length % UNIT != 0)) {
+    COUNT(invalid);
+    return NULL;
+  }
+
+  struct datagram *g = lookup(t, key, d->ts.tv_sec);
+  if (g == NULL) return NULL;
+  struct buffer *b = g->buffer;
+
+  // The end of the datagram can only be set once, and nothing can go past it
+  if ((!more && ((g->has_last && g->total != end) || g->end > end))
+      || (more && g->has_last && end > g->total)) {
+    COUNT(overlaps);
+    release(t, g);
+    return NULL;
+  }
+
+  // Bytes already received must be the same
+  uint32_t added = 0;
+  for (uint32_t unit = offset / UNIT; unit * UNIT < end; unit++) {
+    uint32_t from = unit * UNIT;
+    uint32_t n = end - from < UNIT ? end - from : UNIT;
+    if (!RECEIVED(b->map, unit)) {
+      added += n;
+    } else if (memcmp(b->data + from, data + (from - offset), n) != 0) {
+      COUNT(overlaps);
+      release(t, g);
+      return NULL;
+    }
+  }
+  memcpy(b->data + offset, data, length);
+  for (uint32_t unit = offset / UNIT; unit * UNIT < end; unit++)
+    b->map[unit >> 3] |= 1 << (unit & 7);
+  g->received += added;
+  if (end > g->end) g->end = end;
+  if (!more) {
+    g->has_last = 1;
+    g->total = end;
+  }
+  if (offset == 0) {
+    g->proto = proto;
+    g->has_proto = 1;
+  }
+
+  if (!g->has_last || !g->has_proto || g->received != g->total)
+    return NULL;
+
+  // The headers before the fragment, then the datagram
+  uint32_t head = data - d->packet;
+  uint8_t *packet = dissect_alloc(head + g->total);
+  if (packet == NULL) {
+    release(t, g);
+    return NULL;
+  }
+  memcpy(packet, d->packet, head);
+  memcpy(packet + head, b->data, g->total);
+  d->packet = packet;
+  d->length = head + g->total;
+
+  *datagram_length = g->total;
+  *datagram_proto = g->proto;
+  COUNT(datagrams);
+  release(t, g);
+  return packet + head;
+}
+
+void frag_reset(void) {
+  struct table *t = context_current()->frag;
+  if (t == NULL) return;
+  for (unsigned i = 0; i < FRAG_SLOTS; i++)
+    if (t->slots[i].buffer != NULL)
+      release(t, &t->slots[i]);
+}
+
+void frag_stats(struct frag_stats *stats) {
+  stats->fragments = __atomic_load_n(&totals.fragments, __ATOMIC_RELAXED);
+  stats->datagrams = __atomic_load_n(&totals.datagrams, __ATOMIC_RELAXED);
+  stats->timeouts = __atomic_load_n(&totals.timeouts, __ATOMIC_RELAXED);
+  stats->evictions = __atomic_load_n(&totals.evictions, __ATOMIC_RELAXED);
+  stats->overlaps = __atomic_load_n(&totals.overlaps, __ATOMIC_RELAXED);
+  stats->invalid = __atomic_load_n(&totals.invalid, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,74 @@
+#ifndef __FRAG_H
+#define __FRAG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dissect.h"
+
+// IPv4 and IPv6 fragment reassembly. Datagrams being reassembled are kept per
+// decoding thread in a fixed-size open-addressing table, keyed by addresses,
+// identification and (for IPv4) protocol. Their data goes in buffers of the
+// largest datagram size, taken from a slab pool (slab.h) whose budget is
+// shared by all the threads; when it is reached, the datagram that would
+// expire first is dropped to make room. Datagrams expire after FRAG_TIMEOUT
+// seconds of capture time.
+//
+// Fragments overlapping bytes already received with different contents make
+// the whole datagram invalid (as RFC 5722 requires for IPv6), so that no
+// combination of overlaps can make the decoder see something a host would
+// not.
+#define FRAG_DEFAULT_MEMORY (8 << 20)
+#define FRAG_TIMEOUT 30
+#define FRAG_MAX_DATAGRAM 65535
+
+// Datagrams being reassembled per thread, and how far from its hash slot one
+// can be
+#define FRAG_SLOTS 1024
+#define FRAG_PROBE 8
+
+struct frag_key {
+  uint8_t src[16]; // IPv4 addresses use the first 4 bytes
+  uint8_t dst[16];
+  uint32_t id;
+  uint8_t family; // 4 or 6
+  uint8_t proto;  // 0 for IPv6, where it is only in the first fragment
+};
+
+struct frag_stats {
+  uint64_t fragments;
+  uint64_t datagrams; // reassembled
+  uint64_t timeouts;
+  uint64_t evictions; // to stay within the memory budget
+  uint64_t overlaps;  // datagrams dropped for inconsistent overlaps
+  uint64_t invalid;   // fragments dropped: too big, misaligned
+};
+
+// Set before any packet is decoded. A `memory' of 0 disables reassembly.
+void frag_init(size_t memory);
+
+// Adds a fragment of the packet being dissected: `length' bytes of `data' at
+// `offset' in the datagram, `more' when it is not the last one, and `proto'
+// the protocol of the payload when the fragment has it (always for IPv4, only
+// at offset 0 for IPv6).
+//
+// When the fragment completes its datagram, the dissection is moved to a copy
+// of the packet with the whole datagram in place of the fragment (the headers
+// before `data' are kept, so are the layers pushed so far). Returns the
+// datagram in this copy, with its length and protocol, to be decoded like any
+// payload. Returns NULL otherwise.
+const uint8_t *frag_add(struct dissection *d, const struct frag_key *key,
+                        uint32_t offset, int more, uint8_t proto,
+                        const uint8_t *data, uint32_t length,
+                        uint32_t *datagram_length, uint8_t *datagram_proto);
+
+// Drops the datagrams of the current context (context.h)
+void frag_reset(void);
+
+// Frees the table of a context
+void frag_release(void *table);
+
+// Sum of the counters of all the threads so far
+void frag_stats(struct frag_stats *stats);
+
+#endif
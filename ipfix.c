@@ -0,0 +1,502 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ipfix.h"
+#include "output.h"
+#include "util.h"
+
+#define VERSION 10
+#define HEADER_SIZE 16
+#define SET_HEADER_SIZE 4
+#define TEMPLATE_SET_ID 2
+
+// Information elements of the records (RFC 7012)
+struct field {
+  uint16_t id;
+  uint16_t length;
+};
+
+#define IE_OCTET_DELTA_COUNT 1
+#define IE_PACKET_DELTA_COUNT 2
+#define IE_PROTOCOL_IDENTIFIER 4
+#define IE_TCP_CONTROL_BITS 6
+#define IE_SOURCE_TRANSPORT_PORT 7
+#define IE_SOURCE_IPV4_ADDRESS 8
+#define IE_DESTINATION_TRANSPORT_PORT 11
+#define IE_DESTINATION_IPV4_ADDRESS 12
+#define IE_SOURCE_IPV6_ADDRESS 27
+#define IE_DESTINATION_IPV6_ADDRESS 28
+#define IE_SOURCE_MAC_ADDRESS 56
+#define IE_VLAN_ID 58
+#define IE_DESTINATION_MAC_ADDRESS 80
+#define IE_FLOW_END_REASON 136
+#define IE_FLOW_START_MILLISECONDS 152
+#define IE_FLOW_END_MILLISECONDS 153
+#define IE_LAYER2_SEGMENT_ID 351
+
+enum template {
+  T_IPV4,
+  T_IPV6,
+  T_MAC,
+  TEMPLATES,
+};
+
+// Set IDs of the data sets, after the reserved ones
+#define FIRST_TEMPLATE_ID 256
+
+static const struct field addresses[TEMPLATES][2] = {
+  [T_IPV4] = { { IE_SOURCE_IPV4_ADDRESS, 4 }, { IE_DESTINATION_IPV4_ADDRESS, 4 } },
+  [T_IPV6] = { { IE_SOURCE_IPV6_ADDRESS, 16 }, { IE_DESTINATION_IPV6_ADDRESS, 16 } },
+  [T_MAC] = { { IE_SOURCE_MAC_ADDRESS, 6 }, { IE_DESTINATION_MAC_ADDRESS, 6 } },
+};
+
+// After the addresses, in every template. The VNI uses the reduced size
+// encoding (RFC 7011 6.2) of layer2SegmentId.
+static const struct field common[] = {
+  { IE_SOURCE_TRANSPORT_PORT, 2 },
+  { IE_DESTINATION_TRANSPORT_PORT, 2 },
+  { IE_PROTOCOL_IDENTIFIER, 1 },
+  { IE_TCP_CONTROL_BITS, 2 },
+  { IE_VLAN_ID, 2 },
+  { IE_LAYER2_SEGMENT_ID, 4 },
+  { IE_PACKET_DELTA_COUNT, 8 },
+  { IE_OCTET_DELTA_COUNT, 8 },
+  { IE_FLOW_START_MILLISECONDS, 8 },
+  { IE_FLOW_END_MILLISECONDS, 8 },
+  { IE_FLOW_END_REASON, 1 },
+};
+#define COMMON_FIELDS (sizeof(common) / sizeof(common[0]))
+#define COMMON_SIZE 46
+
+// flowEndReason values
+static const uint8_t end_reasons[] = {
+  [FLOW_END_IDLE] = 1,    // idle timeout
+  [FLOW_END_EVICTED] = 5, // lack of resources
+  [FLOW_END_CAPTURE] = 4, // forced end
+};
+
+struct message {
+  uint8_t *data;
+  size_t length;
+  uint32_t records;
+  int set;       // template of the open data set, -1 for none
+  size_t set_start;
+  uint64_t started; // ms, see output_now
+};
+
+// Message being filled by a decoding thread. The lock is only shared with the
+// exporter thread, which submits the messages left unfilled too long.
+struct exporter_thread {
+  pthread_mutex_t lock;
+  struct message *message;
+  struct exporter_thread *next;
+};
+
+static struct ipfix_config config;
+static int out_fd = -1;
+static int is_udp = 0;
+
+// The pool: a stack of the free messages, and a queue of the ones ready to be
+// sent, in order
+static struct message messages[IPFIX_MESSAGES];
+static uint8_t *message_data = NULL;
+static struct message *free_messages[IPFIX_MESSAGES];
+static unsigned free_count = 0;
+static struct message *ready[IPFIX_MESSAGES];
+static unsigned ready_head = 0, ready_count = 0;
+static int stopping = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_ready = PTHREAD_COND_INITIALIZER;
+static pthread_t exporter;
+
+// All the thread states, for ipfix_finish
+static struct exporter_thread *threads = NULL;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct exporter_thread *thread_state = NULL;
+
+// Only used by the exporter thread
+static uint8_t templates[512];
+static size_t templates_length = 0;
+static time_t templates_sent = 0;
+static uint32_t sequence = 0;
+static int send_failed = 0;
+
+static struct ipfix_stats totals;
+#define ADD(counter, n) __atomic_add_fetch(&totals.counter, (n), __ATOMIC_RELAXED)
+
+static inline uint8_t *put_u16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+  return p + 2;
+}
+
+static inline uint8_t *put_u32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+  return p + 4;
+}
+
+static inline uint8_t *put_u64(uint8_t *p, uint64_t v) {
+  p = put_u32(p, v >> 32);
+  return put_u32(p, v);
+}
+
+static void build_templates(void) {
+  uint8_t *p = templates + HEADER_SIZE;
+  uint8_t *set = p;
+  p += SET_HEADER_SIZE;
+  for (unsigned t = 0; t < TEMPLATES; t++) {
+    p = put_u16(p, FIRST_TEMPLATE_ID + t);
+    p = put_u16(p, 2 + COMMON_FIELDS);
+    for (unsigned i = 0; i < 2; i++) {
+      p = put_u16(p, addresses[t][i].id);
+      p = put_u16(p, addresses[t][i].length);
+    }
+    for (unsigned i = 0; i < COMMON_FIELDS; i++) {
+      p = put_u16(p, common[i].id);
+      p = put_u16(p, common[i].length);
+    }
+  }
+  put_u16(set, TEMPLATE_SET_ID);
+  put_u16(set + 2, p - set);
+  templates_length = p - templates;
+}
+
+static void put_header(uint8_t *data, size_t length) {
+  uint8_t *p = put_u16(data, VERSION);
+  p = put_u16(p, length);
+  p = put_u32(p, time(NULL));
+  p = put_u32(p, sequence);
+  put_u32(p, config.domain);
+}
+
+static int send_data(const uint8_t *data, size_t length) {
+  if (is_udp) {
+    while (send(out_fd, data, length, 0) < 0) {
+      if (errno == EINTR) continue;
+      // Only once, a collector that is down would flood the logs
+      if (!send_failed)
+        WARNF("Could not send to the IPFIX collector: %s", strerror(errno));
+      send_failed = 1;
+      return -1;
+    }
+    return 0;
+  }
+
+  size_t done = 0;
+  while (done < length) {
+    ssize_t n = write(out_fd, data + done, length - done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (!send_failed)
+        ERRORF("Could not write the IPFIX file: %s", strerror(errno));
+      send_failed = 1;
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+static void send_message(struct message *m) {
+  time_t now = time(NULL);
+  if (templates_sent == 0 || (is_udp && now - templates_sent >= IPFIX_TEMPLATE_REFRESH)) {
+    put_header(templates, templates_length);
+    send_data(templates, templates_length);
+    templates_sent = now;
+  }
+
+  put_header(m->data, m->length);
+  if (send_data(m->data, m->length) < 0) {
+    ADD(dropped, m->records);
+    return;
+  }
+  // Counts the data records sent before the next message
+  sequence += m->records;
+  ADD(messages, 1);
+  ADD(records, m->records);
+}
+
+static void submit(struct exporter_thread *t);
+
+// Submits the messages the threads started more than IPFIX_MAX_DELAY ago, for
+// those that have no more flows ending for now
+static void submit_aged(void) {
+  uint64_t now = output_now();
+  pthread_mutex_lock(&threads_lock);
+  for (struct exporter_thread *t = threads; t != NULL; t = t->next) {
+    pthread_mutex_lock(&t->lock);
+    if (t->message != NULL && now - t->message->started >= IPFIX_MAX_DELAY)
+      submit(t);
+    pthread_mutex_unlock(&t->lock);
+  }
+  pthread_mutex_unlock(&threads_lock);
+}
+
+// Messages are at most that late on IPFIX_MAX_DELAY
+#define AGE_CHECK (IPFIX_MAX_DELAY / 4)
+
+static void *exporter_main(void *arg) {
+  (void)arg;
+  uint64_t checked = output_now();
+  pthread_mutex_lock(&pool_lock);
+  for (;;) {
+    while (ready_count == 0 && !stopping && output_now() - checked < AGE_CHECK) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      uint64_t ns = deadline.tv_nsec + (AGE_CHECK - (output_now() - checked)) * 1000000;
+      deadline.tv_sec += ns / 1000000000;
+      deadline.tv_nsec = ns % 1000000000;
+      pthread_cond_timedwait(&pool_ready, &pool_lock, &deadline);
+    }
+    if (output_now() - checked >= AGE_CHECK) {
+      pthread_mutex_unlock(&pool_lock);
+      submit_aged();
+      checked = output_now();
+      pthread_mutex_lock(&pool_lock);
+      continue;
+    }
+    if (ready_count == 0) break;
+    struct message *m = ready[ready_head];
+    ready_head = (ready_head + 1) % IPFIX_MESSAGES;
+    ready_count--;
+    pthread_mutex_unlock(&pool_lock);
+
+    send_message(m);
+
+    pthread_mutex_lock(&pool_lock);
+    free_messages[free_count++] = m;
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+// Splits "host:port" or "[v6]:port", the port being optional
+static int parse_collector(const char *collector, char *host, size_t size, const char **port) {
+  const char *end;
+  *port = IPFIX_DEFAULT_PORT;
+  if (collector[0] == '[') {
+    collector++;
+    end = strchr(collector, ']');
+    if (end == NULL) return -1;
+    if (end[1] == ':') *port = end + 2;
+    else if (end[1] != '\0') return -1;
+  } else {
+    end = strrchr(collector, ':');
+    // More than one colon is a bare IPv6 address
+    if (end == NULL || strchr(collector, ':') != end) {
+      end = collector + strlen(collector);
+    } else {
+      *port = end + 1;
+    }
+  }
+  if ((size_t)(end - collector) >= size) return -1;
+  memcpy(host, collector, end - collector);
+  host[end - collector] = '\0';
+  return 0;
+}
+
+static int open_collector(const char *collector) {
+  char host[256];
+  const char *port;
+  if (parse_collector(collector, host, sizeof(host), &port) < 0) {
+    ERRORF("Invalid IPFIX collector `%s'", collector);
+    return -1;
+  }
+
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM };
+  struct addrinfo *res;
+  int err = getaddrinfo(host, port, &hints, &res);
+  if (err != 0) {
+    ERRORF("Could not resolve the IPFIX collector `%s': %s", collector, gai_strerror(err));
+    return -1;
+  }
+  int fd = -1;
+  for (struct addrinfo *ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  if (fd < 0)
+    ERRORF("Could not connect to the IPFIX collector `%s': %s", collector, strerror(errno));
+  return fd;
+}
+
+int ipfix_init(const struct ipfix_config *c) {
+  config = *c;
+  if (config.mtu < IPFIX_MIN_MTU) config.mtu = IPFIX_MIN_MTU;
+  if (config.mtu > UINT16_MAX) config.mtu = UINT16_MAX;
+
+  if (config.collector != NULL) {
+    out_fd = open_collector(config.collector);
+    is_udp = 1;
+  } else {
+    out_fd = open(config.file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0)
+      ERRORF("Could not open `%s': %s", config.file, strerror(errno));
+  }
+  if (out_fd < 0) return -1;
+
+  message_data = malloc((size_t)IPFIX_MESSAGES * config.mtu);
+  if (message_data == NULL) {
+    ERROR("Out of memory");
+    return -1;
+  }
+  for (unsigned i = 0; i < IPFIX_MESSAGES; i++) {
+    messages[i].data = message_data + (size_t)i * config.mtu;
+    free_messages[free_count++] = &messages[i];
+  }
+  build_templates();
+
+  if (pthread_create(&exporter, NULL, exporter_main, NULL) != 0) {
+    ERROR("Could not start the IPFIX exporter thread");
+    return -1;
+  }
+  return 0;
+}
+
+static struct exporter_thread *get_thread(void) {
+  if (thread_state != NULL) return thread_state;
+
+  struct exporter_thread *t = calloc(1, sizeof(struct exporter_thread));
+  if (t == NULL) return NULL;
+  pthread_mutex_init(&t->lock, NULL);
+  pthread_mutex_lock(&threads_lock);
+  t->next = threads;
+  threads = t;
+  pthread_mutex_unlock(&threads_lock);
+  thread_state = t;
+  return t;
+}
+
+static void close_set(struct message *m) {
+  if (m->set < 0) return;
+  put_u16(m->data + m->set_start + 2, m->length - m->set_start);
+  m->set = -1;
+}
+
+static void submit(struct exporter_thread *t) {
+  struct message *m = t->message;
+  t->message = NULL;
+  close_set(m);
+  pthread_mutex_lock(&pool_lock);
+  ready[(ready_head + ready_count) % IPFIX_MESSAGES] = m;
+  ready_count++;
+  pthread_cond_signal(&pool_ready);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+static struct message *take(void) {
+  struct message *m = NULL;
+  pthread_mutex_lock(&pool_lock);
+  if (free_count > 0) m = free_messages[--free_count];
+  pthread_mutex_unlock(&pool_lock);
+  if (m == NULL) return NULL;
+  m->length = HEADER_SIZE;
+  m->records = 0;
+  m->set = -1;
+  m->started = output_now();
+  return m;
+}
+
+static void add_record(struct exporter_thread *t, const struct flow_record *r) {
+  enum template template = r->key.family == 4 ? T_IPV4 : r->key.family == 6 ? T_IPV6 : T_MAC;
+  size_t size = addresses[template][0].length + addresses[template][1].length + COMMON_SIZE;
+
+  struct message *m = t->message;
+  if (m != NULL) {
+    size_t needed = size + ((int)template != m->set ? SET_HEADER_SIZE : 0);
+    if (m->length + needed > config.mtu || output_now() - m->started >= IPFIX_MAX_DELAY)
+      submit(t);
+  }
+  if (t->message == NULL)
+    t->message = take();
+  m = t->message;
+  if (m == NULL) {
+    ADD(dropped, 1);
+    return;
+  }
+
+  if ((int)template != m->set) {
+    close_set(m);
+    m->set = template;
+    m->set_start = m->length;
+    put_u16(m->data + m->length, FIRST_TEMPLATE_ID + template);
+    m->length += SET_HEADER_SIZE;
+  }
+
+  uint8_t *p = m->data + m->length;
+  memcpy(p, r->key.src, addresses[template][0].length);
+  p += addresses[template][0].length;
+  memcpy(p, r->key.dst, addresses[template][1].length);
+  p += addresses[template][1].length;
+  p = put_u16(p, r->key.sport);
+  p = put_u16(p, r->key.dport);
+  *p++ = r->key.proto;
+  p = put_u16(p, r->tcp_flags);
+  p = put_u16(p, r->key.vlan);
+  p = put_u32(p, r->key.tunnel_id);
+  p = put_u64(p, r->packets);
+  p = put_u64(p, r->bytes);
+  p = put_u64(p, r->first / 1000);
+  p = put_u64(p, r->last / 1000);
+  *p++ = end_reasons[r->end];
+  m->length = p - m->data;
+  m->records++;
+}
+
+void ipfix_flow(const struct flow_record *r) {
+  struct exporter_thread *t = get_thread();
+  if (t == NULL) {
+    ADD(dropped, 1);
+    return;
+  }
+  pthread_mutex_lock(&t->lock);
+  add_record(t, r);
+  pthread_mutex_unlock(&t->lock);
+}
+
+void ipfix_finish(void) {
+  if (out_fd < 0) return;
+
+  pthread_mutex_lock(&threads_lock);
+  struct exporter_thread *t = threads;
+  threads = NULL;
+  pthread_mutex_unlock(&threads_lock);
+  while (t != NULL) {
+    if (t->message != NULL) submit(t);
+    struct exporter_thread *next = t->next;
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+    t = next;
+  }
+  thread_state = NULL;
+
+  pthread_mutex_lock(&pool_lock);
+  stopping = 1;
+  pthread_cond_signal(&pool_ready);
+  pthread_mutex_unlock(&pool_lock);
+  pthread_join(exporter, NULL);
+
+  close(out_fd);
+  out_fd = -1;
+  free(message_data);
+}
+
+void ipfix_stats(struct ipfix_stats *stats) {
+  stats->messages = __atomic_load_n(&totals.messages, __ATOMIC_RELAXED);
+  stats->records = __atomic_load_n(&totals.records, __ATOMIC_RELAXED);
+  stats->dropped = __atomic_load_n(&totals.dropped, __ATOMIC_RELAXED);
+}
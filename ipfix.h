@@ -0,0 +1,55 @@
+#ifndef __IPFIX_H
+#define __IPFIX_H
+
+#include <stdint.h>
+
+#include "flowtable.h"
+
+// IPFIX (RFC 7011) export of the flows leaving the flow table (flowtable.h),
+// over UDP to a collector or to a file. Three templates describe the records:
+// IPv4, IPv6, and MAC addresses for the flows without IP, each followed by
+// the ports, protocol, TCP flags, VLAN, VXLAN VNI (as layer2SegmentId),
+// packet and byte counts, start and end times, and end reason.
+//
+// Records are encoded by the decoding threads into messages of at most `mtu'
+// bytes, taken from a pool allocated once. Full messages are handed to an
+// exporter thread, which numbers them and sends them, so decoding never waits
+// for the network or the disk. It also takes the messages older than
+// IPFIX_MAX_DELAY ms, from threads that have no more flows ending. When all
+// the messages are waiting to be sent, records are dropped and counted.
+// Templates are sent first, and again every IPFIX_TEMPLATE_REFRESH seconds
+// over UDP.
+#define IPFIX_DEFAULT_PORT "4739"
+#define IPFIX_DEFAULT_MTU 1400
+#define IPFIX_MIN_MTU 256
+#define IPFIX_MAX_DELAY 1000
+#define IPFIX_TEMPLATE_REFRESH 60
+#define IPFIX_MESSAGES 256
+
+struct ipfix_config {
+  const char *collector; // host[:port], or NULL to write to `file'
+  const char *file;
+  unsigned mtu;
+  uint32_t domain; // observation domain, the interface index of live captures
+};
+
+struct ipfix_stats {
+  uint64_t messages;
+  uint64_t records;
+  uint64_t dropped; // records lost: no message free, or could not be sent
+};
+
+// Opens the collector socket or the file and starts the exporter thread.
+// Returns -1 with an error logged if it could not.
+int ipfix_init(const struct ipfix_config *config);
+
+// A flow_exporter, for flowtable_config
+void ipfix_flow(const struct flow_record *record);
+
+// Once all the decoding threads are done and the flow table is finished:
+// sends what is left and stops the exporter thread
+void ipfix_finish(void);
+
+void ipfix_stats(struct ipfix_stats *stats);
+
+#endif
@@ -0,0 +1,316 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "cursor.h"
+#include "dns.h"
+#include "format.h"
+#include "json.h"
+#include "render.h"
+#include "util.h"
+#include "vlan.h"
+
+static const char *layer_names[] = {
+  [LAYER_PAYLOAD] = "payload",
+  [LAYER_NULL] = "null",
+  [LAYER_LINUX_SLL] = "sll",
+  [LAYER_ETHERNET] = "ethernet",
+  [LAYER_VLAN] = "vlan",
+  [LAYER_ARP] = "arp",
+  [LAYER_IPV4] = "ipv4",
+  [LAYER_IPV6] = "ipv6",
+  [LAYER_ICMP] = "icmp",
+  [LAYER_ICMPV6] = "icmpv6",
+  [LAYER_UDP] = "udp",
+  [LAYER_TCP] = "tcp",
+  [LAYER_DNS] = "dns",
+  [LAYER_BOOTP] = "bootp",
+  [LAYER_VXLAN] = "vxlan",
+  [LAYER_IPV6_EXT] = "ipv6_ext",
+};
+
+// Room reserved for a layer without its DHCP options, and for each option:
+// 255 bytes escaped as \u00XX at most.
+#define JSON_LAYER_MAX 512
+#define JSON_OPTION_MAX (255 * 6 + 64)
+
+static const char hex[16] = "0123456789abcdef";
+
+// Only for literals, which need no escaping
+static inline char *put(char *p, const char *s) {
+  size_t length = strlen(s);
+  memcpy(p, s, length);
+  return p + length;
+}
+
+static inline char *put_uint(char *p, uint64_t value) {
+  return p + format_uint(value, p);
+}
+
+// ,"key":value
+static inline char *put_field(char *p, const char *key, uint64_t value) {
+  *p++ = ',';
+  *p++ = '"';
+  p = put(p, key);
+  *p++ = '"';
+  *p++ = ':';
+  return put_uint(p, value);
+}
+
+// ,"key":"formatted" with one of the formatters of format.h
+static inline char *put_addr(char *p, const char *key, char *(*formatter)(const uint8_t *, char *),
+                             const uint8_t *addr) {
+  char buf[INET6_ADDRSTRLEN];
+  *p++ = ',';
+  *p++ = '"';
+  p = put(p, key);
+  p = put(p, "\":\"");
+  p = put(p, formatter(addr, buf));
+  *p++ = '"';
+  return p;
+}
+
+// Strings from the packet: quotes, backslashes, control characters and bytes
+// above 0x7e are escaped, so the output stays valid UTF-8 whatever the input.
+static char *put_string(char *p, const uint8_t *s, size_t length) {
+  *p++ = '"';
+  for (size_t i = 0; i < length; i++) {
+    uint8_t c = s[i];
+    if (c == '"' || c == '\\') {
+      *p++ = '\\';
+      *p++ = c;
+    } else if (c < 0x20 || c > 0x7e) {
+      p = put(p, "\\u00");
+      *p++ = hex[c >> 4];
+      *p++ = hex[c & 0xf];
+    } else {
+      *p++ = c;
+    }
+  }
+  *p++ = '"';
+  return p;
+}
+
+static char *put_dhcp_option(char *p, const struct dissection *d, const struct dhcp_option *option) {
+  const uint8_t *payload = d->packet + option->offset;
+  struct cursor value = cursor_make(payload, option->length);
+
+  p = put(p, "{\"code\":");
+  p = put_uint(p, option->code);
+  p = put(p, ",\"value\":");
+
+  switch (option->code) {
+    case 1:  // Network mask
+    case 50: // Requested IP Address
+    case 54: // Server Identifier
+      if (!cursor_has(&value, 0, 4)) goto raw;
+      *p++ = '"';
+      p += strlen(format_ipv4(payload, p));
+      *p++ = '"';
+      break;
+
+    case 3: // Router
+    case 6: // Domain Name Server
+      *p++ = '[';
+      for (uint8_t i = 0; i + 4 <= option->length; i += 4) {
+        if (i > 0) *p++ = ',';
+        *p++ = '"';
+        p += strlen(format_ipv4(payload + i, p));
+        *p++ = '"';
+      }
+      *p++ = ']';
+      break;
+
+    case 12:  // Hostname
+    case 15:  // Domain Name
+    case 252: // WPAD
+      p = put_string(p, payload, option->length);
+      break;
+
+    case 51: // Lease time
+      if (!cursor_has(&value, 0, 4)) goto raw;
+      p = put_uint(p, cursor_u32(&value, 0));
+      break;
+
+    case 53: // DHCP msg type
+      if (!cursor_has(&value, 0, 1)) goto raw;
+      if (dhcp_msgtype_name(cursor_u8(&value, 0)) != NULL) {
+        *p++ = '"';
+        p = put(p, dhcp_msgtype_name(cursor_u8(&value, 0)));
+        *p++ = '"';
+      } else {
+        p = put_uint(p, cursor_u8(&value, 0));
+      }
+      break;
+
+    case 55: // Parameter Request List
+      *p++ = '[';
+      p += format_u8_list(payload, option->length, ",", p);
+      *p++ = ']';
+      break;
+
+    case 57: // Maximum DHCP Message Size
+      if (!cursor_has(&value, 0, 2)) goto raw;
+      p = put_uint(p, cursor_u16(&value, 0));
+      break;
+
+    default:
+    raw:
+      *p++ = '"';
+      p += format_hex_list(payload, option->length, "", p);
+      *p++ = '"';
+      break;
+  }
+
+  *p++ = '}';
+  return p;
+}
+
+static char *put_layer(char *p, const struct layer *l) {
+  p = put(p, "{\"type\":\"");
+  p = put(p, layer_names[l->type]);
+  *p++ = '"';
+  p = put_field(p, "offset", l->offset);
+  p = put_field(p, "length", l->length);
+
+  switch (l->type) {
+    case LAYER_PAYLOAD:
+      break;
+    case LAYER_NULL:
+      p = put_field(p, "af", l->null.af);
+      p = put_field(p, "ether_type", l->null.ether_type);
+      break;
+    case LAYER_LINUX_SLL:
+      p = put_addr(p, "addr", format_ether, l->sll.addr);
+      p = put_field(p, "ether_type", l->sll.ether_type);
+      break;
+    case LAYER_ETHERNET:
+      p = put_addr(p, "src", format_ether, l->ether.src);
+      p = put_addr(p, "dst", format_ether, l->ether.dst);
+      p = put_field(p, "ether_type", l->ether.ether_type);
+      break;
+    case LAYER_VLAN:
+      p = put_field(p, "vid", l->vlan.tci & VLAN_VID_MASK);
+      p = put_field(p, "tci", l->vlan.tci);
+      p = put_field(p, "ether_type", l->vlan.ether_type);
+      break;
+    case LAYER_ARP:
+      p = put_field(p, "op", l->arp.op);
+      p = put_addr(p, "sha", format_ether, l->arp.sha);
+      p = put_addr(p, "spa", format_ipv4, l->arp.spa);
+      p = put_addr(p, "tha", format_ether, l->arp.tha);
+      p = put_addr(p, "tpa", format_ipv4, l->arp.tpa);
+      break;
+    case LAYER_IPV4:
+      p = put_addr(p, "src", format_ipv4, l->ipv4.src);
+      p = put_addr(p, "dst", format_ipv4, l->ipv4.dst);
+      p = put_field(p, "proto", l->ipv4.proto);
+      break;
+    case LAYER_IPV6:
+      p = put_addr(p, "src", format_ipv6, l->ipv6.src);
+      p = put_addr(p, "dst", format_ipv6, l->ipv6.dst);
+      p = put_field(p, "next", l->ipv6.next);
+      p = put_field(p, "proto", l->ipv6.proto);
+      break;
+    case LAYER_IPV6_EXT:
+      p = put_field(p, "header", l->ipv6_ext.type);
+      p = put_field(p, "next", l->ipv6_ext.next);
+      break;
+    case LAYER_ICMP:
+    case LAYER_ICMPV6:
+      p = put_field(p, "icmp_type", l->icmp.type);
+      p = put_field(p, "code", l->icmp.code);
+      break;
+    case LAYER_UDP:
+      p = put_field(p, "sport", l->udp.sport);
+      p = put_field(p, "dport", l->udp.dport);
+      p = put_field(p, "udp_length", l->udp.length);
+      p = put_field(p, "checksum", l->udp.checksum);
+      break;
+    case LAYER_TCP:
+      p = put_field(p, "sport", l->tcp.sport);
+      p = put_field(p, "dport", l->tcp.dport);
+      p = put_field(p, "checksum", l->tcp.checksum);
+      break;
+    case LAYER_DNS:
+    {
+      // The dissection keeps the flags in network order
+      struct dns_hdr h = { .flags = ntohs(l->dns.flags) };
+      p = put_field(p, "id", l->dns.id);
+      p = put_field(p, "qr", h.qr);
+      p = put_field(p, "opcode", h.opcode);
+      p = put_field(p, "aa", h.aa);
+      p = put_field(p, "tc", h.tc);
+      p = put_field(p, "rd", h.rd);
+      p = put_field(p, "ra", h.ra);
+      p = put_field(p, "z", h.z);
+      p = put_field(p, "rcode", h.rcode);
+      p = put_field(p, "qdcount", l->dns.qdcount);
+      p = put_field(p, "ancount", l->dns.ancount);
+      p = put_field(p, "nscount", l->dns.nscount);
+      p = put_field(p, "arcount", l->dns.arcount);
+      break;
+    }
+    case LAYER_BOOTP:
+      p = put_field(p, "op", l->bootp.op);
+      p = put_field(p, "htype", l->bootp.htype);
+      p = put_field(p, "hlen", l->bootp.hlen);
+      p = put_field(p, "hops", l->bootp.hops);
+      p = put_field(p, "xid", ntohl(l->bootp.xid));
+      // The options, and the closing brace, are written by render_json
+      return p;
+    case LAYER_VXLAN:
+      p = put_field(p, "vni", l->vxlan.id);
+      break;
+  }
+
+  *p++ = '}';
+  return p;
+}
+
+void render_json(const struct pcap_pkthdr *header, const struct dissection *d) {
+  char *start = out_reserve(128);
+  if (start == NULL) return;
+
+  char *p = put(start, "{\"ts\":");
+  p = put_uint(p, header->ts.tv_sec);
+  *p++ = '.';
+  for (long usec = header->ts.tv_usec, div = 100000; div > 0; div /= 10)
+    *p++ = '0' + usec / div % 10;
+  p = put_field(p, "caplen", header->caplen);
+  p = put_field(p, "len", header->len);
+  p = put(p, ",\"layers\":[");
+  out_commit(p - start);
+
+  for (unsigned i = 0; i < d->count; i++) {
+    const struct layer *l = &d->layers[i];
+    if ((start = out_reserve(JSON_LAYER_MAX)) == NULL) return;
+    p = start;
+    if (i > 0) *p++ = ',';
+    p = put_layer(p, l);
+    out_commit(p - start);
+
+    if (l->type != LAYER_BOOTP) continue;
+
+    // DHCP options, one reservation each since there can be many of them
+    if ((start = out_reserve(16)) == NULL) return;
+    p = put(start, ",\"options\":[");
+    out_commit(p - start);
+    unsigned written = 0;
+    for (uint16_t j = 0; j < l->bootp.option_count; j++) {
+      const struct dhcp_option *option = &l->bootp.options[j];
+      if (option->code == 0) continue; // Pad
+      if ((start = out_reserve(JSON_OPTION_MAX)) == NULL) return;
+      p = start;
+      if (written++ > 0) *p++ = ',';
+      p = put_dhcp_option(p, d, option);
+      out_commit(p - start);
+    }
+    if ((start = out_reserve(4)) == NULL) return;
+    p = put(start, "]}");
+    out_commit(p - start);
+  }
+
+  if ((start = out_reserve(4)) == NULL) return;
+  p = put(start, "]}\n");
+  out_commit(p - start);
+}
@@ -0,0 +1,23 @@
+#ifndef __JSON_H
+#define __JSON_H
+
+#include <pcap/pcap.h>
+
+#include "dissect.h"
+
+// Writes a dissection as one NDJSON line:
+//
+//   {"ts":1500000000.123456,"caplen":342,"len":342,"layers":[
+//     {"type":"ethernet","offset":0,"length":328,"src":"0:1:2:3:4:5",...},
+//     ...]}
+//
+// Each layer has its type, offset and length, and the fields of its member
+// in struct layer, with the same names (ICMP type and UDP length become
+// "icmp_type" and "udp_length", VLANs also have their "vid"). Addresses are
+// strings formatted as in the text output. DHCP options are listed in
+// "options" with their "code" and a decoded "value" for the known ones
+// (addresses, names, numbers), the raw bytes in hex for the others.
+// Everything goes to the output buffer through out_reserve, without printf.
+void render_json(const struct pcap_pkthdr *header, const struct dissection *d);
+
+#endif
@@ -5,9 +5,11 @@
 #include <arpa/inet.h>
 #include <net/ethernet.h>
 #include <pcap/dlt.h>
-#include <ctype.h>
+#include <stddef.h>
+#include <string.h>
 
 #include "aftypes.h"
+#include "cursor.h"
 #include "ether.h"
 #include "link.h"
 #include "util.h"
@@ -22,17 +24,16 @@ struct linux_sll_header {
   uint16_t ether_type;
 };
 
-static void handle_linux_sll(uint32_t length, const uint8_t *packet) {
+static void handle_linux_sll(struct dissection *d, uint32_t length, const uint8_t *packet) {
   // TODO: check the address type
-  struct linux_sll_header *linux_sll = (struct linux_sll_header *)packet;
-  APPLY_OVERHEAD(struct linux_sll_header, length, packet);
-  DEBUGF("Linux SLL packet addr: %s, type: 0x%04x, length: %d",
-         ether_ntoa((struct ether_addr *)linux_sll->source_address),
-         htons(linux_sll->ether_type),
-         length);
-  PRINTF("Linux SLL %s, ",
-         ether_ntoa((struct ether_addr *)linux_sll->source_address));
-  handle_ether_payload(htons(linux_sll->ether_type), length, packet);
+  struct cursor c = cursor_make(packet, length);
+  CURSOR_NEED(c, sizeof(struct linux_sll_header));
+  struct cursor h = cursor_pull(&c, sizeof(struct linux_sll_header));
+  struct layer *l = dissect_push(d, LAYER_LINUX_SLL, h.data, c.length);
+  if (l == NULL) return;
+  cursor_copy(&h, offsetof(struct linux_sll_header, source_address), l->sll.addr, sizeof(l->sll.addr));
+  l->sll.ether_type = cursor_u16(&h, offsetof(struct linux_sll_header, ether_type));
+  handle_ether_payload(d, l->sll.ether_type, c.length, c.data);
 }
 #endif
 
@@ -63,30 +64,30 @@ struct null_header {
   u_int32_t af_type;
 };
 
-static void handle_null(uint32_t length, const uint8_t *packet) {
-  struct null_header* null = (struct null_header *)packet;
-  APPLY_OVERHEAD(struct null_header, length, packet);
-
-  DEBUGF("Null packet type: 0x%04x, length: %d", null->af_type, length);
-  PRINTF("Loopback, ");
-  handle_ether_payload(af_to_ethertype(null->af_type), length, packet);
+static void handle_null(struct dissection *d, uint32_t length, const uint8_t *packet) {
+  struct cursor c = cursor_make(packet, length);
+  CURSOR_NEED(c, sizeof(struct null_header));
+  struct cursor h = cursor_pull(&c, sizeof(struct null_header));
+  struct layer *l = dissect_push(d, LAYER_NULL, h.data, c.length);
+  if (l == NULL) return;
+  // In the byte order of the capturing host
+  cursor_copy(&h, offsetof(struct null_header, af_type), &l->null.af, sizeof(l->null.af));
+  l->null.ether_type = af_to_ethertype(l->null.af);
+  handle_ether_payload(d, l->null.ether_type, c.length, c.data);
 }
 #endif
 
 // Ethernet devices
-void handle_ethernet(uint32_t length, const uint8_t *packet) {
-  struct ether_header *ethernet = (struct ether_header *)packet;
-  APPLY_OVERHEAD(struct ether_header, length, packet);
-
-  DEBUGF("Ethernet packet dst: %s, src: %s, type: 0x%04x, length: %d",
-         ether_ntoa((struct ether_addr *)ethernet->ether_dhost),
-         ether_ntoa((struct ether_addr *)ethernet->ether_shost),
-         htons(ethernet->ether_type),
-         length);
-  PRINTF("Ethernet %s -> %s, ",
-         ether_ntoa((struct ether_addr *)ethernet->ether_dhost),
-         ether_ntoa((struct ether_addr *)ethernet->ether_shost));
-  handle_ether_payload(htons(ethernet->ether_type), length, packet);
+void handle_ethernet(struct dissection *d, uint32_t length, const uint8_t *packet) {
+  struct cursor c = cursor_make(packet, length);
+  CURSOR_NEED(c, sizeof(struct ether_header));
+  struct cursor h = cursor_pull(&c, sizeof(struct ether_header));
+  struct layer *l = dissect_push(d, LAYER_ETHERNET, h.data, c.length);
+  if (l == NULL) return;
+  cursor_copy(&h, offsetof(struct ether_header, ether_shost), l->ether.src, ETHER_ADDR_LEN);
+  cursor_copy(&h, offsetof(struct ether_header, ether_dhost), l->ether.dst, ETHER_ADDR_LEN);
+  l->ether.ether_type = cursor_u16(&h, offsetof(struct ether_header, ether_type));
+  handle_ether_payload(d, l->ether.ether_type, c.length, c.data);
 }
 
 static link_handler handlers[] = {
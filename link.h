@@ -3,8 +3,11 @@
 
 #include <stdint.h>
 
-void handle_ethernet(uint32_t length, const uint8_t *packet);
-typedef void(*link_handler)(const uint32_t, const uint8_t*);
+#include "dissect.h"
+
+void handle_ethernet(struct dissection *d, uint32_t length, const uint8_t *packet);
+typedef void(*link_handler)(struct dissection *, const uint32_t, const uint8_t*);
 link_handler resolve_link_handler(const uint16_t);
+uint16_t af_to_ethertype(uint16_t af);
 
 #endif
@@ -0,0 +1,259 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "context.h"
+#include "dissect.h"
+#include "log.h"
+#include "output.h"
+#include "util.h"
+
+#define RING_MASK (LOG_RING_SLOTS - 1)
+
+struct log_record {
+  const struct log_site *site;
+  uint32_t length;
+  char text[LOG_MESSAGE_SIZE];
+};
+
+struct log_ring {
+  uint32_t head; // written by the producer
+  uint32_t tail; // written by the writer
+  uint64_t dropped;
+  struct log_record records[LOG_RING_SLOTS];
+  struct log_ring *next;
+};
+
+// Rings are never freed: a thread (the IPFIX exporter...) may log until the
+// very end
+static struct log_ring *rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct log_ring *thread_ring = NULL;
+
+// Sites that suppressed messages
+static struct log_site *sites = NULL;
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Held by whoever empties the rings: the writer, or a synchronous message
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static int running = 0;
+static int stopping = 0;
+static pthread_t writer;
+
+static void write_all(const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(STDERR_FILENO, data, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+// Messages waiting to be written, under log_lock
+static char pending[65536];
+static size_t pending_len = 0;
+
+static void put(const char *data, size_t len) {
+  if (pending_len + len > sizeof(pending)) {
+    write_all(pending, pending_len);
+    pending_len = 0;
+  }
+  if (len > sizeof(pending)) {
+    write_all(data, len);
+    return;
+  }
+  memcpy(pending + pending_len, data, len);
+  pending_len += len;
+}
+
+static void put_counted(const char *prefix, uint64_t count, const char *what) {
+  char line[512];
+  int n = snprintf(line, sizeof(line), "%s%" PRIu64 " %s\n", prefix, count, what);
+  if (n > 0) put(line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+}
+
+// Writes the records of all the rings, and the suppressed messages of the
+// sites whose second is over (all of them when `all')
+static void drain(int all) {
+  uint64_t now = output_now() / 1000;
+  for (struct log_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+    uint32_t tail = r->tail;
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    for (; tail != head; tail++) {
+      const struct log_record *record = &r->records[tail & RING_MASK];
+      put(record->site->prefix, strlen(record->site->prefix));
+      put(record->text, record->length);
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+    uint64_t dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0)
+      put_counted(LEVEL_FMT(WARN) "\t" LOC_FMT "\t", dropped, "log messages dropped, the ring was full");
+  }
+
+  pthread_mutex_lock(&sites_lock);
+  for (struct log_site *site = sites; site != NULL; site = site->next) {
+    if (!all && __atomic_load_n(&site->window, __ATOMIC_RELAXED) >= now) continue;
+    uint64_t suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    if (suppressed > 0)
+      put_counted(site->prefix, suppressed, "similar messages suppressed");
+  }
+  pthread_mutex_unlock(&sites_lock);
+
+  write_all(pending, pending_len);
+  pending_len = 0;
+}
+
+// Whether a warning is in the burst of its site for this second
+static int admit(struct log_site *site) {
+  uint64_t now = output_now() / 1000;
+  uint64_t window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+  if (window != now &&
+      __atomic_compare_exchange_n(&site->window, &window, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+  if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) <= LOG_BURST)
+    return 1;
+
+  __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+  if (!__atomic_load_n(&site->listed, __ATOMIC_RELAXED) &&
+      !__atomic_exchange_n(&site->listed, 1, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&sites_lock);
+    site->next = sites;
+    sites = site;
+    pthread_mutex_unlock(&sites_lock);
+  }
+  return 0;
+}
+
+static struct log_ring *get_ring(void) {
+  if (thread_ring != NULL) return thread_ring;
+
+  struct log_ring *r = calloc(1, sizeof(struct log_ring));
+  if (r == NULL) return NULL;
+  pthread_mutex_lock(&rings_lock);
+  r->next = rings;
+  __atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&rings_lock);
+  thread_ring = r;
+  return r;
+}
+
+// To the sink of the context of a library user (mydump.h)
+static void emit_to_sink(struct mydump_context *c, struct log_site *site,
+                         const char *fmt, va_list ap) {
+  char text[1024];
+  int n = vsnprintf(text, sizeof(text), fmt, ap);
+  if (n < 0) return;
+  c->log(c->log_user, site->level, text);
+}
+
+void log_emit(struct log_site *site, const char *fmt, ...) {
+  va_list ap;
+  struct mydump_context *c = bound_context;
+  if (c != NULL && c->log != NULL) {
+    va_start(ap, fmt);
+    emit_to_sink(c, site, fmt, ap);
+    va_end(ap);
+    return;
+  }
+
+  if (c != NULL && c->decoding != NULL && site->level == LEVEL_WARN) {
+    va_start(ap, fmt);
+    int kept = dissect_keep_warning(c->decoding, site, fmt, ap);
+    va_end(ap);
+    if (kept) return;
+  }
+
+  int async = __atomic_load_n(&running, __ATOMIC_ACQUIRE);
+  if (async && site->level == LEVEL_WARN && !admit(site))
+    return;
+
+  struct log_ring *r = NULL;
+  if (async && site->level > LEVEL_ERROR)
+    r = get_ring();
+  if (r == NULL) {
+    char text[1024];
+    va_start(ap, fmt);
+    int n = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    pthread_mutex_lock(&log_lock);
+    drain(0);
+    put(site->prefix, strlen(site->prefix));
+    put(text, (size_t)n < sizeof(text) ? (size_t)n : sizeof(text) - 1);
+    write_all(pending, pending_len);
+    pending_len = 0;
+    pthread_mutex_unlock(&log_lock);
+    return;
+  }
+
+  uint32_t head = r->head;
+  if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+    __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  struct log_record *record = &r->records[head & RING_MASK];
+  va_start(ap, fmt);
+  int n = vsnprintf(record->text, sizeof(record->text), fmt, ap);
+  va_end(ap);
+  if (n < 0) return;
+  if ((size_t)n >= sizeof(record->text)) {
+    // Truncated, still a line
+    n = sizeof(record->text) - 1;
+    record->text[n - 1] = '\n';
+  }
+  record->site = site;
+  record->length = n;
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void *writer_main(void *arg) {
+  (void)arg;
+  struct timespec interval = { 0, LOG_FLUSH_INTERVAL * 1000000 };
+  while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+    nanosleep(&interval, NULL);
+    pthread_mutex_lock(&log_lock);
+    drain(0);
+    pthread_mutex_unlock(&log_lock);
+  }
+  return NULL;
+}
+
+int log_start(void) {
+  if (get_log_level() >= LEVEL_DEBUG)
+    return 0;
+
+  // SIGINT and SIGTERM are for the capture thread, to break its loop
+  sigset_t signals, saved;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &saved);
+  int err = pthread_create(&writer, NULL, writer_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  if (err != 0)
+    return -1;
+  __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void log_stop(void) {
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return;
+  __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(writer, NULL);
+
+  pthread_mutex_lock(&log_lock);
+  drain(1);
+  pthread_mutex_unlock(&log_lock);
+}
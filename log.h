@@ -0,0 +1,41 @@
+#ifndef __LOG_H
+#define __LOG_H
+
+#include <stdint.h>
+
+// Backend of the LOG macros of util.h. Once log_start is called, a message is
+// formatted by the thread that logs it into a record of its own ring (single
+// producer, single consumer, no lock), and a writer thread writes the records
+// of all the rings on stderr every LOG_FLUSH_INTERVAL ms. A full ring drops
+// the message and counts it instead of waiting.
+//
+// Each call site is a `struct log_site', which also rate-limits the warnings:
+// past LOG_BURST messages in a second from the same site, the next ones are
+// only counted, and the writer reports how many were suppressed.
+//
+// FATAL and ERROR, and everything before log_start or after log_stop, are
+// written right away, after the records waiting in the rings.
+#define LOG_RING_SLOTS 256 // power of two
+#define LOG_MESSAGE_SIZE 240
+#define LOG_FLUSH_INTERVAL 50
+#define LOG_BURST 10
+
+struct log_site {
+  int level;
+  const char *prefix; // level, file and line
+  uint64_t window; // second of the current burst
+  uint32_t count; // messages in that second
+  uint64_t suppressed; // since last reported
+  int listed;
+  struct log_site *next;
+};
+
+void log_emit(struct log_site *site, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Starts the writer thread. Traces (debug level) stay synchronous.
+int log_start(void);
+
+// Writes what is left and stops the writer thread
+void log_stop(void);
+
+#endif
@@ -1,18 +1,46 @@
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <pcap.h>
 #include <pcap/pcap.h>
 #include <arpa/inet.h>
 #include <net/ethernet.h>
+#include <net/if.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 
 #include "aftypes.h"
+#include "arrow.h"
+#include "batch.h"
+#include "capture.h"
+#include "checksum.h"
+#include "ether.h"
+#include "fanout.h"
+#include "flowtable.h"
+#include "frag.h"
+#include "ipfix.h"
 #include "link.h"
+#include "log.h"
+#include "mydump.h"
+#include "offline.h"
+#include "output.h"
+#include "pcapfile.h"
+#include "profile.h"
+#include "pipeline.h"
+#include "render.h"
+#include "sketch.h"
+#include "stats.h"
+#include "stream.h"
+#include "tpacket.h"
 #include "util.h"
 
 enum mode {
@@ -22,45 +50,326 @@ enum mode {
 };
 
 char errbuf[PCAP_ERRBUF_SIZE];
-pcap_t* open_capture(enum mode mode, const char *arg) {
+struct capture* open_capture(enum mode mode, const char *arg,
+                             const struct tpacket_config *tpacket,
+                             unsigned fanout, enum fanout_mode fanout_mode) {
   errbuf[0] = '\0'; // reset the error buffer
   if (arg == NULL) return NULL;
   switch (mode) {
     case M_LIVE:
       DEBUGF("Opening live device `%s'", arg);
-      return pcap_open_live(arg, 9000, 1, 1000, errbuf);
+      if (fanout > 0)
+        return fanout_open(arg, tpacket, fanout, fanout_mode, errbuf);
+      if (tpacket != NULL)
+        return tpacket_open(arg, tpacket, errbuf);
+      return capture_open_live(arg, errbuf);
     case M_OFFLINE:
+    {
       DEBUGF("Opening offline file `%s'", arg);
-      return pcap_open_offline(arg, errbuf);
+      struct capture *capture = pcapfile_open(arg, errbuf);
+      if (capture != NULL)
+        return capture;
+      // Not something the native reader handles (pipe, other format...)
+      DEBUGF("Falling back to libpcap: %s", errbuf);
+      errbuf[0] = '\0';
+      return capture_open_offline(arg, errbuf);
+    }
     default:
       return NULL;
   }
 }
 
 void got_packet(uint8_t *args, const struct pcap_pkthdr *header, const uint8_t *packet) {
-  link_handler handler = (link_handler)args;
-  handler(header->caplen, packet);
-  indent_reset();
-  PRINTF("\n");
-  fflush(stdout);
+  int link_type = (int)(uintptr_t)args;
+  struct dissection *d = mydump_decode(NULL, link_type, header, packet);
+  PROFILE_CALL(PROFILE_RENDER, 0, render_packet(header, d));
+  flowtable_packet(header, d);
+  sketch_packet(header, d);
+  stats_packet(header, d);
+  output_packet_end();
+}
+
+// When nothing is printed: the packets of a batch are decoded class by class,
+// see batch.h. Only within a second of capture time, so that the sketch
+// intervals still end between the packets they did.
+static void got_batch(uint8_t *args, unsigned count, const struct pcap_pkthdr *headers,
+                      const uint8_t *const *packets) {
+  struct batch batch;
+  for (unsigned start = 0, end; start < count; start = end) {
+    for (end = start + 1; end < count && headers[end].ts.tv_sec == headers[start].ts.tv_sec; end++)
+      ;
+    batch_classify(&batch, (int)(uintptr_t)args, end - start, headers + start, packets + start);
+    batch_dispatch(&batch, got_packet, args);
+  }
+}
+
+static struct capture *running_capture = NULL;
+static void stop_capture(int sig) {
+  (void)sig;
+  if (running_capture != NULL)
+    running_capture->breakloop(running_capture);
+  offline_stop();
+}
+
+static void report_decoding(void) {
+  struct checksum_stats sums;
+  checksum_stats(&sums);
+  for (unsigned p = 0; p < CHECKSUM_PROTOCOLS; p++) {
+    if (sums.verified[p] > 0)
+      INFOF("%" PRIu64 " %s checksums verified, %" PRIu64 " bad, %" PRIu64 " offloaded",
+            sums.verified[p], checksum_names[p], sums.bad[p], sums.offloaded[p]);
+    if (sums.bad[p] > 0)
+      WARNF("%" PRIu64 " bad %s checksums", sums.bad[p], checksum_names[p]);
+  }
+
+  struct ipv6_ext_stats ext;
+  ipv6_ext_stats(&ext);
+  if (ext.packets > 0) {
+    INFOF("%" PRIu64 " IPv6 packets with extension headers, %" PRIu64 " with too many",
+          ext.packets, ext.too_deep);
+    for (unsigned i = 1; i < IPV6_EXT_KINDS; i++)
+      if (ext.headers[i] > 0)
+        INFOF("  %" PRIu64 " %s headers", ext.headers[i], ipv6_ext_names[i]);
+  }
+
+  struct frag_stats frags;
+  frag_stats(&frags);
+  INFOF("%" PRIu64 " IP fragments, %" PRIu64 " datagrams reassembled, %" PRIu64 " timed out, %" PRIu64 " evicted",
+        frags.fragments, frags.datagrams, frags.timeouts, frags.evictions);
+  if (frags.overlaps > 0 || frags.invalid > 0)
+    WARNF("%" PRIu64 " IP datagrams dropped for inconsistent overlaps, %" PRIu64 " invalid fragments",
+          frags.overlaps, frags.invalid);
+
+  struct flowtable_stats flows;
+  flowtable_stats(&flows);
+  if (flows.flows > 0)
+    INFOF("%" PRIu64 " flows, %" PRIu64 " expired, %" PRIu64 " evicted",
+          flows.flows, flows.expired, flows.evictions);
+  if (flows.evictions > 0)
+    WARNF("%" PRIu64 " flows evicted before their end, raise --flow-memory", flows.evictions);
+
+  struct ipfix_stats ipfix;
+  ipfix_stats(&ipfix);
+  if (ipfix.messages > 0 || ipfix.dropped > 0)
+    INFOF("%" PRIu64 " IPFIX messages, %" PRIu64 " records exported", ipfix.messages, ipfix.records);
+  if (ipfix.dropped > 0)
+    WARNF("%" PRIu64 " IPFIX records dropped", ipfix.dropped);
+
+  struct stream_stats stats;
+  stream_stats(&stats);
+  INFOF("%" PRIu64 " TCP connections, %" PRIu64 " closed, %" PRIu64 " timed out, %" PRIu64 " evicted",
+        stats.connections, stats.closed, stats.timeouts, stats.evictions);
+  INFOF("%" PRIu64 " TCP segments out of order, %" PRIu64 " retransmitted, %" PRIu64 " dropped, %" PRIu64 " gaps",
+        stats.out_of_order, stats.retransmissions, stats.drops, stats.gaps);
+  if (stats.drops > 0)
+    WARNF("%" PRIu64 " TCP segments could not be buffered, raise --tcp-memory", stats.drops);
+}
+
+// Decodes the files on the offline pool, see offline.h
+static int run_offline(char **files, unsigned count, const char *filter,
+                       unsigned jobs, size_t chunk_size, unsigned stats_interval) {
+  struct offline_file *offline = calloc(count, sizeof(struct offline_file));
+  if (offline == NULL) {
+    FATAL("Out of memory");
+    abort();
+  }
+
+  for (unsigned i = 0; i < count; i++) {
+    struct capture *capture = open_capture(M_OFFLINE, files[i], NULL, 0, FANOUT_HASH);
+    if (capture == NULL) {
+      FATALF("%s", errbuf);
+      abort();
+    }
+    if (errbuf[0] != 0) {
+      WARNF("%s", errbuf);
+    }
+    if (filter != NULL && capture_set_filter(capture, filter, errbuf) < 0) {
+      FATALF("%s", errbuf);
+      abort();
+    }
+
+    uint16_t link_type = capture->datalink(capture);
+    offline[i].capture = capture;
+    offline[i].link_type = link_type;
+    if (resolve_link_handler(link_type) == NULL) {
+      ERRORF("Unsupported link type %d in `%s'", link_type, files[i]);
+      abort();
+    }
+  }
+
+  signal(SIGINT, stop_capture);
+  signal(SIGTERM, stop_capture);
+
+  if (stats_interval > 0 && stats_start(stats_interval, NULL) < 0) {
+    FATAL("Could not start the statistics thread");
+    abort();
+  }
+
+  INFOF("Decoding %u files with %u jobs", count, jobs);
+  struct offline_stats stats;
+  if (offline_run(offline, count, jobs, chunk_size, &stats) < 0) {
+    FATAL("Could not start the decoding jobs");
+    abort();
+  }
+  stats_stop();
+  log_stop();
+  render_finish();
+  flowtable_finish();
+  ipfix_finish();
+  sketch_finish();
+  report_decoding();
+  profile_report();
+
+  double mb = stats.bytes / 1e6;
+  double seconds = stats.seconds > 0 ? stats.seconds : 1e-9;
+  fprintf(stderr, "%" PRIu64 " packets, %.1f MB in %.3f s (%u chunks): "
+          "%.0f packets/s, %.1f MB/s\n", stats.packets, mb, stats.seconds,
+          stats.chunks, stats.packets / seconds, mb / seconds);
+
+  for (unsigned i = 0; i < count; i++)
+    offline[i].capture->close(offline[i].capture);
+  free(offline);
+  free(files);
+  return 0;
 }
 
+void usage (char *progname) __attribute__((noreturn));
 void usage (char *progname) {
-  fprintf(stderr, "usage: %s <-i interface|-o file> [-f filter] [-v]\n", progname);
+  fprintf(stderr,
+          "usage: %s <-i interface|-o file...> [-f filter] [-w workers] [-r ring slots] [-v]\n"
+          "          [-j jobs [--chunk-size bytes]]\n"
+          "          [--format text|json|binary|arrow [--batch-rows rows]]\n"
+          "          [--flush full|interval|packet] [--flush-interval ms] [--output-buffer bytes]\n"
+          "          [--tpacket [--block-size bytes] [--block-count n] [--block-timeout ms]]\n"
+          "          [--fanout sockets [--fanout-mode hash|cpu|rr]] [--tcp-memory bytes] [--frag-memory bytes]\n"
+          "          [--flows file] [--top flows [--top-interval s]] [--flow-memory bytes]\n"
+          "          [--sketch seconds] [--ipfix collector|--ipfix-file file [--ipfix-mtu bytes]]\n"
+          "          [--stats seconds] [--decode-as udp|tcp:port=decoder...]\n"
+          "          [--verify-checksums [--checksum-offload]]\n",
+          progname);
   exit(EXIT_FAILURE);
 }
 
+#define SHORT_OPTIONS "i:o:f:w:r:j:v"
+enum {
+  OPT_TPACKET = 0x100,
+  OPT_BLOCK_SIZE,
+  OPT_BLOCK_COUNT,
+  OPT_BLOCK_TIMEOUT,
+  OPT_FANOUT,
+  OPT_FANOUT_MODE,
+  OPT_CHUNK_SIZE,
+  OPT_FLUSH,
+  OPT_FLUSH_INTERVAL,
+  OPT_OUTPUT_BUFFER,
+  OPT_FORMAT,
+  OPT_BATCH_ROWS,
+  OPT_TCP_MEMORY,
+  OPT_FRAG_MEMORY,
+  OPT_FLOWS,
+  OPT_TOP,
+  OPT_TOP_INTERVAL,
+  OPT_FLOW_MEMORY,
+  OPT_SKETCH,
+  OPT_IPFIX,
+  OPT_IPFIX_FILE,
+  OPT_IPFIX_MTU,
+  OPT_STATS,
+  OPT_DECODE_AS,
+  OPT_VERIFY_CHECKSUMS,
+  OPT_CHECKSUM_OFFLOAD,
+};
+
+static struct option long_options[] = {
+  { "interface",     required_argument, NULL, 'i' },
+  { "offline",       required_argument, NULL, 'o' },
+  { "filter",        required_argument, NULL, 'f' },
+  { "workers",       required_argument, NULL, 'w' },
+  { "ring-slots",    required_argument, NULL, 'r' },
+  { "jobs",          required_argument, NULL, 'j' },
+  { "verbose",       no_argument,       NULL, 'v' },
+  { "tpacket",       no_argument,       NULL, OPT_TPACKET },
+  { "block-size",    required_argument, NULL, OPT_BLOCK_SIZE },
+  { "block-count",   required_argument, NULL, OPT_BLOCK_COUNT },
+  { "block-timeout", required_argument, NULL, OPT_BLOCK_TIMEOUT },
+  { "fanout",        required_argument, NULL, OPT_FANOUT },
+  { "fanout-mode",   required_argument, NULL, OPT_FANOUT_MODE },
+  { "chunk-size",    required_argument, NULL, OPT_CHUNK_SIZE },
+  { "flush",         required_argument, NULL, OPT_FLUSH },
+  { "flush-interval", required_argument, NULL, OPT_FLUSH_INTERVAL },
+  { "output-buffer", required_argument, NULL, OPT_OUTPUT_BUFFER },
+  { "format",        required_argument, NULL, OPT_FORMAT },
+  { "batch-rows",    required_argument, NULL, OPT_BATCH_ROWS },
+  { "tcp-memory",    required_argument, NULL, OPT_TCP_MEMORY },
+  { "frag-memory",   required_argument, NULL, OPT_FRAG_MEMORY },
+  { "flows",         required_argument, NULL, OPT_FLOWS },
+  { "top",           required_argument, NULL, OPT_TOP },
+  { "top-interval",  required_argument, NULL, OPT_TOP_INTERVAL },
+  { "flow-memory",   required_argument, NULL, OPT_FLOW_MEMORY },
+  { "sketch",        required_argument, NULL, OPT_SKETCH },
+  { "ipfix",         required_argument, NULL, OPT_IPFIX },
+  { "ipfix-file",    required_argument, NULL, OPT_IPFIX_FILE },
+  { "ipfix-mtu",     required_argument, NULL, OPT_IPFIX_MTU },
+  { "stats",         required_argument, NULL, OPT_STATS },
+  { "decode-as",     required_argument, NULL, OPT_DECODE_AS },
+  { "verify-checksums", no_argument,    NULL, OPT_VERIFY_CHECKSUMS },
+  { "checksum-offload", no_argument,    NULL, OPT_CHECKSUM_OFFLOAD },
+  { NULL, 0, NULL, 0 }
+};
+
 int main (int argc, char **argv) {
   enum mode mode = M_NONE;
   char *mode_arg = NULL;
   char *filter = NULL;
   char verbose = LEVEL_WARN;
+  unsigned workers = 0;
+  unsigned ring_slots = 4096;
+  int use_tpacket = 0;
+  struct tpacket_config tpacket = {
+    .block_size = TPACKET_DEFAULT_BLOCK_SIZE,
+    .block_count = TPACKET_DEFAULT_BLOCK_COUNT,
+    .block_timeout = TPACKET_DEFAULT_BLOCK_TIMEOUT,
+  };
+  unsigned fanout = 0;
+  enum fanout_mode fanout_mode = FANOUT_HASH;
+  unsigned jobs = 0;
+  size_t chunk_size = OFFLINE_DEFAULT_CHUNK_SIZE;
+  // Every -o file, in order
+  char **files = calloc(argc, sizeof(char *));
+  unsigned file_count = 0;
+  // Every --decode-as, applied once the default decoders are in place
+  char **decode_as = calloc(argc, sizeof(char *));
+  unsigned decode_as_count = 0;
+  int flush_policy = -1;
+  struct output_config output = {
+    .interval = OUTPUT_DEFAULT_INTERVAL,
+    .buffer_size = OUTPUT_DEFAULT_BUFFER_SIZE,
+  };
+  struct render_config render = {
+    .format = OUTPUT_TEXT,
+    .batch_rows = ARROW_DEFAULT_BATCH_ROWS,
+  };
+  size_t tcp_memory = STREAM_DEFAULT_MEMORY;
+  size_t frag_memory = FRAG_DEFAULT_MEMORY;
+  char *flows_file = NULL;
+  unsigned sketch_interval = 0;
+  unsigned stats_interval = 0;
+  int verify_checksums = 0;
+  int checksum_offload = 0;
+  struct ipfix_config ipfix = {
+    .mtu = IPFIX_DEFAULT_MTU,
+  };
+  struct flowtable_config flows = {
+    .memory = FLOWTABLE_DEFAULT_MEMORY,
+    .records_fd = -1,
+    .top_interval = FLOWTABLE_DEFAULT_TOP_INTERVAL,
+  };
 
   int c;
 
   opterr = 0;
 
-  while ((c = getopt (argc, argv, "i:o:f:v")) != -1)
+  while ((c = getopt_long (argc, argv, SHORT_OPTIONS, long_options, NULL)) != -1)
     switch (c) {
       case 'i':
         mode = M_LIVE;
@@ -69,16 +378,145 @@ int main (int argc, char **argv) {
       case 'o':
         mode = M_OFFLINE;
         mode_arg = optarg;
+        files[file_count++] = optarg;
         break;
       case 'f':
         filter = optarg;
         break;
+      case 'w':
+        workers = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        ring_slots = strtoul(optarg, NULL, 10);
+        break;
+      case 'j':
+        jobs = strtoul(optarg, NULL, 10);
+        break;
       case 'v':
         verbose++;
         set_log_level(verbose);
         break;
+      case OPT_TPACKET:
+        use_tpacket = 1;
+        break;
+      case OPT_BLOCK_SIZE:
+        tpacket.block_size = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_BLOCK_COUNT:
+        tpacket.block_count = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_BLOCK_TIMEOUT:
+        tpacket.block_timeout = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_FANOUT:
+        fanout = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_CHUNK_SIZE:
+        chunk_size = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_FLUSH:
+        if (strcmp(optarg, "full") == 0) {
+          flush_policy = FLUSH_FULL;
+        } else if (strcmp(optarg, "interval") == 0) {
+          flush_policy = FLUSH_INTERVAL;
+        } else if (strcmp(optarg, "packet") == 0) {
+          flush_policy = FLUSH_PACKET;
+        } else {
+          ERRORF("Unknown flush policy `%s'.", optarg);
+          usage (argv[0]);
+        }
+        break;
+      case OPT_FLUSH_INTERVAL:
+        output.interval = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_OUTPUT_BUFFER:
+        output.buffer_size = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_FORMAT:
+        if (strcmp(optarg, "text") == 0) {
+          render.format = OUTPUT_TEXT;
+        } else if (strcmp(optarg, "json") == 0) {
+          render.format = OUTPUT_JSON;
+        } else if (strcmp(optarg, "binary") == 0) {
+          render.format = OUTPUT_BINARY;
+        } else if (strcmp(optarg, "arrow") == 0) {
+          render.format = OUTPUT_ARROW;
+        } else {
+          ERRORF("Unknown output format `%s'.", optarg);
+          usage (argv[0]);
+        }
+        break;
+      case OPT_BATCH_ROWS:
+        render.batch_rows = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_TCP_MEMORY:
+        tcp_memory = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_FRAG_MEMORY:
+        frag_memory = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_FLOWS:
+        flows_file = optarg;
+        break;
+      case OPT_TOP:
+        flows.top = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_TOP_INTERVAL:
+        flows.top_interval = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_FLOW_MEMORY:
+        flows.memory = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_IPFIX:
+        ipfix.collector = optarg;
+        break;
+      case OPT_IPFIX_FILE:
+        ipfix.file = optarg;
+        break;
+      case OPT_IPFIX_MTU:
+        ipfix.mtu = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_SKETCH:
+        sketch_interval = strtoul(optarg, NULL, 10);
+        if (sketch_interval == 0) {
+          ERROR("--sketch must be positive");
+          usage (argv[0]);
+        }
+        break;
+      case OPT_STATS:
+        stats_interval = strtoul(optarg, NULL, 10);
+        if (stats_interval == 0) {
+          ERROR("--stats must be positive");
+          usage (argv[0]);
+        }
+        break;
+      case OPT_DECODE_AS:
+        decode_as[decode_as_count++] = optarg;
+        break;
+      case OPT_VERIFY_CHECKSUMS:
+        verify_checksums = 1;
+        break;
+      case OPT_CHECKSUM_OFFLOAD:
+        checksum_offload = 1;
+        break;
+      case OPT_FANOUT_MODE:
+        if (strcmp(optarg, "hash") == 0) {
+          fanout_mode = FANOUT_HASH;
+        } else if (strcmp(optarg, "cpu") == 0) {
+          fanout_mode = FANOUT_CPU;
+        } else if (strcmp(optarg, "rr") == 0) {
+          fanout_mode = FANOUT_RR;
+        } else {
+          ERRORF("Unknown fanout mode `%s'.", optarg);
+          usage (argv[0]);
+        }
+        break;
       case '?':
-        if (optopt == 'i' || optopt == 'o' || optopt == 'f') {
+        if (optopt == 0) {
+          ERRORF("Unknown option `%s'.", argv[optind - 1]);
+        } else if (optopt >= 0x100) {
+          ERRORF("Option `%s' requires an argument.", argv[optind - 1]);
+        } else if (strchr(SHORT_OPTIONS, optopt) != NULL) {
           ERRORF("Option -%c requires an argument.\n", optopt);
         } else if (isprint (optopt)) {
           ERRORF("Unknown option `-%c'.", optopt);
@@ -95,7 +533,112 @@ int main (int argc, char **argv) {
   if (mode == M_NONE || optind > argc)
     usage (argv[0]);
 
-  pcap_t* capture = open_capture(mode, mode_arg);
+  // Each fanout socket has its own capture and decoding thread
+  if (fanout > 0 && (mode != M_LIVE || workers > 0)) {
+    ERROR("--fanout only works on live captures, without -w");
+    usage (argv[0]);
+  }
+
+  // By default, a terminal sees each packet as soon as it is decoded, a live
+  // capture at least every interval, and files are written by big blocks.
+  if (flush_policy >= 0)
+    output.policy = flush_policy;
+  else if (isatty(STDOUT_FILENO))
+    output.policy = FLUSH_PACKET;
+  else
+    output.policy = mode == M_LIVE ? FLUSH_INTERVAL : FLUSH_FULL;
+  // The summaries and the flow export replace the output of each packet
+  int use_ipfix = ipfix.collector != NULL || ipfix.file != NULL;
+  if (sketch_interval > 0 || use_ipfix)
+    render.format = OUTPUT_NONE;
+  if (ipfix.collector != NULL && ipfix.file != NULL) {
+    ERROR("--ipfix and --ipfix-file can not be used together");
+    usage (argv[0]);
+  }
+  if (checksum_offload && !verify_checksums) {
+    ERROR("--checksum-offload only works with --verify-checksums");
+    usage (argv[0]);
+  }
+
+  // Batches are per thread, and only flushed at the end of the capture or of
+  // an offline chunk: the pipeline and fanout threads have no such point.
+  if (render.format == OUTPUT_ARROW && (workers > 0 || fanout > 0)) {
+    ERROR("--format arrow does not work with -w or --fanout");
+    usage (argv[0]);
+  }
+  // The jobs decode different parts of the capture at once: a sketch interval
+  // would end when the first of them gets past it.
+  if (sketch_interval > 0 && jobs > 1) {
+    ERROR("--sketch does not work with -j");
+    usage (argv[0]);
+  }
+  if (render.batch_rows == 0) {
+    ERROR("--batch-rows must be positive");
+    usage (argv[0]);
+  }
+
+  output_init(STDOUT_FILENO, &output);
+  // From here, warnings no longer wait for stderr
+  if (log_start() < 0) {
+    FATAL("Could not start the logging thread");
+    abort();
+  }
+  render_init(&render);
+  mydump_init(tcp_memory, frag_memory);
+  for (unsigned i = 0; i < decode_as_count; i++)
+    if (mydump_decode_as(decode_as[i]) < 0) {
+      ERRORF("Bad --decode-as `%s'.", decode_as[i]);
+      usage (argv[0]);
+    }
+  free(decode_as);
+  if (verify_checksums) {
+    mydump_verify_checksums(checksum_offload);
+    INFOF("Verifying checksums with %s", checksum_implementation);
+  }
+
+  // Several files are decoded one after the other on the offline pool
+  if (mode == M_OFFLINE && file_count > 1 && jobs == 0)
+    jobs = 1;
+
+  // The flow table memory is shared by the decoding threads
+  if (flows_file != NULL) {
+    flows.records_fd = open(flows_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (flows.records_fd < 0) {
+      FATALF("Could not open `%s': %s", flows_file, strerror(errno));
+      abort();
+    }
+  }
+  if (flows.top_interval == 0) {
+    ERROR("--top-interval must be positive");
+    usage (argv[0]);
+  }
+  flows.threads = workers > 0 ? workers : jobs > 0 ? jobs : fanout > 0 ? fanout : 1;
+  sketch_init(sketch_interval, flows.threads);
+  if (use_ipfix) {
+    // Each interface is its own observation domain
+    ipfix.domain = mode == M_LIVE ? if_nametoindex(mode_arg) : 0;
+    if (ipfix_init(&ipfix) < 0) {
+      FATAL("Could not start the IPFIX export");
+      abort();
+    }
+    flows.exporter = ipfix_flow;
+  }
+  flowtable_init(&flows);
+  if (jobs > 0) {
+    if (mode != M_OFFLINE || workers > 0) {
+      ERROR("-j only works on offline captures, without -w");
+      usage (argv[0]);
+    }
+    if (chunk_size == 0) {
+      ERROR("--chunk-size must be positive");
+      usage (argv[0]);
+    }
+    return run_offline(files, file_count, filter, jobs, chunk_size, stats_interval);
+  }
+  free(files);
+
+  struct capture* capture = open_capture(mode, mode_arg, use_tpacket || fanout ? &tpacket : NULL,
+                                         fanout, fanout_mode);
   if (capture == NULL) {
     FATALF("%s", errbuf);
     abort();
@@ -106,35 +649,72 @@ int main (int argc, char **argv) {
     WARNF("%s", errbuf);
   }
 
-  if (filter != NULL) {
-    struct bpf_program fp;
-    DEBUGF("Compiling filter `%s'", filter);
-    // TODO: check for netmask
-    if (pcap_compile(capture, &fp, filter, 1, PCAP_NETMASK_UNKNOWN) == PCAP_ERROR) {
-      FATALF("%s", pcap_geterr(capture));
-      abort();
-    }
-
-    DEBUG("Applying filter");
-    if (pcap_setfilter(capture, &fp) == PCAP_ERROR) {
-      FATALF("%s", pcap_geterr(capture));
-      abort();
-    }
+  if (filter != NULL && capture_set_filter(capture, filter, errbuf) < 0) {
+    FATALF("%s", errbuf);
+    abort();
   }
 
-  uint16_t link_type = pcap_datalink(capture);
-  link_handler handler = resolve_link_handler(link_type);
-  if (handler == NULL) {
+  uint16_t link_type = capture->datalink(capture);
+  if (resolve_link_handler(link_type) == NULL) {
     ERRORF("Unsupported link type %d", link_type);
     abort();
   }
 
-  // TODO: handle singals
+  running_capture = capture;
+  signal(SIGINT, stop_capture);
+  signal(SIGTERM, stop_capture);
+
+  // Files have no kernel counters
+  if (stats_interval > 0 && stats_start(stats_interval, mode == M_LIVE ? capture : NULL) < 0) {
+    FATAL("Could not start the statistics thread");
+    abort();
+  }
+
   INFO("Starting loop");
-  pcap_loop(capture, -1, got_packet, (void *)handler);
+  if (workers > 0) {
+    // The capture thread only copies the packets, they are decoded by the
+    // workers. Live captures drop packets instead of waiting for the workers.
+    struct pipeline *pipeline = pipeline_create(link_type, workers, ring_slots, mode == M_LIVE);
+    if (pipeline == NULL) {
+      FATAL("Could not create the decoding pipeline");
+      abort();
+    }
+    capture->loop(capture, pipeline_push, (void *)pipeline);
+
+    struct pipeline_stats stats;
+    pipeline_destroy(pipeline, &stats);
+    INFOF("%" PRIu64 " packets captured, %" PRIu64 " dropped (ring full)",
+          stats.captured, stats.ring_drops);
+    if (stats.ring_drops > 0)
+      WARNF("%" PRIu64 " packets dropped because the decoding ring was full", stats.ring_drops);
+  } else if (render.format == OUTPUT_NONE) {
+    capture_loop_batch(capture, got_batch, (void *)(uintptr_t)link_type);
+  } else {
+    // Fanout threads each have their own output buffer
+    capture->loop(capture, got_packet, (void *)(uintptr_t)link_type);
+  }
+  stats_stop();
+  log_stop();
+  render_finish();
+  flowtable_finish();
+  ipfix_finish();
+  sketch_finish();
+  report_decoding();
+  profile_report();
+
+  if (mode == M_LIVE) {
+    struct pcap_stat ps;
+    if (capture->stats(capture, &ps) == 0) {
+      INFOF("%u packets received, %u dropped by kernel, %u dropped by interface",
+            ps.ps_recv, ps.ps_drop, ps.ps_ifdrop);
+      if (ps.ps_drop > 0 || ps.ps_ifdrop > 0)
+        WARNF("%u packets dropped by kernel, %u dropped by interface",
+              ps.ps_drop, ps.ps_ifdrop);
+    }
+  }
 
   DEBUG("Closing capture");
-  pcap_close(capture);
+  capture->close(capture);
 
   return 0;
 }
@@ -0,0 +1,147 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "checksum.h"
+#include "context.h"
+#include "ether.h"
+#include "frag.h"
+#include "mydump.h"
+#include "stream.h"
+#include "tcp.h"
+#include "udp.h"
+#include "util.h"
+
+__thread struct mydump_context *bound_context = NULL;
+
+// The contexts of the threads that decode without one of their own
+static __thread struct mydump_context *thread_context = NULL;
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+static void release(struct mydump_context *c) {
+  if (c->frag != NULL) frag_release(c->frag);
+  if (c->stream != NULL) stream_release(c->stream);
+  for (unsigned i = 0; i < ARENA_MAX_BLOCKS; i++)
+    free(c->arena.blocks[i].data);
+  free(c->out.data);
+  free(c);
+}
+
+static void thread_exit(void *arg) {
+  struct mydump_context *c = arg;
+  // Closing the connections may log
+  bound_context = c;
+  release(c);
+  bound_context = NULL;
+  thread_context = NULL;
+}
+
+static void create_key(void) {
+  pthread_key_create(&thread_key, thread_exit);
+}
+
+struct mydump_context *context_thread(void) {
+  if (thread_context != NULL) return thread_context;
+  pthread_once(&thread_once, create_key);
+  struct mydump_context *c = calloc(1, sizeof(struct mydump_context));
+  if (c == NULL) {
+    // Not with the log macros, they need a context
+    fputs("Could not allocate the decoding context\n", stderr);
+    abort();
+  }
+  c->log_level = -1;
+  c->link_type = -1;
+  pthread_setspecific(thread_key, c);
+  thread_context = c;
+  return c;
+}
+
+void mydump_init(size_t tcp_memory, size_t frag_memory) {
+  checksum_init();
+  ether_init();
+  udp_init();
+  tcp_init();
+  stream_init(tcp_memory, resolve_tcp_app);
+  frag_init(frag_memory);
+}
+
+void mydump_verify_checksums(int offload) {
+  checksum_enable(offload);
+}
+
+int mydump_decode_as(const char *spec) {
+  const char *colon = strchr(spec, ':');
+  if (colon == NULL) return -1;
+  char *end;
+  unsigned long port = strtoul(colon + 1, &end, 10);
+  if (end == colon + 1 || *end != '=' || port == 0 || port > 65535) return -1;
+  const char *name = end + 1;
+
+  size_t len = colon - spec;
+  if (len == 3 && strncmp(spec, "udp", 3) == 0)
+    return udp_decode_as(port, name);
+  if (len == 3 && strncmp(spec, "tcp", 3) == 0)
+    return tcp_decode_as(port, name);
+  return -1;
+}
+
+struct mydump_context *mydump_open(const struct mydump_options *options) {
+  struct mydump_context *c = calloc(1, sizeof(struct mydump_context));
+  if (c == NULL) return NULL;
+  c->format = options->format;
+  c->log_level = options->log_level;
+  c->log = options->log;
+  c->log_user = options->log_user;
+  c->link_type = -1;
+  return c;
+}
+
+void mydump_close(struct mydump_context *context) {
+  // Closing the connections may log
+  struct mydump_context *saved = bound_context;
+  bound_context = context;
+  release(context);
+  bound_context = saved;
+}
+
+struct dissection *mydump_decode(struct mydump_context *context, int link_type,
+                                 const struct pcap_pkthdr *header, const uint8_t *packet) {
+  struct mydump_context *saved = bound_context;
+  if (context == NULL)
+    context = context_current();
+  bound_context = context;
+
+  if (context->link_type != link_type) {
+    context->handler = resolve_link_handler(link_type);
+    context->link_type = link_type;
+  }
+  struct dissection *d = NULL;
+  if (context->handler != NULL)
+    d = dissect(context->handler, header, packet);
+  bound_context = saved;
+  return d;
+}
+
+const char *mydump_render(struct mydump_context *context, const struct pcap_pkthdr *header,
+                          const struct dissection *d, size_t *length) {
+  // Unsupported link type
+  if (d == NULL) {
+    *length = 0;
+    return "";
+  }
+
+  struct mydump_context *saved = bound_context;
+  struct out_buffer *saved_out = out_capture;
+  bound_context = context;
+  out_capture = &context->out;
+
+  context->out.len = 0;
+  render_packet_as(context->format, header, d);
+
+  out_capture = saved_out;
+  bound_context = saved;
+  *length = context->out.len;
+  return context->out.data;
+}
@@ -0,0 +1,68 @@
+#ifndef __MYDUMP_H
+#define __MYDUMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pcap/pcap.h>
+
+#include "dissect.h"
+#include "render.h"
+
+// Decoding API of libmydump, which the mydump binary is a client of.
+//
+// A context holds all the state of the decoding: log indentation, the arena
+// of the dissections, the IP fragments and TCP connections being reassembled,
+// and the rendered output. Contexts are independent: each thread can decode
+// with its own, and one thread can use several. A context must not be used by
+// two threads at once.
+//
+// What stays shared by the process: the memory budgets of the reassembly
+// (mydump_init), the decoders of the ports (mydump_decode_as), checksum
+// verification (mydump_verify_checksums) and the counters of frag_stats,
+// stream_stats, checksum_stats and stats.h.
+
+// Receives the messages logged while decoding with a context, formatted and
+// with their newline, instead of stderr
+typedef void (*mydump_log_sink)(void *user, int level, const char *message);
+
+struct mydump_options {
+  enum output_format format; // of mydump_render: text, JSON or binary records
+  int log_level; // LEVEL_* (util.h), -1 for the level of the process
+  mydump_log_sink log; // NULL for stderr
+  void *log_user;
+};
+
+// Once, before any packet is decoded: memory of the TCP reassembly and of the
+// IP fragments, for all the contexts together
+void mydump_init(size_t tcp_memory, size_t frag_memory);
+
+// After mydump_init and before any packet is decoded: decodes a port with
+// another decoder than the default, from a spec like `udp:5353=dns' or
+// `udp:8472=vxlan' (see udp_decode_as, tcp_decode_as). Returns -1 for a bad
+// spec, an unknown decoder, or too many ports.
+int mydump_decode_as(const char *spec);
+
+// After mydump_init and before any packet is decoded: verifies the checksums
+// of the IPv4 headers, and of UDP and TCP over IPv4 and IPv6 (checksum.h).
+// With `offload', those the NIC of the capturing host was left to compute
+// (0, or the pseudo-header only) are counted apart instead of bad.
+void mydump_verify_checksums(int offload);
+
+// Returns NULL when out of memory
+struct mydump_context *mydump_open(const struct mydump_options *options);
+
+// Frees the context, with the connections and fragments it still holds
+void mydump_close(struct mydump_context *context);
+
+// Decodes a packet of a pcap link type (DLT_*). The dissection is valid until
+// the next packet decoded with the same context. Returns NULL when the link
+// type is not supported. A NULL context is the one of the calling thread.
+struct dissection *mydump_decode(struct mydump_context *context, int link_type,
+                                 const struct pcap_pkthdr *header, const uint8_t *packet);
+
+// Renders a dissection in the format of the context. The text is valid until
+// the next call with the same context. A NULL dissection renders as "".
+const char *mydump_render(struct mydump_context *context, const struct pcap_pkthdr *header,
+                          const struct dissection *d, size_t *length);
+
+#endif
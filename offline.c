@@ -0,0 +1,228 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "flowtable.h"
+#include "frag.h"
+#include "mydump.h"
+#include "offline.h"
+#include "output.h"
+#include "pcapfile.h"
+#include "profile.h"
+#include "render.h"
+#include "sketch.h"
+#include "stats.h"
+#include "stream.h"
+#include "util.h"
+
+enum job_state {
+  J_PENDING,
+  J_RUNNING,
+  J_DONE,
+};
+
+struct job {
+  struct offline_file *file;
+  int whole; // not split, decoded with the loop of the capture
+  size_t start;
+  size_t end;
+  enum job_state state;
+  uint64_t packets;
+  uint64_t bytes;
+  struct out_buffer out;
+};
+
+struct pool {
+  struct job *jobs;
+  unsigned count;
+  unsigned next;    // next job to decode
+  unsigned written; // next job to write
+  unsigned window;  // how far the decoding can get ahead of the output
+  int stopped;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  struct offline_file *files;
+  unsigned file_count;
+};
+
+static struct pool *running_pool = NULL;
+static volatile sig_atomic_t stop_requested = 0;
+
+static void decode_packet(uint8_t *args, const struct pcap_pkthdr *header,
+                          const uint8_t *packet) {
+  struct job *job = (struct job *)args;
+  job->packets++;
+  job->bytes += header->caplen;
+  struct dissection *d = mydump_decode(NULL, job->file->link_type, header, packet);
+  PROFILE_CALL(PROFILE_RENDER, 0, render_packet(header, d));
+  flowtable_packet(header, d);
+  sketch_packet(header, d);
+  stats_packet(header, d);
+}
+
+static void run_job(struct job *job) {
+  struct capture *capture = job->file->capture;
+  out_capture = &job->out;
+  if (job->whole)
+    capture->loop(capture, decode_packet, (uint8_t *)job);
+  else
+    pcapfile_walk(capture, job->start, job->end, decode_packet, (uint8_t *)job);
+  // Chunks are decoded independently, the connections and fragments do not
+  // carry over
+  stream_reset();
+  frag_reset();
+  render_flush();
+  out_capture = NULL;
+}
+
+static void *worker_main(void *arg) {
+  struct pool *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->stopped && !stop_requested && pool->next < pool->count
+           && pool->next >= pool->written + pool->window)
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    if (pool->stopped || stop_requested || pool->next == pool->count)
+      break;
+
+    struct job *job = &pool->jobs[pool->next++];
+    job->state = J_RUNNING;
+    pthread_mutex_unlock(&pool->lock);
+
+    run_job(job);
+
+    pthread_mutex_lock(&pool->lock);
+    job->state = J_DONE;
+    pthread_cond_broadcast(&pool->cond);
+  }
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+// Builds the list of jobs, in output order
+static int plan_jobs(struct pool *pool, size_t chunk_size) {
+  unsigned cap = 0;
+  for (unsigned i = 0; i < pool->file_count; i++) {
+    struct offline_file *file = &pool->files[i];
+    size_t *bounds = NULL;
+    unsigned chunks = 1;
+    if (pcapfile_is_native(file->capture)) {
+      chunks = pcapfile_split(file->capture, chunk_size, &bounds);
+      if (chunks == 0) return -1;
+    }
+
+    if (pool->count + chunks > cap) {
+      cap = (pool->count + chunks) * 2;
+      struct job *jobs = realloc(pool->jobs, cap * sizeof(struct job));
+      if (jobs == NULL) {
+        free(bounds);
+        return -1;
+      }
+      pool->jobs = jobs;
+    }
+
+    for (unsigned j = 0; j < chunks; j++) {
+      struct job *job = &pool->jobs[pool->count++];
+      *job = (struct job) {
+        .file = file,
+        .whole = bounds == NULL,
+        .start = bounds ? bounds[j] : 0,
+        .end = bounds ? bounds[j + 1] : 0,
+        .state = J_PENDING,
+      };
+    }
+    DEBUGF("File %u split in %u chunks", i, chunks);
+    free(bounds);
+  }
+  return 0;
+}
+
+int offline_run(struct offline_file *files, unsigned count, unsigned jobs,
+                size_t chunk_size, struct offline_stats *stats) {
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  struct pool pool = {
+    .window = jobs * 2,
+    .files = files,
+    .file_count = count,
+  };
+  if (plan_jobs(&pool, chunk_size) < 0) {
+    free(pool.jobs);
+    return -1;
+  }
+
+  pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+  if (threads == NULL) {
+    free(pool.jobs);
+    return -1;
+  }
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.cond, NULL);
+  running_pool = &pool;
+
+  unsigned started;
+  for (started = 0; started < jobs; started++)
+    if (pthread_create(&threads[started], NULL, worker_main, &pool) != 0)
+      break;
+  if (started == 0) {
+    running_pool = NULL;
+    free(threads);
+    free(pool.jobs);
+    return -1;
+  }
+
+  // Write the output of the chunks in order, as soon as they are decoded
+  *stats = (struct offline_stats) { .chunks = pool.count };
+  pthread_mutex_lock(&pool.lock);
+  while (pool.written < pool.count) {
+    struct job *job = &pool.jobs[pool.written];
+    while (job->state != J_DONE && !(stop_requested && job->state == J_PENDING))
+      pthread_cond_wait(&pool.cond, &pool.lock);
+    if (job->state != J_DONE)
+      break;
+    pthread_mutex_unlock(&pool.lock);
+
+    struct iovec iov = { job->out.data, job->out.len };
+    output_writev(&iov, 1);
+    free(job->out.data);
+    stats->packets += job->packets;
+    stats->bytes += job->bytes;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.written++;
+    pthread_cond_broadcast(&pool.cond);
+  }
+  pool.stopped = 1;
+  pthread_cond_broadcast(&pool.cond);
+  pthread_mutex_unlock(&pool.lock);
+
+  for (unsigned i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  running_pool = NULL;
+
+  // Chunks decoded but not written because an earlier one was interrupted
+  for (unsigned i = pool.written; i < pool.count; i++)
+    free(pool.jobs[i].out.data);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  stats->seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.cond);
+  free(threads);
+  free(pool.jobs);
+  return 0;
+}
+
+void offline_stop(void) {
+  stop_requested = 1;
+  struct pool *pool = running_pool;
+  if (pool == NULL) return;
+  for (unsigned i = 0; i < pool->file_count; i++)
+    pool->files[i].capture->breakloop(pool->files[i].capture);
+}
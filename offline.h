@@ -0,0 +1,36 @@
+#ifndef __OFFLINE_H
+#define __OFFLINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "capture.h"
+
+// Parallel decoding of capture files. Each file read by the native reader is
+// split in chunks of about `chunk_size' bytes (see pcapfile_split), the
+// chunks of all the files are decoded by a pool of `jobs' threads, and their
+// output is written in the order of the files and of the records. Files read
+// through libpcap can not be split, they are decoded whole by one thread.
+struct offline_file {
+  struct capture *capture;
+  int link_type;
+};
+
+struct offline_stats {
+  uint64_t packets;
+  uint64_t bytes; // captured bytes of the decoded packets
+  unsigned chunks;
+  double seconds;
+};
+
+#define OFFLINE_DEFAULT_CHUNK_SIZE (16 << 20)
+
+// Returns -1 if the pool could not be started.
+int offline_run(struct offline_file *files, unsigned count, unsigned jobs,
+                size_t chunk_size, struct offline_stats *stats);
+
+// Stops the decoding, can be called from a signal handler. The output of the
+// chunks decoded so far is still written.
+void offline_stop(void);
+
+#endif
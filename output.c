@@ -0,0 +1,154 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "output.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static int output_fd = STDOUT_FILENO;
+static struct output_config output_config = {
+  .policy = FLUSH_PACKET,
+  .interval = OUTPUT_DEFAULT_INTERVAL,
+  .buffer_size = OUTPUT_DEFAULT_BUFFER_SIZE,
+};
+
+// Only one thread writes at a time, so that blocks are never interleaved even
+// when they are bigger than PIPE_BUF.
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_once = PTHREAD_ONCE_INIT;
+
+struct thread_buffer {
+  struct out_buffer out;
+  uint64_t since; // when the first byte not written was added
+};
+
+static __thread struct thread_buffer *thread_buffer = NULL;
+
+uint64_t output_now(void) {
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int output_writev(struct iovec *iov, int count) {
+  pthread_mutex_lock(&write_lock);
+  while (count > 0) {
+    ssize_t n = writev(output_fd, iov, count < IOV_MAX ? count : IOV_MAX);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      pthread_mutex_unlock(&write_lock);
+      return -1;
+    }
+
+    // Skip what was written, partial writes resume in the middle of a buffer
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  pthread_mutex_unlock(&write_lock);
+  return 0;
+}
+
+static void write_buffer(struct thread_buffer *b) {
+  if (b->out.len == 0) return;
+  struct iovec iov = { b->out.data, b->out.len };
+  output_writev(&iov, 1);
+  b->out.len = 0;
+}
+
+static void free_buffer(void *arg) {
+  struct thread_buffer *b = arg;
+  write_buffer(b);
+  free(b->out.data);
+  free(b);
+}
+
+static void flush_main(void) {
+  output_flush();
+}
+
+static void create_key(void) {
+  pthread_key_create(&buffer_key, free_buffer);
+}
+
+void output_init(int fd, const struct output_config *config) {
+  output_fd = fd;
+  output_config = *config;
+  atexit(flush_main);
+}
+
+struct out_buffer *output_thread_buffer(void) {
+  if (thread_buffer == NULL) {
+    pthread_once(&buffer_once, create_key);
+    thread_buffer = calloc(1, sizeof(struct thread_buffer));
+    if (thread_buffer == NULL) abort();
+    // A bit more than the flush threshold, so that the packet that crosses it
+    // usually fits without growing the buffer.
+    thread_buffer->out.cap = output_config.buffer_size + 65536;
+    thread_buffer->out.data = malloc(thread_buffer->out.cap);
+    if (thread_buffer->out.data == NULL) abort();
+    pthread_setspecific(buffer_key, thread_buffer);
+  }
+  return &thread_buffer->out;
+}
+
+int output_should_flush(size_t bytes, unsigned packets, uint64_t since) {
+  if (packets == 0) return 0;
+  switch (output_config.policy) {
+    case FLUSH_PACKET:
+      return 1;
+    case FLUSH_INTERVAL:
+      if (output_now() - since >= output_config.interval) return 1;
+      // fallthrough
+    case FLUSH_FULL:
+    default:
+      return bytes >= output_config.buffer_size;
+  }
+}
+
+void output_packet_end(void) {
+  // Packets decoded in an `out_capture' buffer are written by its owner
+  if (out_capture != NULL) return;
+
+  struct thread_buffer *b = thread_buffer;
+  if (b == NULL || b->out.len == 0) return;
+  if (b->since == 0) b->since = output_now();
+  if (output_should_flush(b->out.len, 1, b->since)) {
+    write_buffer(b);
+    b->since = 0;
+  }
+}
+
+void output_idle(void) {
+  struct thread_buffer *b = thread_buffer;
+  if (out_capture != NULL || b == NULL || b->since == 0) return;
+  if (output_should_flush(b->out.len, 1, b->since)) {
+    write_buffer(b);
+    b->since = 0;
+  }
+}
+
+void output_flush(void) {
+  if (thread_buffer != NULL) {
+    write_buffer(thread_buffer);
+    thread_buffer->since = 0;
+  }
+}
@@ -0,0 +1,59 @@
+#ifndef __OUTPUT_H
+#define __OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "util.h"
+
+// Output of the decoded packets. PRINTF appends to a buffer of the calling
+// thread (or to `out_capture' when set), which is written with a single
+// writev when the flush policy says so. Buffers are only written at packet
+// boundaries, so the output of concurrent threads never mixes.
+enum flush_policy {
+  FLUSH_FULL,     // when the buffer is full
+  FLUSH_INTERVAL, // when the buffer is full, or every `interval' ms
+  FLUSH_PACKET,   // after each packet, for interactive use
+};
+
+struct output_config {
+  enum flush_policy policy;
+  unsigned interval; // ms
+  size_t buffer_size;
+};
+
+#define OUTPUT_DEFAULT_INTERVAL 200
+#define OUTPUT_DEFAULT_BUFFER_SIZE (1 << 20)
+
+// Where to write, and when. The buffer of the main thread is flushed at exit,
+// the ones of the other threads when they terminate.
+void output_init(int fd, const struct output_config *config);
+
+// Buffer of the calling thread, allocated on first use
+struct out_buffer *output_thread_buffer(void);
+
+// To be called after the last PRINTF of a packet
+void output_packet_end(void);
+
+// To be called by the capture loops when they wake up, packets or not (at
+// least every CAPTURE_TIMEOUT, see capture.h): writes the buffer of the
+// calling thread once it has waited for the interval, so that the output of a
+// quiet capture does not wait for the next packet.
+void output_idle(void);
+
+// Writes the buffer of the calling thread now
+void output_flush(void);
+
+// Writes `count' buffers in order, as one block with regard to the other
+// threads. Returns -1 on error.
+int output_writev(struct iovec *iov, int count);
+
+// Whether a batch of `packets' packets and `bytes' bytes, started at `since'
+// (see output_now), should be written now.
+int output_should_flush(size_t bytes, unsigned packets, uint64_t since);
+
+// Monotonic clock, in ms
+uint64_t output_now(void);
+
+#endif
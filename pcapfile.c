@@ -0,0 +1,559 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pcapfile.h"
+#include "util.h"
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_HEADER_SIZE 24
+#define PCAP_RECORD_SIZE 16
+#define PCAP_MAX_SNAPLEN 262144
+
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_PB 0x00000002
+#define PCAPNG_SPB 0x00000003
+#define PCAPNG_NRB 0x00000004
+#define PCAPNG_ISB 0x00000005
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_DSB 0x0000000a
+#define PCAPNG_CB 0x00000bad
+#define PCAPNG_CB_NOCOPY 0x40000bad
+#define PCAPNG_BYTE_ORDER 0x1a2b3c4d
+#define PCAPNG_OPT_TSRESOL 9
+
+// Number of consecutive records that must look valid to accept a chunk
+// boundary, and how far to look for one.
+#define SPLIT_CHAIN 8
+#define SPLIT_WINDOW (4 << 20)
+
+enum format {
+  F_PCAP,
+  F_PCAPNG,
+};
+
+struct interface {
+  int linktype;
+  uint64_t ts_units; // timestamp units per second
+};
+
+// State of a pcapng section while walking it: the byte order, and the
+// interfaces described so far.
+struct section {
+  int swap;
+  struct interface *interfaces;
+  unsigned interface_count;
+  unsigned interface_cap;
+  int skipped_linktype;
+};
+
+struct pcapfile {
+  const uint8_t *map;
+  size_t size;
+  size_t start; // offset of the first record or block
+  enum format format;
+  int swap;
+  int datalink;
+  volatile int break_loop;
+
+  int has_filter;
+  struct bpf_program filter;
+
+  // pcap
+  uint32_t ts_div;
+  uint32_t snaplen;
+  uint32_t first_ts;
+
+  // pcapng, the interfaces described before the first packet. Walks starting
+  // in the middle of the file start with them.
+  struct section first_section;
+};
+
+static inline uint16_t rd16(const uint8_t *p, int swap) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return swap ? __builtin_bswap16(v) : v;
+}
+
+static inline uint32_t rd32(const uint8_t *p, int swap) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return swap ? __builtin_bswap32(v) : v;
+}
+
+static int file_datalink(struct capture *c) {
+  return ((struct pcapfile *)c->handle)->datalink;
+}
+
+static int file_setfilter(struct capture *c, struct bpf_program *fp) {
+  struct pcapfile *f = c->handle;
+  // The program is freed by the caller, keep a copy
+  size_t size = fp->bf_len * sizeof(struct bpf_insn);
+  struct bpf_insn *insns = malloc(size);
+  if (insns == NULL) return PCAP_ERROR;
+  memcpy(insns, fp->bf_insns, size);
+
+  free(f->filter.bf_insns);
+  f->filter.bf_len = fp->bf_len;
+  f->filter.bf_insns = insns;
+  f->has_filter = 1;
+  return 0;
+}
+
+static inline void deliver(struct pcapfile *f, struct pcap_pkthdr *header,
+                           const uint8_t *data, pcap_handler callback,
+                           uint8_t *user) {
+  if (f->has_filter && pcap_offline_filter(&f->filter, header, data) == 0)
+    return;
+  callback(user, header, data);
+}
+
+static void walk_pcap(struct pcapfile *f, size_t offset, size_t end,
+                      pcap_handler callback, uint8_t *user) {
+  while (!f->break_loop && offset < end && offset + PCAP_RECORD_SIZE <= f->size) {
+    const uint8_t *record = f->map + offset;
+    struct pcap_pkthdr header;
+    header.ts.tv_sec = rd32(record, f->swap);
+    header.ts.tv_usec = rd32(record + 4, f->swap) / f->ts_div;
+    header.caplen = rd32(record + 8, f->swap);
+    header.len = rd32(record + 12, f->swap);
+
+    offset += PCAP_RECORD_SIZE;
+    if (header.caplen > f->size - offset) {
+      WARNF("Truncated record at offset %zu", offset - PCAP_RECORD_SIZE);
+      return;
+    }
+
+    deliver(f, &header, f->map + offset, callback, user);
+    offset += header.caplen;
+  }
+}
+
+// Reads the options of an Interface Description Block
+static void read_idb(struct section *s, const uint8_t *body, uint32_t length) {
+  if (length < 8) return;
+
+  if (s->interface_count == s->interface_cap) {
+    unsigned cap = s->interface_cap ? s->interface_cap * 2 : 4;
+    struct interface *interfaces = realloc(s->interfaces, cap * sizeof(struct interface));
+    if (interfaces == NULL) return;
+    s->interfaces = interfaces;
+    s->interface_cap = cap;
+  }
+
+  struct interface *iface = &s->interfaces[s->interface_count++];
+  iface->linktype = rd16(body, s->swap);
+  iface->ts_units = 1000000;
+
+  const uint8_t *opt = body + 8;
+  const uint8_t *end = body + length;
+  while (opt + 4 <= end) {
+    uint16_t code = rd16(opt, s->swap);
+    uint16_t len = rd16(opt + 2, s->swap);
+    if (code == 0 || opt + 4 + len > end) break;
+    if (code == PCAPNG_OPT_TSRESOL && len >= 1) {
+      uint8_t resol = opt[4];
+      uint64_t units = 1;
+      // Most significant bit set: negative power of 2, else of 10
+      for (uint8_t i = 0; i < (resol & 0x7f) && units < (1ULL << 62); i++)
+        units *= (resol & 0x80) ? 2 : 10;
+      iface->ts_units = units;
+    }
+    opt += 4 + ((len + 3) & ~3);
+  }
+}
+
+static void deliver_ng(struct pcapfile *f, struct section *s, uint32_t interface,
+                       uint64_t ts, uint32_t caplen, uint32_t len,
+                       const uint8_t *data, pcap_handler callback, uint8_t *user) {
+  if (interface >= s->interface_count) {
+    WARNF("Packet on unknown interface %u", interface);
+    return;
+  }
+
+  struct interface *iface = &s->interfaces[interface];
+  // All the packets are decoded with the link handler of the first interface
+  if (iface->linktype != f->datalink) {
+    if (!s->skipped_linktype)
+      WARNF("Skipping packets of link type %d", iface->linktype);
+    s->skipped_linktype = 1;
+    return;
+  }
+
+  uint64_t frac = ts % iface->ts_units;
+  struct pcap_pkthdr header;
+  header.ts.tv_sec = ts / iface->ts_units;
+  header.ts.tv_usec = iface->ts_units >= 1000000
+    ? frac / (iface->ts_units / 1000000)
+    : frac * 1000000 / iface->ts_units;
+  header.caplen = caplen;
+  header.len = len;
+  deliver(f, &header, data, callback, user);
+}
+
+static void walk_pcapng(struct pcapfile *f, struct section *s, size_t offset,
+                        size_t end, pcap_handler callback, uint8_t *user) {
+  while (!f->break_loop && offset < end && offset + 12 <= f->size) {
+    const uint8_t *block = f->map + offset;
+    uint32_t type = rd32(block, s->swap);
+
+    // A new section can change the byte order
+    if (type == PCAPNG_SHB) {
+      uint32_t magic;
+      memcpy(&magic, block + 8, sizeof(magic));
+      s->swap = magic != PCAPNG_BYTE_ORDER;
+      s->interface_count = 0;
+    }
+
+    uint32_t total = rd32(block + 4, s->swap);
+    if (total < 12 || total % 4 != 0 || total > f->size - offset) {
+      WARNF("Invalid block at offset %zu", offset);
+      return;
+    }
+
+    const uint8_t *body = block + 8;
+    uint32_t length = total - 12;
+    switch (type) {
+      case PCAPNG_IDB:
+        read_idb(s, body, length);
+        break;
+
+      case PCAPNG_EPB:
+      {
+        if (length < 20) break;
+        uint32_t caplen = rd32(body + 12, s->swap);
+        if (caplen > length - 20) break;
+        uint64_t ts = (uint64_t)rd32(body + 4, s->swap) << 32 | rd32(body + 8, s->swap);
+        deliver_ng(f, s, rd32(body, s->swap), ts, caplen, rd32(body + 16, s->swap),
+                   body + 20, callback, user);
+        break;
+      }
+
+      case PCAPNG_SPB:
+      {
+        if (length < 4) break;
+        uint32_t len = rd32(body, s->swap);
+        uint32_t caplen = len < length - 4 ? len : length - 4;
+        deliver_ng(f, s, 0, 0, caplen, len, body + 4, callback, user);
+        break;
+      }
+
+      case PCAPNG_PB:
+      {
+        if (length < 20) break;
+        uint32_t caplen = rd32(body + 12, s->swap);
+        if (caplen > length - 20) break;
+        uint64_t ts = (uint64_t)rd32(body + 4, s->swap) << 32 | rd32(body + 8, s->swap);
+        deliver_ng(f, s, rd16(body, s->swap), ts, caplen, rd32(body + 16, s->swap),
+                   body + 20, callback, user);
+        break;
+      }
+
+      default:
+        // Name resolution, statistics, custom blocks...
+        break;
+    }
+
+    offset += total;
+  }
+}
+
+static int walk(struct pcapfile *f, size_t start, size_t end,
+                pcap_handler callback, uint8_t *user) {
+  if (f->format == F_PCAP) {
+    walk_pcap(f, start, end, callback, user);
+  } else {
+    // Walks from the start of the file discover the interfaces themselves
+    struct section s = { .swap = f->swap };
+    if (start > f->start) {
+      s = f->first_section;
+      s.interfaces = malloc(s.interface_cap * sizeof(struct interface));
+      if (s.interface_cap > 0 && s.interfaces == NULL) return PCAP_ERROR;
+      if (s.interface_cap > 0)
+        memcpy(s.interfaces, f->first_section.interfaces,
+               s.interface_count * sizeof(struct interface));
+    }
+    walk_pcapng(f, &s, start, end, callback, user);
+    free(s.interfaces);
+  }
+
+  // Left set for the other chunks walked at the same time
+  return f->break_loop ? PCAP_ERROR_BREAK : 0;
+}
+
+static int file_loop(struct capture *c, pcap_handler callback, uint8_t *user) {
+  struct pcapfile *f = c->handle;
+  int ret = walk(f, f->start, f->size, callback, user);
+  f->break_loop = 0;
+  return ret;
+}
+
+// The records are mapped until the file is closed: batches point into it
+static int file_loop_batch(struct capture *c, capture_batch_handler handler, uint8_t *user) {
+  struct pcapfile *f = c->handle;
+  struct capture_batcher b;
+  capture_batcher_init(&b, handler, user);
+  int ret = walk(f, f->start, f->size, capture_batch_add, (uint8_t *)&b);
+  f->break_loop = 0;
+  capture_batch_flush(&b);
+  return ret;
+}
+
+static void file_breakloop(struct capture *c) {
+  ((struct pcapfile *)c->handle)->break_loop = 1;
+}
+
+static int file_stats(struct capture *c, struct pcap_stat *stats) {
+  (void)c;
+  (void)stats;
+  // Same as libpcap, there are no statistics for savefiles
+  return PCAP_ERROR;
+}
+
+static void file_close(struct capture *c) {
+  struct pcapfile *f = c->handle;
+  if (f->map != NULL && f->map != MAP_FAILED)
+    munmap((void *)f->map, f->size);
+  free(f->filter.bf_insns);
+  free(f->first_section.interfaces);
+  free(f);
+  free(c);
+}
+
+// Checks that `count' records starting at `offset' look like pcap records.
+// Reaching exactly the end of the file is fine.
+static int valid_pcap_chain(struct pcapfile *f, size_t offset, unsigned count) {
+  uint32_t usec_max = f->ts_div == 1 ? 1000000 : 1000000000;
+  int64_t prev_ts = -1;
+  for (unsigned i = 0; i < count; i++) {
+    if (offset == f->size) return 1;
+    if (offset + PCAP_RECORD_SIZE > f->size) return 0;
+
+    const uint8_t *record = f->map + offset;
+    uint32_t ts = rd32(record, f->swap);
+    uint32_t usec = rd32(record + 4, f->swap);
+    uint32_t caplen = rd32(record + 8, f->swap);
+    uint32_t len = rd32(record + 12, f->swap);
+    if (usec >= usec_max || caplen > len || caplen > f->snaplen
+        || caplen > f->size - offset - PCAP_RECORD_SIZE)
+      return 0;
+
+    // Timestamps of neighbour records are close to each other, and to the
+    // start of the capture.
+    if ((int64_t)ts < (int64_t)f->first_ts - 86400
+        || (prev_ts >= 0 && (ts > prev_ts + 3600 || ts + 3600 < prev_ts)))
+      return 0;
+    prev_ts = ts;
+
+    offset += PCAP_RECORD_SIZE + caplen;
+  }
+  return 1;
+}
+
+static int known_block(uint32_t type) {
+  switch (type) {
+    case PCAPNG_SHB: case PCAPNG_IDB: case PCAPNG_PB: case PCAPNG_SPB:
+    case PCAPNG_NRB: case PCAPNG_ISB: case PCAPNG_EPB: case PCAPNG_DSB:
+    case PCAPNG_CB: case PCAPNG_CB_NOCOPY:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+// Same for pcapng: known block types, with the same total length at both ends
+static int valid_pcapng_chain(struct pcapfile *f, size_t offset, unsigned count) {
+  int swap = f->first_section.swap;
+  for (unsigned i = 0; i < count; i++) {
+    if (offset == f->size) return 1;
+    if (offset + 12 > f->size) return 0;
+
+    const uint8_t *block = f->map + offset;
+    uint32_t total = rd32(block + 4, swap);
+    if (!known_block(rd32(block, swap)) || total < 12 || total % 4 != 0
+        || total > f->size - offset
+        || rd32(block + total - 4, swap) != total)
+      return 0;
+    offset += total;
+  }
+  return 1;
+}
+
+unsigned pcapfile_split(struct capture *c, size_t chunk_size, size_t **bounds) {
+  struct pcapfile *f = c->handle;
+  size_t records = f->size - f->start;
+  unsigned count = records / chunk_size + 1;
+  *bounds = malloc((count + 1) * sizeof(size_t));
+  if (*bounds == NULL) return 0;
+
+  unsigned n = 0;
+  (*bounds)[n++] = f->start;
+  for (unsigned i = 1; i < count; i++) {
+    size_t offset = f->start + i * chunk_size;
+    if (offset <= (*bounds)[n - 1]) continue;
+    size_t limit = offset + SPLIT_WINDOW < f->size ? offset + SPLIT_WINDOW : f->size;
+
+    // pcapng blocks are 32-bit aligned, pcap records can start anywhere
+    if (f->format == F_PCAPNG) {
+      offset = (offset + 3) & ~(size_t)3;
+      while (offset < limit && !valid_pcapng_chain(f, offset, SPLIT_CHAIN))
+        offset += 4;
+    } else {
+      while (offset < limit && !valid_pcap_chain(f, offset, SPLIT_CHAIN))
+        offset++;
+    }
+
+    // No boundary found, this chunk is merged with the next one
+    if (offset < limit)
+      (*bounds)[n++] = offset;
+  }
+  (*bounds)[n] = f->size;
+  return n;
+}
+
+int pcapfile_walk(struct capture *c, size_t start, size_t end,
+                  pcap_handler callback, uint8_t *user) {
+  return walk(c->handle, start, end, callback, user);
+}
+
+// Reads the file header, returns -1 if the format is not supported
+static int read_header(struct pcapfile *f, char *errbuf) {
+  if (f->size < 4) {
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "file too small");
+    return -1;
+  }
+
+  uint32_t magic = rd32(f->map, 0);
+  if (magic == PCAP_MAGIC_US || magic == __builtin_bswap32(PCAP_MAGIC_US)
+      || magic == PCAP_MAGIC_NS || magic == __builtin_bswap32(PCAP_MAGIC_NS)) {
+    if (f->size < PCAP_HEADER_SIZE) {
+      snprintf(errbuf, PCAP_ERRBUF_SIZE, "truncated pcap header");
+      return -1;
+    }
+    f->format = F_PCAP;
+    f->swap = magic == __builtin_bswap32(PCAP_MAGIC_US)
+           || magic == __builtin_bswap32(PCAP_MAGIC_NS);
+    f->ts_div = (magic == PCAP_MAGIC_NS || magic == __builtin_bswap32(PCAP_MAGIC_NS)) ? 1000 : 1;
+    f->snaplen = rd32(f->map + 16, f->swap);
+    if (f->snaplen == 0 || f->snaplen > PCAP_MAX_SNAPLEN)
+      f->snaplen = PCAP_MAX_SNAPLEN;
+    // The upper bits of the link type hold the FCS length
+    f->datalink = rd32(f->map + 20, f->swap) & 0x0fffffff;
+    f->start = PCAP_HEADER_SIZE;
+    if (f->size >= PCAP_HEADER_SIZE + PCAP_RECORD_SIZE)
+      f->first_ts = rd32(f->map + PCAP_HEADER_SIZE, f->swap);
+    return 0;
+  }
+
+  if (magic == PCAPNG_SHB && f->size >= 12) {
+    uint32_t order;
+    memcpy(&order, f->map + 8, sizeof(order));
+    f->format = F_PCAPNG;
+    f->start = 0;
+    f->swap = order != PCAPNG_BYTE_ORDER;
+
+    // Collect the interfaces described before the first packet, the link
+    // type is the one of the first of them.
+    struct section *s = &f->first_section;
+    s->swap = f->swap;
+    size_t offset = 0;
+    while (offset + 12 <= f->size) {
+      const uint8_t *block = f->map + offset;
+      uint32_t type = rd32(block, s->swap);
+      uint32_t total = rd32(block + 4, s->swap);
+      if (total < 12 || total > f->size - offset) break;
+      if (type == PCAPNG_IDB)
+        read_idb(s, block + 8, total - 12);
+      else if (type == PCAPNG_EPB || type == PCAPNG_SPB || type == PCAPNG_PB)
+        break;
+      offset += total;
+    }
+
+    if (s->interface_count == 0) {
+      snprintf(errbuf, PCAP_ERRBUF_SIZE, "no interface in pcapng file");
+      return -1;
+    }
+    f->datalink = s->interfaces[0].linktype;
+    return 0;
+  }
+
+  snprintf(errbuf, PCAP_ERRBUF_SIZE, "unknown file format");
+  return -1;
+}
+
+struct capture *pcapfile_open(const char *file, char *errbuf) {
+  struct capture *c = calloc(1, sizeof(struct capture));
+  struct pcapfile *f = calloc(1, sizeof(struct pcapfile));
+  if (c == NULL || f == NULL) {
+    free(c);
+    free(f);
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "out of memory");
+    return NULL;
+  }
+
+  c->handle = f;
+  c->datalink = file_datalink;
+  c->setfilter = file_setfilter;
+  c->loop = file_loop;
+  c->loop_batch = file_loop_batch;
+  c->breakloop = file_breakloop;
+  c->stats = file_stats;
+  c->close = file_close;
+  f->map = MAP_FAILED;
+
+  int fd = open(file, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: %s", file, strerror(errno));
+    if (fd >= 0) close(fd);
+    file_close(c);
+    return NULL;
+  }
+
+  if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: not a regular file", file);
+    close(fd);
+    file_close(c);
+    return NULL;
+  }
+
+  f->size = st.st_size;
+  f->map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (f->map == MAP_FAILED) {
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: mmap: %s", file, strerror(errno));
+    file_close(c);
+    return NULL;
+  }
+
+  // The file is read once from start to end: aggressive readahead, and
+  // transparent huge pages where the kernel supports them for page cache.
+  madvise((void *)f->map, f->size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  madvise((void *)f->map, f->size, MADV_HUGEPAGE);
+#endif
+
+  if (read_header(f, errbuf) < 0) {
+    file_close(c);
+    return NULL;
+  }
+
+  DEBUGF("Mapped %s file `%s' (%zu bytes, link type %d)",
+         f->format == F_PCAP ? "pcap" : "pcapng", file, f->size, f->datalink);
+  return c;
+}
+
+int pcapfile_is_native(struct capture *c) {
+  return c->close == file_close;
+}
+
+size_t pcapfile_size(struct capture *c) {
+  return ((struct pcapfile *)c->handle)->size;
+}
@@ -0,0 +1,43 @@
+#ifndef __PCAPFILE_H
+#define __PCAPFILE_H
+
+#include "capture.h"
+
+// Native reader for pcap and pcapng files. The file is mmap'd and its records
+// are walked in place: the handler gets pointers straight into the mapping,
+// without going through stdio or libpcap's buffer. Both byte orders and both
+// microsecond and nanosecond pcap magics are supported.
+//
+// Returns NULL and fills `errbuf' if the file can not be mapped or is not in
+// a supported format.
+struct capture *pcapfile_open(const char *file, char *errbuf);
+
+// Returns whether the capture was opened by pcapfile_open, as opposed to the
+// libpcap fallback.
+int pcapfile_is_native(struct capture *capture);
+
+// Size of the mapped file, in bytes.
+size_t pcapfile_size(struct capture *capture);
+
+// Splits the records of the file in chunks of about `chunk_size' bytes, that
+// can be walked independently. There are no index in pcap files, so each
+// boundary is found by scanning forward from the guessed offset until a chain
+// of records that look valid (sane lengths and timestamps, blocks with
+// matching lengths for pcapng). A boundary not found close to its guess is
+// dropped and its chunks merged.
+//
+// `*bounds' is set to a malloc'd array of count + 1 offsets, chunk i being
+// [bounds[i], bounds[i + 1]). Returns the number of chunks, 0 on error.
+//
+// pcapng chunks start with the interfaces of the first section: files with
+// several sections should be walked whole.
+unsigned pcapfile_split(struct capture *capture, size_t chunk_size, size_t **bounds);
+
+// Same as the loop of the capture, for the records in [start, end) only. Can
+// be called concurrently on different chunks, but the breakloop callback
+// stops all of them: unlike the loop, this does not clear the request, which
+// stays until the next loop of the whole file.
+int pcapfile_walk(struct capture *capture, size_t start, size_t end,
+                  pcap_handler callback, uint8_t *user);
+
+#endif
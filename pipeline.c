@@ -0,0 +1,300 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flow.h"
+#include "flowtable.h"
+#include "mydump.h"
+#include "output.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "render.h"
+#include "sketch.h"
+#include "stats.h"
+#include "util.h"
+
+// Each slot goes through the following states, `n' being the position of the
+// packet in the capture:
+//   seq == n                   free, the capture thread can fill it
+//   seq == n + 1               filled, queued to its worker
+//   seq == n + 2               decoded, waiting for the output thread
+//   seq == n + slots           released, free for the next lap of the ring
+// Every transition is made by a single thread, so the sequence number is
+// enough to synchronize the stages without any lock.
+struct slot {
+  uint64_t seq;
+  struct pcap_pkthdr header;
+  uint8_t *data;
+  uint32_t cap;
+  struct out_buffer out;
+} __attribute__((aligned(64)));
+
+// Positions of the slots assigned to a worker, in capture order. The capture
+// thread is the only producer and the worker the only consumer. It can never
+// overflow since it is as big as the ring.
+struct worker_queue {
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t *positions;
+  struct pipeline *pipeline;
+  pthread_t thread;
+};
+
+struct pipeline {
+  uint16_t link_type;
+  int lossy;
+  uint64_t mask;
+  struct slot *slots;
+
+  // Written by the capture thread
+  uint64_t produced __attribute__((aligned(64)));
+  uint64_t ring_drops;
+  int closed;
+
+  unsigned nworkers;
+  struct worker_queue *workers;
+  pthread_t output;
+};
+
+// Snaplen used in live mode, bigger packets (offline) grow the slot buffer
+#define SLOT_DATA_SIZE 9000
+
+static void backoff(unsigned *spins) {
+  if (*spins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+  } else if (*spins < 128) {
+    sched_yield();
+  } else {
+    struct timespec ts = { 0, 50000 };
+    nanosleep(&ts, NULL);
+  }
+  (*spins)++;
+}
+
+// Returns 1 when all the packets until `n' (excluded) have been produced and
+// the capture is over.
+static int finished(struct pipeline *p, uint64_t n) {
+  return __atomic_load_n(&p->closed, __ATOMIC_ACQUIRE)
+      && n >= __atomic_load_n(&p->produced, __ATOMIC_ACQUIRE);
+}
+
+static void *worker_main(void *arg) {
+  struct worker_queue *q = arg;
+  struct pipeline *p = q->pipeline;
+  for (uint64_t tail = 0;; tail++) {
+    unsigned spins = 0;
+    while (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail) {
+      if (__atomic_load_n(&p->closed, __ATOMIC_ACQUIRE)
+          && __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail)
+        return NULL;
+      // Only once the queue stays empty, not between two close packets
+      if (spins >= 128) sketch_idle();
+      backoff(&spins);
+    }
+
+    // The slot was filled before its position was queued
+    uint64_t n = q->positions[tail & p->mask];
+    struct slot *s = &p->slots[n & p->mask];
+
+    s->out.len = 0;
+    out_capture = &s->out;
+    struct dissection *d = mydump_decode(NULL, p->link_type, &s->header, s->data);
+    PROFILE_CALL(PROFILE_RENDER, 0, render_packet(&s->header, d));
+    flowtable_packet(&s->header, d);
+    sketch_packet(&s->header, d);
+    stats_packet(&s->header, d);
+    out_capture = NULL;
+
+    __atomic_store_n(&s->seq, n + 2, __ATOMIC_RELEASE);
+  }
+}
+
+// Slots written in a single writev, at most
+#define OUTPUT_BATCH 256
+
+static void *output_main(void *arg) {
+  struct pipeline *p = arg;
+  struct iovec iov[OUTPUT_BATCH];
+  unsigned count = 0;
+  size_t bytes = 0;
+  uint64_t since = 0;
+
+  // Decoded slots are only released once their output is written, `n' is the
+  // first slot of the batch.
+  for (uint64_t n = 0;;) {
+    struct slot *s = &p->slots[(n + count) & p->mask];
+
+    unsigned spins = 0;
+    while (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != n + count + 2) {
+      // Nothing to add for now, make what was decoded so far visible
+      if (count > 0 && (spins >= 64 || finished(p, n + count))) break;
+      if (count == 0 && finished(p, n)) return NULL;
+      backoff(&spins);
+    }
+
+    int ready = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) == n + count + 2;
+    if (ready) {
+      if (count == 0) since = output_now();
+      iov[count].iov_base = s->out.data;
+      iov[count].iov_len = s->out.len;
+      bytes += s->out.len;
+      count++;
+    }
+
+    if (count > 0 && (!ready || count == OUTPUT_BATCH
+                      || output_should_flush(bytes, count, since))) {
+      output_writev(iov, count);
+      for (unsigned i = 0; i < count; i++, n++)
+        __atomic_store_n(&p->slots[n & p->mask].seq, n + p->mask + 1, __ATOMIC_RELEASE);
+      count = 0;
+      bytes = 0;
+    }
+  }
+}
+
+// Frees the ring and the queues, once no thread uses them
+static void release(struct pipeline *p) {
+  for (uint64_t i = 0; i <= p->mask; i++) {
+    free(p->slots[i].data);
+    free(p->slots[i].out.data);
+  }
+  for (unsigned i = 0; i < p->nworkers; i++)
+    free(p->workers[i].positions);
+  free(p->slots);
+  free(p->workers);
+  free(p);
+}
+
+// Stops the `started' first workers, before any packet is pushed, then frees
+// the pipeline.
+static void abort_start(struct pipeline *p, unsigned started) {
+  __atomic_store_n(&p->closed, 1, __ATOMIC_RELEASE);
+  for (unsigned i = 0; i < started; i++)
+    pthread_join(p->workers[i].thread, NULL);
+  release(p);
+}
+
+struct pipeline *pipeline_create(uint16_t link_type, unsigned workers,
+                                 unsigned slots, int lossy) {
+  // The ring size must be a power of two, and at least 4 so that the states
+  // of a slot never overlap between two laps.
+  uint64_t size = 4;
+  while (size < slots) size <<= 1;
+
+  struct pipeline *p = calloc(1, sizeof(struct pipeline));
+  if (p == NULL) return NULL;
+  p->link_type = link_type;
+  p->lossy = lossy;
+  p->mask = size - 1;
+  p->nworkers = workers;
+
+  if (posix_memalign((void **)&p->slots, 64, size * sizeof(struct slot)) != 0)
+    p->slots = NULL;
+  if (posix_memalign((void **)&p->workers, 64, workers * sizeof(struct worker_queue)) != 0)
+    p->workers = NULL;
+  if (p->slots == NULL || p->workers == NULL) {
+    ERROR("Could not allocate the decoding ring");
+    free(p->slots);
+    free(p->workers);
+    free(p);
+    return NULL;
+  }
+
+  memset(p->slots, 0, size * sizeof(struct slot));
+  memset(p->workers, 0, workers * sizeof(struct worker_queue));
+  for (unsigned i = 0; i < workers; i++) {
+    p->workers[i].pipeline = p;
+    p->workers[i].positions = malloc(size * sizeof(uint64_t));
+    if (p->workers[i].positions == NULL) {
+      ERRORF("Could not allocate the queue of worker %u", i);
+      release(p);
+      return NULL;
+    }
+  }
+
+  // Slots without a buffer get one when their first packet is pushed
+  for (uint64_t i = 0; i < size; i++) {
+    p->slots[i].seq = i;
+    p->slots[i].data = malloc(SLOT_DATA_SIZE);
+    p->slots[i].cap = p->slots[i].data ? SLOT_DATA_SIZE : 0;
+  }
+
+  DEBUGF("Starting pipeline with %u workers and %" PRIu64 " slots", workers, size);
+  for (unsigned i = 0; i < workers; i++) {
+    int err = pthread_create(&p->workers[i].thread, NULL, worker_main, &p->workers[i]);
+    if (err != 0) {
+      ERRORF("Could not start worker %u: %s", i, strerror(err));
+      abort_start(p, i);
+      return NULL;
+    }
+  }
+  int err = pthread_create(&p->output, NULL, output_main, p);
+  if (err != 0) {
+    ERRORF("Could not start the output thread: %s", strerror(err));
+    abort_start(p, workers);
+    return NULL;
+  }
+
+  return p;
+}
+
+void pipeline_push(uint8_t *args, const struct pcap_pkthdr *header,
+                   const uint8_t *packet) {
+  struct pipeline *p = (struct pipeline *)args;
+  uint64_t n = p->produced;
+  struct slot *s = &p->slots[n & p->mask];
+  if (n == 0) sketch_origin(header);
+
+  unsigned spins = 0;
+  while (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != n) {
+    if (p->lossy) {
+      p->ring_drops++;
+      return;
+    }
+    backoff(&spins);
+  }
+
+  if (header->caplen > s->cap) {
+    uint8_t *data = realloc(s->data, header->caplen);
+    if (data == NULL) {
+      p->ring_drops++;
+      return;
+    }
+    s->data = data;
+    s->cap = header->caplen;
+  }
+
+  s->header = *header;
+  memcpy(s->data, packet, header->caplen);
+
+  // All the packets of a flow, in both directions, go to the same worker so
+  // that per-flow state can stay local to it.
+  struct flow_key key;
+  flow_key_extract(p->link_type, header->caplen, s->data, &key);
+  struct worker_queue *q = &p->workers[flow_hash(&key) % p->nworkers];
+
+  __atomic_store_n(&s->seq, n + 1, __ATOMIC_RELEASE);
+  q->positions[q->head & p->mask] = n;
+  __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&p->produced, n + 1, __ATOMIC_RELEASE);
+}
+
+void pipeline_destroy(struct pipeline *p, struct pipeline_stats *stats) {
+  __atomic_store_n(&p->closed, 1, __ATOMIC_RELEASE);
+  for (unsigned i = 0; i < p->nworkers; i++)
+    pthread_join(p->workers[i].thread, NULL);
+  pthread_join(p->output, NULL);
+
+  if (stats != NULL) {
+    stats->captured = p->produced;
+    stats->ring_drops = p->ring_drops;
+  }
+
+  release(p);
+}
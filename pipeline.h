@@ -0,0 +1,32 @@
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <stdint.h>
+#include <pcap/pcap.h>
+
+
+// Multi-threaded decoding: the capture thread only copies packets in a bounded
+// ring, `workers' threads decode them, and an output thread writes their
+// output back in capture order. Packets are spread on the workers by flow (see
+// flow.h), so a worker always sees all the packets of a flow.
+struct pipeline;
+
+struct pipeline_stats {
+  uint64_t captured;
+  uint64_t ring_drops;
+};
+
+// When `lossy' is set (live capture), packets are dropped when the ring is
+// full instead of blocking the capture thread.
+struct pipeline *pipeline_create(uint16_t link_type, unsigned workers,
+                                 unsigned slots, int lossy);
+
+// pcap_handler compatible, `args' is the pipeline
+void pipeline_push(uint8_t *args, const struct pcap_pkthdr *header,
+                   const uint8_t *packet);
+
+// Waits for all the captured packets to be decoded and written, then frees
+// the pipeline.
+void pipeline_destroy(struct pipeline *pipeline, struct pipeline_stats *stats);
+
+#endif
@@ -0,0 +1,217 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <net/ethernet.h>
+#include <netinet/in.h>
+
+#include "dissect.h"
+#include "profile.h"
+
+// 16 buckets per power of two, up to 2^40 ticks
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define MAX_SHIFT (40 - SUB_BITS)
+#define BUCKETS ((MAX_SHIFT + 2) * SUB_BUCKETS)
+
+// Distinct decoders seen by a thread
+#define MAX_POINTS 64
+
+struct point {
+  uint8_t stage;
+  unsigned key;
+  uint64_t calls;
+  uint64_t total;
+  uint64_t buckets[BUCKETS];
+};
+
+struct profile {
+  unsigned count;
+  uint64_t overflow; // calls of the decoders past MAX_POINTS
+  struct point points[MAX_POINTS];
+  struct profile *next;
+};
+
+__thread uint64_t profile_children = 0;
+
+static __thread struct profile *thread_profile = NULL;
+static struct profile *profiles = NULL;
+static pthread_mutex_t profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *stage_names[PROFILE_STAGES] = {
+  [PROFILE_LINK] = "link",
+  [PROFILE_ETHER] = "ether",
+  [PROFILE_IP] = "ip",
+  [PROFILE_UDP] = "udp",
+  [PROFILE_RENDER] = "render",
+};
+
+static inline unsigned bucket(uint64_t ticks) {
+  if (ticks < SUB_BUCKETS) return ticks;
+  unsigned shift = 63 - __builtin_clzll(ticks) - SUB_BITS;
+  if (shift > MAX_SHIFT) return BUCKETS - 1;
+  return (shift + 1) * SUB_BUCKETS + ((ticks >> shift) & (SUB_BUCKETS - 1));
+}
+
+// Lowest value of a bucket
+static uint64_t bucket_value(unsigned index) {
+  if (index < SUB_BUCKETS) return index;
+  unsigned shift = index / SUB_BUCKETS - 1;
+  return (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+}
+
+static struct profile *get_profile(void) {
+  if (thread_profile != NULL) return thread_profile;
+
+  struct profile *p = calloc(1, sizeof(struct profile));
+  if (p == NULL) return NULL;
+  pthread_mutex_lock(&profiles_lock);
+  p->next = profiles;
+  profiles = p;
+  pthread_mutex_unlock(&profiles_lock);
+  thread_profile = p;
+  return p;
+}
+
+static struct point *find(struct profile *p, uint8_t stage, unsigned key) {
+  for (unsigned i = 0; i < p->count; i++)
+    if (p->points[i].stage == stage && p->points[i].key == key)
+      return &p->points[i];
+  if (p->count == MAX_POINTS) return NULL;
+  struct point *point = &p->points[p->count++];
+  point->stage = stage;
+  point->key = key;
+  return point;
+}
+
+void profile_record(enum profile_stage stage, unsigned key, uint64_t ticks) {
+  struct profile *p = get_profile();
+  if (p == NULL) return;
+  struct point *point = find(p, stage, key);
+  if (point == NULL) {
+    p->overflow++;
+    return;
+  }
+  point->calls++;
+  point->total += ticks;
+  point->buckets[bucket(ticks)]++;
+}
+
+static void point_name(const struct point *point, char *buf, size_t size) {
+  const char *name = NULL;
+  switch (point->stage) {
+    case PROFILE_LINK:
+      switch (point->key) {
+        case LAYER_ETHERNET: name = "ethernet"; break;
+        case LAYER_LINUX_SLL: name = "linux-sll"; break;
+        case LAYER_NULL: name = "null"; break;
+        case LAYER_PAYLOAD: name = "raw"; break;
+      }
+      break;
+    case PROFILE_ETHER:
+      switch (point->key) {
+        case ETHERTYPE_IP: name = "ipv4"; break;
+        case ETHERTYPE_IPV6: name = "ipv6"; break;
+        case ETHERTYPE_ARP: name = "arp"; break;
+        case ETHERTYPE_VLAN: name = "vlan"; break;
+      }
+      break;
+    case PROFILE_IP:
+      switch (point->key) {
+        case IPPROTO_ICMP: name = "icmp"; break;
+        case IPPROTO_TCP: name = "tcp"; break;
+        case IPPROTO_UDP: name = "udp"; break;
+        case IPPROTO_ICMPV6: name = "icmpv6"; break;
+      }
+      break;
+    case PROFILE_UDP:
+      if (point->key == 0) name = "raw";
+      break;
+    case PROFILE_RENDER:
+      snprintf(buf, size, "%s", stage_names[point->stage]);
+      return;
+  }
+  if (name != NULL)
+    snprintf(buf, size, "%s/%s", stage_names[point->stage], name);
+  else
+    snprintf(buf, size, "%s/%u", stage_names[point->stage], point->key);
+}
+
+static double percentile(const struct point *point, double fraction) {
+  uint64_t rank = (uint64_t)(point->calls * fraction);
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < BUCKETS; i++) {
+    seen += point->buckets[i];
+    if (seen > rank) return bucket_value(i);
+  }
+  return bucket_value(BUCKETS - 1);
+}
+
+// Ticks per nanosecond, measured against the monotonic clock
+static double tick_rate(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  struct timespec start, end, pause = { 0, 20000000 };
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t ticks = profile_ticks();
+  nanosleep(&pause, NULL);
+  ticks = profile_ticks() - ticks;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+  return ns > 0 ? ticks / ns : 1;
+#else
+  return 1;
+#endif
+}
+
+static int by_total(const void *a, const void *b) {
+  const struct point *pa = a, *pb = b;
+  return pa->total < pb->total ? 1 : pa->total > pb->total ? -1 : 0;
+}
+
+void profile_report(void) {
+  // All the threads merged
+  struct profile *merged = calloc(1, sizeof(struct profile));
+  if (merged == NULL) return;
+  uint64_t total = 0;
+  pthread_mutex_lock(&profiles_lock);
+  while (profiles != NULL) {
+    struct profile *p = profiles;
+    profiles = p->next;
+    merged->overflow += p->overflow;
+    for (unsigned i = 0; i < p->count; i++) {
+      const struct point *from = &p->points[i];
+      struct point *into = find(merged, from->stage, from->key);
+      if (into == NULL) {
+        merged->overflow += from->calls;
+        continue;
+      }
+      into->calls += from->calls;
+      into->total += from->total;
+      total += from->total;
+      for (unsigned b = 0; b < BUCKETS; b++)
+        into->buckets[b] += from->buckets[b];
+    }
+    free(p);
+  }
+  pthread_mutex_unlock(&profiles_lock);
+  thread_profile = NULL;
+
+  qsort(merged->points, merged->count, sizeof(struct point), by_total);
+  double rate = tick_rate();
+  fprintf(stderr, "%-16s %12s %10s %10s %10s %10s %7s\n",
+          "decoder", "calls", "mean ns", "p50 ns", "p99 ns", "p99.9 ns", "share");
+  for (unsigned i = 0; i < merged->count; i++) {
+    const struct point *point = &merged->points[i];
+    char name[32];
+    point_name(point, name, sizeof(name));
+    fprintf(stderr, "%-16s %12" PRIu64 " %10.0f %10.0f %10.0f %10.0f %6.1f%%\n",
+            name, point->calls, point->total / rate / point->calls,
+            percentile(point, 0.5) / rate, percentile(point, 0.99) / rate,
+            percentile(point, 0.999) / rate, total > 0 ? 100.0 * point->total / total : 0);
+  }
+  if (merged->overflow > 0)
+    fprintf(stderr, "%" PRIu64 " calls of other decoders not profiled\n", merged->overflow);
+  free(merged);
+}
@@ -0,0 +1,87 @@
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+// Latency of each decoder, to know where the time goes. Compiled in with
+// `-DPROFILE' (`make PROFILE=1'), and to nothing otherwise: PROFILE_CALL is
+// then only the call.
+//
+// Each dispatch (link handler, ethertype, IP protocol, UDP port, and the
+// rendering of the packet) is timed with the cycle counter (clock_gettime off
+// x86). The time of the nested decoders is taken out, so that each one only
+// counts its own work. Every thread has its histograms (log buckets, 16 per
+// power of two, so ~6% precision), merged at exit into a table of p50, p99,
+// p99.9 and share of the total time, on stderr.
+#ifdef PROFILE
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+enum profile_stage {
+  PROFILE_LINK, // keyed by the type of the first layer
+  PROFILE_ETHER, // by ethertype
+  PROFILE_IP, // by protocol
+  PROFILE_UDP, // by port, 0 when not decoded
+  PROFILE_RENDER,
+  PROFILE_STAGES,
+};
+
+struct profile_frame {
+  uint64_t start;
+  uint64_t children; // time of the nested calls of the caller, so far
+};
+
+// Time spent in the calls nested in the current one
+extern __thread uint64_t profile_children;
+
+static inline uint64_t profile_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void profile_record(enum profile_stage stage, unsigned key, uint64_t ticks);
+
+static inline void profile_enter(struct profile_frame *frame) {
+  frame->children = profile_children;
+  profile_children = 0;
+  frame->start = profile_ticks();
+}
+
+static inline void profile_leave(struct profile_frame *frame, enum profile_stage stage, unsigned key) {
+  uint64_t elapsed = profile_ticks() - frame->start;
+  profile_record(stage, key, elapsed - profile_children);
+  profile_children = frame->children + elapsed;
+}
+
+// `key' is evaluated after the call
+#define PROFILE_CALL(stage, key, call)                                         \
+  do {                                                                         \
+    struct profile_frame _frame;                                               \
+    profile_enter(&_frame);                                                    \
+    call;                                                                      \
+    profile_leave(&_frame, stage, key);                                        \
+  } while (0)
+
+// Once all the decoding threads are done
+void profile_report(void);
+
+#else
+
+#define PROFILE_CALL(stage, key, call)                                         \
+  do {                                                                         \
+    (void)(key);                                                               \
+    call;                                                                      \
+  } while (0)
+#define profile_report() ((void)0)
+
+#endif
+
+#endif
@@ -4,54 +4,78 @@
 #include <netinet/icmp6.h>
 #include <netinet/udp.h>
 #include <netinet/tcp.h>
+#include <stddef.h>
 
+#include "cursor.h"
+#include "flow.h"
+#include "profile.h"
 #include "protocol.h"
+#include "stream.h"
+#include "tcp.h"
 #include "udp.h"
 #include "util.h"
 
-static void handle_icmp(uint32_t length, const uint8_t* packet) {
-  struct icmp* icmp = (struct icmp*)packet;
-  APPLY_OVERHEAD(struct icmp, length, packet);
-  DEBUGF("ICMP type: 0x%02x", icmp->icmp_type);
-  PRINTF("ICMP type: 0x%02x", icmp->icmp_type);
+static void handle_icmp(struct dissection *d, uint32_t length, const uint8_t* packet) {
+  struct cursor c = cursor_make(packet, length);
+  CURSOR_NEED(c, sizeof(struct icmp));
+  struct cursor h = cursor_pull(&c, sizeof(struct icmp));
+  struct layer *l = dissect_push(d, LAYER_ICMP, h.data, c.length);
+  if (l == NULL) return;
+  l->icmp.type = cursor_u8(&h, offsetof(struct icmp, icmp_type));
+  l->icmp.code = cursor_u8(&h, offsetof(struct icmp, icmp_code));
 }
 
-static void handle_icmpv6(uint32_t length, const uint8_t* packet) {
-  struct icmp6_hdr* icmp6 = (struct icmp6_hdr*)packet;
-  APPLY_OVERHEAD(struct icmp6_hdr, length, packet);
-  DEBUGF("ICMPv6 type: 0x%02x", icmp6->icmp6_type);
-  PRINTF("ICMPv6 type: 0x%02x", icmp6->icmp6_type);
+static void handle_icmpv6(struct dissection *d, uint32_t length, const uint8_t* packet) {
+  struct cursor c = cursor_make(packet, length);
+  CURSOR_NEED(c, sizeof(struct icmp6_hdr));
+  struct cursor h = cursor_pull(&c, sizeof(struct icmp6_hdr));
+  struct layer *l = dissect_push(d, LAYER_ICMPV6, h.data, c.length);
+  if (l == NULL) return;
+  l->icmp.type = cursor_u8(&h, offsetof(struct icmp6_hdr, icmp6_type));
+  l->icmp.code = cursor_u8(&h, offsetof(struct icmp6_hdr, icmp6_code));
 }
 
-static void handle_udp(uint32_t length, const uint8_t* packet) {
-  struct udphdr* udp = (struct udphdr *)packet;
-  APPLY_OVERHEAD(struct udphdr, length, packet);
-  DEBUGF("UDP sport: %d, dport: %d, length: %d, checksum: %04x",
-         htons(udp->uh_sport),
-         htons(udp->uh_dport),
-         htons(udp->uh_ulen),
-         htons(udp->uh_sum))
-  PRINTF("UDP port %d -> %d, ",
-         htons(udp->uh_sport),
-         htons(udp->uh_dport));
+static void handle_udp(struct dissection *d, uint32_t length, const uint8_t* packet) {
+  struct cursor c = cursor_make(packet, length);
+  CURSOR_NEED(c, sizeof(struct udphdr));
+  struct cursor h = cursor_pull(&c, sizeof(struct udphdr));
+  struct layer *l = dissect_push(d, LAYER_UDP, h.data, c.length);
+  if (l == NULL) return;
+  l->udp.sport = cursor_u16(&h, offsetof(struct udphdr, uh_sport));
+  l->udp.dport = cursor_u16(&h, offsetof(struct udphdr, uh_dport));
+  l->udp.length = cursor_u16(&h, offsetof(struct udphdr, uh_ulen));
+  l->udp.checksum = cursor_u16(&h, offsetof(struct udphdr, uh_sum));
 
-  handle_udp_payload(htons(udp->uh_sport), htons(udp->uh_dport), length, packet);
+  handle_udp_payload(d, l->udp.sport, l->udp.dport, c.length, c.data);
 }
 
-static void handle_tcp(uint32_t length, const uint8_t* packet) {
-  struct tcphdr* tcp = (struct tcphdr *)packet;
-  APPLY_OVERHEAD(struct tcphdr, length, packet);
-  DEBUGF("TCP sport: %d, dport: %d, checksum: %04x",
-         htons(tcp->th_sport),
-         htons(tcp->th_dport),
-         htons(tcp->th_sum))
-  PRINTF("TCP port %d -> %d, ",
-         htons(tcp->th_sport),
-         htons(tcp->th_dport));
+static void handle_tcp(struct dissection *d, uint32_t length, const uint8_t* packet) {
+  struct cursor c = cursor_make(packet, length);
+  CURSOR_NEED(c, sizeof(struct tcphdr));
+  struct cursor h = cursor_pull(&c, sizeof(struct tcphdr));
+  struct layer *l = dissect_push(d, LAYER_TCP, h.data, c.length);
+  if (l == NULL) return;
+  l->tcp.sport = cursor_u16(&h, offsetof(struct tcphdr, th_sport));
+  l->tcp.dport = cursor_u16(&h, offsetof(struct tcphdr, th_dport));
+  l->tcp.checksum = cursor_u16(&h, offsetof(struct tcphdr, th_sum));
+  l->tcp.flags = cursor_u8(&h, offsetof(struct tcphdr, th_flags));
+
+  // The payload starts after the options (th_off, the high nibble of the
+  // byte after th_ack)
+  uint32_t off = (cursor_u8(&h, offsetof(struct tcphdr, th_ack) + 4) >> 4) * 4;
+  uint32_t options = off > sizeof(struct tcphdr) ? off - sizeof(struct tcphdr) : 0;
+  if (options > c.length) options = c.length;
+  struct cursor payload = c;
+  cursor_skip(&payload, options);
+  struct flow_key key;
+  flow_key_from_layers(d, &key);
+
   indent_log();
-  handle_raw(length, packet);
+  l->tcp.held = stream_segment(d, &key, cursor_u32(&h, offsetof(struct tcphdr, th_seq)),
+                               l->tcp.flags, payload.data, payload.length);
+  if (resolve_tcp_app(l->tcp.dport) == NULL && resolve_tcp_app(l->tcp.sport) == NULL)
+    handle_raw(d, payload.length, payload.data);
   dedent_log();
-  // TODO: reassemble packets and handle application layer
 }
 
 static protocol_handler handlers[] = {
@@ -67,14 +91,16 @@ protocol_handler resolve_protocol_handler(const uint16_t protocol_type) {
   return handlers[protocol_type];
 }
 
-void handle_protocol_payload(const uint16_t protocol, const uint32_t length, const uint8_t *packet) {
+void handle_protocol_payload(struct dissection *d, const uint16_t protocol,
+                             const uint32_t length, const uint8_t *packet) {
   protocol_handler handler = resolve_protocol_handler(protocol);
   if (handler == NULL) {
     WARNF("Unknown protocol %#04x", protocol);
+    stats_warn(STATS_UNKNOWN_PROTOCOL);
     return;
   }
 
   indent_log();
-  handler(length, packet);
+  PROFILE_CALL(PROFILE_IP, protocol, handler(d, length, packet));
   dedent_log();
 }
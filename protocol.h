@@ -3,8 +3,11 @@
 
 #include <stdint.h>
 
-typedef void(*protocol_handler)(uint32_t, const uint8_t*);
+#include "dissect.h"
+
+typedef void(*protocol_handler)(struct dissection *, uint32_t, const uint8_t*);
 protocol_handler resolve_protocol_handler(const uint16_t protocol);
-void handle_protocol_payload(const uint16_t protocol, const uint32_t, const uint8_t *packet);
+void handle_protocol_payload(struct dissection *d, const uint16_t protocol,
+                             const uint32_t, const uint8_t *packet);
 
 #endif
@@ -0,0 +1,175 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "output.h"
+#include "record.h"
+#include "util.h"
+
+// Fields of a layer, NULL, ARP and IPv6 being the biggest
+#define RECORD_LAYER_MAX (RECORD_LAYER_HEADER_SIZE + 40)
+
+static inline uint8_t *put_u8(uint8_t *p, uint8_t v) {
+  *p = v;
+  return p + 1;
+}
+
+static inline uint8_t *put_u16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  return p + 2;
+}
+
+static inline uint8_t *put_u32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+  return p + 4;
+}
+
+static inline uint8_t *put_bytes(uint8_t *p, const uint8_t *bytes, size_t length) {
+  memcpy(p, bytes, length);
+  return p + length;
+}
+
+void record_stream_header(void) {
+  uint8_t *start = (uint8_t *)out_reserve(RECORD_STREAM_HEADER_SIZE);
+  if (start == NULL) return;
+  uint8_t *p = put_bytes(start, (const uint8_t *)RECORD_MAGIC, 4);
+  p = put_u16(p, RECORD_VERSION);
+  p = put_u16(p, RECORD_STREAM_HEADER_SIZE);
+  out_commit(p - start);
+}
+
+static uint8_t *put_layer(uint8_t *p, const struct dissection *d, const struct layer *l) {
+  uint8_t *start = p;
+  p = put_u8(p, l->type);
+  p = put_u8(p, l->depth);
+  p += 2; // size, once known
+  p = put_u32(p, l->offset);
+  p = put_u32(p, l->length);
+
+  switch (l->type) {
+    case LAYER_PAYLOAD:
+      break;
+    case LAYER_NULL:
+      p = put_u32(p, l->null.af);
+      p = put_u16(p, l->null.ether_type);
+      break;
+    case LAYER_LINUX_SLL:
+      p = put_bytes(p, l->sll.addr, 8);
+      p = put_u16(p, l->sll.ether_type);
+      break;
+    case LAYER_ETHERNET:
+      p = put_bytes(p, l->ether.src, 6);
+      p = put_bytes(p, l->ether.dst, 6);
+      p = put_u16(p, l->ether.ether_type);
+      break;
+    case LAYER_VLAN:
+      p = put_u16(p, l->vlan.tci);
+      p = put_u16(p, l->vlan.ether_type);
+      break;
+    case LAYER_ARP:
+      p = put_u16(p, l->arp.op);
+      p = put_bytes(p, l->arp.sha, 6);
+      p = put_bytes(p, l->arp.spa, 4);
+      p = put_bytes(p, l->arp.tha, 6);
+      p = put_bytes(p, l->arp.tpa, 4);
+      break;
+    case LAYER_IPV4:
+      p = put_bytes(p, l->ipv4.src, 4);
+      p = put_bytes(p, l->ipv4.dst, 4);
+      p = put_u8(p, l->ipv4.proto);
+      break;
+    case LAYER_IPV6:
+      p = put_bytes(p, l->ipv6.src, 16);
+      p = put_bytes(p, l->ipv6.dst, 16);
+      p = put_u8(p, l->ipv6.next);
+      p = put_u8(p, l->ipv6.proto);
+      break;
+    case LAYER_IPV6_EXT:
+      p = put_u8(p, l->ipv6_ext.type);
+      p = put_u8(p, l->ipv6_ext.next);
+      break;
+    case LAYER_ICMP:
+    case LAYER_ICMPV6:
+      p = put_u8(p, l->icmp.type);
+      p = put_u8(p, l->icmp.code);
+      break;
+    case LAYER_UDP:
+      p = put_u16(p, l->udp.sport);
+      p = put_u16(p, l->udp.dport);
+      p = put_u16(p, l->udp.length);
+      p = put_u16(p, l->udp.checksum);
+      break;
+    case LAYER_TCP:
+      p = put_u16(p, l->tcp.sport);
+      p = put_u16(p, l->tcp.dport);
+      p = put_u16(p, l->tcp.checksum);
+      break;
+    case LAYER_DNS:
+      p = put_u16(p, l->dns.id);
+      // The dissection keeps them in network order for the dns.h macros
+      p = put_u16(p, ntohs(l->dns.flags));
+      p = put_u16(p, l->dns.qdcount);
+      p = put_u16(p, l->dns.ancount);
+      p = put_u16(p, l->dns.nscount);
+      p = put_u16(p, l->dns.arcount);
+      break;
+    case LAYER_BOOTP:
+      p = put_u8(p, l->bootp.op);
+      p = put_u8(p, l->bootp.htype);
+      p = put_u8(p, l->bootp.hlen);
+      p = put_u8(p, l->bootp.hops);
+      p = put_u32(p, ntohl(l->bootp.xid));
+      uint8_t *count = p;
+      p += 2;
+      uint16_t written = 0;
+      for (uint16_t i = 0; i < l->bootp.option_count; i++) {
+        const struct dhcp_option *option = &l->bootp.options[i];
+        // The size of a layer must fit in 16 bits, only jumbo frames get there
+        if (p - start + 2 + option->length > UINT16_MAX) break;
+        p = put_u8(p, option->code);
+        p = put_u8(p, option->length);
+        p = put_bytes(p, d->packet + option->offset, option->length);
+        written++;
+      }
+      put_u16(count, written);
+      break;
+    case LAYER_VXLAN:
+      p = put_u32(p, l->vxlan.id);
+      break;
+  }
+
+  put_u16(start + 2, p - start);
+  return p;
+}
+
+void render_record(const struct pcap_pkthdr *header, const struct dissection *d) {
+  // The whole record is reserved at once, so that its size can be written
+  // at the end
+  size_t size = RECORD_HEADER_SIZE;
+  for (unsigned i = 0; i < d->count; i++) {
+    const struct layer *l = &d->layers[i];
+    size += RECORD_LAYER_MAX;
+    if (l->type == LAYER_BOOTP)
+      for (uint16_t j = 0; j < l->bootp.option_count; j++)
+        size += 2 + l->bootp.options[j].length;
+  }
+
+  uint8_t *start = (uint8_t *)out_reserve(size);
+  if (start == NULL) return;
+
+  uint8_t *p = start + 4; // size, once known
+  p = put_u32(p, header->ts.tv_sec);
+  p = put_u32(p, header->ts.tv_usec);
+  p = put_u32(p, header->caplen);
+  p = put_u32(p, header->len);
+  p = put_u16(p, d->count);
+  p = put_u16(p, 0);
+  for (unsigned i = 0; i < d->count; i++)
+    p = put_layer(p, d, &d->layers[i]);
+
+  put_u32(start, p - start);
+  out_commit(p - start);
+}
@@ -0,0 +1,75 @@
+#ifndef __RECORD_H
+#define __RECORD_H
+
+#include <stdint.h>
+#include <pcap/pcap.h>
+
+#include "dissect.h"
+
+// Compact binary output (--format=binary), for pipelines that would rather
+// not parse text. All integers are little-endian, addresses are copied as they
+// are on the wire.
+//
+// The stream starts with a header:
+//
+//   0   char[4]  magic "MYDR"
+//   4   u16      version (RECORD_VERSION)
+//   6   u16      size of this header (8), later versions may extend it
+//
+// Then one record per packet:
+//
+//   0   u32      size of the record, this field included
+//   4   u32      timestamp, seconds
+//   8   u32      timestamp, microseconds
+//   12  u32      captured length
+//   16  u32      original length
+//   20  u16      number of layers
+//   22  u16      reserved, 0
+//   24  layers...
+//
+// Each layer starts with:
+//
+//   0   u8       type (enum layer_type in dissect.h)
+//   1   u8       depth
+//   2   u16      size of the layer, this header included
+//   4   u32      offset of the header in the packet
+//   8   u32      length of what follows the header
+//   12  fields...
+//
+// followed by the fields of its type, in this order:
+//
+//   PAYLOAD     none (the bytes are not copied)
+//   NULL        u32 af, u16 ether_type
+//   LINUX_SLL   u8[8] addr, u16 ether_type
+//   ETHERNET    u8[6] src, u8[6] dst, u16 ether_type
+//   VLAN        u16 tci, u16 ether_type
+//   ARP         u16 op, u8[6] sha, u8[4] spa, u8[6] tha, u8[4] tpa
+//   IPV4        u8[4] src, u8[4] dst, u8 proto
+//   IPV6        u8[16] src, u8[16] dst, u8 next, u8 proto (after the
+//               extension headers)
+//   ICMP        u8 type, u8 code
+//   ICMPV6      u8 type, u8 code
+//   UDP         u16 sport, u16 dport, u16 length, u16 checksum
+//   TCP         u16 sport, u16 dport, u16 checksum
+//   DNS         u16 id, u16 flags, u16 qdcount, u16 ancount, u16 nscount,
+//               u16 arcount
+//   BOOTP       u8 op, u8 htype, u8 hlen, u8 hops, u32 xid, u16 option count,
+//               then for each option: u8 code, u8 length, u8[length] value
+//   VXLAN       u32 vni
+//   IPV6_EXT    u8 header type, u8 next
+//
+// Readers skip the layers they do not know with their size, and new fields
+// are only ever appended to a layer.
+#define RECORD_MAGIC "MYDR"
+#define RECORD_VERSION 1
+#define RECORD_STREAM_HEADER_SIZE 8
+#define RECORD_HEADER_SIZE 24
+#define RECORD_LAYER_HEADER_SIZE 12
+
+// Writes the stream header, once before the first record
+void record_stream_header(void);
+
+// Writes a dissection as one record
+void render_record(const struct pcap_pkthdr *header, const struct dissection *d);
+
+#endif
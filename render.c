@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <net/if_arp.h>
+
+#include "arrow.h"
+#include "cursor.h"
+#include "dns.h"
+#include "format.h"
+#include "json.h"
+#include "output.h"
+#include "record.h"
+#include "render.h"
+#include "util.h"
+#include "vlan.h"
+
+static enum output_format output_format = OUTPUT_TEXT;
+
+static const char* dhcp_msgtype[] = {
+  [1] = "DHCPDISCOVER",
+  [2] = "DHCPOFFER",
+  [3] = "DHCPREQUEST",
+  [4] = "DHCPDECLINE",
+  [5] = "DHCPACK",
+  [6] = "DHCPNAK",
+  [7] = "DHCPRELEASE",
+  [8] = "DHCPINFORM",
+  [9] = "DHCPFORCERENEW",
+  [10] = "DHCPLEASEQUERY",
+  [11] = "DHCPLEASEUNASSIGNED",
+  [12] = "DHCPLEASEUNKNOWN",
+  [13] = "DHCPLEASEACTIVE",
+  [14] = "DHCPBULKLEASEQUERY",
+  [15] = "DHCPLEASEQUERYDONE",
+  [16] = "DHCPACTIVELEASEQUERY",
+  [17] = "DHCPLEASEQUERYSTATUS",
+  [18] = "DHCPTLS"
+};
+
+const char *dhcp_msgtype_name(uint8_t type) {
+  if (type >= sizeof(dhcp_msgtype) / sizeof(dhcp_msgtype[0]))
+    return NULL;
+  return dhcp_msgtype[type];
+}
+
+static char* truncate(uint8_t length, const uint8_t* payload, char *buf) {
+  memcpy(buf, payload, length);
+  buf[length] = '\0';
+  return buf;
+}
+
+static void render_dhcp_option(const struct dissection *d, const struct dhcp_option *option) {
+  const uint8_t *payload = d->packet + option->offset;
+  // Fixed-size values shorter than they should be are shown raw
+  struct cursor value = cursor_make(payload, option->length);
+  char ip[INET_ADDRSTRLEN];
+  // Big enough for 63 addresses, or 255 bytes in decimal
+  char buf[256 * 5];
+
+  switch (option->code) {
+    case 0: // Pad
+      break;
+
+    case 1: // Network mask
+      if (!cursor_has(&value, 0, 4)) goto raw;
+      DEBUGF("Network mask %s", format_ipv4(payload, ip));
+      break;
+
+    case 3: // Router
+      format_ipv4_list(payload, option->length / 4, ", ", buf);
+      DEBUGF("Router %s", buf);
+      break;
+
+    case 6: // Domain Name Server
+      format_ipv4_list(payload, option->length / 4, ", ", buf);
+      DEBUGF("Domain Name Server %s", buf);
+      break;
+
+    case 12: // Hostname
+      DEBUGF("Hostname %s", truncate(option->length, payload, buf));
+      break;
+
+    case 15: // Domain Name
+      DEBUGF("Domain Name %s", truncate(option->length, payload, buf));
+      break;
+
+    case 50: // Requested IP Address
+      if (!cursor_has(&value, 0, 4)) goto raw;
+      DEBUGF("Requested IP Address %s", format_ipv4(payload, ip));
+      break;
+
+    case 51: // Lease time
+      if (!cursor_has(&value, 0, 4)) goto raw;
+      DEBUGF("Lease time %u", cursor_u32(&value, 0));
+      break;
+
+    case 53: // DHCP msg type
+      if (!cursor_has(&value, 0, 1)) goto raw;
+      if (dhcp_msgtype_name(cursor_u8(&value, 0)) != NULL)
+        DEBUGF("DHCP message type %s", dhcp_msgtype_name(cursor_u8(&value, 0)));
+      break;
+
+    case 54: // Server Identifier
+      if (!cursor_has(&value, 0, 4)) goto raw;
+      DEBUGF("Server Identifier %s", format_ipv4(payload, ip));
+      break;
+
+    case 55: // Parameter Request List
+      format_u8_list(payload, option->length, ", ", buf);
+      DEBUGF("Parameter Request List %s", buf);
+      break;
+
+    case 57: // Maximum DHCP Message Size
+      if (!cursor_has(&value, 0, 2)) goto raw;
+      DEBUGF("Maximum DHCP Message Size %d", cursor_u16(&value, 0));
+      break;
+
+    case 252: // WPAD
+      DEBUGF("WPAD %s", truncate(option->length, payload, buf));
+      break;
+
+    default:
+    raw:
+      format_hex_list(payload, option->length, " ", buf);
+      DEBUGF("DHCP option %3d (len: %2d): %s", option->code, option->length, buf);
+      break;
+  }
+}
+
+static void render_hex(uint32_t length, const uint8_t *packet) {
+  char *buf = out_reserve(FORMAT_HEXDUMP_SIZE(length));
+  if (buf != NULL)
+    out_commit(format_hexdump(packet, length, buf));
+}
+
+// One line per packet, one part per layer
+static void render_line(const struct layer *l) {
+  char src[INET6_ADDRSTRLEN];
+  char dst[INET6_ADDRSTRLEN];
+
+  switch (l->type) {
+    case LAYER_PAYLOAD:
+      PRINTF("Raw (length: %d)", l->length);
+      break;
+    case LAYER_NULL:
+      PRINTF("Loopback, ");
+      break;
+    case LAYER_LINUX_SLL:
+      PRINTF("Linux SLL %s, ", format_ether(l->sll.addr, src));
+      break;
+    case LAYER_ETHERNET:
+      PRINTF("Ethernet %s -> %s, ",
+             format_ether(l->ether.dst, dst), format_ether(l->ether.src, src));
+      break;
+    case LAYER_VLAN:
+      PRINTF("VLAN %d, ", l->vlan.tci);
+      break;
+    case LAYER_ARP:
+      if (l->arp.op == ARPOP_REQUEST) PRINTF("ARP request");
+      if (l->arp.op == ARPOP_REPLY) PRINTF("ARP reply");
+      break;
+    case LAYER_IPV4:
+      PRINTF("IPv4 %s -> %s, ",
+             format_ipv4(l->ipv4.src, src),
+             format_ipv4(l->ipv4.dst, dst));
+      break;
+    case LAYER_IPV6:
+      PRINTF("IPv6 %s -> %s, ",
+             format_ipv6(l->ipv6.src, src),
+             format_ipv6(l->ipv6.dst, dst));
+      break;
+    case LAYER_ICMP:
+      PRINTF("ICMP type: 0x%02x", l->icmp.type);
+      break;
+    case LAYER_ICMPV6:
+      PRINTF("ICMPv6 type: 0x%02x", l->icmp.type);
+      break;
+    case LAYER_UDP:
+      PRINTF("UDP port %d -> %d, ", l->udp.sport, l->udp.dport);
+      break;
+    case LAYER_TCP:
+      PRINTF("TCP port %d -> %d, ", l->tcp.sport, l->tcp.dport);
+      // Decoded with a later packet, once the bytes before it arrive
+      if (l->tcp.held) PRINTF("held for reordering");
+      break;
+    case LAYER_DNS:
+      PRINTF("DNS");
+      break;
+    case LAYER_BOOTP:
+      PRINTF("BOOTP %s", l->bootp.op == 1 ? "request" : "reply");
+      break;
+    case LAYER_VXLAN:
+    case LAYER_IPV6_EXT:
+      break;
+  }
+}
+
+// One log per layer, indented by nesting level
+static void render_debug(const struct dissection *d, const struct layer *l) {
+  char src[INET6_ADDRSTRLEN];
+  char dst[INET6_ADDRSTRLEN];
+  char sha[ETHER_ADDRSTRLEN];
+  char tha[ETHER_ADDRSTRLEN];
+
+  indent_reset();
+  for (uint8_t i = 0; i < l->depth; i++) indent_log();
+
+  switch (l->type) {
+    case LAYER_PAYLOAD:
+      DEBUGF("Raw packet (length: %d)", l->length);
+      break;
+    case LAYER_NULL:
+      DEBUGF("Null packet type: 0x%04x, length: %d", l->null.af, l->length);
+      break;
+    case LAYER_LINUX_SLL:
+      DEBUGF("Linux SLL packet addr: %s, type: 0x%04x, length: %d",
+             format_ether(l->sll.addr, src), l->sll.ether_type, l->length);
+      break;
+    case LAYER_ETHERNET:
+      DEBUGF("Ethernet packet dst: %s, src: %s, type: 0x%04x, length: %d",
+             format_ether(l->ether.dst, dst), format_ether(l->ether.src, src),
+             l->ether.ether_type, l->length);
+      break;
+    case LAYER_VLAN:
+      DEBUGF("VLAN vid: %d, type: %04x", l->vlan.tci & VLAN_VID_MASK, l->vlan.ether_type);
+      break;
+    case LAYER_ARP:
+      switch (l->arp.op) {
+        case ARPOP_REQUEST:
+          DEBUGF("ARP request, who has %s (%s)? Tell %s (%s)",
+                 format_ipv4(l->arp.tpa, dst), format_ether(l->arp.tha, tha),
+                 format_ipv4(l->arp.spa, src), format_ether(l->arp.sha, sha));
+          break;
+        case ARPOP_REPLY:
+          DEBUGF("ARP reply, %s is at %s",
+                 format_ipv4(l->arp.spa, src), format_ether(l->arp.sha, sha));
+          break;
+        default:
+          DEBUGF("Unhandled ARP op: %04x, tpa: %s, tha: %s, spa: %s, sha: %s", l->arp.op,
+                 format_ipv4(l->arp.tpa, dst), format_ether(l->arp.tha, tha),
+                 format_ipv4(l->arp.spa, src), format_ether(l->arp.sha, sha));
+          break;
+      }
+      break;
+    case LAYER_IPV4:
+      DEBUGF("IPv4 packet src: %s, dst: %s, protocol: %#08x",
+             format_ipv4(l->ipv4.src, src),
+             format_ipv4(l->ipv4.dst, dst),
+             l->ipv4.proto);
+      break;
+    case LAYER_IPV6:
+      DEBUGF("IPv6 packet src:[%s], dst:[%s], protocol: %#08x",
+             format_ipv6(l->ipv6.src, src),
+             format_ipv6(l->ipv6.dst, dst),
+             l->ipv6.proto);
+      break;
+    case LAYER_IPV6_EXT:
+      DEBUGF("IPv6 extension header type: %d, next: %d, length: %d",
+             l->ipv6_ext.type, l->ipv6_ext.next, l->length);
+      break;
+    case LAYER_ICMP:
+      DEBUGF("ICMP type: 0x%02x", l->icmp.type);
+      break;
+    case LAYER_ICMPV6:
+      DEBUGF("ICMPv6 type: 0x%02x", l->icmp.type);
+      break;
+    case LAYER_UDP:
+      DEBUGF("UDP sport: %d, dport: %d, length: %d, checksum: %04x",
+             l->udp.sport, l->udp.dport, l->udp.length, l->udp.checksum);
+      break;
+    case LAYER_TCP:
+      DEBUGF("TCP sport: %d, dport: %d, checksum: %04x",
+             l->tcp.sport, l->tcp.dport, l->tcp.checksum);
+      if (l->tcp.held) {
+        indent_log();
+        DEBUG("Segment held for reordering");
+      }
+      break;
+    case LAYER_DNS:
+      DEBUGF("DNS id:0x%04x qr:%d opcode:0x%02x aa:%d tc:%d rd:%d ra:%d z:%d rcode:%d qdcount:%d ancount:%d nscount:%d arcount:%d",
+             l->dns.id, l->dns.qr, l->dns.opcode, l->dns.aa, l->dns.tc, l->dns.rd,
+             l->dns.ra, l->dns.z, l->dns.rcode,
+             l->dns.qdcount, l->dns.ancount, l->dns.nscount, l->dns.arcount);
+      break;
+    case LAYER_BOOTP:
+      DEBUGF("BOOTP op:%x htype:%x len:%d hops:%d xid:%x",
+             l->bootp.op, l->bootp.htype, l->bootp.hlen, l->bootp.hops, l->bootp.xid);
+      indent_log();
+      for (uint16_t i = 0; i < l->bootp.option_count; i++)
+        render_dhcp_option(d, &l->bootp.options[i]);
+      break;
+    case LAYER_VXLAN:
+      DEBUGF("VXLAN vni: 0x%06x", l->vxlan.id);
+      break;
+  }
+}
+
+void render_text(const struct dissection *d) {
+  const struct dissect_warning *w = d->warnings;
+  for (unsigned i = 0; i < d->count; i++) {
+    const struct layer *l = &d->layers[i];
+    if (LOG_LEVEL < LEVEL_DEBUG) {
+      render_line(l);
+      continue;
+    }
+
+    // The warnings of the decoders, where they were logged between the layers
+    w = dissect_log_warnings(w, i);
+    render_debug(d, l);
+    if (l->type == LAYER_PAYLOAD && LOG_LEVEL >= LEVEL_DEBUG + 1)
+      render_hex(l->length, d->packet + l->offset);
+  }
+  dissect_log_warnings(w, d->count);
+  indent_reset();
+  PRINTF("\n");
+}
+
+void render_init(const struct render_config *config) {
+  output_format = config->format;
+  // The layers are traced once decoded, and the warnings with them
+  dissect_defer_warnings(output_format == OUTPUT_TEXT && LOG_LEVEL >= LEVEL_DEBUG);
+  if (output_format == OUTPUT_BINARY) {
+    // Written now, before any thread has output to write
+    record_stream_header();
+    output_flush();
+  } else if (output_format == OUTPUT_ARROW) {
+    arrow_init(config->batch_rows);
+  }
+}
+
+void render_flush(void) {
+  if (output_format == OUTPUT_ARROW)
+    arrow_flush();
+}
+
+void render_finish(void) {
+  if (output_format == OUTPUT_ARROW)
+    arrow_finish();
+}
+
+void render_packet(const struct pcap_pkthdr *header, const struct dissection *d) {
+  render_packet_as(output_format, header, d);
+}
+
+void render_packet_as(enum output_format format, const struct pcap_pkthdr *header,
+                      const struct dissection *d) {
+  if (d == NULL) return;
+  // Only the text traces the layers
+  if (format != OUTPUT_TEXT)
+    dissect_log_warnings(d->warnings, d->count);
+  switch (format) {
+    case OUTPUT_JSON:
+      render_json(header, d);
+      break;
+    case OUTPUT_BINARY:
+      render_record(header, d);
+      break;
+    case OUTPUT_ARROW:
+      arrow_append(header, d);
+      break;
+    case OUTPUT_NONE:
+      break;
+    case OUTPUT_TEXT:
+    default:
+      render_text(d);
+      break;
+  }
+}
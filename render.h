@@ -0,0 +1,49 @@
+#ifndef __RENDER_H
+#define __RENDER_H
+
+#include <stdint.h>
+#include <pcap/pcap.h>
+
+#include "dissect.h"
+
+enum output_format {
+  OUTPUT_TEXT,
+  OUTPUT_JSON,   // NDJSON, see json.h
+  OUTPUT_BINARY, // length-prefixed records, see record.h
+  OUTPUT_ARROW,  // Arrow IPC stream, see arrow.h
+  OUTPUT_NONE,   // only the summaries of sketch.h
+};
+
+struct render_config {
+  enum output_format format;
+  unsigned batch_rows; // Arrow only
+};
+
+// Chosen once, before the capture starts. Writes the stream header of the
+// formats that have one.
+void render_init(const struct render_config *config);
+
+// Writes what the calling thread has pending (a partial Arrow batch), to be
+// called before its output is taken.
+void render_flush(void);
+
+// Writes the end of the stream, once all the threads have flushed
+void render_finish(void);
+
+// Writes nothing when `d' is NULL (link type not supported)
+void render_packet(const struct pcap_pkthdr *header, const struct dissection *d);
+
+// In another format than the one of render_init, except Arrow, whose batches
+// are per thread (see mydump_render)
+void render_packet_as(enum output_format format, const struct pcap_pkthdr *header,
+                      const struct dissection *d);
+
+// Writes a dissection as text: one line per packet with PRINTF, or one debug
+// log per layer at the debug level, followed by a hex dump of the payload
+// at the level above. Nothing is formatted for the levels that are not shown.
+void render_text(const struct dissection *d);
+
+// Name of a DHCP message type (option 53), NULL if unknown
+const char *dhcp_msgtype_name(uint8_t type);
+
+#endif
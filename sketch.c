@@ -0,0 +1,458 @@
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "dns.h"
+#include "flow.h"
+#include "format.h"
+#include "output.h"
+#include "sketch.h"
+#include "util.h"
+
+#define HLL_REGISTERS (1 << SKETCH_HLL_BITS)
+
+enum kind {
+  K_SOURCES,
+  K_DESTINATIONS,
+  K_SOURCE_PORTS,
+  K_DESTINATION_PORTS,
+  K_DNS_SERVERS,
+  KINDS,
+};
+
+static const char *kind_names[KINDS] = {
+  [K_SOURCES] = "sources",
+  [K_DESTINATIONS] = "destinations",
+  [K_SOURCE_PORTS] = "source ports",
+  [K_DESTINATION_PORTS] = "destination ports",
+  [K_DNS_SERVERS] = "DNS servers",
+};
+
+// An address, or a port in the first two bytes (family 0)
+struct item {
+  uint8_t value[16];
+  uint8_t family;
+};
+
+struct candidate {
+  struct item item;
+  uint64_t hash;
+  uint32_t count;
+};
+
+struct counts {
+  uint32_t rows[SKETCH_DEPTH][SKETCH_WIDTH];
+  struct candidate top[SKETCH_CANDIDATES];
+  unsigned used;
+  unsigned min; // candidate with the lowest count
+};
+
+// Sketches of a thread, or of an interval merged from the threads
+struct sketch {
+  uint64_t packets;
+  struct counts counts[KINDS];
+  uint8_t sources[HLL_REGISTERS];
+  uint8_t flows[HLL_REGISTERS];
+  // End of the interval counted (seconds of capture time), 0 before the first
+  // packet of the thread. Only changed by the thread, under `lock'.
+  uint64_t end;
+  struct sketch *next;
+};
+
+static unsigned interval = 0;
+static unsigned threads = 1;
+
+// The rest is under `lock'. All the sketches of the threads, kept after they
+// are gone for sketch_finish.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sketch *sketches = NULL;
+static unsigned registered = 0;
+static __thread struct sketch *thread_sketch = NULL;
+// Set on the thread that only reads the capture for the decoding threads
+static __thread int reader = 0;
+
+// The intervals handed over by some threads but not all, by end
+static struct sketch *pending = NULL;
+static unsigned pending_count = 0;
+static uint64_t origin = 0; // capture time of the first packet, in seconds
+static uint64_t latest = 0; // highest end of the threads, also read without the lock
+static uint64_t written = 0; // end of the last interval written
+
+void sketch_init(unsigned seconds, unsigned decoding_threads) {
+  interval = seconds;
+  threads = decoding_threads;
+}
+
+void sketch_origin(const struct pcap_pkthdr *header) {
+  if (interval == 0) return;
+  reader = 1;
+  pthread_mutex_lock(&lock);
+  if (origin == 0) origin = header->ts.tv_sec;
+  pthread_mutex_unlock(&lock);
+}
+
+static struct sketch *get_sketch(void) {
+  if (thread_sketch != NULL) return thread_sketch;
+
+  struct sketch *s = calloc(1, sizeof(struct sketch));
+  if (s == NULL) return NULL;
+
+  pthread_mutex_lock(&lock);
+  s->next = sketches;
+  sketches = s;
+  registered++;
+  pthread_mutex_unlock(&lock);
+  thread_sketch = s;
+  return s;
+}
+
+static inline uint64_t mix(uint64_t h, uint64_t v) {
+  h ^= v;
+  h *= 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 29);
+}
+
+static inline uint64_t load64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t hash_item(const struct item *item) {
+  uint64_t h = mix(item->family + 1, load64(item->value));
+  h = mix(h, load64(item->value + 8));
+  return mix(h, h >> 32);
+}
+
+static uint64_t hash_flow(const struct flow_key *key) {
+  uint64_t h = key->family | (uint64_t)key->proto << 8
+             | (uint64_t)key->vlan << 16 | (uint64_t)key->tunnel_id << 32;
+  h = mix(h, load64(key->src));
+  h = mix(h, load64(key->src + 8));
+  h = mix(h, load64(key->dst));
+  h = mix(h, load64(key->dst + 8));
+  h = mix(h, (uint64_t)key->sport << 16 | key->dport);
+  return mix(h, h >> 32);
+}
+
+// Row r uses h1 + r * h2 (Kirsch and Mitzenmacher), from one 64 bit hash
+static inline uint32_t cell(uint64_t hash, unsigned row) {
+  return ((uint32_t)hash + row * (uint32_t)(hash >> 32)) & (SKETCH_WIDTH - 1);
+}
+
+static uint32_t estimate(const struct counts *c, uint64_t hash) {
+  uint32_t count = UINT32_MAX;
+  for (unsigned r = 0; r < SKETCH_DEPTH; r++)
+    if (c->rows[r][cell(hash, r)] < count)
+      count = c->rows[r][cell(hash, r)];
+  return count;
+}
+
+static void find_min(struct counts *c) {
+  c->min = 0;
+  for (unsigned i = 1; i < c->used; i++)
+    if (c->top[i].count < c->top[c->min].count)
+      c->min = i;
+}
+
+static void count(struct counts *c, const struct item *item) {
+  uint64_t hash = hash_item(item);
+
+  // Conservative update: only the counters below the new estimate move
+  uint32_t n = estimate(c, hash) + 1;
+  for (unsigned r = 0; r < SKETCH_DEPTH; r++)
+    if (c->rows[r][cell(hash, r)] < n)
+      c->rows[r][cell(hash, r)] = n;
+
+  for (unsigned i = 0; i < c->used; i++) {
+    struct candidate *k = &c->top[i];
+    if (k->hash == hash && memcmp(&k->item, item, sizeof(struct item)) == 0) {
+      k->count = n;
+      if (i == c->min) find_min(c);
+      return;
+    }
+  }
+  if (c->used < SKETCH_CANDIDATES) {
+    c->top[c->used++] = (struct candidate){ .item = *item, .hash = hash, .count = n };
+    find_min(c);
+  } else if (n > c->top[c->min].count) {
+    c->top[c->min] = (struct candidate){ .item = *item, .hash = hash, .count = n };
+    find_min(c);
+  }
+}
+
+static void count_distinct(uint8_t *registers, uint64_t hash) {
+  unsigned index = hash >> (64 - SKETCH_HLL_BITS);
+  // Leading zeros of the rest, with a bit set past it for when it is all 0
+  uint8_t rank = __builtin_clzll(hash << SKETCH_HLL_BITS | 1ULL << (SKETCH_HLL_BITS - 1)) + 1;
+  if (rank > registers[index]) registers[index] = rank;
+}
+
+static double distinct(const uint8_t *registers) {
+  double m = HLL_REGISTERS;
+  double sum = 0;
+  unsigned zeros = 0;
+  for (unsigned i = 0; i < HLL_REGISTERS; i++) {
+    sum += ldexp(1.0, -registers[i]);
+    if (registers[i] == 0) zeros++;
+  }
+  double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+  // Linear counting is better for the small ones
+  if (e <= 2.5 * m && zeros > 0)
+    e = m * log(m / zeros);
+  return e;
+}
+
+static void address_item(struct item *item, const struct flow_key *key, const uint8_t *addr) {
+  memset(item, 0, sizeof(struct item));
+  memcpy(item->value, addr, key->family == 4 ? 4 : 16);
+  item->family = key->family;
+}
+
+static void port_item(struct item *item, uint16_t port) {
+  memset(item, 0, sizeof(struct item));
+  memcpy(item->value, &port, sizeof(port));
+}
+
+static void add_packet(struct sketch *s, const struct dissection *d) {
+  struct flow_key key;
+  flow_key_from_layers(d, &key);
+  s->packets++;
+  count_distinct(s->flows, hash_flow(&key));
+  if (key.family == 0) return;
+
+  struct item item;
+  address_item(&item, &key, key.src);
+  count(&s->counts[K_SOURCES], &item);
+  count_distinct(s->sources, hash_item(&item));
+  address_item(&item, &key, key.dst);
+  count(&s->counts[K_DESTINATIONS], &item);
+
+  if (key.proto == IPPROTO_TCP || key.proto == IPPROTO_UDP) {
+    port_item(&item, key.sport);
+    count(&s->counts[K_SOURCE_PORTS], &item);
+    port_item(&item, key.dport);
+    count(&s->counts[K_DESTINATION_PORTS], &item);
+  }
+
+  for (unsigned i = 0; i < d->count; i++) {
+    if (d->layers[i].type != LAYER_DNS) continue;
+    // The server is the destination of the queries, the source of the answers
+    struct dns_hdr h = { .flags = ntohs(d->layers[i].dns.flags) };
+    address_item(&item, &key, h.qr ? key.src : key.dst);
+    count(&s->counts[K_DNS_SERVERS], &item);
+    break;
+  }
+}
+
+static void merge(struct sketch *into, const struct sketch *s) {
+  into->packets += s->packets;
+  for (unsigned k = 0; k < KINDS; k++) {
+    struct counts *c = &into->counts[k];
+    const struct counts *from = &s->counts[k];
+    for (unsigned r = 0; r < SKETCH_DEPTH; r++)
+      for (unsigned i = 0; i < SKETCH_WIDTH; i++)
+        c->rows[r][i] += from->rows[r][i];
+
+    // Candidates are merged after the counters, their counts are estimated
+    // again from the sum
+    for (unsigned i = 0; i < from->used; i++) {
+      const struct candidate *candidate = &from->top[i];
+      unsigned j = 0;
+      while (j < c->used && (c->top[j].hash != candidate->hash
+                             || memcmp(&c->top[j].item, &candidate->item, sizeof(struct item)) != 0))
+        j++;
+      if (j < c->used) continue;
+      if (c->used < SKETCH_CANDIDATES) {
+        c->top[c->used++] = *candidate;
+        continue;
+      }
+      // Keeps the heaviest ones, by what this thread saw
+      find_min(c);
+      if (candidate->count > c->top[c->min].count) c->top[c->min] = *candidate;
+    }
+  }
+  for (unsigned i = 0; i < HLL_REGISTERS; i++) {
+    if (s->sources[i] > into->sources[i]) into->sources[i] = s->sources[i];
+    if (s->flows[i] > into->flows[i]) into->flows[i] = s->flows[i];
+  }
+}
+
+static void reset(struct sketch *s) {
+  s->packets = 0;
+  memset(s->counts, 0, sizeof(s->counts));
+  memset(s->sources, 0, sizeof(s->sources));
+  memset(s->flows, 0, sizeof(s->flows));
+}
+
+static int compare_candidates(const void *a, const void *b) {
+  const struct candidate *ca = a, *cb = b;
+  return (ca->count < cb->count) - (ca->count > cb->count);
+}
+
+static size_t format_item(const struct item *item, char *buf) {
+  switch (item->family) {
+    case 4:
+      return strlen(format_ipv4(item->value, buf));
+    case 6:
+      return strlen(format_ipv6(item->value, buf));
+    default:
+    {
+      uint16_t port;
+      memcpy(&port, item->value, sizeof(port));
+      return format_uint(port, buf);
+    }
+  }
+}
+
+// Writes the interval from `from' to `to' (0 for the end of the capture)
+static void dump(struct sketch *merged, uint64_t from, uint64_t to) {
+  // A line per kind: each item is at most an IPv6 address and a count
+  size_t size = 256 + KINDS * (64 + SKETCH_TOP * (INET6_ADDRSTRLEN + 24));
+  char *buf = malloc(size);
+  if (buf == NULL) return;
+  size_t len = 0;
+  if (to > 0)
+    len += snprintf(buf, size, "%" PRIu64 "-%" PRIu64 ": ", from, to);
+  else
+    len += snprintf(buf, size, "%" PRIu64 "-end: ", from);
+  len += snprintf(buf + len, size - len,
+                  "%" PRIu64 " packets, ~%.0f sources, ~%.0f flows\n",
+                  merged->packets, distinct(merged->sources), distinct(merged->flows));
+
+  for (unsigned k = 0; k < KINDS; k++) {
+    struct counts *c = &merged->counts[k];
+    for (unsigned i = 0; i < c->used; i++)
+      c->top[i].count = estimate(c, c->top[i].hash);
+    qsort(c->top, c->used, sizeof(struct candidate), compare_candidates);
+
+    len += snprintf(buf + len, size - len, "  %s:", kind_names[k]);
+    for (unsigned i = 0; i < c->used && i < SKETCH_TOP; i++) {
+      buf[len++] = ' ';
+      len += format_item(&c->top[i].item, buf + len);
+      buf[len++] = ' ';
+      len += format_uint(c->top[i].count, buf + len);
+    }
+    buf[len++] = '\n';
+  }
+
+  struct iovec iov = { .iov_base = buf, .iov_len = len };
+  output_writev(&iov, 1);
+  free(buf);
+}
+
+// End of the interval of a packet, the first one starts with the capture
+static uint64_t interval_end(uint64_t now) {
+  if (now < origin) now = origin;
+  return now - (now - origin) % interval + interval;
+}
+
+// Merges the sketch of a thread with the others of its interval, and resets it
+static void hand_over(struct sketch *s) {
+  if (s->end == 0) return;
+  // Its interval was written without it (SKETCH_PENDING): in the next one
+  uint64_t end = s->end > written ? s->end : written + interval;
+  struct sketch **p = &pending;
+  while (*p != NULL && (*p)->end < end)
+    p = &(*p)->next;
+  if (*p == NULL || (*p)->end != end) {
+    struct sketch *merged = calloc(1, sizeof(struct sketch));
+    if (merged == NULL) {
+      reset(s);
+      return;
+    }
+    merged->end = end;
+    merged->next = *p;
+    *p = merged;
+    pending_count++;
+  }
+  merge(*p, s);
+  reset(s);
+}
+
+// Writes the intervals all the threads are done with, in order. A thread
+// which has not started yet could still have packets for any of them.
+static void write_done(void) {
+  while (pending != NULL) {
+    struct sketch *merged = pending;
+    if (pending_count <= SKETCH_PENDING) {
+      if (registered < threads) return;
+      for (struct sketch *s = sketches; s != NULL; s = s->next)
+        if (s->end <= merged->end) return;
+    }
+    pending = merged->next;
+    pending_count--;
+    dump(merged, merged->end - interval, merged->end);
+    written = merged->end;
+    free(merged);
+  }
+}
+
+// The thread moves on to the interval ending at `end'
+static void move_to(struct sketch *s, uint64_t end) {
+  hand_over(s);
+  s->end = end;
+  if (end > latest) __atomic_store_n(&latest, end, __ATOMIC_RELAXED);
+  write_done();
+}
+
+void sketch_packet(const struct pcap_pkthdr *header, const struct dissection *d) {
+  if (interval == 0 || d == NULL || d->count == 0) return;
+  struct sketch *s = get_sketch();
+  if (s == NULL) return;
+
+  // The sketch is only touched by its thread, and handed over with the first
+  // packet past its interval
+  uint64_t now = header->ts.tv_sec;
+  if (now >= s->end) {
+    pthread_mutex_lock(&lock);
+    if (origin == 0) origin = now;
+    move_to(s, interval_end(now));
+    pthread_mutex_unlock(&lock);
+  }
+  add_packet(s, d);
+}
+
+void sketch_idle(void) {
+  // Not counted with the decoding threads: `registered' would reach
+  // `threads' before all of them start
+  if (interval == 0 || reader) return;
+  uint64_t end = __atomic_load_n(&latest, __ATOMIC_RELAXED);
+  if (end == 0 || (thread_sketch != NULL && thread_sketch->end >= end)) return;
+  struct sketch *s = get_sketch();
+  if (s == NULL) return;
+  // Its next packets can not be older than what the others already decoded
+  pthread_mutex_lock(&lock);
+  move_to(s, latest);
+  pthread_mutex_unlock(&lock);
+}
+
+void sketch_finish(void) {
+  if (interval == 0) return;
+  pthread_mutex_lock(&lock);
+  // The threads are gone
+  struct sketch *s = sketches;
+  sketches = NULL;
+  while (s != NULL) {
+    struct sketch *next = s->next;
+    hand_over(s);
+    free(s);
+    s = next;
+  }
+  while (pending != NULL) {
+    struct sketch *merged = pending;
+    pending = merged->next;
+    dump(merged, merged->end - interval, pending != NULL ? merged->end : 0);
+    free(merged);
+  }
+  pending_count = 0;
+  registered = 0;
+  pthread_mutex_unlock(&lock);
+  thread_sketch = NULL;
+}
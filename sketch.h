@@ -0,0 +1,59 @@
+#ifndef __SKETCH_H
+#define __SKETCH_H
+
+#include <stdint.h>
+
+#include <pcap/pcap.h>
+
+#include "dissect.h"
+
+// Approximate traffic summary, in place of the output of every packet. For
+// each interval of capture time, the heaviest source and destination
+// addresses, ports and DNS servers (by packets), and the number of distinct
+// sources and flows.
+//
+// The heavy hitters are counted by a Count-Min sketch (SKETCH_DEPTH rows of
+// SKETCH_WIDTH counters, with conservative updates) per kind of item, which
+// can only overestimate: by less than e / SKETCH_WIDTH of the packets, but
+// for a chance of e^-SKETCH_DEPTH. Next to it, the SKETCH_CANDIDATES items with
+// the highest estimates are kept to know what to report. The distinct counts are
+// HyperLogLog estimates with 2^SKETCH_HLL_BITS registers, about 1.6% off.
+//
+// Each decoding thread has its own sketches, of a fixed size whatever the
+// traffic, and counts its packets without any lock. With its first packet of
+// the next interval, or when its capture is idle, it hands them over: they are
+// merged (counters added, registers maxed) with the ones of the other threads
+// for the same interval, which is written on the output once all of them are
+// past it.
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096
+#define SKETCH_CANDIDATES 64
+#define SKETCH_HLL_BITS 12
+
+// Intervals waiting for the threads behind, beyond which the oldest one is
+// written without them
+#define SKETCH_PENDING 16
+
+// Items reported for each kind
+#define SKETCH_TOP 10
+
+// Set before any packet is decoded, `interval' in seconds of capture time.
+// Nothing is written before the `threads' decoding threads have started.
+void sketch_init(unsigned interval, unsigned threads);
+
+// From the thread reading a capture decoded by others, before they get its
+// first packet: the intervals start with it. sketch_idle does nothing on that
+// thread afterwards.
+void sketch_origin(const struct pcap_pkthdr *header);
+
+// Counts a decoded packet
+void sketch_packet(const struct pcap_pkthdr *header, const struct dissection *d);
+
+// From a decoding thread without packets for now, so that the others do not
+// wait for its next packet (or its first one) to write their intervals
+void sketch_idle(void);
+
+// Once all the decoding threads are done: writes the last interval
+void sketch_finish(void);
+
+#endif
@@ -0,0 +1,72 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+// Chunks start with the link to the next one, objects follow, aligned for
+// any field type
+#define CHUNK_HEADER 16
+
+void slab_init(struct slab *slab, size_t size, unsigned per_chunk, struct slab_budget *budget) {
+  slab->size = (size + 15) & ~(size_t)15;
+  slab->per_chunk = per_chunk;
+  slab->budget = budget;
+  slab->free = NULL;
+  slab->chunks = NULL;
+  slab->in_use = 0;
+}
+
+static int grow(struct slab *slab) {
+  size_t bytes = CHUNK_HEADER + slab->size * slab->per_chunk;
+  if (slab->budget != NULL) {
+    size_t used = __atomic_add_fetch(&slab->budget->used, bytes, __ATOMIC_RELAXED);
+    if (used > slab->budget->limit) {
+      __atomic_sub_fetch(&slab->budget->used, bytes, __ATOMIC_RELAXED);
+      return -1;
+    }
+  }
+
+  uint8_t *chunk = malloc(bytes);
+  if (chunk == NULL) {
+    if (slab->budget != NULL)
+      __atomic_sub_fetch(&slab->budget->used, bytes, __ATOMIC_RELAXED);
+    return -1;
+  }
+  *(void **)chunk = slab->chunks;
+  slab->chunks = chunk;
+
+  for (unsigned i = slab->per_chunk; i > 0; i--) {
+    void **object = (void **)(chunk + CHUNK_HEADER + (i - 1) * slab->size);
+    *object = slab->free;
+    slab->free = object;
+  }
+  return 0;
+}
+
+void *slab_alloc(struct slab *slab) {
+  if (slab->free == NULL && grow(slab) < 0)
+    return NULL;
+  void **object = slab->free;
+  slab->free = *object;
+  slab->in_use++;
+  return object;
+}
+
+void slab_free(struct slab *slab, void *object) {
+  *(void **)object = slab->free;
+  slab->free = object;
+  slab->in_use--;
+}
+
+void slab_destroy(struct slab *slab) {
+  size_t bytes = CHUNK_HEADER + slab->size * slab->per_chunk;
+  while (slab->chunks != NULL) {
+    void *next = *(void **)slab->chunks;
+    free(slab->chunks);
+    if (slab->budget != NULL)
+      __atomic_sub_fetch(&slab->budget->used, bytes, __ATOMIC_RELAXED);
+    slab->chunks = next;
+  }
+  slab->free = NULL;
+  slab->in_use = 0;
+}
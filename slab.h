@@ -0,0 +1,34 @@
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include <stddef.h>
+
+// Pool of fixed-size objects, allocated by chunks and never given back to
+// malloc until the pool is destroyed: freed objects are reused as they are.
+// A pool belongs to one thread. Pools share a budget, which bounds the memory
+// of all their chunks together; once it is reached, slab_alloc fails and the
+// caller has to free objects (evict something) to get new ones.
+struct slab_budget {
+  size_t limit;
+  size_t used; // updated atomically, pools of several threads share it
+};
+
+struct slab {
+  size_t size;
+  unsigned per_chunk;
+  struct slab_budget *budget;
+  void *free;   // free objects, linked through their first word
+  void *chunks; // linked through their first word
+  size_t in_use;
+};
+
+void slab_init(struct slab *slab, size_t size, unsigned per_chunk, struct slab_budget *budget);
+
+// Returns NULL when the budget is reached, or when out of memory
+void *slab_alloc(struct slab *slab);
+void slab_free(struct slab *slab, void *object);
+
+// Frees all the chunks, and gives their memory back to the budget
+void slab_destroy(struct slab *slab);
+
+#endif
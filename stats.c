@@ -0,0 +1,324 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <net/ethernet.h>
+#include <netinet/in.h>
+
+#include "capture.h"
+#include "stats.h"
+#include "util.h"
+
+enum link {
+  LINK_ETHERNET,
+  LINK_LINUX_SLL,
+  LINK_NULL,
+  LINK_OTHER,
+  LINKS,
+};
+
+enum ethertype {
+  ETH_IPV4,
+  ETH_IPV6,
+  ETH_ARP,
+  ETH_VLAN,
+  ETH_OTHER,
+  ETHERTYPES,
+};
+
+enum udp {
+  UDP_DNS,
+  UDP_DHCP,
+  UDP_VXLAN,
+  UDP_OTHER,
+  UDPS,
+};
+
+static const char *link_names[LINKS] = { "ethernet", "linux-sll", "null", "other" };
+static const char *ethertype_names[ETHERTYPES] = { "ipv4", "ipv6", "arp", "vlan", "other" };
+static const char *udp_names[UDPS] = { "dns", "dhcp", "vxlan", "other" };
+static const char *warning_names[STATS_WARNINGS] = {
+  [STATS_TOO_SMALL] = "packet too small",
+  [STATS_UNKNOWN_ETHERTYPE] = "unknown ethertype",
+  [STATS_UNKNOWN_PROTOCOL] = "unknown protocol",
+  [STATS_ARP_TOO_SMALL] = "ARP too small",
+  [STATS_ARP_GARBAGE] = "garbage after ARP",
+  [STATS_TOO_MANY_LAYERS] = "too many layers",
+  [STATS_INVALID_FRAGMENT] = "invalid IPv4 fragment",
+  [STATS_IPV6_EXT_TOO_DEEP] = "too many IPv6 extensions",
+  [STATS_IPV6_EXT_TOO_SMALL] = "IPv6 extension too small",
+  [STATS_UNKNOWN_DHCP_TYPE] = "unknown DHCP type",
+  [STATS_INVALID_IPV4_HEADER] = "invalid IPv4 header length",
+  [STATS_BAD_IPV4_CHECKSUM] = "bad IPv4 checksum",
+  [STATS_BAD_UDP_CHECKSUM] = "bad UDP checksum",
+  [STATS_BAD_TCP_CHECKSUM] = "bad TCP checksum",
+};
+
+struct counter {
+  uint64_t packets;
+  uint64_t bytes;
+};
+
+// Counters of a thread, only written by it
+struct block {
+  struct counter total;
+  struct counter links[LINKS];
+  struct counter ethertypes[ETHERTYPES];
+  struct counter protocols[256];
+  struct counter udp[UDPS];
+  uint64_t warnings[STATS_WARNINGS];
+  struct block *next;
+};
+
+// Single writer: no read-modify-write needed, only whole stores that a
+// snapshot can not see torn
+#define BUMP(field, n) \
+  __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static int enabled = 0;
+static unsigned interval = 0;
+static struct capture *live_capture = NULL;
+
+// All the blocks, kept after their thread is gone
+static struct block *blocks = NULL;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct block *thread_block = NULL;
+
+static pthread_t snapshot_thread;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+static int stopping = 0;
+
+static struct block *get_block(void) {
+  if (thread_block != NULL) return thread_block;
+
+  struct block *b = calloc(1, sizeof(struct block));
+  if (b == NULL) return NULL;
+  pthread_mutex_lock(&blocks_lock);
+  b->next = blocks;
+  // Published after it is zeroed, the snapshot thread walks the list
+  __atomic_store_n(&blocks, b, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&blocks_lock);
+  thread_block = b;
+  return b;
+}
+
+void stats_warn(enum stats_warning warning) {
+  if (!enabled) return;
+  struct block *b = get_block();
+  if (b == NULL) return;
+  BUMP(b->warnings[warning], 1);
+}
+
+static inline void add(struct counter *c, uint32_t bytes) {
+  BUMP(c->packets, 1);
+  BUMP(c->bytes, bytes);
+}
+
+void stats_packet(const struct pcap_pkthdr *header, const struct dissection *d) {
+  if (!enabled || d == NULL) return;
+  struct block *b = get_block();
+  if (b == NULL) return;
+
+  uint32_t bytes = header->len;
+  add(&b->total, bytes);
+  if (d->count == 0) {
+    add(&b->links[LINK_OTHER], bytes);
+    return;
+  }
+
+  // The outermost headers only: a VXLAN frame counts as UDP
+  uint16_t ether_type = 0;
+  switch (d->layers[0].type) {
+    case LAYER_ETHERNET:
+      add(&b->links[LINK_ETHERNET], bytes);
+      ether_type = d->layers[0].ether.ether_type;
+      break;
+    case LAYER_LINUX_SLL:
+      add(&b->links[LINK_LINUX_SLL], bytes);
+      ether_type = d->layers[0].sll.ether_type;
+      break;
+    case LAYER_NULL:
+      add(&b->links[LINK_NULL], bytes);
+      ether_type = d->layers[0].null.ether_type;
+      break;
+    default:
+      add(&b->links[LINK_OTHER], bytes);
+      break;
+  }
+  switch (ether_type) {
+    case ETHERTYPE_IP: add(&b->ethertypes[ETH_IPV4], bytes); break;
+    case ETHERTYPE_IPV6: add(&b->ethertypes[ETH_IPV6], bytes); break;
+    case ETHERTYPE_ARP: add(&b->ethertypes[ETH_ARP], bytes); break;
+    case ETHERTYPE_VLAN: add(&b->ethertypes[ETH_VLAN], bytes); break;
+    default: add(&b->ethertypes[ETH_OTHER], bytes); break;
+  }
+
+  for (unsigned i = 1; i < d->count; i++) {
+    const struct layer *l = &d->layers[i];
+    if (l->type == LAYER_IPV4 || l->type == LAYER_IPV6) {
+      uint8_t proto = l->type == LAYER_IPV4 ? l->ipv4.proto : l->ipv6.proto;
+      add(&b->protocols[proto], bytes);
+      // Not the IP in IP
+      if (proto != IPPROTO_UDP) return;
+    } else if (l->type == LAYER_UDP) {
+      enum udp handler = UDP_OTHER;
+      if (i + 1 < d->count) {
+        switch (d->layers[i + 1].type) {
+          case LAYER_DNS: handler = UDP_DNS; break;
+          case LAYER_BOOTP: handler = UDP_DHCP; break;
+          case LAYER_VXLAN: handler = UDP_VXLAN; break;
+        }
+      }
+      add(&b->udp[handler], bytes);
+      return;
+    } else if (l->type != LAYER_VLAN && l->type != LAYER_IPV6_EXT) {
+      return;
+    }
+  }
+}
+
+static const char *protocol_name(unsigned proto) {
+  switch (proto) {
+    case IPPROTO_ICMP: return "icmp";
+    case IPPROTO_TCP: return "tcp";
+    case IPPROTO_UDP: return "udp";
+    case IPPROTO_ICMPV6: return "icmpv6";
+    default: return NULL;
+  }
+}
+
+static void sum(struct counter *into, const struct counter *c) {
+  into->packets += READ(c->packets);
+  into->bytes += READ(c->bytes);
+}
+
+// Appends to the `size' bytes of `buf', `*len' of them used. What does not
+// fit is cut, and `*len' stays below `size'.
+__attribute__((format(printf, 4, 5)))
+static void append(char *buf, size_t size, size_t *len, const char *fmt, ...) {
+  if (*len + 1 >= size) return;
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf + *len, size - *len, fmt, ap);
+  va_end(ap);
+  if (n < 0) return;
+  *len += n;
+  if (*len >= size) *len = size - 1;
+}
+
+// One line of counters, the empty ones skipped
+static void put_counters(char *buf, size_t size, size_t *len, const char *title,
+                         const char **names, const struct counter *c, unsigned count) {
+  append(buf, size, len, "  %s:", title);
+  for (unsigned i = 0; i < count; i++) {
+    if (c[i].packets == 0) continue;
+    char number[12];
+    const char *name = names != NULL ? names[i] : protocol_name(i);
+    if (name == NULL) {
+      snprintf(number, sizeof(number), "%u", i);
+      name = number;
+    }
+    append(buf, size, len, " %s %" PRIu64 " (%" PRIu64 " bytes)", name, c[i].packets, c[i].bytes);
+  }
+  append(buf, size, len, "\n");
+}
+
+static void snapshot(double elapsed) {
+  struct block total;
+  memset(&total, 0, sizeof(total));
+  for (struct block *b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b != NULL; b = b->next) {
+    sum(&total.total, &b->total);
+    for (unsigned i = 0; i < LINKS; i++) sum(&total.links[i], &b->links[i]);
+    for (unsigned i = 0; i < ETHERTYPES; i++) sum(&total.ethertypes[i], &b->ethertypes[i]);
+    for (unsigned i = 0; i < 256; i++) sum(&total.protocols[i], &b->protocols[i]);
+    for (unsigned i = 0; i < UDPS; i++) sum(&total.udp[i], &b->udp[i]);
+    for (unsigned i = 0; i < STATS_WARNINGS; i++) total.warnings[i] += READ(b->warnings[i]);
+  }
+
+  // Enough for every counter of every line at their largest
+  char buf[32768];
+  size_t size = sizeof(buf), len = 0;
+  append(buf, size, &len, "stats after %.1f s: %" PRIu64 " packets, %" PRIu64 " bytes\n",
+         elapsed, total.total.packets, total.total.bytes);
+  put_counters(buf, size, &len, "link", link_names, total.links, LINKS);
+  put_counters(buf, size, &len, "ethertype", ethertype_names, total.ethertypes, ETHERTYPES);
+  put_counters(buf, size, &len, "ip", NULL, total.protocols, 256);
+  put_counters(buf, size, &len, "udp", udp_names, total.udp, UDPS);
+  append(buf, size, &len, "  warnings:");
+  for (unsigned i = 0; i < STATS_WARNINGS; i++)
+    if (total.warnings[i] > 0)
+      append(buf, size, &len, " %s %" PRIu64, warning_names[i], total.warnings[i]);
+  append(buf, size, &len, "\n");
+
+  struct pcap_stat ps;
+  if (live_capture != NULL && live_capture->stats(live_capture, &ps) == 0)
+    append(buf, size, &len, "  kernel: %u received, %u dropped, %u dropped by interface\n",
+           ps.ps_recv, ps.ps_drop, ps.ps_ifdrop);
+  fputs(buf, stderr);
+  fflush(stderr);
+}
+
+static double seconds_since(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *snapshot_main(void *arg) {
+  (void)arg;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_mutex_lock(&stop_lock);
+  struct timespec next;
+  clock_gettime(CLOCK_REALTIME, &next);
+  while (!stopping) {
+    next.tv_sec += interval;
+    while (!stopping && pthread_cond_timedwait(&stop_cond, &stop_lock, &next) != ETIMEDOUT)
+      ;
+    if (stopping) break;
+    pthread_mutex_unlock(&stop_lock);
+    snapshot(seconds_since(&start));
+    pthread_mutex_lock(&stop_lock);
+  }
+  pthread_mutex_unlock(&stop_lock);
+  snapshot(seconds_since(&start));
+  return NULL;
+}
+
+int stats_start(unsigned seconds, struct capture *capture) {
+  interval = seconds;
+  live_capture = capture;
+  enabled = 1;
+
+  // SIGINT and SIGTERM are for the capture thread, to break its loop
+  sigset_t signals, saved;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &saved);
+  int err = pthread_create(&snapshot_thread, NULL, snapshot_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  if (err != 0) {
+    enabled = 0;
+    return -1;
+  }
+  return 0;
+}
+
+void stats_stop(void) {
+  if (!enabled) return;
+  pthread_mutex_lock(&stop_lock);
+  stopping = 1;
+  pthread_cond_signal(&stop_cond);
+  pthread_mutex_unlock(&stop_lock);
+  pthread_join(snapshot_thread, NULL);
+}
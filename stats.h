@@ -0,0 +1,55 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdint.h>
+
+#include <pcap/pcap.h>
+
+#include "dissect.h"
+
+struct capture;
+
+// Traffic and decoder counters. Each thread counts in its own block, which it
+// is the only one to write, with plain loads and stores; snapshots add the
+// blocks of all the threads, so counting never takes a lock nor an atomic
+// read-modify-write. Packets and bytes are counted by link layer, ethertype,
+// IP protocol and UDP decoder, from the dissection of each packet, and every
+// decoder warning on its own.
+//
+// A snapshot is written on stderr every few seconds (wall clock) by a thread
+// of its own, with the kernel counters of live captures, and a last one when
+// the capture stops, on its end or on SIGINT/SIGTERM.
+
+// Decoder warnings
+enum stats_warning {
+  STATS_TOO_SMALL,          // "Packet too small", any header
+  STATS_UNKNOWN_ETHERTYPE,
+  STATS_UNKNOWN_PROTOCOL,
+  STATS_ARP_TOO_SMALL,
+  STATS_ARP_GARBAGE,
+  STATS_TOO_MANY_LAYERS,
+  STATS_INVALID_FRAGMENT,
+  STATS_IPV6_EXT_TOO_DEEP,
+  STATS_IPV6_EXT_TOO_SMALL,
+  STATS_UNKNOWN_DHCP_TYPE,
+  STATS_INVALID_IPV4_HEADER,
+  STATS_BAD_IPV4_CHECKSUM,  // only counted with mydump_verify_checksums
+  STATS_BAD_UDP_CHECKSUM,
+  STATS_BAD_TCP_CHECKSUM,
+  STATS_WARNINGS,
+};
+
+// Counts a warning of the decoder of the calling thread
+void stats_warn(enum stats_warning warning);
+
+// Counts a decoded packet
+void stats_packet(const struct pcap_pkthdr *header, const struct dissection *d);
+
+// Starts the snapshot thread, with the capture to read the kernel counters
+// from (NULL for files). Counting works without it.
+int stats_start(unsigned interval, struct capture *capture);
+
+// Writes the last snapshot and stops the thread, once the capture is over
+void stats_stop(void);
+
+#endif
@@ -0,0 +1,462 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/tcp.h>
+
+#include "context.h"
+#include "slab.h"
+#include "stream.h"
+#include "util.h"
+#include "wheel.h"
+
+// Out-of-order data is kept in blocks of this size, bigger segments take
+// several of them
+#define SEGMENT_SIZE 2048
+#define SEGMENT_DATA (SEGMENT_SIZE - 16)
+
+struct segment {
+  struct segment *next;
+  uint32_t seq;
+  uint16_t length;
+  uint8_t data[SEGMENT_DATA];
+};
+
+// One direction of a connection
+struct half {
+  uint32_t next_seq; // next byte to deliver
+  uint32_t fin_seq;
+  uint8_t started;   // next_seq is known
+  uint8_t fin;       // fin_seq is known
+  uint8_t closed;    // delivered up to the FIN
+  uint32_t pending_bytes;
+  struct segment *pending; // out of order, sorted by seq
+};
+
+enum stream_state {
+  S_HALF_OPEN, // SYN seen, no answer yet
+  S_ESTABLISHED,
+  S_CLOSING,   // FIN seen in at least one direction
+};
+
+struct stream {
+  struct stream *hash_next;
+  struct stream *lru_prev;
+  struct stream *lru_next;
+  struct wheel_entry timer;
+  struct flow_key key; // as sent by the client
+  uint32_t hash;
+  uint8_t state;
+  struct half half[2];
+  const struct stream_app *app;
+  // Packet being decoded, NULL outside of stream_segment
+  struct dissection *d;
+  const uint8_t *payload;
+  uint64_t app_state[STREAM_APP_STATE / 8];
+};
+
+// Connections of a thread
+struct table {
+  struct stream **buckets;
+  size_t mask;
+  struct stream lru; // list head, most recent first
+  struct wheel wheel;
+  int wheel_started;
+  struct slab streams;
+  struct slab segments;
+};
+
+static size_t stream_memory = STREAM_DEFAULT_MEMORY;
+static stream_app_resolver resolve_app = NULL;
+
+// A quarter of the memory for the connections and the rest for the segments,
+// so that a flood of connections can not prevent all the buffering.
+static struct slab_budget stream_budget;
+static struct slab_budget segment_budget;
+
+static struct stream_stats totals;
+#define COUNT(counter) __atomic_add_fetch(&totals.counter, 1, __ATOMIC_RELAXED)
+
+
+static inline int32_t seq_diff(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b);
+}
+
+static void lru_unlink(struct stream *s) {
+  s->lru_prev->lru_next = s->lru_next;
+  s->lru_next->lru_prev = s->lru_prev;
+}
+
+static void lru_touch(struct table *t, struct stream *s) {
+  if (t->lru.lru_next == s) return;
+  lru_unlink(s);
+  s->lru_next = t->lru.lru_next;
+  s->lru_prev = &t->lru;
+  t->lru.lru_next->lru_prev = s;
+  t->lru.lru_next = s;
+}
+
+static void free_pending(struct table *t, struct half *h) {
+  while (h->pending != NULL) {
+    struct segment *next = h->pending->next;
+    slab_free(&t->segments, h->pending);
+    h->pending = next;
+  }
+  h->pending_bytes = 0;
+}
+
+static void close_stream(struct table *t, struct stream *s) {
+  if (s->app != NULL && s->app->close != NULL)
+    s->app->close(s);
+
+  free_pending(t, &s->half[0]);
+  free_pending(t, &s->half[1]);
+
+  struct stream **p = &t->buckets[s->hash & t->mask];
+  while (*p != s) p = &(*p)->hash_next;
+  *p = s->hash_next;
+
+  lru_unlink(s);
+  wheel_cancel(&s->timer);
+  slab_free(&t->streams, s);
+}
+
+static void expired(struct wheel_entry *entry, void *arg) {
+  struct stream *s = (struct stream *)((char *)entry - offsetof(struct stream, timer));
+  COUNT(timeouts);
+  close_stream(arg, s);
+}
+
+void stream_release(void *table) {
+  struct table *t = table;
+  while (t->lru.lru_next != &t->lru)
+    close_stream(t, t->lru.lru_next);
+  slab_destroy(&t->streams);
+  slab_destroy(&t->segments);
+  free(t->buckets);
+  free(t);
+}
+
+static struct table *get_table(void) {
+  struct mydump_context *c = context_current();
+  if (c->stream != NULL) return c->stream;
+
+  struct table *t = calloc(1, sizeof(struct table));
+  if (t == NULL) return NULL;
+
+  // About two connections per bucket when the budget is full
+  size_t buckets = 1024;
+  while (buckets * 2 * sizeof(struct stream) < stream_budget.limit) buckets *= 2;
+  t->buckets = calloc(buckets, sizeof(struct stream *));
+  if (t->buckets == NULL) {
+    free(t);
+    return NULL;
+  }
+  t->mask = buckets - 1;
+  t->lru.lru_next = t->lru.lru_prev = &t->lru;
+  slab_init(&t->streams, sizeof(struct stream), 64, &stream_budget);
+  slab_init(&t->segments, sizeof(struct segment), 8, &segment_budget);
+
+  c->stream = t;
+  return t;
+}
+
+void stream_init(size_t memory, stream_app_resolver resolver) {
+  stream_memory = memory;
+  resolve_app = resolver;
+  stream_budget.limit = memory / 4;
+  segment_budget.limit = memory - memory / 4;
+}
+
+// Evicts the least recently active connections until an object can be
+// allocated. Segments only come back from connections that have some, and
+// the connection being decoded is never evicted.
+static void *alloc_stream(struct table *t) {
+  void *p;
+  while ((p = slab_alloc(&t->streams)) == NULL) {
+    struct stream *victim = t->lru.lru_prev;
+    if (victim == &t->lru) return NULL;
+    COUNT(evictions);
+    close_stream(t, victim);
+  }
+  return p;
+}
+
+// Connections looked at from the LRU end to find segments to take back
+#define EVICTION_SCAN 64
+
+static struct segment *alloc_segment(struct table *t, struct stream *current) {
+  void *p;
+  while ((p = slab_alloc(&t->segments)) == NULL) {
+    struct stream *victim = t->lru.lru_prev;
+    for (int i = 0; victim != &t->lru && i < EVICTION_SCAN; i++, victim = victim->lru_prev)
+      if (victim != current && (victim->half[0].pending || victim->half[1].pending))
+        break;
+    if (victim == &t->lru || victim == current || !(victim->half[0].pending || victim->half[1].pending))
+      return NULL;
+    COUNT(evictions);
+    close_stream(t, victim);
+  }
+  return p;
+}
+
+static void deliver(struct stream *s, int dir, const uint8_t *data, uint32_t length) {
+  s->half[dir].next_seq += length;
+  if (s->app != NULL && s->app->data != NULL)
+    s->app->data(s, dir, data, length);
+}
+
+// Delivers the buffered segments that the last delivery made contiguous
+static void drain(struct table *t, struct stream *s, int dir) {
+  struct half *h = &s->half[dir];
+  while (h->pending != NULL && seq_diff(h->pending->seq, h->next_seq) <= 0) {
+    struct segment *seg = h->pending;
+    h->pending = seg->next;
+    h->pending_bytes -= seg->length;
+
+    // What was already delivered by another copy is skipped
+    int32_t skip = seq_diff(h->next_seq, seg->seq);
+    if (skip < seg->length)
+      deliver(s, dir, seg->data + skip, seg->length - skip);
+    slab_free(&t->segments, seg);
+  }
+}
+
+static void buffer(struct table *t, struct stream *s, int dir,
+                   uint32_t seq, const uint8_t *data, uint32_t length) {
+  struct half *h = &s->half[dir];
+  while (length > 0) {
+    uint16_t part = length < SEGMENT_DATA ? length : SEGMENT_DATA;
+
+    // Sorted by seq, after the copies already there. An exact retransmission
+    // of a buffered segment is not kept twice.
+    struct segment **p = &h->pending;
+    while (*p != NULL && seq_diff((*p)->seq, seq) <= 0) {
+      if ((*p)->seq == seq && (*p)->length >= part) break;
+      p = &(*p)->next;
+    }
+    if (*p != NULL && (*p)->seq == seq && (*p)->length >= part) {
+      COUNT(retransmissions);
+    } else {
+      struct segment *seg = alloc_segment(t, s);
+      if (seg == NULL) {
+        COUNT(drops);
+        return;
+      }
+      seg->seq = seq;
+      seg->length = part;
+      memcpy(seg->data, data, part);
+      seg->next = *p;
+      *p = seg;
+      h->pending_bytes += part;
+    }
+
+    seq += part;
+    data += part;
+    length -= part;
+  }
+}
+
+// Returns 1 if the segment is buffered until the hole before it is filled
+static int receive(struct table *t, struct stream *s, int dir,
+                   uint32_t seq, const uint8_t *data, uint32_t length) {
+  struct half *h = &s->half[dir];
+  for (;;) {
+    int32_t ahead = seq_diff(seq, h->next_seq);
+    if (ahead <= 0) {
+      // Starts with bytes already delivered
+      if ((uint32_t)-ahead >= length) {
+        COUNT(retransmissions);
+        return 0;
+      }
+      if (ahead < 0) COUNT(retransmissions);
+      deliver(s, dir, data - ahead, length + ahead);
+      drain(t, s, dir);
+      return 0;
+    }
+
+    if (h->pending_bytes + length <= STREAM_MAX_PENDING) {
+      COUNT(out_of_order);
+      buffer(t, s, dir, seq, data, length);
+      return 1;
+    }
+
+    // Too much waiting for the hole: skip it, up to the first byte received
+    COUNT(gaps);
+    if (s->app != NULL && s->app->gap != NULL)
+      s->app->gap(s, dir);
+    h->next_seq = h->pending != NULL && seq_diff(h->pending->seq, seq) < 0 ? h->pending->seq : seq;
+    drain(t, s, dir);
+  }
+}
+
+static struct stream *lookup(struct table *t, const struct flow_key *key,
+                             uint32_t hash, int *dir) {
+  for (struct stream *s = t->buckets[hash & t->mask]; s != NULL; s = s->hash_next) {
+    if (s->hash != hash) continue;
+    if (memcmp(&s->key, key, sizeof(struct flow_key)) == 0) {
+      *dir = 0;
+      return s;
+    }
+    const struct flow_key *k = &s->key;
+    if (memcmp(k->src, key->dst, 16) == 0 && memcmp(k->dst, key->src, 16) == 0
+        && k->sport == key->dport && k->dport == key->sport
+        && k->vlan == key->vlan && k->family == key->family
+        && k->proto == key->proto && k->tunnel_id == key->tunnel_id) {
+      *dir = 1;
+      return s;
+    }
+  }
+  return NULL;
+}
+
+static void reverse(const struct flow_key *key, struct flow_key *reversed) {
+  *reversed = *key;
+  memcpy(reversed->src, key->dst, 16);
+  memcpy(reversed->dst, key->src, 16);
+  reversed->sport = key->dport;
+  reversed->dport = key->sport;
+}
+
+static struct stream *create(struct table *t, const struct flow_key *key,
+                             uint32_t hash, uint8_t flags, int *dir) {
+  struct stream *s = alloc_stream(t);
+  if (s == NULL) {
+    COUNT(drops);
+    return NULL;
+  }
+  memset(s, 0, sizeof(struct stream));
+
+  // The client is the one that sends the SYN, or the first segment seen
+  // when the capture starts in the middle of the connection
+  *dir = 0;
+  s->key = *key;
+  if ((flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK)) {
+    reverse(key, &s->key);
+    *dir = 1;
+  }
+  s->hash = hash;
+  s->state = (flags & (TH_SYN | TH_ACK)) == TH_SYN ? S_HALF_OPEN : S_ESTABLISHED;
+  if (resolve_app != NULL) {
+    s->app = resolve_app(s->key.dport);
+    if (s->app == NULL) s->app = resolve_app(s->key.sport);
+  }
+
+  s->hash_next = t->buckets[hash & t->mask];
+  t->buckets[hash & t->mask] = s;
+  s->lru_next = t->lru.lru_next;
+  s->lru_prev = &t->lru;
+  t->lru.lru_next->lru_prev = s;
+  t->lru.lru_next = s;
+  COUNT(connections);
+  return s;
+}
+
+static const unsigned timeouts[] = {
+  [S_HALF_OPEN] = STREAM_TIMEOUT_HALF_OPEN,
+  [S_ESTABLISHED] = STREAM_TIMEOUT_ESTABLISHED,
+  [S_CLOSING] = STREAM_TIMEOUT_CLOSING,
+};
+
+int stream_segment(struct dissection *d, const struct flow_key *key,
+                   uint32_t seq, uint8_t flags,
+                   const uint8_t *payload, uint32_t length) {
+  if (stream_memory == 0) return 0;
+  struct table *t = get_table();
+  if (t == NULL) return 0;
+
+  uint64_t now = d->ts.tv_sec;
+  if (!t->wheel_started) {
+    wheel_init(&t->wheel, now);
+    t->wheel_started = 1;
+  }
+  wheel_advance(&t->wheel, now, expired, t);
+
+  int dir;
+  uint32_t hash = flow_hash(key);
+  struct stream *s = lookup(t, key, hash, &dir);
+  if (s == NULL) {
+    // Nothing to reassemble for a reset or an empty segment of something
+    // unknown, like the last ACK of a connection already closed
+    if ((flags & TH_RST) || (length == 0 && !(flags & TH_SYN))) return 0;
+    s = create(t, key, hash, flags, &dir);
+    if (s == NULL) return 0;
+  } else {
+    lru_touch(t, s);
+  }
+
+  s->d = d;
+  s->payload = payload;
+
+  if (flags & TH_RST) {
+    COUNT(closed);
+    close_stream(t, s);
+    return 0;
+  }
+
+  struct half *h = &s->half[dir];
+  if (flags & TH_SYN) {
+    if (!h->started) {
+      h->next_seq = seq + 1;
+      h->started = 1;
+    }
+    seq++;
+    if (dir == 1 && s->state == S_HALF_OPEN) s->state = S_ESTABLISHED;
+  }
+  if (!h->started) {
+    h->next_seq = seq;
+    h->started = 1;
+  }
+
+  int held = 0;
+  if (length > 0)
+    held = receive(t, s, dir, seq, payload, length);
+
+  if ((flags & TH_FIN) && !h->fin) {
+    h->fin = 1;
+    h->fin_seq = seq + length;
+    s->state = S_CLOSING;
+  }
+  // The FIN counts once everything before it is delivered
+  if (h->fin && !h->closed && h->next_seq == h->fin_seq) {
+    h->closed = 1;
+    h->next_seq++;
+  }
+  if (s->half[0].closed && s->half[1].closed) {
+    COUNT(closed);
+    close_stream(t, s);
+    return held;
+  }
+
+  s->d = NULL;
+  s->payload = NULL;
+  wheel_schedule(&t->wheel, &s->timer, now + timeouts[s->state]);
+  return held;
+}
+
+void stream_reset(void) {
+  struct table *t = context_current()->stream;
+  if (t == NULL) return;
+  while (t->lru.lru_next != &t->lru)
+    close_stream(t, t->lru.lru_next);
+  t->wheel_started = 0;
+}
+
+void stream_stats(struct stream_stats *stats) {
+  stats->connections = __atomic_load_n(&totals.connections, __ATOMIC_RELAXED);
+  stats->closed = __atomic_load_n(&totals.closed, __ATOMIC_RELAXED);
+  stats->timeouts = __atomic_load_n(&totals.timeouts, __ATOMIC_RELAXED);
+  stats->evictions = __atomic_load_n(&totals.evictions, __ATOMIC_RELAXED);
+  stats->out_of_order = __atomic_load_n(&totals.out_of_order, __ATOMIC_RELAXED);
+  stats->retransmissions = __atomic_load_n(&totals.retransmissions, __ATOMIC_RELAXED);
+  stats->gaps = __atomic_load_n(&totals.gaps, __ATOMIC_RELAXED);
+  stats->drops = __atomic_load_n(&totals.drops, __ATOMIC_RELAXED);
+}
+
+void *stream_app_state(struct stream *stream) {
+  return stream->app_state;
+}
+
+struct layer *stream_push(struct stream *stream, uint8_t type, uint32_t length) {
+  if (stream->d == NULL) return NULL;
+  return dissect_push(stream->d, type, stream->payload, length);
+}
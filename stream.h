@@ -0,0 +1,90 @@
+#ifndef __STREAM_H
+#define __STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dissect.h"
+#include "flow.h"
+
+// TCP stream reassembly. Connections are tracked per decoding thread, keyed by
+// flow (see flow.h), from their SYN (or their first segment when the capture
+// starts in the middle) to their FIN or RST. Each direction is delivered in
+// order to the application decoder of the connection: in-order segments
+// straight from the packet, out-of-order ones once the hole before them is
+// filled. Retransmitted bytes are dropped, overlaps keep the first copy.
+//
+// Memory is bounded: connections and buffered segments come from slab pools
+// (slab.h) with budgets shared by all the threads, a quarter of the memory for
+// the connections and the rest for the segments. When one is reached, the
+// least recently active connections of the thread are evicted. Idle ones are
+// closed by a timer wheel (wheel.h) running on capture time.
+#define STREAM_DEFAULT_MEMORY (64 << 20)
+
+// Idle timeouts, in seconds of capture time
+#define STREAM_TIMEOUT_HALF_OPEN 30
+#define STREAM_TIMEOUT_ESTABLISHED 300
+#define STREAM_TIMEOUT_CLOSING 30
+
+// Bytes buffered out of order per direction before giving up on the hole
+#define STREAM_MAX_PENDING (256 << 10)
+
+// Room for the state of an application decoder, in each connection
+#define STREAM_APP_STATE 64
+
+struct stream;
+
+// An application decoder. `data' gets the bytes of one direction (0 from the
+// client, 1 from the server) in order, `gap' is called when bytes were lost
+// before the next `data', and `close' once, when the connection goes away.
+// They are called while decoding a packet of the connection, and can push
+// layers in its dissection with stream_push, except `close' on a timeout or
+// an eviction.
+struct stream_app {
+  const char *name;
+  void (*data)(struct stream *, int dir, const uint8_t *data, uint32_t length);
+  void (*gap)(struct stream *, int dir);
+  void (*close)(struct stream *);
+};
+
+// Returns the application decoder for a port, NULL if there is none
+typedef const struct stream_app *(*stream_app_resolver)(uint16_t port);
+
+struct stream_stats {
+  uint64_t connections;
+  uint64_t closed;     // by FIN or RST
+  uint64_t timeouts;
+  uint64_t evictions;  // to stay within the memory budget
+  uint64_t out_of_order;
+  uint64_t retransmissions;
+  uint64_t gaps;       // holes given up on
+  uint64_t drops;      // segments that could not be buffered
+};
+
+// Set before any packet is decoded. A `memory' of 0 disables reassembly.
+void stream_init(size_t memory, stream_app_resolver resolver);
+
+// Feeds a TCP segment of the packet being dissected. `flags' are the TCP
+// flags, `payload' points in the packet. Returns 1 when the payload is held
+// until the bytes before it arrive, its layers will be in the dissection of
+// that packet.
+int stream_segment(struct dissection *d, const struct flow_key *key,
+                   uint32_t seq, uint8_t flags,
+                   const uint8_t *payload, uint32_t length);
+
+// Closes all the connections of the current context (context.h)
+void stream_reset(void);
+
+// Frees the table of a context
+void stream_release(void *table);
+
+// Sum of the counters of all the threads so far
+void stream_stats(struct stream_stats *stats);
+
+// For application decoders: their state (STREAM_APP_STATE bytes, zeroed when
+// the connection is created), and a new layer in the dissection of the
+// current packet, placed at its TCP payload.
+void *stream_app_state(struct stream *stream);
+struct layer *stream_push(struct stream *stream, uint8_t type, uint32_t length);
+
+#endif
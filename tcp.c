@@ -0,0 +1,81 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "dispatch.h"
+#include "dns.h"
+#include "tcp.h"
+
+// DNS over TCP: each message is preceded by its length on two bytes. Only the
+// header is decoded, like over UDP, the rest of the message is skipped.
+struct dns_stream {
+  uint16_t skip;    // rest of the current message
+  uint8_t have;     // bytes of `header' received
+  uint8_t header[2 + sizeof(struct dns_hdr)];
+};
+
+static void dns_data(struct stream *s, int dir, const uint8_t *data, uint32_t length) {
+  struct dns_stream *st = (struct dns_stream *)stream_app_state(s) + dir;
+  while (length > 0) {
+    if (st->skip > 0) {
+      uint32_t n = length < st->skip ? length : st->skip;
+      st->skip -= n;
+      data += n;
+      length -= n;
+      continue;
+    }
+
+    uint32_t n = sizeof(st->header) - st->have;
+    if (n > length) n = length;
+    memcpy(st->header + st->have, data, n);
+    st->have += n;
+    data += n;
+    length -= n;
+    if (st->have < sizeof(st->header)) break;
+
+    uint16_t size = st->header[0] << 8 | st->header[1];
+    struct dns_hdr dns;
+    memcpy(&dns, st->header + 2, sizeof(dns));
+    st->have = 0;
+    st->skip = size > sizeof(dns) ? size - sizeof(dns) : 0;
+
+    struct layer *l = stream_push(s, LAYER_DNS, st->skip);
+    if (l == NULL) continue;
+    l->dns.id = htons(dns.id);
+    l->dns.flags = dns.flags;
+    l->dns.qdcount = htons(dns.qdcount);
+    l->dns.ancount = htons(dns.ancount);
+    l->dns.nscount = htons(dns.nscount);
+    l->dns.arcount = htons(dns.arcount);
+  }
+}
+
+// Lost bytes: the message boundaries are lost too, start over
+static void dns_gap(struct stream *s, int dir) {
+  struct dns_stream *st = (struct dns_stream *)stream_app_state(s) + dir;
+  st->skip = 0;
+  st->have = 0;
+}
+
+static const struct stream_app dns_app = {
+  .name = "dns",
+  .data = dns_data,
+  .gap = dns_gap,
+};
+
+static struct dispatch apps;
+
+void tcp_init(void) {
+  dispatch_set(&apps, 53, (void *)&dns_app);
+}
+
+int tcp_decode_as(const uint16_t port, const char *name) {
+  if (strcmp(name, "none") == 0)
+    return dispatch_set(&apps, port, NULL);
+  if (strcmp(name, dns_app.name) == 0)
+    return dispatch_set(&apps, port, (void *)&dns_app);
+  return -1;
+}
+
+const struct stream_app *resolve_tcp_app(const uint16_t port) {
+  return dispatch_get(&apps, port);
+}
@@ -0,0 +1,14 @@
+#ifndef __TCP_H
+#define __TCP_H
+
+#include <stdint.h>
+
+#include "stream.h"
+
+// Application decoders of the reassembled TCP streams, by port
+void tcp_init(void);
+// Like udp_decode_as: dns, or none
+int tcp_decode_as(const uint16_t port, const char *name);
+const struct stream_app *resolve_tcp_app(const uint16_t port);
+
+#endif
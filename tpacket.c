@@ -0,0 +1,293 @@
+#include <stdio.h>
+
+#include "tpacket.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "output.h"
+#include "sketch.h"
+#include "util.h"
+
+struct tpacket_ring {
+  int fd;
+  uint8_t *map;
+  size_t map_size;
+  struct tpacket_config config;
+  uint32_t current;
+  int datalink;
+  volatile int break_loop;
+  // PACKET_STATISTICS resets the counters, so they are accumulated here
+  struct pcap_stat stats;
+};
+
+static int ring_datalink(struct capture *c) {
+  return ((struct tpacket_ring *)c->handle)->datalink;
+}
+
+static int ring_setfilter(struct capture *c, struct bpf_program *fp) {
+  struct tpacket_ring *ring = c->handle;
+  // struct bpf_insn and struct sock_filter have the same layout
+  struct sock_fprog prog = {
+    .len = fp->bf_len,
+    .filter = (struct sock_filter *)fp->bf_insns,
+  };
+  if (setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+    ERRORF("SO_ATTACH_FILTER: %s", strerror(errno));
+    return PCAP_ERROR;
+  }
+  return 0;
+}
+
+static void walk_block(struct tpacket_block_desc *block, pcap_handler callback,
+                       uint8_t *user) {
+  uint32_t count = block->hdr.bh1.num_pkts;
+  uint8_t *frame = (uint8_t *)block + block->hdr.bh1.offset_to_first_pkt;
+  for (uint32_t i = 0; i < count; i++) {
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)frame;
+    struct pcap_pkthdr header;
+    header.ts.tv_sec = hdr->tp_sec;
+    header.ts.tv_usec = hdr->tp_nsec / 1000;
+    header.caplen = hdr->tp_snaplen;
+    header.len = hdr->tp_len;
+    callback(user, &header, frame + hdr->tp_mac);
+    frame += hdr->tp_next_offset;
+  }
+}
+
+// With `batcher', the frames of a block are handed by batches before the
+// block goes back to the kernel
+static int ring_walk(struct capture *c, pcap_handler callback, uint8_t *user,
+                     struct capture_batcher *batcher) {
+  struct tpacket_ring *ring = c->handle;
+  struct pollfd pfd = { .fd = ring->fd, .events = POLLIN | POLLERR };
+
+  while (!ring->break_loop) {
+    struct tpacket_block_desc *block = (struct tpacket_block_desc *)
+      (ring->map + (size_t)ring->current * ring->config.block_size);
+
+    if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+         & TP_STATUS_USER) == 0) {
+      // Wake up regularly to check if the loop should stop, and for the output
+      int timeout = ring->config.block_timeout < CAPTURE_TIMEOUT
+                  ? (int)ring->config.block_timeout : CAPTURE_TIMEOUT;
+      if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+        ERRORF("poll: %s", strerror(errno));
+        return PCAP_ERROR;
+      }
+      output_idle();
+      sketch_idle();
+      continue;
+    }
+
+    walk_block(block, callback, user);
+    if (batcher != NULL) capture_batch_flush(batcher);
+
+    // Give the block back to the kernel
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    ring->current = (ring->current + 1) % ring->config.block_count;
+  }
+
+  ring->break_loop = 0;
+  return PCAP_ERROR_BREAK;
+}
+
+static int ring_loop(struct capture *c, pcap_handler callback, uint8_t *user) {
+  return ring_walk(c, callback, user, NULL);
+}
+
+static int ring_loop_batch(struct capture *c, capture_batch_handler handler, uint8_t *user) {
+  struct capture_batcher b;
+  capture_batcher_init(&b, handler, user);
+  return ring_walk(c, capture_batch_add, (uint8_t *)&b, &b);
+}
+
+static void ring_breakloop(struct capture *c) {
+  ((struct tpacket_ring *)c->handle)->break_loop = 1;
+}
+
+static int ring_stats(struct capture *c, struct pcap_stat *stats) {
+  struct tpacket_ring *ring = c->handle;
+  struct tpacket_stats_v3 st;
+  socklen_t len = sizeof(st);
+  if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0)
+    return PCAP_ERROR;
+
+  // tp_packets includes the dropped packets
+  ring->stats.ps_recv += st.tp_packets;
+  ring->stats.ps_drop += st.tp_drops;
+  *stats = ring->stats;
+  return 0;
+}
+
+static void ring_close(struct capture *c) {
+  struct tpacket_ring *ring = c->handle;
+  if (ring->map != NULL && ring->map != MAP_FAILED)
+    munmap(ring->map, ring->map_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  free(ring);
+  free(c);
+}
+
+static int link_type(int fd, const char *device, char *errbuf) {
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, device, IFNAMSIZ - 1);
+  if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "SIOCGIFHWADDR: %s", strerror(errno));
+    return -1;
+  }
+
+  switch (ifr.ifr_hwaddr.sa_family) {
+    case ARPHRD_ETHER:
+    case ARPHRD_LOOPBACK: // Linux loopback has an ethernet header
+      return DLT_EN10MB;
+    default:
+      snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: unsupported hardware type %d",
+               device, ifr.ifr_hwaddr.sa_family);
+      return -1;
+  }
+}
+
+struct capture *tpacket_open(const char *device,
+                             const struct tpacket_config *config,
+                             char *errbuf) {
+  struct capture *c = calloc(1, sizeof(struct capture));
+  struct tpacket_ring *ring = calloc(1, sizeof(struct tpacket_ring));
+  if (c == NULL || ring == NULL) {
+    free(c);
+    free(ring);
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "out of memory");
+    return NULL;
+  }
+
+  c->handle = ring;
+  c->datalink = ring_datalink;
+  c->setfilter = ring_setfilter;
+  c->loop = ring_loop;
+  c->loop_batch = ring_loop_batch;
+  c->breakloop = ring_breakloop;
+  c->stats = ring_stats;
+  c->close = ring_close;
+  ring->config = *config;
+  ring->map = MAP_FAILED;
+
+#define FAIL(what) \
+  { \
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: %s", what, strerror(errno)); \
+    ring_close(c); \
+    return NULL; \
+  }
+
+  // No protocol until bind(), so that no packet from another interface is queued
+  ring->fd = socket(AF_PACKET, SOCK_RAW, 0);
+  if (ring->fd < 0) FAIL("socket");
+
+  ring->datalink = link_type(ring->fd, device, errbuf);
+  if (ring->datalink < 0) {
+    ring_close(c);
+    return NULL;
+  }
+
+  int version = TPACKET_V3;
+  if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+    FAIL("PACKET_VERSION");
+
+  // Frames are not fixed-size in V3, but the kernel still checks them
+  struct tpacket_req3 req;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = config->block_size;
+  req.tp_block_nr = config->block_count;
+  req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+  req.tp_frame_nr = (uint64_t)config->block_size * config->block_count / req.tp_frame_size;
+  req.tp_retire_blk_tov = config->block_timeout;
+  if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+    FAIL("PACKET_RX_RING");
+
+  ring->map_size = (size_t)config->block_size * config->block_count;
+  ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring->fd, 0);
+  if (ring->map == MAP_FAILED) FAIL("mmap");
+
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_ALL);
+  addr.sll_ifindex = if_nametoindex(device);
+  if (addr.sll_ifindex == 0) FAIL(device);
+  if (bind(ring->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) FAIL("bind");
+
+  struct packet_mreq mreq;
+  memset(&mreq, 0, sizeof(mreq));
+  mreq.mr_ifindex = addr.sll_ifindex;
+  mreq.mr_type = PACKET_MR_PROMISC;
+  if (setsockopt(ring->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+    FAIL("PACKET_ADD_MEMBERSHIP");
+
+#undef FAIL
+
+  DEBUGF("TPACKET_V3 ring on `%s': %u blocks of %u bytes, timeout %u ms",
+         device, config->block_count, config->block_size, config->block_timeout);
+  return c;
+}
+
+int tpacket_join_fanout(struct capture *c, uint16_t group,
+                        enum fanout_mode mode, char *errbuf) {
+  struct tpacket_ring *ring = c->handle;
+  int type;
+  switch (mode) {
+    case FANOUT_HASH:
+      type = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
+      break;
+    case FANOUT_CPU:
+      type = PACKET_FANOUT_CPU;
+      break;
+    default:
+      type = PACKET_FANOUT_LB;
+      break;
+  }
+
+  int arg = group | type << 16;
+  if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+    snprintf(errbuf, PCAP_ERRBUF_SIZE, "PACKET_FANOUT: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+#else
+
+struct capture *tpacket_open(const char *device,
+                             const struct tpacket_config *config,
+                             char *errbuf) {
+  (void)config;
+  snprintf(errbuf, PCAP_ERRBUF_SIZE,
+           "%s: TPACKET_V3 capture is only available on Linux", device);
+  return NULL;
+}
+
+int tpacket_join_fanout(struct capture *c, uint16_t group,
+                        enum fanout_mode mode, char *errbuf) {
+  (void)c;
+  (void)group;
+  (void)mode;
+  snprintf(errbuf, PCAP_ERRBUF_SIZE, "PACKET_FANOUT is only available on Linux");
+  return -1;
+}
+
+#endif
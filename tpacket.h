@@ -0,0 +1,39 @@
+#ifndef __TPACKET_H
+#define __TPACKET_H
+
+#include <stdint.h>
+
+#include "capture.h"
+
+// Linux AF_PACKET capture backend using a TPACKET_V3 memory-mapped ring. The
+// kernel fills blocks of `block_size' bytes with packets, and hands them over
+// when they are full or after `block_timeout' milliseconds. Packets are given
+// to the handler straight from the mmap'd block, without any copy.
+struct tpacket_config {
+  uint32_t block_size; // must be a multiple of the page size
+  uint32_t block_count;
+  uint32_t block_timeout;
+};
+
+#define TPACKET_DEFAULT_BLOCK_SIZE (1 << 22)
+#define TPACKET_DEFAULT_BLOCK_COUNT 64
+#define TPACKET_DEFAULT_BLOCK_TIMEOUT 100
+
+// Returns NULL and fills `errbuf' on error, or on non-Linux systems.
+struct capture *tpacket_open(const char *device,
+                             const struct tpacket_config *config,
+                             char *errbuf);
+
+// How the kernel spreads packets between the sockets of a fanout group
+enum fanout_mode {
+  FANOUT_HASH, // by flow, fragments are defragmented first
+  FANOUT_CPU,  // by the CPU that received the packet
+  FANOUT_RR,   // round-robin
+};
+
+// Joins the PACKET_FANOUT group `group' on the device the capture was opened
+// on. Returns -1 and fills `errbuf' on error.
+int tpacket_join_fanout(struct capture *capture, uint16_t group,
+                        enum fanout_mode mode, char *errbuf);
+
+#endif
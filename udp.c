@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
@@ -8,197 +9,137 @@
 
 #include "bootp.h"
 
+#include "cursor.h"
+#include "dispatch.h"
 #include "dns.h"
 #include "udp.h"
 #include "util.h"
 #include "link.h"
+#include "profile.h"
+#include "render.h"
 #include "vxlan.h"
 
-#define DHCP_MAGIC 0x63538263
-
-static char* dhcp_msgtype[] = {
-  [1] = "DHCPDISCOVER",
-  [2] = "DHCPOFFER",
-  [3] = "DHCPREQUEST",
-  [4] = "DHCPDECLINE",
-  [5] = "DHCPACK",
-  [6] = "DHCPNAK",
-  [7] = "DHCPRELEASE",
-  [8] = "DHCPINFORM",
-  [9] = "DHCPFORCERENEW",
-  [10] = "DHCPLEASEQUERY",
-  [11] = "DHCPLEASEUNASSIGNED",
-  [12] = "DHCPLEASEUNKNOWN",
-  [13] = "DHCPLEASEACTIVE",
-  [14] = "DHCPBULKLEASEQUERY",
-  [15] = "DHCPLEASEQUERYDONE",
-  [16] = "DHCPACTIVELEASEQUERY",
-  [17] = "DHCPLEASEQUERYSTATUS",
-  [18] = "DHCPTLS"
-};
-
-static char* format_addresses(uint32_t count, const struct in_addr *ips) {
-  static char buf[256];
-  size_t off = 0;
-  for (uint8_t i = 0; i < count; i++)
-    off += sprintf(buf + off, "%s, ", inet_ntoa(ips[i]));
-  buf[off - 2] = '\0';
-  return buf;
-}
-
-static char* truncate(uint8_t length, const uint8_t* payload) {
-  static char buf[256];
-  memcpy(buf, payload, length);
-  buf[length] = '\0';
-  return buf;
-}
-
-static void handle_bootp(uint32_t length, const uint8_t* packet) {
-  struct bootp *bootp = (struct bootp *)packet;
-  APPLY_OVERHEAD_S(sizeof(struct bootp) - 64, length, packet);
-
-  DEBUGF("BOOTP op:%x htype:%x len:%d hops:%d xid:%x", bootp->bp_op, bootp->bp_htype, bootp->bp_hlen, bootp->bp_hops, bootp->bp_xid);
-  PRINTF("BOOTP %s", bootp->bp_op == 1 ? "request" : "reply");
-
-  int *magic = (int *)packet;
-  APPLY_OVERHEAD(int, length, packet);
-  if (*magic == DHCP_MAGIC) {
-    u_char opt;
-    while(length > 0 && (opt = *packet) != 0xFF) {
-      APPLY_OVERHEAD(char, length, packet);
-      u_char *optlen = (u_char *)packet;
-      APPLY_OVERHEAD(char, length, packet);
-      u_char *optpayload = (u_char *)packet;
-      APPLY_OVERHEAD_S(*optlen, length, packet);
-
-      indent_log();
-      switch (opt) {
-        case 0: // Pad
-          break;
-
-        case 1: // Network mask
-          DEBUGF("Network mask %s", inet_ntoa(*(struct in_addr *)optpayload));
-          break;
-
-        case 3: // Router
-          DEBUGF("Router %s", format_addresses(*optlen / 4, (struct in_addr *)optpayload));
-          break;
-
-        case 6: // Domain Name Server
-          DEBUGF("Domain Name Server %s", format_addresses(*optlen / 4, (struct in_addr *)optpayload));
-          break;
-
-        case 12: // Hostname
-          DEBUGF("Hostname %s", truncate(*optlen, optpayload));
-          break;
-
-        case 15: // Domain Name
-          DEBUGF("Domain Name %s", truncate(*optlen, optpayload));
-          break;
-
-        case 50: // Requested IP Address
-          DEBUGF("Requested IP Address %s", inet_ntoa(*(struct in_addr *)optpayload));
-          break;
-
-        case 51: // Lease time
-          DEBUGF("Lease time %d", htonl(*(uint32_t *)optpayload));
-          break;
-
-        case 53: // DHCP msg type
-          if (*optpayload < sizeof(dhcp_msgtype) && dhcp_msgtype[*optpayload]) {
-            DEBUGF("DHCP message type %s", dhcp_msgtype[*optpayload]);
-          } else {
-            WARNF("Unknown DHCP message type %d", *optpayload);
-          }
-          break;
-
-        case 54: // Server Identifier
-          DEBUGF("Server Identifier %s", inet_ntoa(*(struct in_addr *)optpayload));
-          break;
-
-        case 55: // Parameter Request List
-        {
-          char buf[1024];
-          size_t off = 0;
-          for (uint8_t i = 0; i < *optlen; i++)
-            off += sprintf(buf + off, "%d, ", optpayload[i]);
-          buf[off - 2] = '\0';
-
-          DEBUGF("Parameter Request List %s", buf);
-          break;
-        }
-
-        case 57: // Maximum DHCP Message Size
-          DEBUGF("Maximum DHCP Message Size %d", htons(*(uint16_t *)optpayload));
-          break;
-
-        case 252: // WPAD
-          DEBUGF("WPAD %s", truncate(*optlen, optpayload));
-          break;
-
-        default:
-        {
-          char buf[1024];
-          size_t off = 0;
-          for (uint8_t i = 0; i < *optlen; i++)
-            off += sprintf(buf + off, "%02x ", optpayload[i]);
-          buf[off - 1] = '\0';
-
-          DEBUGF("DHCP option %3d (len: %2d): %s", opt, *optlen, buf);
-          break;
-        }
+#define DHCP_MAGIC 0x63825363
+#define BOOTP_HEADER_SIZE (sizeof(struct bootp) - sizeof(((struct bootp *)0)->bp_vend))
+
+static void handle_bootp(struct dissection *d, uint32_t length, const uint8_t* packet) {
+  struct cursor c = cursor_make(packet, length);
+  CURSOR_NEED(c, BOOTP_HEADER_SIZE);
+  struct cursor h = cursor_pull(&c, BOOTP_HEADER_SIZE);
+  struct layer *l = dissect_push(d, LAYER_BOOTP, h.data, c.length);
+  if (l == NULL) return;
+  l->bootp.op = cursor_u8(&h, offsetof(struct bootp, bp_op));
+  l->bootp.htype = cursor_u8(&h, offsetof(struct bootp, bp_htype));
+  l->bootp.hlen = cursor_u8(&h, offsetof(struct bootp, bp_hlen));
+  l->bootp.hops = cursor_u8(&h, offsetof(struct bootp, bp_hops));
+  cursor_copy(&h, offsetof(struct bootp, bp_xid), &l->bootp.xid, sizeof(l->bootp.xid));
+  l->bootp.option_count = 0;
+  l->bootp.options = NULL;
+
+  CURSOR_NEED(c, 4);
+  uint32_t magic = cursor_u32(&c, 0);
+  cursor_skip(&c, 4);
+  if (magic == DHCP_MAGIC) {
+    // Each option takes at least two bytes
+    l->bootp.options = dissect_alloc((c.length / 2 + 1) * sizeof(struct dhcp_option));
+    if (l->bootp.options == NULL) return;
+
+    uint8_t opt;
+    while (c.length > 0 && (opt = cursor_u8(&c, 0)) != 0xFF) {
+      cursor_skip(&c, 1);
+      CURSOR_NEED(c, 1);
+      uint8_t optlen = cursor_u8(&c, 0);
+      cursor_skip(&c, 1);
+      CURSOR_NEED(c, optlen);
+      struct cursor optpayload = cursor_pull(&c, optlen);
+
+      struct dhcp_option *option = &l->bootp.options[l->bootp.option_count++];
+      option->code = opt;
+      option->length = optlen;
+      option->offset = optpayload.data - d->packet;
+
+      if (opt == 53 && optlen >= 1 && dhcp_msgtype_name(cursor_u8(&optpayload, 0)) == NULL) {
+        indent_log();
+        WARNF("Unknown DHCP message type %d", cursor_u8(&optpayload, 0));
+        stats_warn(STATS_UNKNOWN_DHCP_TYPE);
+        dedent_log();
       }
-      dedent_log();
     }
   }
 }
 
-static void handle_vxlan(uint32_t length, const uint8_t* packet) {
-  struct vxlan_hdr *vxlan = (struct vxlan_hdr *)packet;
-  APPLY_OVERHEAD(struct vxlan_hdr, length, packet);
-  DEBUGF("VXLAN vni: 0x%06x", vxlan->vni);
+static void handle_vxlan(struct dissection *d, uint32_t length, const uint8_t* packet) {
+  struct cursor c = cursor_make(packet, length);
+  CURSOR_NEED(c, sizeof(struct vxlan_hdr));
+  struct cursor h = cursor_pull(&c, sizeof(struct vxlan_hdr));
+  struct layer *l = dissect_push(d, LAYER_VXLAN, h.data, c.length);
+  if (l == NULL) return;
+  // 24 bits, then 8 reserved
+  l->vxlan.id = cursor_u32(&h, offsetof(struct vxlan_hdr, vni_reserved)) >> 8;
   indent_log();
-  handle_ethernet(length, packet);
+  handle_ethernet(d, c.length, c.data);
   dedent_log();
 }
 
-static void handle_dns(uint32_t length, const uint8_t* packet) {
-  struct dns_hdr *dns = (struct dns_hdr *)packet;
-  APPLY_OVERHEAD(struct dns_hdr, length, packet);
-  uint16_t qdcount = htons(dns->qdcount);
-  uint16_t ancount = htons(dns->ancount);
-  uint16_t nscount = htons(dns->nscount);
-  uint16_t arcount = htons(dns->arcount);
-
-  DEBUGF("DNS id:0x%04x qr:%d opcode:0x%02x aa:%d tc:%d rd:%d ra:%d z:%d rcode:%d qdcount:%d ancount:%d nscount:%d arcount:%d",
-         htons(dns->id), dns->qr, dns->opcode, dns->aa, dns->tc, dns->rd, dns->ra, dns->z, dns->rcode,
-         qdcount, ancount, nscount, arcount);
-  PRINTF("DNS");
+static void handle_dns(struct dissection *d, uint32_t length, const uint8_t* packet) {
+  struct cursor c = cursor_make(packet, length);
+  CURSOR_NEED(c, sizeof(struct dns_hdr));
+  struct cursor h = cursor_pull(&c, sizeof(struct dns_hdr));
+  struct layer *l = dissect_push(d, LAYER_DNS, h.data, c.length);
+  if (l == NULL) return;
+  l->dns.id = cursor_u16(&h, offsetof(struct dns_hdr, id));
+  cursor_copy(&h, offsetof(struct dns_hdr, flags), &l->dns.flags, sizeof(l->dns.flags));
+  l->dns.qdcount = cursor_u16(&h, offsetof(struct dns_hdr, qdcount));
+  l->dns.ancount = cursor_u16(&h, offsetof(struct dns_hdr, ancount));
+  l->dns.nscount = cursor_u16(&h, offsetof(struct dns_hdr, nscount));
+  l->dns.arcount = cursor_u16(&h, offsetof(struct dns_hdr, arcount));
   // TODO: decode queries and answers
 }
 
-static udp_handler handlers[] = {
-  [53] = handle_dns,
-  [67] = handle_bootp,
-  [68] = handle_bootp,
-  [4789] = handle_vxlan,
+static const struct {
+  const char *name;
+  udp_handler handler;
+} decoders[] = {
+  { "dns", handle_dns },
+  { "bootp", handle_bootp },
+  { "dhcp", handle_bootp },
+  { "vxlan", handle_vxlan },
+  { "none", NULL },
 };
 
+static struct dispatch handlers;
+
+void udp_init(void) {
+  dispatch_set(&handlers, 53, handle_dns);
+  dispatch_set(&handlers, 67, handle_bootp);
+  dispatch_set(&handlers, 68, handle_bootp);
+  dispatch_set(&handlers, 4789, handle_vxlan);
+}
+
+int udp_decode_as(const uint16_t port, const char *name) {
+  for (unsigned i = 0; i < sizeof(decoders) / sizeof(decoders[0]); i++)
+    if (strcmp(decoders[i].name, name) == 0)
+      return dispatch_set(&handlers, port, decoders[i].handler);
+  return -1;
+}
+
 udp_handler resolve_udp_handler(const uint16_t port) {
-  if (port >= (sizeof(handlers) / sizeof(udp_handler)))
-    return NULL;
-  return handlers[port];
+  return (udp_handler)dispatch_get(&handlers, port);
 }
 
-void handle_udp_payload(const uint16_t sport, const uint16_t dport, const uint32_t length, const uint8_t *packet) {
+void handle_udp_payload(struct dissection *d, const uint16_t sport, const uint16_t dport,
+                        const uint32_t length, const uint8_t *packet) {
+  uint16_t port = dport;
   udp_handler handler = resolve_udp_handler(dport);
-  if (handler == NULL)
+  if (handler == NULL) {
+    port = sport;
     handler = resolve_udp_handler(sport);
+  }
 
   indent_log();
   if (handler != NULL)
-    handler(length, packet);
+    PROFILE_CALL(PROFILE_UDP, port, handler(d, length, packet));
   else
-    handle_raw(length, packet);
+    PROFILE_CALL(PROFILE_UDP, 0, handle_raw(d, length, packet));
   dedent_log();
 }
@@ -3,9 +3,16 @@
 
 #include <stdint.h>
 
-typedef void(*udp_handler)(uint32_t, const uint8_t*);
+#include "dissect.h"
+
+typedef void(*udp_handler)(struct dissection *, uint32_t, const uint8_t*);
+// Fills the table of the well-known ports, once before decoding
+void udp_init(void);
+// Decodes a port with a decoder by name (dns, bootp, dhcp, vxlan, or none
+// for raw payload). Returns -1 for an unknown name or a full table.
+int udp_decode_as(const uint16_t port, const char *name);
 udp_handler resolve_udp_handler(const uint16_t port);
-void handle_udp_payload(const uint16_t sport, const uint16_t dport,
+void handle_udp_payload(struct dissection *d, const uint16_t sport, const uint16_t dport,
                         const uint32_t, const uint8_t *packet);
 
 #endif
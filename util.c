@@ -1,64 +1,91 @@
-#include <ctype.h>
+#include <stdarg.h>
+#include <stdlib.h>
 
+#include "context.h"
+#include "output.h"
 #include "util.h"
 
-char logindent[256] = "";
-static uint8_t indent_level = 0;
+__thread struct out_buffer *out_capture = NULL;
 
+// Celui du processus, qu'un contexte peut remplacer
 int log_level = LEVEL_WARN;
-int get_log_level() { return log_level; }
+int get_log_level() {
+  struct mydump_context *c = bound_context;
+  return c != NULL && c->log_level >= 0 ? c->log_level : log_level;
+}
 void set_log_level(int l) { log_level = l; }
 
-void handle_raw(const uint32_t length, const uint8_t *packet) {
-  DEBUGF("Raw packet (length: %d)", length);
-  PRINTF("Raw (length: %d)", length);
-
-  if (LOG_LEVEL < LEVEL_DEBUG + 1) return;
-  for (uint32_t i = 0; i * 16 < length; i++) {
-    // Display 2 groups of 2*16 hex characters
-    for (uint32_t j = 0; j < 16; j++) {
-      if (j + i * 16 < length) {
-        printf("%02x ", packet[i * 16 + j]);
-      } else {
-        printf("   ");
-      }
+void out_printf(const char *fmt, ...) {
+  va_list ap;
+  struct out_buffer *out = out_capture;
+  if (out == NULL) out = output_thread_buffer();
 
-      if (j == 7) printf(" ");
+  for (;;) {
+    size_t room = out->cap - out->len;
+    va_start(ap, fmt);
+    int n = vsnprintf(out->data + out->len, room, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < room) {
+      out->len += n;
+      return;
     }
 
-    printf("  ");
+    // Not enough room, grow the buffer. It is kept between packets, so this
+    // only happens until it reaches the size of the biggest packet output.
+    size_t cap = out->cap ? out->cap * 2 : 1024;
+    while (cap - out->len <= (size_t)n) cap *= 2;
+    char *data = realloc(out->data, cap);
+    if (data == NULL) return;
+    out->data = data;
+    out->cap = cap;
+  }
+}
 
-    // Display the same 16 characters in ascii if they are printable
-    for (uint32_t j = 0; j < 16; j++) {
-      if (j + i * 16 < length) {
-        if (isprint(packet[i * 16 + j])) {
-          printf("%c", packet[i * 16 + j]);
-        } else {
-          printf(".");
-        }
-      } else {
-        printf(" ");
-      }
+char *out_reserve(size_t size) {
+  struct out_buffer *out = out_capture;
+  if (out == NULL) out = output_thread_buffer();
 
-      if (j == 7) printf(" ");
-    }
-    printf("\n");
+  if (out->cap - out->len < size) {
+    size_t cap = out->cap ? out->cap * 2 : 1024;
+    while (cap - out->len < size) cap *= 2;
+    char *data = realloc(out->data, cap);
+    if (data == NULL) return NULL;
+    out->data = data;
+    out->cap = cap;
   }
-  fflush(stdout);
+  return out->data + out->len;
+}
+
+void out_commit(size_t len) {
+  struct out_buffer *out = out_capture;
+  if (out == NULL) out = output_thread_buffer();
+  out->len += len;
+}
+
+const char *log_indent(void) {
+  return context_current()->indent;
 }
 
 void dedent_log(void) {
-  indent_level -= 2;
-  logindent[indent_level] = '\0';
+  struct mydump_context *c = context_current();
+  c->indent_level -= 2;
+  c->indent[c->indent_level] = '\0';
 }
 
 void indent_log(void) {
-  logindent[indent_level++] = ' ';
-  logindent[indent_level++] = ' ';
-  logindent[indent_level] = '\0';
+  struct mydump_context *c = context_current();
+  c->indent[c->indent_level++] = ' ';
+  c->indent[c->indent_level++] = ' ';
+  c->indent[c->indent_level] = '\0';
 }
 
 void indent_reset(void) {
-  indent_level = 0;
-  logindent[0] = '\0';
+  struct mydump_context *c = context_current();
+  c->indent_level = 0;
+  c->indent[0] = '\0';
+}
+
+uint8_t indent_depth(void) {
+  return context_current()->indent_level / 2;
 }
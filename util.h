@@ -4,6 +4,9 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include "log.h"
+#include "stats.h"
+
 // Permet de définir LOG_LEVEL à une constante, à la compilation ou par
 // programme. C'est le cas de dump, qui a son niveau de log au maximum, quoi
 // qu'il arrive.
@@ -28,16 +31,16 @@
 // À chaque fois, une variante avec et sans formattage à la printf.
 // J'ai dû séparer pour pas avoir à traîner des retours à la ligne, et quand
 // même faire un seul appel à fprintf.
-#define FATAL(MSG) LOG(FATAL, MSG "\n", logindent)
-#define FATALF(MSG, ...) LOG(FATAL, MSG "\n", logindent, __VA_ARGS__)
-#define ERROR(MSG) LOG(ERROR, MSG "\n", logindent)
-#define ERRORF(MSG, ...) LOG(ERROR, MSG "\n", logindent, __VA_ARGS__)
-#define WARN(MSG) LOG(WARN, MSG "\n", logindent)
-#define WARNF(MSG, ...) LOG(WARN, MSG "\n", logindent, __VA_ARGS__)
-#define INFO(MSG) LOG(INFO, MSG "\n", logindent)
-#define INFOF(MSG, ...) LOG(INFO, MSG "\n", logindent, __VA_ARGS__)
-#define DEBUG(MSG) LOG(DEBUG, MSG "\n", logindent)
-#define DEBUGF(MSG, ...) LOG(DEBUG, MSG "\n", logindent, __VA_ARGS__)
+#define FATAL(MSG) LOG(FATAL, MSG "\n", log_indent())
+#define FATALF(MSG, ...) LOG(FATAL, MSG "\n", log_indent(), __VA_ARGS__)
+#define ERROR(MSG) LOG(ERROR, MSG "\n", log_indent())
+#define ERRORF(MSG, ...) LOG(ERROR, MSG "\n", log_indent(), __VA_ARGS__)
+#define WARN(MSG) LOG(WARN, MSG "\n", log_indent())
+#define WARNF(MSG, ...) LOG(WARN, MSG "\n", log_indent(), __VA_ARGS__)
+#define INFO(MSG) LOG(INFO, MSG "\n", log_indent())
+#define INFOF(MSG, ...) LOG(INFO, MSG "\n", log_indent(), __VA_ARGS__)
+#define DEBUG(MSG) LOG(DEBUG, MSG "\n", log_indent())
+#define DEBUGF(MSG, ...) LOG(DEBUG, MSG "\n", log_indent(), __VA_ARGS__)
 
 // Double expansion technique to convert __LINE__ into string literal
 #define S(x) #x
@@ -54,42 +57,60 @@
 #endif
 
 // Macro interne pour formatter un message de logs (en couleur), avec
-// [niveau] [fichier]:[ligne] [message]
-#define LOG_FMT(LEVEL, ...) LEVEL_FMT(LEVEL) "\t" LOC_FMT "\t%s" __VA_ARGS__
+// [niveau] [fichier]:[ligne] [message]. Chaque appel a son `log_site', qui
+// porte le préfixe ; le message est écrit par le thread de log.h.
+#define LOG_PREFIX(LEVEL) LEVEL_FMT(LEVEL) "\t" LOC_FMT "\t"
 #define LOG(LEVEL, ...)                                                        \
   {                                                                            \
     if (LEVEL_##LEVEL <= LOG_LEVEL) {                                          \
-      fprintf(stderr, LOG_FMT(LEVEL, __VA_ARGS__));                            \
-      fflush(stderr);                                                          \
+      static struct log_site _site = { LEVEL_##LEVEL, LOG_PREFIX(LEVEL), 0, 0, 0, 0, NULL }; \
+      log_emit(&_site, "%s" __VA_ARGS__);                                      \
     }                                                                          \
   }
 
 #define PRINTF(...) \
   {                                                                            \
     if (LOG_LEVEL < LEVEL_DEBUG)                                               \
-      printf(__VA_ARGS__);                                                     \
+      out_printf(__VA_ARGS__);                                                 \
   }
 
-#define APPLY_OVERHEAD_S(overhead, length, packet)                             \
+// Pour les gestionnaires : retourne si le curseur (cursor.h) n'a pas `size'
+// octets, avec un avertissement.
+#define CURSOR_NEED(cursor, size)                                              \
   {                                                                            \
-    if ((int)(length) < (int)(overhead)) {                                     \
-      WARNF("Packet too small (%d < %d)", (length), (int)(overhead));          \
+    if (!cursor_has(&(cursor), 0, (size))) {                                   \
+      WARNF("Packet too small (%d < %d)", (cursor).length, (int)(size));       \
+      stats_warn(STATS_TOO_SMALL);                                             \
       return;                                                                  \
     }                                                                          \
-    length -= (overhead);                                                      \
-    packet += (overhead);                                                      \
   }
 
-#define APPLY_OVERHEAD(structure, length, packet)                              \
-    APPLY_OVERHEAD_S(sizeof(structure), length, packet)
+// Tampon de sortie d'un paquet. Quand `out_capture' est défini (un par
+// thread), PRINTF écrit dedans au lieu du tampon du thread (voir output.h) :
+// c'est ce qui permet aux workers du pipeline de décoder en parallèle et de
+// laisser l'étage de sortie afficher les paquets dans l'ordre de capture.
+struct out_buffer {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+extern __thread struct out_buffer *out_capture;
 
-extern char logindent[256];
+void out_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+// Pour écrire sans passer par printf : réserve `size' octets à la fin du
+// tampon, puis en valide `len'.
+char *out_reserve(size_t size);
+void out_commit(size_t len);
 
 int get_log_level();
 void set_log_level(int);
-void handle_raw(const uint32_t length, const uint8_t *packet);
+
+// Indentation des logs du contexte courant (voir context.h)
+const char *log_indent(void);
 void indent_log(void);
 void dedent_log(void);
 void indent_reset(void);
+uint8_t indent_depth(void);
 
 #endif
@@ -0,0 +1,58 @@
+#include <stddef.h>
+
+#include "wheel.h"
+
+void wheel_init(struct wheel *wheel, uint64_t now) {
+  wheel->now = now;
+  for (unsigned i = 0; i < WHEEL_SLOTS; i++) {
+    wheel->slots[i].prev = &wheel->slots[i];
+    wheel->slots[i].next = &wheel->slots[i];
+  }
+}
+
+void wheel_cancel(struct wheel_entry *entry) {
+  if (entry->next == NULL) return;
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+  entry->next = entry->prev = NULL;
+}
+
+void wheel_schedule(struct wheel *wheel, struct wheel_entry *entry, uint64_t expires) {
+  wheel_cancel(entry);
+  // Something already due goes in the next slot processed
+  if (expires <= wheel->now) expires = wheel->now + 1;
+  entry->expires = expires;
+  struct wheel_entry *head = &wheel->slots[expires % WHEEL_SLOTS];
+  entry->prev = head->prev;
+  entry->next = head;
+  head->prev->next = entry;
+  head->prev = entry;
+}
+
+static void expire_slot(struct wheel *wheel, unsigned slot, uint64_t now,
+                        void (*expired)(struct wheel_entry *, void *), void *arg) {
+  struct wheel_entry *head = &wheel->slots[slot];
+  // Entries added by the callback go at the end, they are due later
+  struct wheel_entry *last = head->prev;
+  struct wheel_entry *entry = head->next;
+  while (entry != head) {
+    struct wheel_entry *next = entry->next;
+    int is_last = entry == last;
+    if (entry->expires <= now) {
+      wheel_cancel(entry);
+      expired(entry, arg);
+    }
+    if (is_last) break;
+    entry = next;
+  }
+}
+
+void wheel_advance(struct wheel *wheel, uint64_t now,
+                   void (*expired)(struct wheel_entry *, void *), void *arg) {
+  if (now <= wheel->now) return;
+  uint64_t from = wheel->now + 1;
+  if (now - wheel->now >= WHEEL_SLOTS) from = now - WHEEL_SLOTS + 1;
+  wheel->now = now;
+  for (uint64_t tick = from; tick <= now; tick++)
+    expire_slot(wheel, tick % WHEEL_SLOTS, now, expired, arg);
+}
@@ -0,0 +1,37 @@
+#ifndef __WHEEL_H
+#define __WHEEL_H
+
+#include <stdint.h>
+
+// Timer wheel for idle timeouts, in ticks of any unit (seconds of capture
+// time for the reassembly). Scheduling, rescheduling and cancelling are O(1);
+// advancing costs one slot per tick elapsed, at most a full turn. Timers
+// further than a turn away stay in their slot until their tick comes.
+#define WHEEL_SLOTS 1024
+
+struct wheel_entry {
+  struct wheel_entry *prev;
+  struct wheel_entry *next; // NULL when not scheduled
+  uint64_t expires;
+};
+
+struct wheel {
+  uint64_t now;
+  struct wheel_entry slots[WHEEL_SLOTS]; // list heads
+};
+
+void wheel_init(struct wheel *wheel, uint64_t now);
+
+// (Re)schedules `entry' to expire at tick `expires'
+void wheel_schedule(struct wheel *wheel, struct wheel_entry *entry, uint64_t expires);
+
+void wheel_cancel(struct wheel_entry *entry);
+
+// Moves the wheel to `now', calling `expired' for every timer due by then,
+// after it has been cancelled. The callback can free or reschedule that timer,
+// but not touch the others. Time never goes backwards, an earlier `now' is
+// ignored.
+void wheel_advance(struct wheel *wheel, uint64_t now,
+                   void (*expired)(struct wheel_entry *, void *), void *arg);
+
+#endif